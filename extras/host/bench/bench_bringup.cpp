@@ -0,0 +1,214 @@
+// Bring-up latency benchmark of WifiMessaging on the simulated back-ends
+//
+// For every scenario a fresh device runs connectToWiFi() and then calls
+// loop() once per virtual millisecond, like a sketch doing 1 ms of work
+// between calls. Reported per scenario:
+//   wifi            virtual ms from boot until the station has an IP
+//   mqtt/tlgm       virtual ms from boot until StatusMQTT and StatusTelegram
+//                   are ConnectionActive
+//   1st msg         virtual ms until the first Telegram message, queued right
+//                   after connectToWiFi(), is delivered at the API
+//   max blk         longest virtual time spent inside a single loop() call
+//   path            how WiFi connected: scan (scan and DHCP), fast (cached
+//                   channel, BSSID and IP) or fallback (fast, then scan)
+//   try             WiFi connect attempts
+//   tls             full/resumed TLS handshakes
+//   cmd             virtual ms from a user's /ping to its command handler, in
+//                   the scenarios that poll for Telegram commands
+//   heap lo         lowest free simulated heap after a loop() call, the TLS
+//                   record buffers of the Telegram connection included
+//   loop ns         mean and worst host wall-clock cost of one loop() call
+//
+// Usage: bench_bringup [--scenario name] [--max-loop-block-ms n]
+// Exits non-zero if a scenario misses its expected outcome or a loop() call
+// blocks longer than the given bound.
+
+#include <sim.h>
+#include <wifimessaging.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+
+namespace {
+
+const uint32_t kRunMs = 60000;   ///< virtual time budget per scenario
+const uint32_t kIdleMs = 5000;   ///< extra virtual time measured after bring-up
+
+struct Scenario {
+  const char *name;
+  std::function<void(sim::Script &)> setup;
+  bool expectMqtt;
+  bool expectTelegram;
+  /// when set, measure the boot after a first boot, 10 minutes of deep sleep
+  /// and this change of the environment
+  std::function<void(sim::Script &)> wake;
+  bool commands = false;  ///< poll for Telegram commands, a user sends /ping after 10 s
+};
+
+struct Result {
+  uint64_t wifiMs = 0, mqttMs = 0, telegramMs = 0, firstMessageMs = 0;
+  uint32_t maxBlockMs = 0;
+  uint64_t loops = 0;
+  double meanNs = 0;
+  uint64_t worstNs = 0;
+  uint32_t tlsFull = 0, tlsResumed = 0;
+  const char *path = "-";
+  uint32_t wifiAttempts = 0;
+  uint64_t commandMs = 0;
+  uint32_t heapLow = UINT32_MAX;
+};
+
+void mqttCallback(char *, uint8_t *, unsigned int) {}
+
+const uint32_t kPingAtMs = 10000;
+uint64_t pingHandledAt = 0;
+void ping(const char *, const char *) { pingHandledAt = sim::bootMs(); }
+const WifiMessaging::telegramCommand commands[] = {{"ping", ping}};
+
+Result boot(const Scenario &scenario) {
+  Result r;
+  sim::Counters before = sim::counters();
+  WifiMessaging wm("sim-ssid", "sim-password");
+  wm.SetMQTT(sim::kMqttHost, 1883, mqttCallback);
+  wm.SetTelegram("123456:SIMULATED", "42");
+  pingHandledAt = 0;
+  if (scenario.commands) {
+    wm.SetTelegramCommands(commands, 1);
+    sim::after(kPingAtMs, [] { sim::telegramReceive("42", "/ping"); });
+  }
+  wm.connectToWiFi();
+  WifiMessaging::wifiConnectPath firstPath = wm.connectPath();
+  wm.queueMessage("bench");
+
+  uint64_t totalNs = 0;
+  uint64_t doneAt = 0;
+  while (sim::bootMs() < kRunMs) {
+    uint32_t before = sim::bootMs();
+    if (!r.wifiMs && sim::wifiHasIP()) r.wifiMs = before;
+    auto start = std::chrono::steady_clock::now();
+    wm.loop();
+    auto stop = std::chrono::steady_clock::now();
+    uint32_t after = sim::bootMs();
+
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count();
+    totalNs += ns;
+    r.loops++;
+    if (ns > r.worstNs) r.worstNs = ns;
+    if (after - before > r.maxBlockMs) r.maxBlockMs = after - before;
+    if (sim::heap().free < r.heapLow) r.heapLow = sim::heap().free;
+
+    if (!r.mqttMs && wm.StatusMQTT == WifiMessaging::ConnectionActive) r.mqttMs = after;
+    if (!r.telegramMs && wm.StatusTelegram == WifiMessaging::ConnectionActive) r.telegramMs = after;
+    if (!r.firstMessageMs && !sim::telegramSent().empty()) r.firstMessageMs = sim::bootMs();
+
+    bool done = (r.mqttMs || !scenario.expectMqtt) && (r.firstMessageMs || !scenario.expectTelegram) &&
+                (pingHandledAt || !scenario.commands);
+    if (done && !doneAt) doneAt = sim::bootMs();
+    if (doneAt && sim::bootMs() > doneAt + kIdleMs) break;
+
+    sim::advance(1);
+  }
+  r.meanNs = r.loops ? (double)totalNs / r.loops : 0;
+  if (pingHandledAt) r.commandMs = pingHandledAt - kPingAtMs;
+  r.wifiAttempts = wm.statistics(WifiMessaging::ServiceWifi).attempts;
+  if (wm.connectPath() == WifiMessaging::WiFiPathFast)
+    r.path = "fast";
+  else if (firstPath == WifiMessaging::WiFiPathFast)
+    r.path = "fallback";
+  else if (wm.connectPath() == WifiMessaging::WiFiPathFull)
+    r.path = "scan";
+  r.tlsFull = sim::counters().tlsFull - before.tlsFull;
+  r.tlsResumed = sim::counters().tlsResumed - before.tlsResumed;
+  return r;
+}
+
+Result run(const Scenario &scenario) {
+  sim::reset();
+  scenario.setup(sim::script());
+  if (scenario.wake) {
+    boot(scenario);
+    sim::advance(600000);
+    sim::reboot();
+    scenario.wake(sim::script());
+    sim::telegramSent().clear();
+  }
+  return boot(scenario);
+}
+
+void print(const char *name, const Result &r) {
+  auto ms = [](uint64_t v, char *buf) {
+    if (v)
+      snprintf(buf, 16, "%llu", (unsigned long long)v);
+    else
+      snprintf(buf, 16, "-");
+    return buf;
+  };
+  char a[16], b[16], c[16], d[16], e[16], tls[16];
+  snprintf(tls, sizeof(tls), "%u/%u", r.tlsFull, r.tlsResumed);
+  printf("%-14s %7s %7s %7s %8s %8u %8s %4u %6s %6s %8u %9.0f %9llu\n", name, ms(r.wifiMs, a), ms(r.mqttMs, b),
+         ms(r.telegramMs, c), ms(r.firstMessageMs, d), r.maxBlockMs, r.path, r.wifiAttempts, tls,
+         ms(r.commandMs, e), r.heapLow, r.meanNs, (unsigned long long)r.worstNs);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const char *only = nullptr;
+  long maxBlock = -1;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--scenario") && i + 1 < argc) {
+      only = argv[++i];
+    } else if (!strcmp(argv[i], "--max-loop-block-ms") && i + 1 < argc) {
+      maxBlock = atol(argv[++i]);
+    } else {
+      fprintf(stderr, "usage: %s [--scenario name] [--max-loop-block-ms n]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  const Scenario scenarios[] = {
+      {"lan", [](sim::Script &) {}, true, true, nullptr},
+      {"slow-dns", [](sim::Script &s) { s.dnsMs = 900; }, true, true, nullptr},
+      {"slow-tls", [](sim::Script &s) { s.tlsFullHandshakeMs = 3500; s.telegramTcpMs = 150; }, true, true, nullptr},
+      {"broker-down", [](sim::Script &s) { s.mqttAvailable = false; }, false, true, nullptr},
+      {"far-broker", [](sim::Script &s) { s.mqttTcpMs = 150; s.mqttConnackMs = 150; }, true, true, nullptr},
+      {"ntp-slow", [](sim::Script &s) { s.ntpSyncMs = 2500; }, true, true, nullptr},
+      {"wake", [](sim::Script &) {}, true, true, [](sim::Script &) {}},
+      {"wake-moved", [](sim::Script &) {}, true, true, [](sim::Script &s) { s.wifiChannel = 11; }},
+      {"wake-dns-down", [](sim::Script &) {}, true, false, [](sim::Script &s) { s.dnsAvailable = false; }},
+      {"wake-slow-dns", [](sim::Script &) {}, true, true, [](sim::Script &s) { s.dnsMs = 900; }},
+      {"ap-late", [](sim::Script &s) { s.wifiAvailable = false; sim::after(20000, sim::restoreWiFi); }, true, true,
+       nullptr},
+      {"wrong-psk", [](sim::Script &s) { s.wifiRejectReason = 202; }, false, false, nullptr},
+      {"commands", [](sim::Script &) {}, true, true, nullptr, true},
+      {"mfln", [](sim::Script &s) { s.telegramMfln = true; }, true, true, nullptr},
+  };
+
+  printf("%-14s %7s %7s %7s %8s %8s %8s %4s %6s %6s %8s %9s %9s\n", "scenario", "wifi", "mqtt", "tlgm", "1st msg",
+         "max blk", "path", "try", "tls", "cmd", "heap lo", "loop ns", "worst ns");
+  int failures = 0;
+  for (const Scenario &s : scenarios) {
+    if (only && strcmp(only, s.name)) continue;
+    Result r = run(s);
+    print(s.name, r);
+    if (s.expectMqtt && !r.mqttMs) {
+      fprintf(stderr, "%s: MQTT never became active\n", s.name);
+      failures++;
+    }
+    if (s.expectTelegram && !r.firstMessageMs) {
+      fprintf(stderr, "%s: Telegram message never delivered\n", s.name);
+      failures++;
+    }
+    if (s.commands && !r.commandMs) {
+      fprintf(stderr, "%s: Telegram command never handled\n", s.name);
+      failures++;
+    }
+    if (maxBlock >= 0 && r.maxBlockMs > maxBlock) {
+      fprintf(stderr, "%s: loop() blocked %u ms (bound %ld ms)\n", s.name, r.maxBlockMs, maxBlock);
+      failures++;
+    }
+  }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,147 @@
+// Duty-cycle benchmark of WifiMessaging: wake, deliver, deep-sleep
+//
+// A battery node wakes every 5 minutes for 2 hours. It publishes a reading
+// when it changed (two wakes out of three) and sends a Telegram alert every
+// sixth wake. Two ways to run the cycle are compared:
+//   polled   the sketch calls connectToWiFi(), runs loop() until every
+//            service is active and both outboxes are empty, then deep-sleeps;
+//            the library does not know the cycle
+//   duty     the sketch calls deliverAndSleep()
+// Reported per kind of wake, mean awake ms from boot to deep sleep:
+//   cold            the first boot, nothing in RTC memory
+//   idle            nothing to send
+//   mqtt            a reading
+//   mqtt+tlgm       a reading and an alert
+// and the awake ms of all wakes, the messages delivered and the awake ms of
+// all cycles as dutyCycle() reports it after the last wake.
+//
+// Usage: bench_duty
+// Exits non-zero if a message is lost, deliverAndSleep() is not faster or
+// dutyCycle() disagrees with the measured awake time.
+
+#include <sim.h>
+#include <wifimessaging.h>
+
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+const uint32_t kSleepS = 300;
+const uint32_t kWakes = 24;
+const uint32_t kDeadlineMs = 30000;  ///< a wake that does not sleep by then is a failure
+
+enum Kind { Cold, Idle, Mqtt, MqttTelegram, Kinds };
+const char *const kKindNames[Kinds] = {"cold", "idle", "mqtt", "mqtt+tlgm"};
+
+struct Result {
+  uint64_t awakeMs[Kinds] = {};
+  uint32_t wakes[Kinds] = {};
+  uint64_t totalMs = 0;
+  uint32_t queued = 0;
+  uint32_t delivered = 0;
+  uint32_t reportedMs = 0;  ///< dutyCycle().totalAwakeMs read after the last wake
+  bool stuck = false;
+};
+
+void mqttCallback(char *, uint8_t *, unsigned int) {}
+
+bool polledDone(WifiMessaging &wm) {
+  return wm.StatusWiFi == WifiMessaging::ConnectionActive && wm.StatusNTP == WifiMessaging::ConnectionActive &&
+         wm.StatusMQTT == WifiMessaging::ConnectionActive && wm.StatusTelegram == WifiMessaging::ConnectionActive &&
+         wm.pendingPublishes() == 0 && wm.pendingMessages() == 0;
+}
+
+/// One wake of the node
+void wake(uint32_t i, bool duty, Result &r) {
+  WifiMessaging wm("sim-ssid", "sim-password");
+  wm.SetMQTT(sim::kMqttHost, 1883, mqttCallback);
+  wm.SetTelegram("123456:SIMULATED", "42");
+
+  bool reading = i % 3 != 2;
+  bool alert = i % 6 == 0;
+  if (reading) {
+    wm.publish("node/temperature", "21.5");
+    r.queued++;
+  }
+  if (alert) {
+    wm.queueMessage("battery low");
+    r.queued++;
+  }
+
+  if (duty) {
+    wm.deliverAndSleep(kSleepS);
+  } else {
+    wm.connectToWiFi();
+  }
+  while (!sim::sleepRequestedUs() && sim::bootMs() < kDeadlineMs) {
+    wm.loop();
+    if (!duty && polledDone(wm)) ESP.deepSleep((uint64_t)kSleepS * 1000000);
+    if (!sim::sleepRequestedUs()) sim::advance(1);
+  }
+  if (!sim::sleepRequestedUs()) r.stuck = true;
+  uint32_t awake = sim::bootMs();
+
+  Kind kind = i == 0 ? Cold : alert ? MqttTelegram : reading ? Mqtt : Idle;
+  r.awakeMs[kind] += awake;
+  r.wakes[kind]++;
+  r.totalMs += awake;
+}
+
+Result run(bool duty) {
+  Result r;
+  sim::reset();
+  for (uint32_t i = 0; i < kWakes; i++) {
+    wake(i, duty, r);
+    sim::advance(kSleepS * 1000);
+    sim::reboot();
+  }
+  if (duty) {
+    WifiMessaging wm("sim-ssid", "sim-password");
+    r.reportedMs = wm.dutyCycle().totalAwakeMs;
+  }
+  r.delivered = sim::mqttPublished().size() + sim::telegramSent().size();
+  return r;
+}
+
+void print(const char *name, const Result &r) {
+  printf("%-8s", name);
+  for (int k = 0; k < Kinds; k++) printf(" %9llu", (unsigned long long)(r.wakes[k] ? r.awakeMs[k] / r.wakes[k] : 0));
+  printf(" %9llu %6u/%-4u", (unsigned long long)r.totalMs, r.delivered, r.queued);
+  if (r.reportedMs)
+    printf(" %9u\n", r.reportedMs);
+  else
+    printf(" %9s\n", "-");
+}
+
+}  // namespace
+
+int main() {
+  printf("%-8s", "cycle");
+  for (int k = 0; k < Kinds; k++) printf(" %9s", kKindNames[k]);
+  printf(" %9s %11s %9s\n", "total ms", "delivered", "reported");
+
+  Result polled = run(false);
+  print("polled", polled);
+  Result duty = run(true);
+  print("duty", duty);
+
+  int failures = 0;
+  for (const Result *r : {&polled, &duty}) {
+    if (r->stuck || r->delivered != r->queued) {
+      fprintf(stderr, "%s: %u of %u messages delivered%s\n", r == &duty ? "duty" : "polled", r->delivered, r->queued,
+              r->stuck ? ", a wake did not sleep" : "");
+      failures++;
+    }
+  }
+  if (duty.reportedMs != duty.totalMs) {
+    fprintf(stderr, "dutyCycle() reports %u ms awake, measured %llu ms\n", duty.reportedMs,
+            (unsigned long long)duty.totalMs);
+    failures++;
+  }
+  if (duty.totalMs >= polled.totalMs) {
+    fprintf(stderr, "deliverAndSleep() is not faster than the polled cycle\n");
+    failures++;
+  }
+  return failures ? 1 : 0;
+}
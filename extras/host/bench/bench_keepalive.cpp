@@ -0,0 +1,156 @@
+// Telegram connection benchmark of WifiMessaging: keep-alive, pipelining and idle management
+//
+// A node reports to four chats. Once Telegram is active, an alert goes out
+// to every chat every 3 minutes, five times. The server closes a connection
+// idle for 75 s, as nginx does by default. Ways to run the connection:
+//   serial      kept open, one request at a time: the outbox before pipelining
+//   pipelined   kept open, up to four requests ahead of their responses
+//   idle-close  pipelined, closed after 60 s without a message (the default)
+//   probed      pipelined, a getMe every 30 s keeps it open
+//   recycled    probed, against a server that closes a connection after
+//               three requests, so a burst loses the requests behind the
+//               last answer and sends them again
+//   chunked     probed, against a server that sends its bodies chunked
+//   close-body  probed, against a server that ends each body by closing
+//               the connection, like recycled after every request
+// Reported:
+//   delivered   messages delivered at the API / sends asked for
+//   tls         full/resumed TLS handshakes
+//   probes      getMe requests
+//   burst ms    mean ms from an alert to its delivery in the last chat
+//   heap mean   mean free simulated heap, the TLS buffers of an open
+//               connection taken out
+//
+// Usage: bench_keepalive
+// Exits non-zero if a message is lost or fails, if pipelining does not
+// deliver a burst sooner than serial, or if probing needs a handshake after
+// the first.
+
+#include <sim.h>
+#include <wifimessaging.h>
+
+#include <cstdio>
+
+namespace {
+
+const uint32_t kRunMs = 900000;
+const uint32_t kFirstMs = 10000;  ///< after Telegram is active
+const uint32_t kBurstMs = 180000;
+const uint32_t kBursts = 5;
+const char *const kChats[] = {"42", "-1001", "-1002", "-1003"};
+const uint32_t kChatCount = sizeof(kChats) / sizeof(kChats[0]);
+
+struct Mode {
+  const char *name;
+  uint32_t idleMs;
+  uint32_t probeMs;
+  uint8_t pipeline;
+  uint32_t serverRequests;  ///< requests the server answers per connection, 0 any
+  uint8_t serverFraming;    ///< see sim::Script::telegramFraming
+};
+
+const Mode kModes[] = {
+    {"serial", 0, 0, 1, 0, 0},      {"pipelined", 0, 0, 4, 0, 0},  {"idle-close", 60000, 0, 4, 0, 0},
+    {"probed", 0, 30000, 4, 0, 0},  {"recycled", 0, 30000, 4, 3, 0}, {"chunked", 0, 30000, 4, 0, 1},
+    {"close-body", 0, 30000, 4, 0, 2},
+};
+
+struct Result {
+  uint32_t asked = 0;
+  uint32_t delivered = 0;
+  uint32_t failed = 0;
+  uint32_t tlsFull = 0;
+  uint32_t tlsResumed = 0;
+  uint32_t probes = 0;
+  uint64_t burstMs = 0;  ///< summed over the bursts
+  uint64_t heapSum = 0;
+  uint32_t heapSamples = 0;
+};
+
+Result run(const Mode &mode) {
+  sim::reset();
+  sim::script().telegramIdleCloseMs = 75000;
+  sim::script().telegramKeepAliveRequests = mode.serverRequests;
+  sim::script().telegramFraming = mode.serverFraming;
+  Result r;
+  WifiMessaging wm("sim-ssid", "sim-password");
+  wm.SetTelegram("123456:SIMULATED", kChats[0]);
+  for (uint32_t i = 1; i < kChatCount; i++) wm.AddTelegramChat(kChats[i]);
+  wm.SetTelegramKeepAlive(mode.idleMs, mode.probeMs, mode.pipeline);
+  wm.connectToWiFi();
+
+  uint64_t startMs = 0;
+  uint64_t queuedAt[kBursts] = {0};
+  uint16_t tickets[kBursts] = {0};
+  uint32_t bursts = 0;
+  while (sim::bootMs() < kRunMs) {
+    wm.loop();
+    uint64_t now = sim::worldMs();
+    if (!startMs && wm.StatusTelegram == WifiMessaging::ConnectionActive) startMs = now;
+    if (startMs && bursts < kBursts && now >= startMs + kFirstMs + bursts * kBurstMs) {
+      char text[16];
+      snprintf(text, sizeof(text), "alert %u", bursts);
+      queuedAt[bursts] = now;
+      tickets[bursts] = wm.queueMessageTo(WifiMessaging::TelegramAllChats, WifiMessaging::PriorityUrgent, text);
+      r.asked += kChatCount;
+      bursts++;
+    }
+    if (startMs) {
+      r.heapSum += sim::heap().free;
+      r.heapSamples++;
+    }
+    sim::advance(1);
+  }
+
+  uint64_t lastAt[kBursts] = {0};
+  for (const sim::TelegramMessage &m : sim::telegramSent()) {
+    unsigned burst;
+    if (sscanf(m.text.c_str(), "alert %u", &burst) != 1 || burst >= kBursts) continue;
+    r.delivered++;
+    if (m.atMs > lastAt[burst]) lastAt[burst] = m.atMs;
+  }
+  for (uint32_t i = 0; i < kBursts; i++) {
+    if (lastAt[i]) r.burstMs += lastAt[i] - queuedAt[i];
+    if (wm.messageStatus(tickets[i]) != WifiMessaging::DeliverySent) r.failed++;
+  }
+  r.tlsFull = sim::counters().tlsFull;
+  r.tlsResumed = sim::counters().tlsResumed;
+  r.probes = sim::counters().telegramProbes;
+  return r;
+}
+
+void print(const char *name, const Result &r) {
+  char tls[16];
+  snprintf(tls, sizeof(tls), "%u/%u", r.tlsFull, r.tlsResumed);
+  printf("%-10s %6u/%-4u %6s %6u %8llu %9llu\n", name, r.delivered, r.asked, tls, r.probes,
+         (unsigned long long)(r.burstMs / kBursts), (unsigned long long)(r.heapSamples ? r.heapSum / r.heapSamples : 0));
+}
+
+}  // namespace
+
+int main() {
+  printf("%-10s %11s %6s %6s %8s %9s\n", "connection", "delivered", "tls", "probes", "burst ms", "heap mean");
+  const uint32_t kModeCount = sizeof(kModes) / sizeof(kModes[0]);
+  Result results[kModeCount];
+  int failures = 0;
+  for (uint32_t i = 0; i < kModeCount; i++) {
+    results[i] = run(kModes[i]);
+    print(kModes[i].name, results[i]);
+    if (results[i].delivered != results[i].asked || results[i].failed) {
+      fprintf(stderr, "%s: %u of %u sends delivered, %u messages failed\n", kModes[i].name, results[i].delivered,
+              results[i].asked, results[i].failed);
+      failures++;
+    }
+  }
+
+  const Result &serial = results[0], &pipelined = results[1], &probed = results[3];
+  if (pipelined.burstMs >= serial.burstMs) {
+    fprintf(stderr, "pipelined: bursts not delivered sooner\n");
+    failures++;
+  }
+  if (probed.tlsFull + probed.tlsResumed != 1) {
+    fprintf(stderr, "probed: %u handshakes\n", probed.tlsFull + probed.tlsResumed);
+    failures++;
+  }
+  return failures ? 1 : 0;
+}
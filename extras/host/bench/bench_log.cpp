@@ -0,0 +1,186 @@
+// Log output benchmark of WifiMessaging: synchronous writes against the ring
+//
+// A device with every log level compiled in brings up WiFi, NTP, MQTT and
+// Telegram on a 115200 baud Serial, publishes once a second, sends two
+// Telegram messages and rides out a WiFi drop, for 60 virtual seconds. A
+// timer logs a compact record every 50 ms, standing in for an interrupt.
+// Two ways to write the log are compared:
+//   sync     every record is written to Serial at the call, as the former
+//            DEBUG_WIFIMESSAGING_PRINTF did
+//   ring     records are kept in the ring and loop() writes them out
+// Reported:
+//   lines         log lines written to Serial
+//   bytes         bytes written to Serial
+//   serial ms     virtual ms the device waited for the UART
+//   mqtt ms       time until MQTT is active
+//   ticks         timer records written / logged
+//   dropped       records lost on a full ring, while a blocking TLS
+//                 handshake keeps loop() from writing the ring out
+// followed by the host cost of one log call per record format.
+//
+// Usage: bench_log
+// Exits non-zero if the ring waits for the UART, reorders a record or loses
+// one without counting it, or if the synchronous log does not wait.
+
+#include <sim.h>
+#include <wifimessaging.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace {
+
+const uint32_t kRunMs = 60000;
+const uint32_t kTickMs = 50;
+
+/**
+ * @brief Serial with a count of the lines and a check of the timer records
+ */
+class Tap : public Print {
+ public:
+  uint32_t lines = 0;
+  uint32_t ticks = 0;
+  bool ordered = true;
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override {
+    for (size_t i = 0; i < size; i++) {
+      if (buffer[i] != '\n') {
+        line += (char)buffer[i];
+        continue;
+      }
+      lines++;
+      size_t at = line.find("tick ");
+      if (at != std::string::npos) {
+        int32_t tick = atoi(line.c_str() + at + 5);
+        if (tick <= lastTick) ordered = false;
+        lastTick = tick;
+        ticks++;
+      }
+      line.clear();
+    }
+    return Serial.write(buffer, size);
+  }
+  int availableForWrite() override { return Serial.availableForWrite(); }
+  void flush() override { Serial.flush(); }
+
+ private:
+  std::string line;
+  int32_t lastTick = -1;
+};
+
+struct Result {
+  uint32_t lines = 0;
+  uint32_t bytes = 0;
+  uint64_t serialMs = 0;
+  uint32_t mqttMs = 0;
+  uint32_t dropped = 0;
+  uint32_t ticks = 0;  ///< timer records written
+  uint32_t ticksLogged = 0;
+  bool ordered = true;
+};
+
+void mqttCallback(char *, uint8_t *, unsigned int) {}
+
+Result run(bool sync) {
+  sim::reset();
+  Serial.begin(115200);
+  Tap tap;
+  WifiMessagingLog::output(&tap);
+  WifiMessagingLog::synchronous(sync);
+  uint32_t droppedBefore = WifiMessagingLog::dropped();
+
+  Result r;
+  uint32_t tick = 0;
+  sim::every(kTickMs, [&tick] { WIFIMESSAGING_LOG_COMPACT(WIFIMESSAGING_LOG_DEBUG, "tick %u", tick++); });
+  sim::after(20000, [] { sim::dropWiFi(WIFI_DISCONNECT_REASON_BEACON_TIMEOUT); });
+  sim::after(25000, [] { sim::restoreWiFi(); });
+
+  WifiMessaging wm("sim-ssid", "sim-password");
+  wm.SetMQTT(sim::kMqttHost, 1883, mqttCallback);
+  wm.SetTelegram("123456:SIMULATED", "42");
+  wm.connectToWiFi();
+  wm.queueMessage("booted");
+
+  uint32_t publishAt = 1000;
+  while (sim::bootMs() < kRunMs) {
+    wm.loop();
+    if (!r.mqttMs && wm.StatusMQTT == WifiMessaging::ConnectionActive) r.mqttMs = sim::bootMs();
+    if (sim::bootMs() >= publishAt) {
+      publishAt += 1000;
+      wm.publish("node/temperature", "21.5");
+      if (publishAt == 30000) wm.queueMessage("back online");
+    }
+    sim::advance(1);
+  }
+  r.serialMs = sim::counters().serialBlockedMs;
+  WifiMessagingLog::flush();
+
+  r.lines = tap.lines;
+  r.bytes = sim::counters().serialBytes;
+  r.dropped = WifiMessagingLog::dropped() - droppedBefore;
+  r.ticks = tap.ticks;
+  r.ticksLogged = tick;
+  r.ordered = tap.ordered;
+  WifiMessagingLog::synchronous(false);
+  WifiMessagingLog::output(&Serial);
+  return r;
+}
+
+void print(const char *name, const Result &r) {
+  printf("%-6s %7u %8u %10llu %8u %6u/%-6u %7u\n", name, r.lines, r.bytes, (unsigned long long)r.serialMs, r.mqttMs,
+         r.ticks, r.ticksLogged, r.dropped);
+}
+
+/// Host ns of one call of log, with the ring emptied every 8 calls
+template <typename F>
+double hostNs(F log) {
+  const int kCalls = 200000;
+  WifiMessagingLog::output(nullptr);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kCalls; i++) {
+    log(i);
+    if (i % 8 == 7) WifiMessagingLog::drain();
+  }
+  auto stop = std::chrono::steady_clock::now();
+  WifiMessagingLog::drain();
+  WifiMessagingLog::output(&Serial);
+  return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count() / kCalls;
+}
+
+}  // namespace
+
+int main() {
+  printf("%-6s %7s %8s %10s %8s %13s %7s\n", "log", "lines", "bytes", "serial ms", "mqtt ms", "ticks", "dropped");
+  Result sync = run(true);
+  print("sync", sync);
+  Result ring = run(false);
+  print("ring", ring);
+
+  // the drain of the calls above is not timed, only the call
+  volatile int sink = 0;
+  double textNs = hostNs([](int i) { WIFIMESSAGING_LOGI("MQTT outbox full, %s dropped", "node/temperature"); });
+  double compactNs = hostNs([](int i) { WIFIMESSAGING_LOG_COMPACT(WIFIMESSAGING_LOG_INFO, "tick %u", i); });
+  double offNs = hostNs([&sink](int i) {
+    WIFIMESSAGING_LOG_AT(WIFIMESSAGING_LOG_DEBUG + 1, "above the level %d", sink += i);
+  });
+  printf("\nhost ns per call: text %.0f, compact %.0f, above the level %.1f\n", textNs, compactNs, offNs);
+
+  int failures = 0;
+  if (ring.serialMs) {
+    fprintf(stderr, "ring: %llu ms waiting for the UART\n", (unsigned long long)ring.serialMs);
+    failures++;
+  }
+  if (!ring.ordered || ring.ticks + ring.dropped < ring.ticksLogged) {
+    fprintf(stderr, "ring: %u of %u timer records written, %u dropped%s\n", ring.ticks, ring.ticksLogged,
+            ring.dropped, ring.ordered ? "" : ", out of order");
+    failures++;
+  }
+  if (!sync.serialMs) {
+    fprintf(stderr, "sync: never waited for the UART\n");
+    failures++;
+  }
+  return failures ? 1 : 0;
+}
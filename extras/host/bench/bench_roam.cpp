@@ -0,0 +1,182 @@
+// WiFi roaming benchmark of WifiMessaging on a simulated multi-AP site
+//
+// Every scenario runs twice for 10 virtual minutes, MQTT publishing once a
+// second: "single" is the network of the constructor without roaming, the
+// behaviour before AddWiFi() and SetWiFiRoaming(); "roaming" adds the other
+// networks of the site and roams with the default threshold. Reported:
+//   offline ms      virtual ms without an IP after the first connect
+//   weak s          seconds associated below -75 dBm
+//   rate            mean 802.11g/b rate the RSSI of the link supports, Mbit/s,
+//                   0 while offline (see phyRate())
+//   roams           switches to a stronger access point
+//   scans           full scans, by the SDK or by the library
+//   mqtt            messages at the broker / published
+//
+// Usage: bench_roam [--scenario name]
+// Exits non-zero if roaming improves neither the rate nor the offline time
+// of a scenario.
+
+#include <sim.h>
+#include <wifimessaging.h>
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+
+namespace {
+
+const uint32_t kRunMs = 600000;     ///< virtual time per run
+const uint32_t kPublishMs = 1000;
+const uint32_t kEventMs = 120000;   ///< when the scenario changes the site
+
+const uint8_t kBssidB[6] = {0x24, 0xA4, 0x3C, 0x0B, 0x0B, 0x0B};
+
+struct Scenario {
+  const char *name;
+  std::function<void(sim::Script &)> setup;  ///< access points at boot
+  std::function<void(uint32_t)> step;        ///< once a second, with ms since kEventMs, nullptr for none
+  std::function<void()> event;               ///< at kEventMs, nullptr for none
+  const char *otherSsid;                     ///< network added by AddWiFi() in the roaming run, nullptr for none
+};
+
+struct Result {
+  uint64_t offlineMs = 0;
+  uint32_t weakS = 0;
+  double rate = 0;
+  uint32_t roams = 0;
+  uint32_t scans = 0;
+  size_t delivered = 0;
+  uint32_t published = 0;
+};
+
+/// Rate an ESP8266 sustains at this RSSI, 802.11g down to 802.11b
+double phyRate(int32_t rssi) {
+  if (rssi >= -67) return 54;
+  if (rssi >= -72) return 36;
+  if (rssi >= -76) return 18;
+  if (rssi >= -80) return 11;
+  if (rssi >= -85) return 5.5;
+  return 1;
+}
+
+sim::AccessPoint accessPointB(const char *ssid, int32_t rssi) {
+  sim::AccessPoint ap{ssid, {}, 11, rssi, true};
+  memcpy(ap.bssid, kBssidB, sizeof(ap.bssid));
+  return ap;
+}
+
+/// linear from a to b over kEventMs
+int32_t ramp(int32_t a, int32_t b, uint32_t ms) {
+  if (ms >= kEventMs) return b;
+  return a + (int32_t)((int64_t)(b - a) * ms / kEventMs);
+}
+
+void mqttCallback(char *, uint8_t *, unsigned int) {}
+
+Result run(const Scenario &scenario, bool roaming) {
+  sim::reset();
+  scenario.setup(sim::script());
+  if (scenario.step) sim::every(1000, [&scenario] {
+    if (sim::bootMs() >= kEventMs) scenario.step(sim::bootMs() - kEventMs);
+  });
+  if (scenario.event) sim::after(kEventMs, scenario.event);
+
+  WifiMessaging wm("sim-ssid", "sim-password");
+  if (roaming) {
+    if (scenario.otherSsid) wm.AddWiFi(scenario.otherSsid, "sim-password");
+  } else {
+    wm.SetWiFiRoaming(0);
+  }
+  wm.SetMQTT(sim::kMqttHost, 1883, mqttCallback);
+  wm.connectToWiFi();
+
+  Result r;
+  uint64_t rateSum = 0;  ///< in kbit/s * ms
+  bool connected = false;
+  uint32_t publishAt = kPublishMs;
+  while (sim::bootMs() < kRunMs) {
+    wm.loop();
+    if (sim::wifiHasIP()) connected = true;
+    if (connected) {
+      int32_t rssi = sim::wifiRssi();
+      if (!sim::wifiHasIP())
+        r.offlineMs++;
+      else
+        rateSum += (uint64_t)(phyRate(rssi) * 1000);
+      if (rssi && rssi < -75 && sim::bootMs() % 1000 == 0) r.weakS++;
+    }
+    if (sim::bootMs() >= publishAt) {
+      publishAt += kPublishMs;
+      if (wm.publish("site/sensor", "21.5")) r.published++;
+    }
+    sim::advance(1);
+  }
+  r.rate = (double)rateSum / kRunMs / 1000;
+  r.roams = wm.statistics(WifiMessaging::ServiceWifi).roams;
+  r.scans = sim::counters().wifiScans;
+  r.delivered = sim::mqttPublished().size();
+  return r;
+}
+
+void print(const char *name, const char *config, const Result &r) {
+  printf("%-10s %-8s %10llu %7u %6.1f %6u %6u %6zu/%-6u\n", name, config, (unsigned long long)r.offlineMs, r.weakS,
+         r.rate, r.roams, r.scans, r.delivered, r.published);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const char *only = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--scenario") && i + 1 < argc) {
+      only = argv[++i];
+    } else {
+      fprintf(stderr, "usage: %s [--scenario name]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  const Scenario scenarios[] = {
+      // the device moves from the first access point to the second one
+      {"walk",
+       [](sim::Script &s) {
+         s.wifiRssi = -55;
+         s.accessPoints.push_back(accessPointB("sim-ssid", -82));
+       },
+       [](uint32_t ms) {
+         sim::script().wifiRssi = ramp(-55, -86, ms);
+         sim::script().accessPoints[0].rssi = ramp(-82, -55, ms);
+       },
+       nullptr, nullptr},
+      // the access point of the station fails, a weaker one of the same SSID stays
+      {"ap-lost",
+       [](sim::Script &s) {
+         s.wifiRssi = -76;
+         s.accessPoints.push_back(accessPointB("sim-ssid", -80));
+       },
+       nullptr, [] { sim::dropWiFi(WIFI_DISCONNECT_REASON_BEACON_TIMEOUT); }, nullptr},
+      // the network of the station fails, another network of the site stays
+      {"two-ssids",
+       [](sim::Script &s) {
+         s.wifiRssi = -60;
+         s.accessPoints.push_back(accessPointB("sim-backup", -66));
+       },
+       nullptr, [] { sim::dropWiFi(WIFI_DISCONNECT_REASON_BEACON_TIMEOUT); }, "sim-backup"},
+  };
+
+  printf("%-10s %-8s %10s %7s %6s %6s %6s %13s\n", "scenario", "config", "offline ms", "weak s", "rate", "roams",
+         "scans", "mqtt");
+  int failures = 0;
+  for (const Scenario &s : scenarios) {
+    if (only && strcmp(only, s.name)) continue;
+    Result single = run(s, false);
+    print(s.name, "single", single);
+    Result roaming = run(s, true);
+    print(s.name, "roaming", roaming);
+    if (roaming.rate <= single.rate && roaming.offlineMs >= single.offlineMs) {
+      fprintf(stderr, "%s: roaming improves neither rate nor offline time\n", s.name);
+      failures++;
+    }
+  }
+  return failures ? 1 : 0;
+}
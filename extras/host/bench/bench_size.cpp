@@ -0,0 +1,64 @@
+// Size of one service selection of WifiMessaging
+//
+// Built once per selection of WIFIMESSAGING_ENABLE_MQTT and
+// WIFIMESSAGING_ENABLE_TELEGRAM (see CMakeLists.txt), against a library
+// compiled with the same selection. A device brings up the compiled services
+// on the simulated back-ends. Reported:
+//   sizeof          RAM of the WifiMessaging object
+//   heap            simulated heap in use once the services are active
+//   up ms           virtual ms from boot until every compiled service is active
+//
+// The code size of each selection is reported by the size_report target.
+//
+// Usage: size_<selection>
+// Exits non-zero if a compiled service does not come up.
+
+#include <sim.h>
+#include <wifimessaging.h>
+
+#include <cstdio>
+#include <string>
+
+namespace {
+
+const uint32_t kRunMs = 60000;  ///< virtual time budget
+
+#if WIFIMESSAGING_ENABLE_MQTT
+void mqttCallback(char *, uint8_t *, unsigned int) {}
+#endif
+
+bool allActive(const WifiMessaging &wm) {
+  bool active = wm.StatusWiFi == WifiMessaging::ConnectionActive && wm.StatusNTP == WifiMessaging::ConnectionActive;
+#if WIFIMESSAGING_ENABLE_MQTT
+  active = active && wm.StatusMQTT == WifiMessaging::ConnectionActive;
+#endif
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  active = active && wm.StatusTelegram == WifiMessaging::ConnectionActive;
+#endif
+  return active;
+}
+
+}  // namespace
+
+int main() {
+  sim::reset();
+  uint32_t heapAtBoot = sim::heap().free;
+  static WifiMessaging wm("sim-ssid", "sim-password");
+#if WIFIMESSAGING_ENABLE_MQTT
+  wm.SetMQTT(sim::kMqttHost, 1883, mqttCallback);
+#endif
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  wm.SetTelegram("123456:SIMULATED", "42");
+#endif
+  wm.connectToWiFi();
+
+  while (!allActive(wm) && sim::bootMs() < kRunMs) {
+    wm.loop();
+    sim::advance(1);
+  }
+  bool up = allActive(wm);
+
+  printf("%-9s sizeof %6zu  heap %6u  up ms %6s\n", WIFIMESSAGING_SELECTION, sizeof(WifiMessaging),
+         (unsigned)(heapAtBoot - sim::heap().free), up ? std::to_string(sim::bootMs()).c_str() : "-");
+  return up ? 0 : 1;
+}
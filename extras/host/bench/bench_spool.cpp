@@ -0,0 +1,405 @@
+// Flash spool benchmark of WifiMessaging: throughput, outage and brown-out
+//
+// Throughput: a spool of WIFIMESSAGING_SPOOL_SEGMENTS segments is filled
+// with 64-byte records until it refuses one, then read back and acked in
+// batches of four, what loop() does, 200 times over. Reported per phase:
+//   records/s, MB/s  on the host file system, for comparing changes only
+//   flash B/rec      bytes written to flash per record, headers and acks included
+//   syncs/rec        File::flush() of written data per record
+//   device ms/rec    blocked ms per record with Script::fsSyncMs per sync
+//
+// Outage: a node publishes a reading every 200 ms and sends a Telegram alert
+// every 2 s, 40 readings and 4 alerts. Two seconds in the access point goes
+// away, six seconds in the node browns out and reboots, ten seconds in the
+// access point is back. Two ways to keep the messages:
+//   ram      the outboxes only
+//   spool    beginSpool(LittleFS)
+// Reported: readings and alerts delivered, lost, duplicated or out of order,
+// ms from the access point coming back until all is delivered, and the
+// bytes written to flash while the node was online.
+//
+// Checks of the spool on its own: records read but not acked come again after
+// a reboot, acked ones do not; a torn record at the end of a segment is
+// ignored and the spool carries on in a new segment; records the replay
+// cannot read are taken off the spool, also as its last record.
+//
+// Usage: bench_spool
+// Exits non-zero if the spool loses, duplicates or reorders a message of the
+// outage, writes flash while online, or fails a check.
+
+#include <LittleFS.h>
+#include <sim.h>
+#include <wifimessaging.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+// ********************  THROUGHPUT  ********************
+
+const uint16_t kRecordSize = 64;
+const uint32_t kRounds = 200;
+const uint32_t kAckBatch = 4;
+
+struct Phase {
+  uint64_t records = 0;
+  double seconds = 0;
+  uint64_t bytesWritten = 0;
+  uint64_t syncs = 0;
+  uint64_t blockedMs = 0;
+};
+
+void printPhase(const char *name, const Phase &p) {
+  double records = p.records ? (double)p.records : 1;
+  printf("%-8s %8llu %10.0f %6.2f %10.1f %9.2f %13.2f\n", name, (unsigned long long)p.records,
+         p.seconds > 0 ? p.records / p.seconds : 0, p.seconds > 0 ? p.records * kRecordSize / p.seconds / 1e6 : 0,
+         p.bytesWritten / records, p.syncs / records, p.blockedMs / records);
+}
+
+int throughput() {
+  sim::reset();
+  LittleFS.begin();
+  WifiMessagingSpool spool;
+  spool.begin(LittleFS, "/bench");
+  Phase append, replay;
+  uint8_t record[kRecordSize];
+  uint32_t written = 0, read = 0, mismatches = 0;
+  for (uint32_t round = 0; round < kRounds; round++) {
+    sim::Counters before = sim::counters();
+    auto start = std::chrono::steady_clock::now();
+    for (;;) {
+      memset(record, 0, sizeof(record));
+      memcpy(record, &written, sizeof(written));
+      if (!spool.append(record, sizeof(record))) break;
+      written++;
+      append.records++;
+    }
+    auto mid = std::chrono::steady_clock::now();
+    sim::Counters after = sim::counters();
+    append.seconds += std::chrono::duration<double>(mid - start).count();
+    append.bytesWritten += after.fsBytesWritten - before.fsBytesWritten;
+    append.syncs += after.fsSyncs - before.fsSyncs;
+    append.blockedMs += after.blockedMs - before.blockedMs;
+
+    uint32_t sequence, batch = 0;
+    while (spool.read(record, sizeof(record), sequence) == sizeof(record)) {
+      uint32_t index;
+      memcpy(&index, record, sizeof(index));
+      if (index != read) mismatches++;
+      read++;
+      replay.records++;
+      if (++batch == kAckBatch) {
+        spool.ack(sequence);
+        batch = 0;
+      }
+    }
+    if (batch) spool.ack(sequence);
+    auto end = std::chrono::steady_clock::now();
+    sim::Counters last = sim::counters();
+    replay.seconds += std::chrono::duration<double>(end - mid).count();
+    replay.bytesWritten += last.fsBytesWritten - after.fsBytesWritten;
+    replay.syncs += last.fsSyncs - after.fsSyncs;
+    replay.blockedMs += last.blockedMs - after.blockedMs;
+  }
+  printf("%-8s %8s %10s %6s %10s %9s %13s\n", "phase", "records", "records/s", "MB/s", "flash B/rec", "syncs/rec",
+         "device ms/rec");
+  printPhase("append", append);
+  printPhase("replay", replay);
+  printf("%u records a fill, %u segment files created\n\n", (unsigned)(append.records / kRounds),
+         sim::counters().fsFilesCreated);
+
+  int failures = 0;
+  if (read != written || mismatches || spool.pending()) {
+    fprintf(stderr, "throughput: %u of %u records read back, %u out of order, %u pending\n", read, written,
+            mismatches, spool.pending());
+    failures++;
+  }
+  return failures;
+}
+
+// ********************  OUTAGE  ********************
+
+const uint32_t kReadingMs = 200;
+const uint32_t kReadings = 40;
+const uint32_t kAlertMs = 2000;
+const uint32_t kAlerts = 4;
+const uint32_t kDropMs = 2000;
+const uint32_t kRebootMs = 6000;
+const uint32_t kRestoreMs = 10000;
+const uint32_t kRunMs = 60000;
+
+struct Outage {
+  uint32_t readings = 0;  ///< distinct readings delivered
+  uint32_t alerts = 0;
+  uint32_t duplicates = 0;
+  uint32_t reordered = 0;
+  uint64_t drainMs = 0;  ///< from the access point back to the last delivery
+  uint32_t onlineBytes = 0;  ///< flash written before the access point went away
+  bool online = true;
+};
+
+void mqttCallback(char *, uint8_t *, unsigned int) {}
+
+std::unique_ptr<WifiMessaging> boot(bool spool) {
+  std::unique_ptr<WifiMessaging> wm(new WifiMessaging("sim-ssid", "sim-password"));
+  wm->SetMQTT(sim::kMqttHost, 1883, mqttCallback);
+  wm->SetTelegram("123456:SIMULATED", "42");
+  if (spool) {
+    LittleFS.begin();
+    wm->beginSpool(LittleFS);
+  }
+  wm->connectToWiFi();
+  return wm;
+}
+
+/// distinct indices of "<prefix> <index>" in order of delivery
+void account(const std::vector<std::string> &texts, const char *prefix, uint32_t &distinct, Outage &o) {
+  std::vector<bool> seen;
+  int64_t last = -1;
+  for (const std::string &text : texts) {
+    unsigned index;
+    char format[32];
+    snprintf(format, sizeof(format), "%s %%u", prefix);
+    if (sscanf(text.c_str(), format, &index) != 1) continue;
+    if (index >= seen.size()) seen.resize(index + 1);
+    if (seen[index]) {
+      o.duplicates++;
+      continue;
+    }
+    seen[index] = true;
+    distinct++;
+    if ((int64_t)index < last) o.reordered++;
+    last = index;
+  }
+}
+
+Outage outage(bool spool) {
+  sim::reset();
+  Outage o;
+  std::unique_ptr<WifiMessaging> wm = boot(spool);
+  while (sim::bootMs() < 30000 && (wm->StatusMQTT != WifiMessaging::ConnectionActive ||
+                                   wm->StatusTelegram != WifiMessaging::ConnectionActive)) {
+    wm->loop();
+    sim::advance(1);
+  }
+  if (wm->StatusMQTT != WifiMessaging::ConnectionActive || wm->StatusTelegram != WifiMessaging::ConnectionActive) {
+    o.online = false;
+    return o;
+  }
+
+  uint64_t start = sim::worldMs();
+  uint32_t readings = 0, alerts = 0;
+  bool dropped = false, rebooted = false, restored = false;
+  while (sim::worldMs() < start + kRunMs) {
+    uint64_t at = sim::worldMs() - start;
+    if (!dropped && at >= kDropMs) {
+      o.onlineBytes = sim::counters().fsBytesWritten;
+      sim::dropWiFi(WIFI_DISCONNECT_REASON_BEACON_TIMEOUT);
+      dropped = true;
+    }
+    if (!rebooted && at >= kRebootMs) {
+      wm.reset();
+      sim::reboot();
+      wm = boot(spool);
+      rebooted = true;
+    }
+    if (!restored && at >= kRestoreMs) {
+      sim::restoreWiFi();
+      restored = true;
+    }
+    if (readings < kReadings && at >= readings * kReadingMs) {
+      char payload[16];
+      snprintf(payload, sizeof(payload), "reading %u", readings++);
+      wm->publish("node/reading", payload, false, 1);
+    }
+    if (alerts < kAlerts && at >= alerts * kAlertMs) {
+      char text[16];
+      snprintf(text, sizeof(text), "alert %u", alerts++);
+      wm->queueMessage(text);
+    }
+    wm->loop();
+    sim::advance(1);
+  }
+
+  std::vector<std::string> texts;
+  uint64_t lastAt = 0;
+  for (const sim::MqttMessage &m : sim::mqttPublished()) {
+    texts.push_back(m.payload);
+    if (m.atMs > lastAt) lastAt = m.atMs;
+  }
+  account(texts, "reading", o.readings, o);
+  texts.clear();
+  for (const sim::TelegramMessage &m : sim::telegramSent()) {
+    texts.push_back(m.text);
+    if (m.atMs > lastAt) lastAt = m.atMs;
+  }
+  account(texts, "alert", o.alerts, o);
+  if (lastAt > start + kRestoreMs) o.drainMs = lastAt - start - kRestoreMs;
+  return o;
+}
+
+void printOutage(const char *name, const Outage &o) {
+  printf("%-6s %6u/%-3u %5u/%-3u %6u %6u %9u %9llu %12u\n", name, o.readings, kReadings, o.alerts, kAlerts,
+         kReadings + kAlerts - o.readings - o.alerts, o.duplicates, o.reordered, (unsigned long long)o.drainMs,
+         o.onlineBytes);
+}
+
+// ********************  CHECKS  ********************
+
+int checkReplay() {
+  sim::reset();
+  LittleFS.begin();
+  WifiMessagingSpool spool;
+  spool.begin(LittleFS, "/check");
+  char text[16];
+  for (uint32_t i = 0; i < 10; i++) {
+    snprintf(text, sizeof(text), "record %u", i);
+    spool.append(text, strlen(text) + 1);
+  }
+  uint32_t sequence = 0;
+  for (uint32_t i = 0; i < 6; i++) spool.read(text, sizeof(text), sequence);
+  spool.ack(sequence - 2);  // four delivered, two read and lost with the reboot
+  spool.end();
+  sim::reboot();
+
+  spool.begin(LittleFS, "/check");
+  int failures = 0;
+  if (spool.pending() != 6 || spool.unread() != 6) {
+    fprintf(stderr, "replay: %u pending, %u unread after the reboot, expected 6\n", spool.pending(), spool.unread());
+    failures++;
+  }
+  if (!spool.read(text, sizeof(text), sequence) || strcmp(text, "record 4") != 0) {
+    fprintf(stderr, "replay: first record after the reboot is \"%s\", expected \"record 4\"\n", text);
+    failures++;
+  }
+  while (spool.read(text, sizeof(text), sequence)) {
+  }
+  spool.ack(sequence);
+  if (spool.pending() != 0 || sim::counters().fsFilesCreated != sim::counters().fsFilesRemoved) {
+    fprintf(stderr, "replay: %u pending, %u of %u files removed once all is acked\n", spool.pending(),
+            sim::counters().fsFilesRemoved, sim::counters().fsFilesCreated);
+    failures++;
+  }
+  return failures;
+}
+
+int checkTornTail() {
+  sim::reset();
+  LittleFS.begin();
+  WifiMessagingSpool spool;
+  spool.begin(LittleFS, "/check");
+  char text[16];
+  for (uint32_t i = 0; i < 5; i++) {
+    snprintf(text, sizeof(text), "record %u", i);
+    spool.append(text, strlen(text) + 1);
+  }
+  spool.end();
+  // a power loss halfway through a record: its header and part of its data
+  std::string segment = sim::fsPath("/check/00000001");
+  FILE *file = fopen(segment.c_str(), "ab");
+  const uint8_t torn[] = {0x12, 0x34, 0x56, 0x78, 6, 0, 0, 0, 9, 0, 1, 0xA5, 'r', 'e', 'c'};
+  fwrite(torn, 1, sizeof(torn), file);
+  fclose(file);
+  sim::reboot();
+
+  spool.begin(LittleFS, "/check");
+  int failures = 0;
+  if (spool.pending() != 5) {
+    fprintf(stderr, "torn tail: %u records pending, expected 5\n", spool.pending());
+    failures++;
+  }
+  spool.append("record 5", 9);
+  uint32_t sequence, count = 0;
+  while (spool.read(text, sizeof(text), sequence)) {
+    char expected[16];
+    snprintf(expected, sizeof(expected), "record %u", count++);
+    if (strcmp(text, expected) != 0) {
+      fprintf(stderr, "torn tail: read \"%s\", expected \"%s\"\n", text, expected);
+      failures++;
+      break;
+    }
+  }
+  if (count != 6) {
+    fprintf(stderr, "torn tail: %u records read, expected 6\n", count);
+    failures++;
+  }
+  return failures;
+}
+
+int checkUnreadable() {
+  sim::reset();
+  LittleFS.begin();
+  LittleFS.mkdir(WIFIMESSAGING_SPOOL_DIR);
+  // a message each, then a record the replay cannot read as the last one:
+  // a topic longer than the outbox takes, a message to no chat
+  WifiMessagingSpool mqtt, telegram;
+  mqtt.begin(LittleFS, WIFIMESSAGING_SPOOL_DIR "/mqtt");
+  const uint8_t reading[] = {3, 0, 't', '/', 'a', 'r', 'e', 'a', 'd', 'i', 'n', 'g', ' ', '0'};
+  const uint8_t badTopic[] = {200, 0, 't'};
+  mqtt.append(reading, sizeof(reading));
+  mqtt.append(badTopic, sizeof(badTopic));
+  mqtt.end();
+  telegram.begin(LittleFS, WIFIMESSAGING_SPOOL_DIR "/telegram");
+  const uint8_t alert[] = {0, 1, 0, 'a', 'l', 'e', 'r', 't', ' ', '0'};
+  const uint8_t noChat[] = {0, 0, 0, 'x'};
+  telegram.append(alert, sizeof(alert));
+  telegram.append(noChat, sizeof(noChat));
+  telegram.end();
+
+  std::unique_ptr<WifiMessaging> wm = boot(true);
+  while (sim::bootMs() < 30000 && (sim::mqttPublished().empty() || sim::telegramSent().empty())) {
+    wm->loop();
+    sim::advance(1);
+  }
+  // the responses come back
+  for (uint64_t until = sim::bootMs() + 2000; sim::bootMs() < until; sim::advance(1)) wm->loop();
+  wm.reset();
+
+  int failures = 0;
+  if (sim::mqttPublished().size() != 1 || sim::telegramSent().size() != 1) {
+    fprintf(stderr, "unreadable: %u readings and %u alerts delivered, expected 1 each\n",
+            (unsigned)sim::mqttPublished().size(), (unsigned)sim::telegramSent().size());
+    failures++;
+  }
+  mqtt.begin(LittleFS, WIFIMESSAGING_SPOOL_DIR "/mqtt");
+  telegram.begin(LittleFS, WIFIMESSAGING_SPOOL_DIR "/telegram");
+  if (mqtt.pending() || telegram.pending()) {
+    fprintf(stderr, "unreadable: %u MQTT and %u Telegram records left in the spools, expected none\n",
+            mqtt.pending(), telegram.pending());
+    failures++;
+  }
+  return failures;
+}
+
+}  // namespace
+
+int main() {
+  int failures = throughput();
+
+  printf("%-6s %10s %9s %6s %6s %9s %9s %12s\n", "keep", "readings", "alerts", "lost", "dups", "reordered", "drain ms",
+         "online bytes");
+  Outage ram = outage(false);
+  printOutage("ram", ram);
+  Outage spool = outage(true);
+  printOutage("spool", spool);
+  if (!spool.online || spool.readings != kReadings || spool.alerts != kAlerts || spool.duplicates ||
+      spool.reordered) {
+    fprintf(stderr, "spool: %u of %u readings, %u of %u alerts, %u duplicated, %u out of order\n", spool.readings,
+            kReadings, spool.alerts, kAlerts, spool.duplicates, spool.reordered);
+    failures++;
+  }
+  if (spool.onlineBytes) {
+    fprintf(stderr, "spool: %u bytes written to flash while online\n", spool.onlineBytes);
+    failures++;
+  }
+
+  failures += checkReplay();
+  failures += checkTornTail();
+  failures += checkUnreadable();
+  return failures ? 1 : 0;
+}
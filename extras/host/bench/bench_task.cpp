@@ -0,0 +1,226 @@
+// Network task benchmark of WifiMessaging: a control loop beside the network
+//
+// A device brings up WiFi, NTP, MQTT and Telegram and runs a control loop
+// every 10 ms for 60 virtual seconds. The loop publishes a reading every
+// 100 ms, queues a Telegram message every 10 s and takes an MQTT command the
+// broker sends every 500 ms. WiFi drops at 20 s and comes back at 25 s, so
+// MQTT and the TLS connection of Telegram reconnect. Two ways are compared:
+//   shared   the control loop calls loop(), which runs the network
+//   task     runNetwork() runs beside the control loop, as the ESP32 task of
+//            beginNetworkTask() does; loop() only crosses messages
+// Reported per way:
+//   max ms        longest virtual time the control loop spent in a library call
+//   total ms      virtual time the control loop spent in library calls
+//   published     readings delivered at the broker / published
+//   telegram      messages delivered at the API / queued
+//   commands      MQTT commands handled / sent by the broker
+//   dropped       commands loop() did not take in time, see droppedIncoming()
+//
+// Then the network runs on a second thread while the main thread publishes
+// as fast as the queues take it, queues Telegram messages and handles the
+// commands; every message must arrive, in order.
+//
+// Usage: bench_task
+// Exits non-zero if the task way spends any virtual time in a library call,
+// a message is lost or reordered, or the threaded run does not finish.
+
+#include <sim.h>
+#include <wifimessaging.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+namespace {
+
+const uint32_t kRunMs = 60000;
+const uint32_t kTickMs = 10;
+const uint32_t kReadingMs = 100;
+const uint32_t kMessageMs = 10000;
+const uint32_t kCommandMs = 500;
+
+std::atomic<uint32_t> commands{0};
+
+void onCommand(char *, uint8_t *, unsigned int) { commands++; }
+
+struct Result {
+  uint64_t maxMs = 0;
+  uint64_t totalMs = 0;
+  uint32_t dropped = 0;
+  uint32_t published = 0, delivered = 0;
+  uint32_t queued = 0, sent = 0;
+  uint32_t commandsSent = 0, commandsHandled = 0;
+};
+
+void setUp(WifiMessaging &wm) {
+  wm.SetMQTT(sim::kMqttHost, 1883, nullptr);
+  wm.SetTelegram("123456:SIMULATED", "42");
+  wm.subscribe("node/command", onCommand);
+  wm.connectToWiFi();
+}
+
+Result run(bool task) {
+  sim::reset();
+  commands = 0;
+  Result r;
+  WifiMessaging wm("sim-ssid", "sim-password");
+  setUp(wm);
+  if (task) wm.detachNetwork();
+
+  sim::after(20000, [] { sim::dropWiFi(WIFI_DISCONNECT_REASON_BEACON_TIMEOUT); });
+  sim::after(25000, [] { sim::restoreWiFi(); });
+  sim::every(kCommandMs, [&r] {
+    sim::mqttDeliver("node/command", "toggle");
+    r.commandsSent++;
+  });
+
+  uint32_t tickAt = 0, readingAt = 0, messageAt = kMessageMs;
+  while (sim::bootMs() < kRunMs) {
+    // the other core
+    if (task) wm.runNetwork();
+
+    if (sim::bootMs() >= tickAt) {
+      tickAt += kTickMs;
+      while (tickAt <= sim::bootMs()) tickAt += kTickMs;
+
+      uint64_t blocked = sim::counters().blockedMs;
+      wm.loop();
+      if (sim::bootMs() >= readingAt) {
+        readingAt += kReadingMs;
+        if (wm.publish("node/reading", "21.5", false, 1)) r.published++;
+      }
+      if (sim::bootMs() >= messageAt) {
+        messageAt += kMessageMs;
+        if (wm.queueMessagef("reading %lu", (unsigned long)sim::bootMs())) r.queued++;
+      }
+      uint64_t spent = sim::counters().blockedMs - blocked;
+      if (spent > r.maxMs) r.maxMs = spent;
+      r.totalMs += spent;
+    }
+    sim::advance(1);
+  }
+  // what is still on its way
+  for (uint32_t ms = 0; ms < 10000 && (wm.pendingPublishes() || wm.pendingMessages()); ms++) {
+    if (task) wm.runNetwork();
+    wm.loop();
+    sim::advance(1);
+  }
+  wm.loop();
+
+  for (const sim::MqttMessage &m : sim::mqttPublished()) {
+    if (m.topic == "node/reading") r.delivered++;
+  }
+  r.sent = sim::telegramSent().size();
+  r.commandsHandled = commands;
+  if (task) r.dropped = wm.droppedIncoming();
+  return r;
+}
+
+void print(const char *name, const Result &r) {
+  printf("%-7s %7llu %9llu %9u/%-5u %6u/%-3u %6u/%-4u %7u\n", name, (unsigned long long)r.maxMs,
+         (unsigned long long)r.totalMs, r.delivered, r.published, r.sent, r.queued, r.commandsHandled, r.commandsSent,
+         r.dropped);
+}
+
+/// The network on a second thread, the control loop on this one
+bool threaded() {
+  const uint32_t kReadings = 2000;
+  const uint32_t kMessages = 20;
+  const uint32_t kVirtualCapMs = 600000;
+
+  sim::reset();
+  commands = 0;
+  WifiMessaging wm("sim-ssid", "sim-password");
+  setUp(wm);
+  uint32_t commandsSent = 0;
+  sim::every(20, [&commandsSent] {
+    sim::mqttDeliver("node/command", "toggle");
+    commandsSent++;
+  });
+  wm.detachNetwork();
+
+  std::atomic<bool> stop{false};
+  std::atomic<bool> stopped{false};
+  std::thread network([&] {
+    while (!stop && sim::bootMs() < kVirtualCapMs) {
+      wm.runNetwork();
+      sim::advance(1);
+      std::this_thread::yield();
+    }
+    stopped = true;
+  });
+
+  uint32_t readings = 0, messages = 0, refusals = 0;
+  uint16_t lastTicket = 0;
+  char payload[16];
+  while (!stopped && (readings < kReadings || messages < kMessages || wm.pendingPublishes() ||
+                      wm.pendingMessages() || wm.messageStatus(lastTicket) == WifiMessaging::DeliveryQueued)) {
+    wm.loop();
+    if (readings < kReadings) {
+      snprintf(payload, sizeof(payload), "%u", readings);
+      if (wm.publish("node/reading", payload, false, 1))
+        readings++;
+      else
+        refusals++;
+    }
+    if (messages < kMessages && readings >= (messages + 1) * (kReadings / kMessages)) {
+      uint16_t ticket = wm.queueMessagef("message %u", messages);
+      if (ticket) {
+        lastTicket = ticket;
+        messages++;
+      }
+    }
+    std::this_thread::yield();
+  }
+  stop = true;
+  network.join();
+  wm.loop();
+
+  uint32_t delivered = 0;
+  bool ordered = true;
+  for (const sim::MqttMessage &m : sim::mqttPublished()) {
+    if (m.topic != "node/reading") continue;
+    if (atoi(m.payload.c_str()) != (int)delivered) ordered = false;
+    delivered++;
+  }
+  uint32_t sent = sim::telegramSent().size();
+  uint32_t handled = commands;
+  printf("\nthreaded: %u/%u readings%s, %u refused and retried, %u/%u telegram, last %s, %u/%u commands, "
+         "%u dropped, %u virtual ms\n",
+         delivered, kReadings, ordered ? "" : " out of order", refusals, sent, kMessages,
+         wm.messageStatus(lastTicket) == WifiMessaging::DeliverySent ? "sent" : "not sent", handled, commandsSent,
+         wm.droppedIncoming(), sim::bootMs());
+
+  bool ok = delivered == kReadings && ordered && sent == kMessages &&
+            wm.messageStatus(lastTicket) == WifiMessaging::DeliverySent &&
+            handled + wm.droppedIncoming() == commandsSent && sim::bootMs() < kVirtualCapMs;
+  if (!ok) fprintf(stderr, "threaded: messages lost, reordered or not finished\n");
+  return ok;
+}
+
+}  // namespace
+
+int main() {
+  printf("%-7s %7s %9s %15s %10s %11s %7s\n", "loop", "max ms", "total ms", "published", "telegram", "commands",
+         "dropped");
+  Result shared = run(false);
+  print("shared", shared);
+  Result task = run(true);
+  print("task", task);
+
+  int failures = 0;
+  if (task.maxMs) {
+    fprintf(stderr, "task: the control loop spent %llu ms in library calls\n", (unsigned long long)task.totalMs);
+    failures++;
+  }
+  for (const Result *r : {&shared, &task}) {
+    if (r->delivered != r->published || r->sent != r->queued ||
+        r->commandsHandled + r->dropped != r->commandsSent) {
+      fprintf(stderr, "%s: messages lost\n", r == &task ? "task" : "shared");
+      failures++;
+    }
+  }
+  if (!threaded()) failures++;
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,158 @@
+// Telegram outbox benchmark of WifiMessaging: flood control and priorities
+//
+// A node reports to four chats. Once Telegram is active, a routine report
+// is queued every 2 s for 30 s, each to the next chat. Ten seconds in an
+// alarm queues three routine detail reports to the first chat and fans three
+// alerts out to every chat. The API refuses a chat above about one message a
+// second, after a burst of three, with 429 and a retry_after of 5 s, and a
+// bot above 30 a second. Three ways to run the outbox are compared:
+//   unpaced    SetTelegramLimits(0, 0), sends as fast as the connection
+//              allows and waits only when the API answers 429
+//   fifo       paced by the token buckets, the alerts queued as routine
+//   paced      paced, the alerts queued as PriorityUrgent
+// Reported:
+//   delivered     messages delivered at the API / sends asked for
+//   refused       queueMessageTo() calls refused on a full outbox
+//   429           Too Many Requests answers
+//   urgent max    worst ms from queueing an alert to its delivery in a chat
+//   routine mean  mean ms from queueing a report to its delivery
+//   alarm ms      ms from the alarm until its last message is delivered
+//
+// Usage: bench_telegram
+// Exits non-zero if the paced outbox loses a message, is answered 429, or
+// does not deliver the alerts sooner than the other two.
+
+#include <sim.h>
+#include <wifimessaging.h>
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+
+namespace {
+
+const uint32_t kRunMs = 90000;
+const uint32_t kReportMs = 2000;
+const uint32_t kReports = 15;
+const uint32_t kAlarmMs = 10000;  ///< after the first report
+const uint32_t kDetails = 3;
+const uint32_t kAlerts = 3;
+const char *const kChats[] = {"42", "-1001", "-1002", "-1003"};
+const uint32_t kChatCount = sizeof(kChats) / sizeof(kChats[0]);
+
+enum Mode { Unpaced, Fifo, Paced };
+const char *const kModeNames[] = {"unpaced", "fifo", "paced"};
+
+struct Result {
+  uint32_t asked = 0;  ///< sends, one per message and chat
+  uint32_t delivered = 0;
+  uint32_t refused = 0;
+  uint32_t limited = 0;
+  uint64_t urgentMaxMs = 0;
+  uint64_t routineMs = 0;
+  uint32_t routines = 0;
+  uint64_t alarmMs = 0;
+};
+
+Result run(Mode mode) {
+  sim::reset();
+  Result r;
+  WifiMessaging wm("sim-ssid", "sim-password");
+  wm.SetTelegram("123456:SIMULATED", kChats[0]);
+  uint8_t chats[kChatCount] = {1};
+  for (uint32_t i = 1; i < kChatCount; i++) chats[i] = wm.AddTelegramChat(kChats[i]);
+  if (mode == Unpaced) wm.SetTelegramLimits(0, 0);
+  wm.connectToWiFi();
+
+  std::map<std::string, uint64_t> queuedAt;  ///< text -> world ms queued
+  uint64_t startMs = 0;
+  uint32_t reports = 0;
+  uint64_t alarmAt = 0;
+  // a send to chats, one per chat; false when the outbox is full
+  auto queue = [&](uint8_t to, WifiMessaging::messagePriority priority, const char *text, uint32_t sends) {
+    if (!wm.queueMessageTo(to, priority, text)) {
+      r.refused += sends;
+      return;
+    }
+    queuedAt[text] = sim::worldMs();
+    r.asked += sends;
+  };
+  while (sim::bootMs() < kRunMs) {
+    wm.loop();
+    uint64_t now = sim::worldMs();
+    if (!startMs && wm.StatusTelegram == WifiMessaging::ConnectionActive) startMs = now;
+    if (startMs) {
+      char text[16];
+      if (reports < kReports && now >= startMs + reports * kReportMs) {
+        snprintf(text, sizeof(text), "report %u", reports);
+        queue(chats[reports % kChatCount], WifiMessaging::PriorityRoutine, text, 1);
+        reports++;
+      }
+      if (!alarmAt && now >= startMs + kAlarmMs) {
+        alarmAt = now;
+        for (uint32_t i = 0; i < kDetails; i++) {
+          snprintf(text, sizeof(text), "detail %u", i);
+          queue(chats[0], WifiMessaging::PriorityRoutine, text, 1);
+        }
+        for (uint32_t i = 0; i < kAlerts; i++) {
+          snprintf(text, sizeof(text), "alert %u", i);
+          queue(WifiMessaging::TelegramAllChats, mode == Paced ? WifiMessaging::PriorityUrgent
+                                                               : WifiMessaging::PriorityRoutine,
+                text, kChatCount);
+        }
+      }
+    }
+    sim::advance(1);
+  }
+
+  for (const sim::TelegramMessage &m : sim::telegramSent()) {
+    auto queued = queuedAt.find(m.text);
+    if (queued == queuedAt.end()) continue;
+    uint64_t latency = m.atMs - queued->second;
+    r.delivered++;
+    if (m.text.compare(0, 6, "report") != 0 && m.atMs - alarmAt > r.alarmMs) r.alarmMs = m.atMs - alarmAt;
+    if (m.text.compare(0, 5, "alert") == 0) {
+      if (latency > r.urgentMaxMs) r.urgentMaxMs = latency;
+    } else {
+      r.routineMs += latency;
+      r.routines++;
+    }
+  }
+  r.limited = sim::counters().telegram429;
+  return r;
+}
+
+void print(const char *name, const Result &r) {
+  printf("%-8s %6u/%-4u %7u %5u %10llu %12llu %9llu\n", name, r.delivered, r.asked, r.refused, r.limited,
+         (unsigned long long)r.urgentMaxMs, (unsigned long long)(r.routines ? r.routineMs / r.routines : 0),
+         (unsigned long long)r.alarmMs);
+}
+
+}  // namespace
+
+int main() {
+  printf("%-8s %11s %7s %5s %10s %12s %9s\n", "outbox", "delivered", "refused", "429", "urgent max", "routine mean",
+         "alarm ms");
+  Result results[3];
+  for (int mode = Unpaced; mode <= Paced; mode++) {
+    results[mode] = run((Mode)mode);
+    print(kModeNames[mode], results[mode]);
+  }
+
+  const Result &paced = results[Paced];
+  int failures = 0;
+  if (paced.delivered != paced.asked || paced.refused) {
+    fprintf(stderr, "paced: %u of %u sends delivered, %u refused\n", paced.delivered, paced.asked, paced.refused);
+    failures++;
+  }
+  if (paced.limited) {
+    fprintf(stderr, "paced: %u answers 429\n", paced.limited);
+    failures++;
+  }
+  if (paced.urgentMaxMs >= results[Unpaced].urgentMaxMs || paced.urgentMaxMs >= results[Fifo].urgentMaxMs) {
+    fprintf(stderr, "paced: alerts not delivered sooner\n");
+    failures++;
+  }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,255 @@
+// Host stand-in for the ESP8266 Arduino core (Arduino.h)
+//
+// Only the subset used by WifiMessaging is provided. Time is virtual: millis()
+// and delay() run on the simulator clock (see sim.h).
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int8_t sint8;
+
+#define PROGMEM
+#define IRAM_ATTR
+#define PSTR(s) (s)
+#define F(s) (s)
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define strncpy_P strncpy
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+void configTime(long gmtOffset_sec, int daylightOffset_sec, const char *server1,
+                const char *server2 = nullptr, const char *server3 = nullptr);
+
+// ********************  Device heap  ********************
+
+namespace sim {
+
+void *heapAlloc(size_t size);  ///< nullptr when the model heap has no block that fits
+void heapFree(void *ptr);
+bool heapOwns(const void *ptr);
+
+/**
+ * @brief Allocator on the device heap model, for what the device keeps on its heap
+ */
+template <typename T>
+struct DeviceAllocator {
+  typedef T value_type;
+  DeviceAllocator() = default;
+  template <typename U>
+  DeviceAllocator(const DeviceAllocator<U> &) {}
+  T *allocate(size_t n) {
+    void *p = heapAlloc(n * sizeof(T));
+    if (!p) p = ::operator new(n * sizeof(T));  // out of device heap, counted in sim::heap().failures
+    return (T *)p;
+  }
+  void deallocate(T *p, size_t) {
+    if (heapOwns(p))
+      heapFree(p);
+    else
+      ::operator delete(p);
+  }
+  template <typename U>
+  bool operator==(const DeviceAllocator<U> &) const { return true; }
+  template <typename U>
+  bool operator!=(const DeviceAllocator<U> &) const { return false; }
+};
+
+}  // namespace sim
+
+// ********************  String  ********************
+
+class String {
+  typedef std::basic_string<char, std::char_traits<char>, sim::DeviceAllocator<char>> Storage;
+
+ public:
+  String() {}
+  String(const char *s) : s_(s ? s : "") {}
+  String(const std::string &s) : s_(s.data(), s.size()) {}
+  explicit String(char c) : s_(1, c) {}
+  explicit String(int v) : String(std::to_string(v)) {}
+  explicit String(unsigned int v) : String(std::to_string(v)) {}
+  explicit String(long v) : String(std::to_string(v)) {}
+  explicit String(unsigned long v) : String(std::to_string(v)) {}
+
+  const char *c_str() const { return s_.c_str(); }
+  unsigned int length() const { return s_.length(); }
+  bool reserve(unsigned int size) { s_.reserve(size); return true; }
+  char charAt(unsigned int i) const { return i < s_.size() ? s_[i] : 0; }
+  char operator[](unsigned int i) const { return charAt(i); }
+  int indexOf(const char *s, unsigned int from = 0) const {
+    size_t p = s_.find(s, from);
+    return p == std::string::npos ? -1 : (int)p;
+  }
+  int indexOf(char c, unsigned int from = 0) const {
+    size_t p = s_.find(c, from);
+    return p == std::string::npos ? -1 : (int)p;
+  }
+  String substring(unsigned int from) const { return from < s_.size() ? String(s_.substr(from)) : String(); }
+  String substring(unsigned int from, unsigned int to) const {
+    return from < s_.size() && to > from ? String(s_.substr(from, to - from)) : String();
+  }
+  long toInt() const { return strtol(s_.c_str(), nullptr, 10); }
+  bool startsWith(const char *p) const { return s_.compare(0, strlen(p), p) == 0; }
+
+  String &operator+=(const String &o) { s_ += o.s_; return *this; }
+  String &operator+=(const char *o) { s_ += o; return *this; }
+  String &operator+=(char c) { s_ += c; return *this; }
+  bool operator==(const String &o) const { return s_ == o.s_; }
+  bool operator==(const char *o) const { return s_ == o; }
+  bool operator!=(const String &o) const { return s_ != o.s_; }
+  bool operator!=(const char *o) const { return s_ != o; }
+
+  friend String operator+(const String &a, const String &b) { return String(a.s_ + b.s_); }
+  friend String operator+(const String &a, const char *b) { return String(a.s_ + b); }
+  friend String operator+(const char *a, const String &b) { return String(a + b.s_); }
+
+ private:
+  String(const Storage &s) : s_(s) {}
+  Storage s_;
+};
+
+// ********************  Print / Stream  ********************
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size) {
+    size_t n = 0;
+    while (size--) n += write(*buffer++);
+    return n;
+  }
+  virtual int availableForWrite() { return 0; }
+  size_t write(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+
+  size_t print(const char *s) { return write(s); }
+  size_t print(const String &s) { return write(s.c_str()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int v) { return printf("%d", v); }
+  size_t print(unsigned int v) { return printf("%u", v); }
+  size_t print(long v) { return printf("%ld", v); }
+  size_t print(unsigned long v) { return printf("%lu", v); }
+  size_t println() { return write("\r\n"); }
+  template <typename T>
+  size_t println(const T &v) { size_t n = print(v); return n + println(); }
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+  virtual void flush() {}
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  void setTimeout(unsigned long timeout) { _timeout = timeout; }
+  unsigned long getTimeout() const { return _timeout; }
+
+ protected:
+  unsigned long _timeout = 1000;
+};
+
+class HardwareSerial : public Stream {
+ public:
+  void begin(unsigned long baud);
+  explicit operator bool() const;
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  using Print::write;
+  int availableForWrite() override;
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  void flush() override;
+};
+
+extern HardwareSerial Serial;
+
+// ********************  IPAddress  ********************
+
+class IPAddress {
+ public:
+  IPAddress() { _address.dword = 0; }
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+    _address.bytes[0] = a;
+    _address.bytes[1] = b;
+    _address.bytes[2] = c;
+    _address.bytes[3] = d;
+  }
+  IPAddress(uint32_t address) { _address.dword = address; }
+  operator uint32_t() const { return _address.dword; }
+  uint8_t operator[](int index) const { return _address.bytes[index]; }
+  uint8_t &operator[](int index) { return _address.bytes[index]; }
+  bool operator==(const IPAddress &o) const { return _address.dword == o._address.dword; }
+  bool operator!=(const IPAddress &o) const { return _address.dword != o._address.dword; }
+  bool isSet() const { return _address.dword != 0; }
+  String toString() const;
+
+ private:
+  union {
+    uint8_t bytes[4];
+    uint32_t dword;
+  } _address;
+};
+
+// ********************  Client  ********************
+
+class Client : public Stream {
+ public:
+  virtual int connect(IPAddress ip, uint16_t port) = 0;
+  virtual int connect(const char *host, uint16_t port) = 0;
+  virtual size_t write(uint8_t) = 0;
+  virtual size_t write(const uint8_t *buf, size_t size) = 0;
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int read(uint8_t *buf, size_t size) = 0;
+  virtual int peek() = 0;
+  virtual void flush() = 0;
+  virtual void stop() = 0;
+  virtual uint8_t connected() = 0;
+  virtual operator bool() = 0;
+  using Print::write;
+};
+
+// ********************  ESP  ********************
+
+enum RFMode { RF_DEFAULT = 0, RF_CAL = 1, RF_NO_CAL = 2, RF_DISABLED = 4 };
+#define WAKE_RF_DEFAULT RF_DEFAULT
+
+class EspClass {
+ public:
+  uint32_t getFreeHeap();
+  uint32_t getMaxFreeBlockSize();
+  uint8_t getHeapFragmentation();
+  uint32_t getChipId() { return 0x00A1B2C3; }
+  uint32_t random();  ///< hardware RNG, a fixed sequence per sim::reset() on the host
+  bool rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size);
+  bool rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size);
+  void deepSleep(uint64_t time_us, RFMode mode = RF_DEFAULT);  ///< returns on the host, see sim::sleepRequestedUs()
+  uint64_t deepSleepMax() { return 12000000000ULL; }
+};
+
+extern EspClass ESP;
+
+#endif
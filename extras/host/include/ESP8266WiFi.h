@@ -0,0 +1,159 @@
+// Host stand-in for the ESP8266 core WiFi library (ESP8266WiFi.h)
+//
+// Association, DHCP, DNS and TCP connects are driven by the simulator script
+// (see sim.h); events are delivered from the virtual clock like the SDK does
+// between loop() iterations.
+
+#ifndef HOST_ESP8266WIFI_H
+#define HOST_ESP8266WIFI_H
+
+#include <Arduino.h>
+#include <user_interface.h>
+
+typedef enum WiFiMode { WIFI_OFF = 0, WIFI_STA = 1, WIFI_AP = 2, WIFI_AP_STA = 3 } WiFiMode_t;
+
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_CONNECTION_LOST = 5,
+  WL_WRONG_PASSWORD = 6,
+  WL_DISCONNECTED = 7
+} wl_status_t;
+
+// https://github.com/esp8266/Arduino/blob/master/libraries/ESP8266WiFi/src/ESP8266WiFiType.h
+enum WiFiDisconnectReason {
+  WIFI_DISCONNECT_REASON_UNSPECIFIED = 1,
+  WIFI_DISCONNECT_REASON_AUTH_EXPIRE = 2,
+  WIFI_DISCONNECT_REASON_AUTH_LEAVE = 3,
+  WIFI_DISCONNECT_REASON_ASSOC_EXPIRE = 4,
+  WIFI_DISCONNECT_REASON_ASSOC_TOOMANY = 5,
+  WIFI_DISCONNECT_REASON_NOT_AUTHED = 6,
+  WIFI_DISCONNECT_REASON_NOT_ASSOCED = 7,
+  WIFI_DISCONNECT_REASON_ASSOC_LEAVE = 8,
+  WIFI_DISCONNECT_REASON_ASSOC_NOT_AUTHED = 9,
+  WIFI_DISCONNECT_REASON_DISASSOC_PWRCAP_BAD = 10,
+  WIFI_DISCONNECT_REASON_DISASSOC_SUPCHAN_BAD = 11,
+  WIFI_DISCONNECT_REASON_IE_INVALID = 13,
+  WIFI_DISCONNECT_REASON_MIC_FAILURE = 14,
+  WIFI_DISCONNECT_REASON_4WAY_HANDSHAKE_TIMEOUT = 15,
+  WIFI_DISCONNECT_REASON_GROUP_KEY_UPDATE_TIMEOUT = 16,
+  WIFI_DISCONNECT_REASON_IE_IN_4WAY_DIFFERS = 17,
+  WIFI_DISCONNECT_REASON_GROUP_CIPHER_INVALID = 18,
+  WIFI_DISCONNECT_REASON_PAIRWISE_CIPHER_INVALID = 19,
+  WIFI_DISCONNECT_REASON_AKMP_INVALID = 20,
+  WIFI_DISCONNECT_REASON_UNSUPP_RSN_IE_VERSION = 21,
+  WIFI_DISCONNECT_REASON_INVALID_RSN_IE_CAP = 22,
+  WIFI_DISCONNECT_REASON_802_1X_AUTH_FAILED = 23,
+  WIFI_DISCONNECT_REASON_CIPHER_SUITE_REJECTED = 24,
+  WIFI_DISCONNECT_REASON_BEACON_TIMEOUT = 200,
+  WIFI_DISCONNECT_REASON_NO_AP_FOUND = 201,
+  WIFI_DISCONNECT_REASON_AUTH_FAIL = 202,
+  WIFI_DISCONNECT_REASON_ASSOC_FAIL = 203,
+  WIFI_DISCONNECT_REASON_HANDSHAKE_TIMEOUT = 204,
+};
+
+// ESP8266WiFiScan.h
+#define WIFI_SCAN_RUNNING (-1)
+#define WIFI_SCAN_FAILED (-2)
+
+struct WiFiEventStationModeConnected {
+  String ssid;
+  uint8 bssid[6];
+  uint8 channel;
+};
+
+struct WiFiEventStationModeDisconnected {
+  String ssid;
+  uint8 bssid[6];
+  WiFiDisconnectReason reason;
+};
+
+struct WiFiEventStationModeGotIP {
+  IPAddress ip;
+  IPAddress mask;
+  IPAddress gw;
+};
+
+struct WiFiEventHandlerOpaque;
+typedef std::shared_ptr<WiFiEventHandlerOpaque> WiFiEventHandler;
+
+class ESP8266WiFiClass {
+ public:
+  WiFiMode_t getMode();
+  bool mode(WiFiMode_t m);
+  void persistent(bool persistent);
+  bool setAutoConnect(bool autoConnect);
+  bool setAutoReconnect(bool autoReconnect);
+  bool disconnect(bool wifioff = false);
+  bool forceSleepBegin(uint32 sleepUs = 0);
+  bool forceSleepWake();
+
+  wl_status_t begin(const char *ssid, const char *passphrase = nullptr, int32_t channel = 0,
+                    const uint8_t *bssid = nullptr, bool connect = true);
+  bool config(IPAddress local_ip, IPAddress gateway, IPAddress subnet, IPAddress dns1 = (uint32_t)0,
+              IPAddress dns2 = (uint32_t)0);
+  wl_status_t status();
+  bool isConnected() { return status() == WL_CONNECTED; }
+  IPAddress localIP();
+  IPAddress subnetMask();
+  IPAddress gatewayIP();
+  IPAddress dnsIP(uint8_t dns_no = 0);
+  int32_t RSSI();
+  uint8_t *BSSID();
+  int32_t channel();
+
+  int8_t scanNetworks(bool async = false, bool show_hidden = false, uint8 channel = 0, uint8 *ssid = nullptr);
+  int8_t scanComplete();
+  void scanDelete();
+  String SSID(uint8_t networkItem);
+  int32_t RSSI(uint8_t networkItem);
+  uint8_t *BSSID(uint8_t networkItem);
+  int32_t channel(uint8_t networkItem);
+
+  int hostByName(const char *aHostname, IPAddress &aResult);
+  int hostByName(const char *aHostname, IPAddress &aResult, uint32_t timeout_ms);
+
+  WiFiEventHandler onStationModeConnected(std::function<void(const WiFiEventStationModeConnected &)>);
+  WiFiEventHandler onStationModeDisconnected(std::function<void(const WiFiEventStationModeDisconnected &)>);
+  WiFiEventHandler onStationModeGotIP(std::function<void(const WiFiEventStationModeGotIP &)>);
+};
+
+extern ESP8266WiFiClass WiFi;
+
+class ClientContext;
+
+class WiFiClient : public Client {
+ public:
+  WiFiClient();
+  ~WiFiClient() override;
+  // The core shares the connection between copies, here it moves
+  WiFiClient(WiFiClient &&other);
+  WiFiClient &operator=(WiFiClient &&other);
+
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(const char *host, uint16_t port) override;
+  uint8_t connected() override;
+  void stop() override;
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buf, size_t size) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  int read(uint8_t *buf, size_t size) override;
+  int peek() override;
+  void flush() override {}
+  operator bool() override { return connected(); }
+  int availableForWrite() override { return connected() ? 1460 : 0; }
+  IPAddress remoteIP() const { return _remote; }
+
+ protected:
+  /// what WiFiServer hands out, see include/ClientContext.h
+  WiFiClient(ClientContext *client);
+
+  IPAddress _remote;
+  uint32_t _socket = 0;  ///< simulated socket, 0 when closed
+};
+
+#endif
@@ -0,0 +1,65 @@
+// Host stand-in for the file system API of the Arduino core (FS.h)
+//
+// Files live in a host directory (see sim::fsPath()), so what a device wrote
+// survives sim::reboot() like flash does. Only the subset used by
+// WifiMessaging is provided.
+
+#ifndef HOST_FS_H
+#define HOST_FS_H
+
+#include <Arduino.h>
+
+#include <memory>
+
+namespace fs {
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+struct FileImpl;
+
+class File {
+ public:
+  File() = default;
+  explicit File(std::shared_ptr<FileImpl> impl) : _impl(impl) {}
+
+  size_t write(const uint8_t *buf, size_t size);
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t read(uint8_t *buf, size_t size);
+  int read();
+  int available();
+  void flush();
+  bool seek(uint32_t pos, SeekMode mode);
+  bool seek(uint32_t pos) { return seek(pos, SeekSet); }
+  size_t position() const;
+  size_t size() const;
+  void close();
+  operator bool() const;
+  const char *name() const;  ///< without the directory
+  bool isDirectory() const;
+  File openNextFile();  ///< next entry of a directory
+
+ private:
+  std::shared_ptr<FileImpl> _impl;
+};
+
+class FS {
+ public:
+  bool begin();
+  void end() {}
+  bool format();
+  File open(const char *path, const char *mode);
+  bool exists(const char *path);
+  bool remove(const char *path);
+  bool mkdir(const char *path);
+  bool rmdir(const char *path);
+};
+
+}  // namespace fs
+
+using fs::File;
+using fs::FS;
+using fs::SeekCur;
+using fs::SeekEnd;
+using fs::SeekSet;
+
+#endif
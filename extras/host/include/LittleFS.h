@@ -0,0 +1,10 @@
+// Host stand-in for LittleFS.h of the Arduino core, see FS.h
+
+#ifndef HOST_LITTLEFS_H
+#define HOST_LITTLEFS_H
+
+#include <FS.h>
+
+extern fs::FS LittleFS;
+
+#endif
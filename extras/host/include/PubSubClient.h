@@ -0,0 +1,71 @@
+// Host stand-in for knolleary/PubSubClient (PubSubClient.h)
+//
+// connect() keeps the behaviour of the real library: a TCP connect through
+// the attached Client unless it is already connected, a CONNECT packet written
+// in one go and a busy wait for CONNACK of at most the socket timeout.
+
+#ifndef HOST_PUBSUBCLIENT_H
+#define HOST_PUBSUBCLIENT_H
+
+#include <Arduino.h>
+
+#include <string>
+#include <vector>
+
+#define MQTT_VERSION_3_1 3
+#define MQTT_VERSION_3_1_1 4
+#define MQTT_VERSION MQTT_VERSION_3_1_1
+
+#define MQTT_MAX_PACKET_SIZE 256
+#define MQTT_MAX_HEADER_SIZE 5
+#define MQTT_KEEPALIVE 15
+#define MQTT_SOCKET_TIMEOUT 15
+
+#define MQTT_CONNECTION_TIMEOUT -4
+#define MQTT_CONNECTION_LOST -3
+#define MQTT_CONNECT_FAILED -2
+#define MQTT_DISCONNECTED -1
+#define MQTT_CONNECTED 0
+
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char *, uint8_t *, unsigned int)> callback
+
+class PubSubClient {
+ public:
+  PubSubClient() {}
+
+  PubSubClient &setServer(IPAddress ip, uint16_t port);
+  PubSubClient &setServer(const char *domain, uint16_t port);
+  PubSubClient &setCallback(MQTT_CALLBACK_SIGNATURE);
+  PubSubClient &setClient(Client &client);
+  PubSubClient &setSocketTimeout(uint16_t timeout);
+  PubSubClient &setKeepAlive(uint16_t keepAlive);
+  boolean setBufferSize(uint16_t size);
+  uint16_t getBufferSize() { return bufferSize; }
+
+  boolean connect(const char *id);
+  void disconnect();
+  boolean publish(const char *topic, const char *payload);
+  boolean publish(const char *topic, const char *payload, boolean retained);
+  boolean publish(const char *topic, const uint8_t *payload, unsigned int plength);
+  boolean publish(const char *topic, const uint8_t *payload, unsigned int plength, boolean retained);
+  boolean subscribe(const char *topic);
+  boolean subscribe(const char *topic, uint8_t qos);
+  boolean unsubscribe(const char *topic);
+  boolean loop();
+  boolean connected();
+  int state() { return _state; }
+
+ private:
+  Client *_client = nullptr;
+  IPAddress ip;
+  const char *domain = nullptr;
+  uint16_t port = 0;
+  uint16_t socketTimeout = MQTT_SOCKET_TIMEOUT;
+  uint16_t keepAlive = MQTT_KEEPALIVE;
+  uint16_t bufferSize = MQTT_MAX_PACKET_SIZE;
+  std::function<void(char *, uint8_t *, unsigned int)> callback;
+  int _state = MQTT_DISCONNECTED;
+  std::vector<std::string> _subscriptions;  ///< filters held by the simulated broker session
+};
+
+#endif
@@ -0,0 +1,24 @@
+// Host stand-in for the ESP8266 core Ticker library (Ticker.h)
+
+#ifndef HOST_TICKER_H
+#define HOST_TICKER_H
+
+#include <Arduino.h>
+
+class Ticker {
+ public:
+  typedef std::function<void(void)> callback_function_t;
+
+  Ticker() {}
+  ~Ticker() { detach(); }
+
+  void attach_ms(uint32_t milliseconds, callback_function_t callback);
+  void once_ms(uint32_t milliseconds, callback_function_t callback);
+  void detach();
+  bool active() const { return _id != 0; }
+
+ private:
+  uint32_t _id = 0;
+};
+
+#endif
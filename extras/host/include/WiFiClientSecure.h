@@ -0,0 +1,96 @@
+// Host stand-in for the ESP8266 core BearSSL client (WiFiClientSecure.h)
+//
+// The handshake is not performed: its cost (full or resumed) is charged to the
+// virtual clock from the simulator script, and certificate validation only
+// succeeds once the clock has been synchronised.
+
+#ifndef HOST_WIFICLIENTSECURE_H
+#define HOST_WIFICLIENTSECURE_H
+
+#include <ESP8266WiFi.h>
+
+#include <vector>
+
+struct br_ssl_session_parameters {
+  unsigned char session_id[32];
+  unsigned char session_id_len;
+  unsigned version;
+  uint16_t cipher_suite;
+  unsigned char master_secret[48];
+};
+
+namespace BearSSL {
+
+class WiFiClientSecure;
+
+class X509List {
+ public:
+  X509List() {}
+  X509List(const char *pemCert) { append(pemCert); }
+  X509List(const uint8_t *derCert, size_t derLen) { append(derCert, derLen); }
+
+  bool append(const char *pemCert);
+  bool append(const uint8_t *derCert, size_t derLen);
+  size_t getCount() const { return _count; }
+
+ private:
+  size_t _count = 0;
+  std::vector<uint8_t, sim::DeviceAllocator<uint8_t>> _storage;  ///< stands in for the decoded trust anchors
+};
+
+class Session {
+  friend class WiFiClientSecure;
+
+ public:
+  Session() { memset(&_session, 0, sizeof(_session)); }
+
+ private:
+  br_ssl_session_parameters *getSession() { return &_session; }
+  br_ssl_session_parameters _session;
+};
+
+class WiFiClientSecure : public WiFiClient {
+ public:
+  ~WiFiClientSecure() override { _freeSSL(); }
+
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(const char *name, uint16_t port) override;
+
+  /**
+   * @brief Whether the server accepts a maximum fragment length of len (512, 1024, 2048 or 4096)
+   *
+   * Costs a TCP connect and a ClientHello/ServerHello round-trip.
+   */
+  static bool probeMaxFragmentLength(const char *hostname, uint16_t port, uint16_t len);
+  static bool probeMaxFragmentLength(IPAddress ip, uint16_t port, uint16_t len);
+
+  void setBufferSizes(int recv, int xmit) { _iobuf_in_size = recv; _iobuf_out_size = xmit; }
+  void setSession(Session *session) { _session = session; }
+  void setTrustAnchors(const X509List *ta) { _ta = ta; _insecure = false; }
+  void setInsecure() { _insecure = true; }
+  void setX509Time(time_t now) { _now = now; }
+  void stop() override;
+
+ private:
+  int _connectSSL(const char *hostName);
+  bool _allocSSL();
+  void _freeSSL();
+
+  // Engine context and I/O buffers on the device heap while connected
+  void *_sc = nullptr;
+  void *_iobuf_in = nullptr;
+  void *_iobuf_out = nullptr;
+  int _iobuf_in_size = 16384;  ///< record payload, a smaller size needs MFLN at the server
+  int _iobuf_out_size = 512;
+
+  Session *_session = nullptr;
+  const X509List *_ta = nullptr;
+  bool _insecure = false;
+  time_t _now = 0;
+};
+
+}  // namespace BearSSL
+
+using BearSSL::WiFiClientSecure;
+
+#endif
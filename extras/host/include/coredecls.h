@@ -0,0 +1,15 @@
+// Host stand-in for the ESP8266 core declarations (coredecls.h)
+
+#ifndef HOST_COREDECLS_H
+#define HOST_COREDECLS_H
+
+#include <functional>
+
+using BoolCB = std::function<void(bool)>;
+
+/**
+ * @brief Called after every settimeofday(), from_sntp tells an SNTP sync
+ */
+void settimeofday_cb(const BoolCB &cb);
+
+#endif
@@ -0,0 +1,22 @@
+// Host stand-in for the connection of the ESP8266WiFi library (include/ClientContext.h)
+//
+// It only carries an established simulated socket from a tcp_pcb to the
+// WiFiClient constructed on it.
+
+#ifndef HOST_CLIENTCONTEXT_H
+#define HOST_CLIENTCONTEXT_H
+
+#include <ESP8266WiFi.h>
+#include <lwip/tcp.h>
+
+typedef void (*discard_cb_t)(void *, ClientContext *);
+
+class ClientContext {
+ public:
+  ClientContext(tcp_pcb *pcb, discard_cb_t discard_cb, void *discard_cb_arg);
+
+  IPAddress remote;
+  uint32_t socket;  ///< simulated socket, taken over from the pcb
+};
+
+#endif
@@ -0,0 +1,36 @@
+// Host stand-in for the lwIP raw TCP API (lwip/tcp.h), as far as a connect goes
+//
+// tcp_connect() returns at once; the simulator calls the connected callback
+// after the scripted TCP delay of the server, never when the server is down.
+
+#ifndef HOST_LWIP_TCP_H
+#define HOST_LWIP_TCP_H
+
+#include <cstdint>
+
+typedef int8_t err_t;
+
+#define ERR_OK 0
+#define ERR_MEM -1
+#define ERR_RTE -4
+#define ERR_ABRT -13
+
+struct ip_addr_t {
+  uint32_t addr;
+};
+
+#define IP_ADDR4(ipaddr, a, b, c, d) \
+  ((ipaddr)->addr = (uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+
+struct tcp_pcb;
+
+typedef err_t (*tcp_connected_fn)(void *arg, struct tcp_pcb *tpcb, err_t err);
+typedef void (*tcp_err_fn)(void *arg, err_t err);
+
+struct tcp_pcb *tcp_new();
+void tcp_arg(struct tcp_pcb *pcb, void *arg);
+void tcp_err(struct tcp_pcb *pcb, tcp_err_fn err);
+err_t tcp_connect(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, uint16_t port, tcp_connected_fn connected);
+void tcp_abort(struct tcp_pcb *pcb);
+
+#endif
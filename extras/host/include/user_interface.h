@@ -0,0 +1,23 @@
+// Host stand-in for the ESP8266 NONOS SDK system API (user_interface.h)
+
+#ifndef HOST_USER_INTERFACE_H
+#define HOST_USER_INTERFACE_H
+
+#include <Arduino.h>
+
+#define STATION_IF 0x00
+#define SOFTAP_IF 0x01
+
+bool wifi_get_macaddr(uint8 if_index, uint8 *macaddr);
+
+/**
+ * @brief RTC timer ticks since power-on, counting through deep sleep, 32 bit
+ */
+uint32 system_get_rtc_time(void);
+
+/**
+ * @brief RTC tick period in microseconds, fixed point with 12 fractional bits
+ */
+uint32 system_rtc_clock_cali_proc(void);
+
+#endif
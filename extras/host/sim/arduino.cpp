@@ -0,0 +1,106 @@
+// Stand-in implementations of the Arduino core: Print, Serial, IPAddress, ESP
+
+#include <Arduino.h>
+
+#include "sim_internal.h"
+
+HardwareSerial Serial;
+EspClass ESP;
+
+size_t Print::printf(const char *format, ...) {
+  char buffer[256];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  if (len < 0) return 0;
+  return write((const uint8_t *)buffer, std::min((size_t)len, sizeof(buffer) - 1));
+}
+
+// Serial output is swallowed unless WM_SIM_SERIAL is set in the environment
+static bool serialEcho() {
+  static int echo = -1;
+  if (echo < 0) echo = getenv("WM_SIM_SERIAL") != nullptr;
+  return echo;
+}
+
+// The UART after begin(): a 128 byte TX FIFO sent at the baud rate, a write
+// that does not fit waits. Without begin() output is taken at no cost.
+static const uint32_t kSerialFifo = 128;
+
+void HardwareSerial::begin(unsigned long baud) {
+  sim::World &w = sim::world();
+  w.serialBaud = baud;
+  w.serialEmptyUs = w.now * 1000;
+}
+
+HardwareSerial::operator bool() const { return sim::world().serialBaud != 0; }
+
+/// bytes in the TX FIFO
+static uint32_t serialQueued() {
+  sim::World &w = sim::world();
+  uint64_t nowUs = w.now * 1000;
+  if (w.serialEmptyUs <= nowUs) return 0;
+  uint64_t byteUs = 10000000 / w.serialBaud;
+  return (uint32_t)((w.serialEmptyUs - nowUs + byteUs - 1) / byteUs);
+}
+
+size_t HardwareSerial::write(uint8_t c) { return write(&c, 1); }
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size) {
+  if (serialEcho()) fwrite(buffer, 1, size, stdout);
+  sim::World &w = sim::world();
+  if (!w.serialBaud) return size;
+  w.counters.serialBytes += size;
+  uint64_t byteUs = 10000000 / w.serialBaud;
+  uint64_t nowUs = w.now * 1000;
+  w.serialEmptyUs = std::max(w.serialEmptyUs, nowUs) + size * byteUs;
+  // wait until all but a FIFO full is sent
+  uint64_t fifoUs = kSerialFifo * byteUs;
+  if (w.serialEmptyUs > nowUs + fifoUs) {
+    uint32_t waitMs = (uint32_t)((w.serialEmptyUs - nowUs - fifoUs + 999) / 1000);
+    w.counters.serialBlockedMs += waitMs;
+    sim::block(waitMs);
+  }
+  return size;
+}
+
+int HardwareSerial::availableForWrite() {
+  if (!sim::world().serialBaud) return kSerialFifo;
+  uint32_t queued = serialQueued();
+  return queued < kSerialFifo ? kSerialFifo - queued : 0;
+}
+
+void HardwareSerial::flush() {
+  if (serialEcho()) fflush(stdout);
+  sim::World &w = sim::world();
+  uint64_t nowUs = w.now * 1000;
+  if (w.serialBaud && w.serialEmptyUs > nowUs) {
+    uint32_t waitMs = (uint32_t)((w.serialEmptyUs - nowUs + 999) / 1000);
+    w.counters.serialBlockedMs += waitMs;
+    sim::block(waitMs);
+  }
+}
+
+String IPAddress::toString() const {
+  char buffer[16];
+  snprintf(buffer, sizeof(buffer), "%u.%u.%u.%u", _address.bytes[0], _address.bytes[1], _address.bytes[2],
+           _address.bytes[3]);
+  return String(buffer);
+}
+
+uint32_t EspClass::random() { return sim::world().random(); }
+
+void EspClass::deepSleep(uint64_t time_us, RFMode) { sim::world().sleepUs = time_us ? time_us : 1; }
+
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size) {
+  if (offset * 4 + size > sizeof(sim::world().rtcMemory) || size == 0) return false;
+  memcpy(data, sim::world().rtcMemory + offset * 4, size);
+  return true;
+}
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size) {
+  if (offset * 4 + size > sizeof(sim::world().rtcMemory) || size == 0) return false;
+  memcpy(sim::world().rtcMemory + offset * 4, data, size);
+  return true;
+}
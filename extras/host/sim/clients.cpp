@@ -0,0 +1,491 @@
+// Stand-in implementations of PubSubClient and BearSSL::WiFiClientSecure on
+// top of the simulated network, and the getUpdates and sendMessage methods of
+// the Telegram API
+
+#include <PubSubClient.h>
+#include <WiFiClientSecure.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "sim_internal.h"
+
+// ********************  PubSubClient  ********************
+
+PubSubClient &PubSubClient::setServer(IPAddress ip, uint16_t port) {
+  this->ip = ip;
+  this->domain = nullptr;
+  this->port = port;
+  return *this;
+}
+
+PubSubClient &PubSubClient::setServer(const char *domain, uint16_t port) {
+  this->domain = domain;
+  this->port = port;
+  return *this;
+}
+
+PubSubClient &PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE) {
+  this->callback = callback;
+  return *this;
+}
+
+PubSubClient &PubSubClient::setClient(Client &client) {
+  this->_client = &client;
+  return *this;
+}
+
+PubSubClient &PubSubClient::setSocketTimeout(uint16_t timeout) {
+  this->socketTimeout = timeout;
+  return *this;
+}
+
+PubSubClient &PubSubClient::setKeepAlive(uint16_t keepAlive) {
+  this->keepAlive = keepAlive;
+  return *this;
+}
+
+boolean PubSubClient::setBufferSize(uint16_t size) {
+  if (size == 0) return false;
+  bufferSize = size;
+  return true;
+}
+
+boolean PubSubClient::connect(const char *id) {
+  if (connected()) return true;
+  int result = 0;
+  if (_client->connected()) {
+    result = 1;
+  } else if (domain != nullptr) {
+    result = _client->connect(domain, port);
+  } else {
+    result = _client->connect(ip, port);
+  }
+  if (result != 1) {
+    _state = MQTT_CONNECT_FAILED;
+    return false;
+  }
+
+  uint8_t packet[64] = {0x10, 0, 0x00, 0x04, 'M', 'Q', 'T', 'T', MQTT_VERSION, 0x02,
+                        (uint8_t)(keepAlive >> 8), (uint8_t)(keepAlive & 0xFF)};
+  size_t idLen = strnlen(id, sizeof(packet) - 14);
+  packet[12] = 0;
+  packet[13] = idLen;
+  memcpy(packet + 14, id, idLen);
+  packet[1] = 12 + idLen;
+  _client->write(packet, 14 + idLen);
+
+  // Busy wait for CONNACK
+  uint32_t start = millis();
+  while (!_client->available()) {
+    if (millis() - start >= socketTimeout * 1000UL) {
+      _state = MQTT_CONNECTION_TIMEOUT;
+      _client->stop();
+      return false;
+    }
+    sim::block(1);
+  }
+  uint8_t connack[4];
+  if (_client->read(connack, sizeof(connack)) != 4 || connack[0] != 0x20 || connack[3] != 0) {
+    _state = MQTT_CONNECT_FAILED;
+    _client->stop();
+    return false;
+  }
+  sim::world().counters.mqttConnects++;
+  _subscriptions.clear();
+  _state = MQTT_CONNECTED;
+  return true;
+}
+
+void PubSubClient::disconnect() {
+  _state = MQTT_DISCONNECTED;
+  if (_client) _client->stop();
+}
+
+boolean PubSubClient::publish(const char *topic, const char *payload) {
+  return publish(topic, (const uint8_t *)payload, payload ? strlen(payload) : 0, false);
+}
+
+boolean PubSubClient::publish(const char *topic, const char *payload, boolean retained) {
+  return publish(topic, (const uint8_t *)payload, payload ? strlen(payload) : 0, retained);
+}
+
+boolean PubSubClient::publish(const char *topic, const uint8_t *payload, unsigned int plength) {
+  return publish(topic, payload, plength, false);
+}
+
+boolean PubSubClient::publish(const char *topic, const uint8_t *payload, unsigned int plength, boolean retained) {
+  if (!connected()) return false;
+  // fixed header, topic length and topic, payload in one buffer of getBufferSize()
+  if (MQTT_MAX_HEADER_SIZE + 2 + strlen(topic) + plength > bufferSize) return false;
+  sim::mqttPublished().push_back(
+      sim::MqttMessage{topic, std::string((const char *)payload, plength), (bool)retained, sim::worldMs()});
+  return true;
+}
+
+boolean PubSubClient::subscribe(const char *topic) { return subscribe(topic, 0); }
+
+boolean PubSubClient::subscribe(const char *topic, uint8_t qos) {
+  if (qos > 1 || !connected()) return false;
+  _subscriptions.push_back(topic);
+  return true;
+}
+
+boolean PubSubClient::unsubscribe(const char *topic) {
+  if (!connected()) return false;
+  for (auto it = _subscriptions.begin(); it != _subscriptions.end(); ++it) {
+    if (*it == topic) {
+      _subscriptions.erase(it);
+      break;
+    }
+  }
+  return true;
+}
+
+boolean PubSubClient::loop() {
+  if (!connected()) return false;
+  sim::World &w = sim::world();
+  // one packet per call, like the library
+  while (!w.mqttInbox.empty()) {
+    std::string topic = w.mqttInbox.front().first;
+    std::string payload = w.mqttInbox.front().second;
+    w.mqttInbox.erase(w.mqttInbox.begin());
+    bool wanted = false;
+    for (auto &filter : _subscriptions) wanted = wanted || sim::topicMatches(filter, topic);
+    if (!wanted || !callback) continue;
+    callback(&topic[0], (uint8_t *)&payload[0], payload.size());
+    break;
+  }
+  return true;
+}
+
+boolean PubSubClient::connected() {
+  if (_client == nullptr) return false;
+  if (!_client->connected()) {
+    if (_state == MQTT_CONNECTED) {
+      _state = MQTT_CONNECTION_LOST;
+      _client->stop();
+    }
+    return false;
+  }
+  return _state == MQTT_CONNECTED;
+}
+
+// ********************  BearSSL  ********************
+
+namespace BearSSL {
+
+bool X509List::append(const char *pemCert) {
+  _storage.insert(_storage.end(), pemCert, pemCert + strlen(pemCert) * 3 / 4);
+  _count++;
+  return true;
+}
+
+bool X509List::append(const uint8_t *derCert, size_t derLen) {
+  _storage.insert(_storage.end(), derCert, derCert + derLen);
+  _count++;
+  return true;
+}
+
+bool WiFiClientSecure::probeMaxFragmentLength(const char *hostname, uint16_t port, uint16_t len) {
+  IPAddress remote;
+  if (!WiFi.hostByName(hostname, remote)) return false;
+  return probeMaxFragmentLength(remote, port, len);
+}
+
+bool WiFiClientSecure::probeMaxFragmentLength(IPAddress ip, uint16_t port, uint16_t len) {
+  sim::World &w = sim::world();
+  WiFiClient probe;
+  if (!probe.connect(ip, port)) return false;
+  w.counters.tlsProbes++;
+  sim::block(w.script.telegramTcpMs);  // ClientHello out, ServerHello back
+  probe.stop();
+  bool valid = len == 512 || len == 1024 || len == 2048 || len == 4096;
+  return valid && w.script.telegramMfln;
+}
+
+// Without MFLN BearSSL needs a 16 KB record buffer in one piece; the record
+// header, MAC and padding come on top of the payload sizes
+bool WiFiClientSecure::_allocSSL() {
+  _sc = sim::heapAlloc(3600);
+  _iobuf_in = sim::heapAlloc(_iobuf_in_size + 325);
+  _iobuf_out = sim::heapAlloc(_iobuf_out_size + 85);
+  if (_sc && _iobuf_in && _iobuf_out) return true;
+  _freeSSL();
+  return false;
+}
+
+void WiFiClientSecure::_freeSSL() {
+  sim::heapFree(_sc);
+  sim::heapFree(_iobuf_in);
+  sim::heapFree(_iobuf_out);
+  _sc = _iobuf_in = _iobuf_out = nullptr;
+}
+
+void WiFiClientSecure::stop() {
+  _freeSSL();
+  WiFiClient::stop();
+}
+
+int WiFiClientSecure::connect(IPAddress ip, uint16_t port) {
+  if (!WiFiClient::connect(ip, port)) return 0;
+  return _connectSSL(nullptr);
+}
+
+int WiFiClientSecure::connect(const char *name, uint16_t port) {
+  IPAddress remote;
+  if (!WiFi.hostByName(name, remote, _timeout)) return 0;
+  if (!WiFiClient::connect(remote, port)) return 0;
+  return _connectSSL(name);
+}
+
+int WiFiClientSecure::_connectSSL(const char *) {
+  sim::World &w = sim::world();
+  _freeSSL();
+  if (!_allocSSL()) {
+    w.counters.tlsFailures++;  // OOM in the handshake
+    WiFiClient::stop();
+    return 0;
+  }
+  if (_iobuf_in_size < 16384 && !w.script.telegramMfln) {
+    sim::block(w.script.telegramTcpMs);  // a 16 KB record of the server overflows the buffer
+    w.counters.tlsFailures++;
+    stop();
+    return 0;
+  }
+  bool haveTime = _now > 0 || sim::timeValid();
+  if (!_insecure && (!_ta || !_ta->getCount() || !haveTime)) {
+    sim::block(w.script.telegramTcpMs);  // server certificate received and rejected
+    w.counters.tlsFailures++;
+    stop();
+    return 0;
+  }
+
+  if (_session && _session->_session.session_id_len) {
+    std::string id((const char *)_session->_session.session_id, _session->_session.session_id_len);
+    auto it = w.tlsSessions.find(id);
+    if (it != w.tlsSessions.end() && it->second + w.script.tlsSessionLifetimeS * 1000ULL > w.now) {
+      sim::block(w.script.tlsResumedHandshakeMs);
+      w.counters.tlsResumed++;
+      return connected();
+    }
+  }
+
+  sim::block(w.script.tlsFullHandshakeMs);
+  w.counters.tlsFull++;
+  if (_session) {
+    br_ssl_session_parameters &p = _session->_session;
+    uint64_t serial = w.counters.tlsFull + (w.now << 8);
+    memset(&p, 0, sizeof(p));
+    memcpy(p.session_id, &serial, sizeof(serial));
+    p.session_id_len = 32;
+    p.version = 0x0303;
+    p.cipher_suite = 0xC02F;
+    w.tlsSessions[std::string((const char *)p.session_id, p.session_id_len)] = w.now;
+  }
+  return connected();
+}
+
+}  // namespace BearSSL
+
+// ********************  Telegram API  ********************
+
+namespace sim {
+
+static std::string jsonEscape(const std::string &text) {
+  std::string out;
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c == '\n') {
+      out += "\\n";
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+static uint32_t queryValue(const std::string &request, const char *name, uint32_t otherwise) {
+  std::string key = std::string(name) + "=";
+  size_t at = request.find(key);
+  if (at == std::string::npos || at == 0 || (request[at - 1] != '?' && request[at - 1] != '&')) return otherwise;
+  return strtoul(request.c_str() + at + key.size(), nullptr, 10);
+}
+
+// Answer of the API, after one round-trip; the last one on the connection closes it.
+// The body goes with its Content-Length, in chunks of 100 bytes or up to the
+// close of the connection, see Script::telegramFraming.
+static void respond(uint32_t socket, const char *status, const std::string &body) {
+  World &w = world();
+  Socket *s = openSocket(socket);
+  uint8_t framing = w.script.telegramFraming;
+  if (s && framing == 2) s->closing = true;
+  bool close = s && s->closing;
+  std::string response = std::string("HTTP/1.1 ") + status +
+                         "\r\nServer: nginx/1.18.0\r\nContent-Type: application/json\r\n";
+  if (framing == 0) response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+  if (framing == 1) response += "Transfer-Encoding: chunked\r\n";
+  if (framing != 2) response += std::string("Connection: ") + (close ? "close" : "keep-alive") + "\r\n";
+  response += "\r\n";
+  if (framing == 1) {
+    char size[16];
+    for (size_t at = 0; at < body.size(); at += 100) {
+      std::string chunk = body.substr(at, 100);
+      snprintf(size, sizeof(size), "%zx\r\n", chunk.size());
+      response += size + chunk + "\r\n";
+    }
+    response += "0\r\n\r\n";
+  } else {
+    response += body;
+  }
+  after(w.script.telegramRequestMs, [socket, response, close]() {
+    Socket *s = openSocket(socket);
+    if (!s) return;
+    s->rx += response;
+    s->activeAt = world().now;
+    s->closed = close;
+  });
+}
+
+// String member key of the JSON object in json, unescaped; empty when absent
+static std::string jsonString(const std::string &json, const char *key) {
+  size_t at = json.find(std::string("\"") + key + "\":\"");
+  if (at == std::string::npos) return "";
+  std::string out;
+  for (size_t i = at + strlen(key) + 4; i < json.size() && json[i] != '"'; i++) {
+    if (json[i] != '\\' || i + 1 >= json.size()) {
+      out += json[i];
+      continue;
+    }
+    char c = json[++i];
+    if (c == 'n') {
+      out += '\n';
+    } else if (c == 'u' && i + 4 < json.size()) {
+      out += (char)strtoul(json.substr(i + 1, 4).c_str(), nullptr, 16);
+      i += 4;
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+// GCRA: take a token of the bucket full at fullAt, false when none is left
+static bool takeToken(uint64_t &fullAt, uint64_t now, uint32_t interval, uint32_t burst) {
+  if (interval == 0) return true;
+  uint64_t start = fullAt > now ? fullAt : now;
+  if (start + interval > now + (uint64_t)interval * burst) return false;
+  fullAt = start + interval;
+  return true;
+}
+
+// sendMessage, with the flood control of the API: about one message a second
+// per chat and 30 a second per bot; a chat over its limit is refused with 429
+// until retry_after has passed
+static void sendMessage(uint32_t socket, const std::string &request) {
+  World &w = world();
+  w.counters.telegramRequests++;
+  std::string json = request.substr(request.find("\r\n\r\n") + 4);
+  std::string chatId = jsonString(json, "chat_id");
+  std::string text = jsonString(json, "text");
+  if (chatId.empty()) {
+    respond(socket, "400 Bad Request", "{\"ok\":false,\"error_code\":400,\"description\":\"Bad Request: chat not found\"}");
+    return;
+  }
+
+  uint64_t &refusedUntil = w.telegramChatRefusedUntil[chatId];
+  bool allowed = w.now >= refusedUntil && takeToken(w.telegramGlobalFullAt, w.now, w.script.telegramGlobalIntervalMs,
+                                                    w.script.telegramGlobalBurst);
+  if (allowed &&
+      !takeToken(w.telegramChatFullAt[chatId], w.now, w.script.telegramChatIntervalMs, w.script.telegramChatBurst)) {
+    allowed = false;
+  }
+  if (!allowed) {
+    if (refusedUntil <= w.now) refusedUntil = w.now + w.script.telegramRetryAfterS * 1000ULL;
+    uint32_t retryAfter = (uint32_t)((refusedUntil - w.now + 999) / 1000);
+    w.counters.telegram429++;
+    respond(socket, "429 Too Many Requests",
+            "{\"ok\":false,\"error_code\":429,\"description\":\"Too Many Requests: retry after " +
+                std::to_string(retryAfter) + "\",\"parameters\":{\"retry_after\":" + std::to_string(retryAfter) + "}}");
+    return;
+  }
+
+  w.telegramSent.push_back(TelegramMessage{chatId, text, w.now});
+  respond(socket, "200 OK",
+          "{\"ok\":true,\"result\":{\"message_id\":" + std::to_string(w.telegramSent.size()) +
+              ",\"from\":{\"id\":123456,\"is_bot\":true,\"first_name\":\"Sim\"},\"chat\":{\"id\":" + chatId +
+              ",\"type\":\"private\"},\"date\":" + std::to_string(worldEpoch()) + ",\"text\":\"" +
+              jsonEscape(text) + "\"}}");
+}
+
+// getUpdates answer with up to limit pending updates, after one round-trip
+static void answerPoll(uint32_t socket, uint32_t limit) {
+  World &w = world();
+  std::string body = "{\"ok\":true,\"result\":[";
+  for (size_t i = 0; i < w.telegramUpdates.size() && i < limit; i++) {
+    const TelegramUpdate &u = w.telegramUpdates[i];
+    if (i) body += ",";
+    body += "{\"update_id\":" + std::to_string(u.id) + ",\"message\":{\"message_id\":" +
+            std::to_string(u.id % 1000) + ",\"from\":{\"id\":" + u.chatId +
+            ",\"is_bot\":false,\"first_name\":\"Sim\"},\"chat\":{\"id\":" + u.chatId +
+            ",\"first_name\":\"Sim\",\"type\":\"private\"},\"date\":" + std::to_string(worldEpoch()) +
+            ",\"text\":\"" + jsonEscape(u.text) + "\"}}";
+  }
+  body += "]}";
+  respond(socket, "200 OK", body);
+}
+
+void telegramRequest(uint32_t socket, const std::string &request) {
+  World &w = world();
+  size_t line = request.find("\r\n");
+  if (request.compare(0, 9, "POST /bot") == 0 && request.rfind("/sendMessage ", line) != std::string::npos) {
+    sendMessage(socket, request);
+    return;
+  }
+  if (request.compare(0, 8, "GET /bot") == 0 && request.rfind("/getMe ", line) != std::string::npos) {
+    w.counters.telegramProbes++;
+    respond(socket, "200 OK",
+            "{\"ok\":true,\"result\":{\"id\":123456,\"is_bot\":true,\"first_name\":\"Sim\",\"username\":\"sim_bot\"}}");
+    return;
+  }
+  if (request.compare(0, 8, "GET /bot") != 0 || request.find("/getUpdates") == std::string::npos) {
+    respond(socket, "404 Not Found", "{\"ok\":false,\"error_code\":404,\"description\":\"Not Found\"}");
+    return;
+  }
+
+  w.counters.telegramPolls++;
+  // an offset confirms every update before it
+  uint32_t offset = queryValue(request, "offset", 0);
+  w.telegramUpdates.erase(std::remove_if(w.telegramUpdates.begin(), w.telegramUpdates.end(),
+                                         [offset](const TelegramUpdate &u) { return u.id < offset; }),
+                          w.telegramUpdates.end());
+  uint32_t limit = queryValue(request, "limit", 100);
+  uint32_t timeout = queryValue(request, "timeout", 0);
+  if (!w.telegramUpdates.empty() || timeout == 0) {
+    answerPoll(socket, limit);
+    return;
+  }
+
+  // long poll: held until an update arrives or the timeout passes
+  if (w.telegramPoll.socket) cancel(w.telegramPoll.deadline);
+  w.telegramPoll.socket = socket;
+  w.telegramPoll.limit = limit;
+  w.telegramPoll.deadline = after(timeout * 1000, [socket, limit]() {
+    world().telegramPoll.socket = 0;
+    answerPoll(socket, limit);
+  });
+}
+
+void telegramReceive(const std::string &chatId, const std::string &text) {
+  World &w = world();
+  w.telegramUpdates.push_back(TelegramUpdate{w.nextUpdateId++, chatId, text});
+  if (w.telegramPoll.socket) {
+    cancel(w.telegramPoll.deadline);
+    answerPoll(w.telegramPoll.socket, w.telegramPoll.limit);
+    w.telegramPoll.socket = 0;
+  }
+}
+
+}  // namespace sim
@@ -0,0 +1,205 @@
+// File system of the simulated device (FS.h, LittleFS.h): a host directory
+//
+// The directory outlives sim::reboot() like flash does and is emptied by
+// sim::reset(). A flush of written data costs Script::fsSyncMs of blocked
+// time, what a LittleFS commit of the metadata costs on the device.
+
+#include <FS.h>
+#include <LittleFS.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "sim_internal.h"
+
+namespace stdfs = std::filesystem;
+
+fs::FS LittleFS;
+
+namespace {
+
+struct Root {
+  std::string path;
+  Root() {
+    char name[] = "/tmp/wifimessaging-fs-XXXXXX";
+    if (mkdtemp(name)) path = name;
+  }
+  ~Root() {
+    std::error_code ec;
+    if (!path.empty()) stdfs::remove_all(path, ec);
+  }
+};
+
+Root &root() {
+  static Root r;
+  return r;
+}
+
+}  // namespace
+
+namespace fs {
+
+struct FileImpl {
+  FILE *file = nullptr;
+  std::string name;
+  bool directory = false;
+  std::string path;                  ///< host path of a directory
+  std::vector<std::string> entries;  ///< of a directory, read by openNextFile()
+  size_t next = 0;
+  bool dirty = false;  ///< written since the last flush
+
+  ~FileImpl() {
+    if (file) fclose(file);
+  }
+};
+
+size_t File::write(const uint8_t *buf, size_t size) {
+  if (!_impl || !_impl->file) return 0;
+  size_t n = fwrite(buf, 1, size, _impl->file);
+  sim::counters().fsBytesWritten += n;
+  if (n) _impl->dirty = true;
+  return n;
+}
+
+size_t File::read(uint8_t *buf, size_t size) {
+  if (!_impl || !_impl->file) return 0;
+  return fread(buf, 1, size, _impl->file);
+}
+
+int File::read() {
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+int File::available() { return _impl && _impl->file ? (int)(size() - position()) : 0; }
+
+void File::flush() {
+  if (!_impl || !_impl->file) return;
+  fflush(_impl->file);
+  if (!_impl->dirty) return;
+  _impl->dirty = false;
+  sim::counters().fsSyncs++;
+  sim::block(sim::script().fsSyncMs);
+}
+
+bool File::seek(uint32_t pos, SeekMode mode) {
+  if (!_impl || !_impl->file) return false;
+  int whence = mode == SeekCur ? SEEK_CUR : mode == SeekEnd ? SEEK_END : SEEK_SET;
+  return fseek(_impl->file, (long)pos, whence) == 0;
+}
+
+size_t File::position() const {
+  if (!_impl || !_impl->file) return 0;
+  long pos = ftell(_impl->file);
+  return pos < 0 ? 0 : (size_t)pos;
+}
+
+size_t File::size() const {
+  if (!_impl || !_impl->file) return 0;
+  long pos = ftell(_impl->file);
+  fseek(_impl->file, 0, SEEK_END);
+  long end = ftell(_impl->file);
+  fseek(_impl->file, pos, SEEK_SET);
+  return end < 0 ? 0 : (size_t)end;
+}
+
+void File::close() {
+  if (!_impl) return;
+  flush();
+  _impl.reset();
+}
+
+File::operator bool() const { return _impl && (_impl->file || _impl->directory); }
+
+const char *File::name() const { return _impl ? _impl->name.c_str() : ""; }
+
+bool File::isDirectory() const { return _impl && _impl->directory; }
+
+File File::openNextFile() {
+  if (!_impl || !_impl->directory || _impl->next >= _impl->entries.size()) return File();
+  std::string name = _impl->entries[_impl->next++];
+  std::string path = _impl->path + "/" + name;
+  auto impl = std::make_shared<FileImpl>();
+  impl->name = name;
+  if (stdfs::is_directory(path)) {
+    impl->directory = true;
+    impl->path = path;
+  } else {
+    impl->file = fopen(path.c_str(), "rb");
+    if (!impl->file) return File();
+  }
+  return File(impl);
+}
+
+bool FS::begin() { return !root().path.empty(); }
+
+bool FS::format() {
+  sim::fsWipe();
+  return begin();
+}
+
+File FS::open(const char *path, const char *mode) {
+  std::string host = sim::fsPath(path);
+  auto impl = std::make_shared<FileImpl>();
+  const char *slash = strrchr(path, '/');
+  impl->name = slash ? slash + 1 : path;
+  if (stdfs::is_directory(host)) {
+    impl->directory = true;
+    impl->path = host;
+    for (const stdfs::directory_entry &entry : stdfs::directory_iterator(host))
+      impl->entries.push_back(entry.path().filename().string());
+    std::sort(impl->entries.begin(), impl->entries.end());
+    return File(impl);
+  }
+  bool exists = stdfs::exists(host);
+  std::string hostMode = mode;
+  if (hostMode.find('b') == std::string::npos) hostMode += 'b';
+  impl->file = fopen(host.c_str(), hostMode.c_str());
+  if (!impl->file) return File();
+  if (!exists) sim::counters().fsFilesCreated++;
+  return File(impl);
+}
+
+bool FS::exists(const char *path) { return stdfs::exists(sim::fsPath(path)); }
+
+bool FS::remove(const char *path) {
+  std::error_code ec;
+  if (!stdfs::is_regular_file(sim::fsPath(path)) || !stdfs::remove(sim::fsPath(path), ec)) return false;
+  sim::counters().fsFilesRemoved++;
+  return true;
+}
+
+bool FS::mkdir(const char *path) {
+  std::error_code ec;
+  stdfs::create_directories(sim::fsPath(path), ec);
+  return !ec;
+}
+
+bool FS::rmdir(const char *path) {
+  std::error_code ec;
+  return stdfs::remove(sim::fsPath(path), ec);
+}
+
+}  // namespace fs
+
+namespace sim {
+
+std::string fsPath(const char *path) {
+  std::string host = root().path;
+  if (*path != '/') host += '/';
+  return host + path;
+}
+
+void fsWipe() {
+  std::error_code ec;
+  if (root().path.empty()) return;
+  for (const stdfs::directory_entry &entry : stdfs::directory_iterator(root().path, ec))
+    stdfs::remove_all(entry.path(), ec);
+}
+
+}  // namespace sim
@@ -0,0 +1,103 @@
+// Model of the ESP8266 heap (umm_malloc): a 40 KB arena handed out first fit
+// in 8-byte blocks with a 4-byte header, free neighbours coalesced.
+//
+// Only what the device would allocate goes here: String buffers and the
+// buffers of the TLS client and Telegram stand-ins. The arena outlives
+// sim::reset(), like the objects that own those buffers may.
+
+#include <Arduino.h>
+
+#include <cmath>
+#include <map>
+
+#include "sim.h"
+
+namespace {
+
+const size_t kArena = 40 * 1024;
+const size_t kBlock = 8;
+const size_t kHeader = 4;
+
+alignas(8) uint8_t arena[kArena];
+
+struct Heap {
+  std::map<size_t, size_t> freeBlocks{{0, kArena}};  ///< offset -> size
+  std::map<size_t, size_t> used;                     ///< offset of the block -> size
+  uint32_t allocations = 0;
+  uint32_t failures = 0;
+};
+
+Heap &heapState() {
+  static Heap h;
+  return h;
+}
+
+}  // namespace
+
+namespace sim {
+
+void *heapAlloc(size_t size) {
+  Heap &h = heapState();
+  size_t need = (size + kHeader + kBlock - 1) / kBlock * kBlock;
+  for (auto it = h.freeBlocks.begin(); it != h.freeBlocks.end(); ++it) {
+    if (it->second < need) continue;
+    size_t offset = it->first;
+    size_t rest = it->second - need;
+    h.freeBlocks.erase(it);
+    if (rest) h.freeBlocks[offset + need] = rest;
+    h.used[offset] = need;
+    h.allocations++;
+    return arena + offset + kHeader;
+  }
+  h.failures++;
+  return nullptr;
+}
+
+void heapFree(void *ptr) {
+  if (!ptr) return;
+  Heap &h = heapState();
+  size_t offset = (uint8_t *)ptr - arena - kHeader;
+  auto u = h.used.find(offset);
+  if (u == h.used.end()) return;
+  size_t size = u->second;
+  h.used.erase(u);
+
+  auto next = h.freeBlocks.lower_bound(offset);
+  if (next != h.freeBlocks.end() && next->first == offset + size) {
+    size += next->second;
+    next = h.freeBlocks.erase(next);
+  }
+  if (next != h.freeBlocks.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset) {
+      prev->second += size;
+      return;
+    }
+  }
+  h.freeBlocks[offset] = size;
+}
+
+bool heapOwns(const void *ptr) { return ptr >= (const void *)arena && ptr < (const void *)(arena + kArena); }
+
+HeapStats heap() {
+  Heap &h = heapState();
+  HeapStats s;
+  double squares = 0;
+  for (auto &b : h.freeBlocks) {
+    size_t usable = b.second - kHeader;
+    s.free += usable;
+    if (usable > s.maxBlock) s.maxBlock = usable;
+    squares += (double)usable * usable;
+  }
+  // same measure as ESP.getHeapFragmentation()
+  s.fragmentation = s.free ? (uint8_t)(100 - (uint32_t)(std::sqrt(squares) * 100 / s.free)) : 0;
+  s.allocations = h.allocations;
+  s.failures = h.failures;
+  return s;
+}
+
+}  // namespace sim
+
+uint32_t EspClass::getFreeHeap() { return sim::heap().free; }
+uint32_t EspClass::getMaxFreeBlockSize() { return sim::heap().maxBlock; }
+uint8_t EspClass::getHeapFragmentation() { return sim::heap().fragmentation; }
@@ -0,0 +1,223 @@
+// Simulator core: virtual clock, event queue, world state and time
+
+#include <coredecls.h>
+#include <Ticker.h>
+#include <sys/time.h>
+
+#include <algorithm>
+
+#include "sim_internal.h"
+
+namespace sim {
+
+const char *const kMqttHost = "broker.example";
+const uint32_t kMqttIp = IPAddress(192, 168, 1, 10);
+const char *const kTelegramHost = "api.telegram.org";
+const uint32_t kTelegramIp = IPAddress(149, 154, 167, 220);
+
+World &world() {
+  static World w;
+  return w;
+}
+
+Script &script() { return world().script; }
+Counters &counters() { return world().counters; }
+std::vector<MqttMessage> &mqttPublished() { return world().mqttPublished; }
+std::vector<TelegramMessage> &telegramSent() { return world().telegramSent; }
+
+void reset() {
+  world() = World();
+  fsWipe();
+}
+
+void reboot() {
+  World &w = world();
+  w.events.erase(std::remove_if(w.events.begin(), w.events.end(), [](const Event &e) { return e.device; }),
+                 w.events.end());
+  w.boot = w.now;
+  w.sleepUs = 0;
+  w.serialBaud = 0;
+  w.mode = WIFI_OFF;
+  w.autoReconnect = true;
+  w.associated = false;
+  w.hasIP = false;
+  w.link++;
+  w.pendingConnect = 0;
+  w.hintChannel = 0;
+  w.hintBssidSet = false;
+  w.accessPoint = -1;
+  w.pendingScan = 0;
+  w.scanResult = -2;
+  w.scanList.clear();
+  w.staticIP = IPAddress();
+  w.onConnected.clear();
+  w.onDisconnected.clear();
+  w.onGotIP.clear();
+  w.dnsCache.clear();
+  w.dnsPending.clear();
+  w.ntpRequested = false;
+  w.pendingNtp = 0;
+  w.timeSet = false;
+  w.ntpSynced = false;
+  w.onTimeSet = nullptr;
+  w.epochAtBoot = 0;
+}
+
+uint64_t worldMs() { return world().now; }
+uint32_t bootMs() { return (uint32_t)(world().now - world().boot); }
+
+EventId schedule(uint32_t ms, uint32_t period, bool device, std::function<void()> fn) {
+  World &w = world();
+  Event e{w.nextEvent++, w.now + ms, period, device, std::move(fn)};
+  w.events.push_back(std::move(e));
+  return w.events.back().id;
+}
+
+EventId after(uint32_t ms, std::function<void()> fn) { return schedule(ms, 0, true, std::move(fn)); }
+EventId every(uint32_t ms, std::function<void()> fn) { return schedule(ms, ms ? ms : 1, true, std::move(fn)); }
+
+void cancel(EventId id) {
+  World &w = world();
+  w.events.erase(std::remove_if(w.events.begin(), w.events.end(), [id](const Event &e) { return e.id == id; }),
+                 w.events.end());
+}
+
+void advance(uint32_t ms) {
+  World &w = world();
+  uint64_t target = w.now + ms;
+  for (;;) {
+    auto next = std::min_element(w.events.begin(), w.events.end(), [](const Event &a, const Event &b) {
+      return a.due < b.due || (a.due == b.due && a.id < b.id);
+    });
+    if (next == w.events.end() || next->due > target) break;
+    w.now = std::max(w.now, next->due);
+    std::function<void()> fn = next->fn;
+    if (next->period) {
+      next->due += next->period;
+    } else {
+      w.events.erase(next);
+    }
+    fn();
+  }
+  w.now = std::max(w.now, target);
+}
+
+void block(uint32_t ms) {
+  world().counters.blockedMs += ms;
+  advance(ms);
+}
+
+int64_t worldEpoch() { return (int64_t)world().script.epoch + (int64_t)(world().now / 1000); }
+
+bool timeValid() { return world().timeSet; }
+
+int64_t epochNow() { return world().epochAtBoot + bootMs() / 1000; }
+
+bool wifiHasIP() { return world().hasIP; }
+uint64_t sleepRequestedUs() { return world().sleepUs; }
+
+uint32_t linkGeneration() { return world().link; }
+
+static void syncClock() {
+  World &w = world();
+  w.pendingNtp = 0;
+  if (!w.hasIP) return;
+  if (!w.script.ntpAvailable) {
+    w.pendingNtp = schedule(15000, 0, true, syncClock);  // SNTP retries
+    return;
+  }
+  w.timeSet = true;
+  w.ntpSynced = true;
+  w.counters.ntpSyncs++;
+  w.epochAtBoot = worldEpoch() - bootMs() / 1000;
+  if (w.onTimeSet) w.onTimeSet(true);
+}
+
+void requestClock() {
+  World &w = world();
+  if (w.ntpRequested && w.hasIP && !w.pendingNtp && !w.ntpSynced)
+    w.pendingNtp = schedule(w.script.ntpSyncMs, 0, true, syncClock);
+}
+
+bool topicMatches(const std::string &filter, const std::string &topic) {
+  size_t f = 0, t = 0;
+  while (f < filter.size()) {
+    if (filter[f] == '#') return true;
+    if (filter[f] == '+') {
+      while (t < topic.size() && topic[t] != '/') t++;
+      f++;
+      continue;
+    }
+    if (t >= topic.size() || filter[f] != topic[t]) return false;
+    f++;
+    t++;
+  }
+  return t == topic.size();
+}
+
+void mqttDeliver(const std::string &topic, const std::string &payload) {
+  world().mqttInbox.emplace_back(topic, payload);
+}
+
+}  // namespace sim
+
+// ********************  Arduino time  ********************
+
+unsigned long millis() { return sim::bootMs(); }
+unsigned long micros() { return (unsigned long)((sim::world().now - sim::world().boot) * 1000); }
+void delay(unsigned long ms) { sim::block(ms); }
+void yield() {}
+
+void configTime(long, int, const char *, const char *, const char *) {
+  sim::world().ntpRequested = true;
+  sim::requestClock();
+}
+
+// time() of the library is redirected here with -Wl,--wrap=time
+extern "C" time_t __wrap_time(time_t *t) {
+  time_t now = sim::timeValid() ? (time_t)sim::epochNow() : (time_t)(sim::bootMs() / 1000);
+  if (t) *t = now;
+  return now;
+}
+
+// settimeofday() of the library is redirected here with -Wl,--wrap=settimeofday
+extern "C" int __wrap_settimeofday(const struct timeval *tv, const void *) {
+  sim::World &w = sim::world();
+  if (!tv) return 0;
+  w.timeSet = true;
+  w.epochAtBoot = (int64_t)tv->tv_sec - sim::bootMs() / 1000;
+  if (w.onTimeSet) w.onTimeSet(false);
+  return 0;
+}
+
+void settimeofday_cb(const BoolCB &cb) { sim::world().onTimeSet = cb; }
+
+// ********************  RTC timer  ********************
+
+// Counts world time since sim::reset() (power-on), through reboots
+uint32 system_get_rtc_time(void) {
+  return (uint32)(((uint64_t)sim::world().now * 1000 << 12) / sim::script().rtcCali);
+}
+
+uint32 system_rtc_clock_cali_proc(void) { return sim::script().rtcCali; }
+
+// ********************  Ticker  ********************
+
+void Ticker::attach_ms(uint32_t milliseconds, callback_function_t callback) {
+  detach();
+  _id = sim::every(milliseconds, callback);
+}
+
+void Ticker::once_ms(uint32_t milliseconds, callback_function_t callback) {
+  detach();
+  uint32_t *id = &_id;
+  _id = sim::after(milliseconds, [id, callback]() {
+    *id = 0;
+    callback();
+  });
+}
+
+void Ticker::detach() {
+  if (_id) sim::cancel(_id);
+  _id = 0;
+}
@@ -0,0 +1,200 @@
+// Simulator for the host build of WifiMessaging
+//
+// A virtual clock with an event queue drives the stand-in headers in
+// ../include. Every network operation costs scripted virtual milliseconds, so
+// bring-up latency and the time spent blocked inside loop() can be measured
+// deterministically without a board.
+//
+// World time keeps running across sim::reboot(), millis() restarts at 0.
+
+#ifndef WIFIMESSAGING_SIM_H
+#define WIFIMESSAGING_SIM_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace sim {
+
+// Addresses of the simulated servers
+extern const char *const kMqttHost;      ///< "broker.example"
+extern const uint32_t kMqttIp;           ///< 192.168.1.10
+extern const char *const kTelegramHost;  ///< "api.telegram.org"
+extern const uint32_t kTelegramIp;       ///< 149.154.167.220
+
+/**
+ * @brief Further access point of the site, see Script::accessPoints
+ */
+struct AccessPoint {
+  std::string ssid;
+  uint8_t bssid[6];
+  uint8_t channel;
+  int32_t rssi;
+  bool available;
+};
+
+/**
+ * @brief Scriptable delays and availability of the simulated environment
+ */
+struct Script {
+  // WiFi access point
+  bool wifiAvailable = true;
+  std::string wifiSsid = "sim-ssid";
+  uint32_t wifiAssociateMs = 1500;  ///< WiFi.begin() until onStationModeConnected (scan + auth)
+  uint32_t wifiDhcpMs = 600;        ///< association until onStationModeGotIP
+  uint32_t wifiFastAssociateMs = 120;  ///< association with channel and BSSID given, no scan
+  uint32_t wifiStaticIpMs = 5;      ///< association until onStationModeGotIP with a static IP
+  uint8_t wifiChannel = 6;
+  uint8_t wifiBssid[6] = {0x24, 0xA4, 0x3C, 0x01, 0x02, 0x03};
+  int32_t wifiRssi = -62;
+  uint8_t wifiRejectReason = 0;     ///< AP refuses the station with this disconnect reason, 0 to accept
+  std::vector<AccessPoint> accessPoints;  ///< further access points, a station without BSSID takes the strongest
+  uint32_t wifiScanMs = 2100;       ///< WiFi.scanNetworks() of all channels
+
+  // NTP
+  bool ntpAvailable = true;
+  uint32_t ntpSyncMs = 350;         ///< configTime() until the clock is set
+  uint32_t epoch = 1760000000;      ///< world time at sim::reset()
+  uint32_t rtcCali = 23552;         ///< RTC tick of 5.75 us, as system_rtc_clock_cali_proc() returns it
+
+  // DNS
+  bool dnsAvailable = true;
+  uint32_t dnsMs = 30;              ///< round-trip of one lookup
+  uint32_t dnsTtlS = 300;           ///< lifetime of a cached answer in the resolver
+
+  // MQTT broker
+  bool mqttAvailable = true;
+  uint32_t mqttTcpMs = 5;
+  uint32_t mqttConnackMs = 10;
+
+  // Telegram API
+  bool telegramAvailable = true;
+  uint32_t telegramTcpMs = 40;
+  uint32_t tlsFullHandshakeMs = 1600;    ///< RSA handshake at 80 MHz
+  uint32_t tlsResumedHandshakeMs = 180;  ///< abbreviated handshake on a cached session
+  uint32_t tlsSessionLifetimeS = 86400;  ///< server side session cache lifetime
+  uint32_t telegramRequestMs = 220;      ///< one HTTPS request/response on an open connection
+  bool telegramMfln = false;             ///< server accepts a maximum fragment length, api.telegram.org does not
+  uint32_t telegramChatIntervalMs = 1000;  ///< sendMessage flood control per chat, 0 for none
+  uint32_t telegramChatBurst = 3;
+  uint32_t telegramGlobalIntervalMs = 33;  ///< per bot, about 30 messages a second
+  uint32_t telegramGlobalBurst = 30;
+  uint32_t telegramRetryAfterS = 5;        ///< wait a 429 asks for, the chat is refused until then
+  uint32_t telegramIdleCloseMs = 0;        ///< server closes a connection idle this long, 0 never
+  uint32_t telegramKeepAliveRequests = 0;  ///< requests answered on a connection before the server closes it, 0 any
+  uint8_t telegramFraming = 0;  ///< end of a response body: 0 Content-Length, 1 chunked, 2 the server closes the connection
+
+  // Flash file system
+  uint32_t fsSyncMs = 6;            ///< File::flush() of written data, a LittleFS metadata commit
+};
+
+Script &script();
+
+/**
+ * @brief Counters of what the simulated environment has seen
+ */
+struct Counters {
+  uint32_t dnsQueries = 0;
+  uint32_t tcpConnects = 0;
+  uint32_t tcpFailures = 0;
+  uint32_t tlsFull = 0;
+  uint32_t tlsResumed = 0;
+  uint32_t tlsFailures = 0;
+  uint32_t tlsProbes = 0;          ///< MFLN probes
+  uint32_t mqttConnects = 0;
+  uint32_t ntpSyncs = 0;
+  uint32_t wifiScans = 0;          ///< full scans, by an association or WiFi.scanNetworks()
+  uint32_t dhcpLeases = 0;
+  uint32_t telegramRequests = 0;
+  uint32_t telegramPolls = 0;      ///< getUpdates requests
+  uint32_t telegram429 = 0;        ///< sendMessage answered 429 Too Many Requests
+  uint32_t telegramProbes = 0;     ///< getMe requests
+  uint32_t fsBytesWritten = 0;     ///< written to flash files
+  uint32_t fsSyncs = 0;            ///< File::flush() of written data
+  uint32_t fsFilesCreated = 0;
+  uint32_t fsFilesRemoved = 0;
+  uint32_t serialBytes = 0;        ///< written to Serial after Serial.begin()
+  uint64_t serialBlockedMs = 0;    ///< virtual ms Serial writes waited for the UART
+  uint64_t blockedMs = 0;  ///< virtual ms spent inside blocking calls
+};
+
+Counters &counters();
+
+struct MqttMessage {
+  std::string topic;
+  std::string payload;
+  bool retained;
+  uint64_t atMs;  ///< world time of delivery at the broker
+};
+
+struct TelegramMessage {
+  std::string chatId;
+  std::string text;
+  uint64_t atMs;  ///< world time of delivery at the API
+};
+
+std::vector<MqttMessage> &mqttPublished();
+std::vector<TelegramMessage> &telegramSent();
+
+/**
+ * @brief Fresh world: clock, events, logs, counters and script reset, file
+ * system emptied
+ */
+void reset();
+
+/**
+ * @brief Restart the device: millis() restarts, radio and sockets are gone,
+ * the world (servers, caches, clock) carries on
+ */
+void reboot();
+
+uint64_t worldMs();  ///< monotonic world time
+uint32_t bootMs();   ///< time since the last (re)boot, what millis() returns
+
+/**
+ * @brief Let virtual time pass, running every event that falls due
+ */
+void advance(uint32_t ms);
+
+/**
+ * @brief Like advance(), but accounted as time the caller was blocked
+ */
+void block(uint32_t ms);
+
+typedef uint32_t EventId;
+EventId after(uint32_t ms, std::function<void()> fn);
+EventId every(uint32_t ms, std::function<void()> fn);
+void cancel(EventId id);
+
+// World manipulation
+void dropWiFi(int reason);  ///< access point goes away with a disconnect reason
+void restoreWiFi();         ///< access point is back and the station reconnects
+int32_t wifiRssi();         ///< RSSI of the access point of the station, 0 when not associated
+void mqttDeliver(const std::string &topic, const std::string &payload);  ///< broker pushes a message
+void telegramReceive(const std::string &chatId, const std::string &text);  ///< a user writes to the bot
+std::string fsPath(const char *path);  ///< host path of a file of the device file system, to tamper with it
+
+/**
+ * @brief Device heap model, see heap.cpp
+ */
+struct HeapStats {
+  uint32_t free = 0;           ///< ESP.getFreeHeap()
+  uint32_t maxBlock = 0;       ///< ESP.getMaxFreeBlockSize()
+  uint8_t fragmentation = 0;   ///< ESP.getHeapFragmentation()
+  uint32_t allocations = 0;    ///< since program start
+  uint32_t failures = 0;       ///< allocations that did not fit
+};
+
+HeapStats heap();
+
+// State used by the stand-ins
+bool timeValid();
+int64_t epochNow();  ///< seconds, only meaningful when timeValid()
+bool wifiHasIP();
+uint64_t sleepRequestedUs();  ///< ESP.deepSleep() since the last boot, 0 for none; sim::reboot() is the wake
+uint32_t linkGeneration();  ///< changes whenever the station loses its IP
+
+}  // namespace sim
+
+#endif
@@ -0,0 +1,150 @@
+// Shared state of the simulator, only for the stand-in implementations
+
+#ifndef WIFIMESSAGING_SIM_INTERNAL_H
+#define WIFIMESSAGING_SIM_INTERNAL_H
+
+#include <ESP8266WiFi.h>
+
+#include <map>
+#include <random>
+#include <set>
+
+#include "sim.h"
+
+namespace sim {
+
+struct Event {
+  EventId id;
+  uint64_t due;
+  uint32_t period;  ///< 0 for one-shot events
+  bool device;      ///< cancelled by reboot()
+  std::function<void()> fn;
+};
+
+struct DnsEntry {
+  uint32_t ip;
+  uint64_t expires;  ///< world ms
+};
+
+struct Endpoint {
+  uint32_t ip;
+  const bool *available;
+  const uint32_t *tcpMs;
+  const uint32_t *idleCloseMs;  ///< nullptr or 0 when the server keeps idle connections
+};
+
+struct Socket {
+  const Endpoint *endpoint;
+  uint32_t link;   ///< linkGeneration() when opened
+  std::string rx;  ///< bytes received from the server, not yet read
+  std::string tx;  ///< bytes of an HTTP request not complete yet
+  uint64_t activeAt = 0;  ///< world ms of the last request or response
+  uint32_t requests = 0;  ///< HTTP requests taken
+  bool closing = false;   ///< the server takes no more requests
+  bool closed = false;    ///< closed by the server, once rx is read
+};
+
+struct TelegramUpdate {
+  uint32_t id;
+  std::string chatId;
+  std::string text;
+};
+
+/**
+ * @brief getUpdates held open by the server until an update or its timeout
+ */
+struct TelegramPoll {
+  uint32_t socket = 0;  ///< 0 when no poll is held
+  uint32_t limit = 0;
+  EventId deadline = 0;
+};
+
+struct World {
+  Script script;
+  Counters counters;
+  std::vector<MqttMessage> mqttPublished;
+  std::vector<TelegramMessage> telegramSent;
+
+  uint8_t rtcMemory[512];  ///< RTC user memory, survives reboot()
+
+  World() { memset(rtcMemory, 0xA5, sizeof(rtcMemory)); }
+
+  uint64_t now = 0;
+  uint64_t boot = 0;
+  uint64_t sleepUs = 0;  ///< ESP.deepSleep() since boot
+  uint32_t serialBaud = 0;     ///< Serial.begin(), 0 before
+  uint64_t serialEmptyUs = 0;  ///< world us when the UART has sent everything written
+  EventId nextEvent = 1;
+  std::vector<Event> events;
+
+  // WiFi station
+  WiFiMode_t mode = WIFI_OFF;
+  bool autoReconnect = true;  ///< the SDK retries a failed or lost association
+  bool associated = false;
+  bool hasIP = false;
+  uint32_t link = 1;
+  EventId pendingConnect = 0;
+  int32_t hintChannel = 0;    ///< channel given to WiFi.begin(), 0 to scan
+  uint8_t hintBssid[6] = {};
+  bool hintBssidSet = false;
+  std::string hintSsid;       ///< SSID given to WiFi.begin()
+  int accessPoint = -1;       ///< associated: 0 the one of the script, i + 1 accessPoints[i]
+  EventId pendingScan = 0;
+  int scanResult = -2;        ///< WiFi.scanComplete()
+  std::vector<AccessPoint> scanList;
+  IPAddress staticIP;         ///< set by WiFi.config(), 0.0.0.0 for DHCP
+  IPAddress staticMask;
+  IPAddress staticGateway;
+  std::vector<std::pair<std::weak_ptr<WiFiEventHandlerOpaque>, std::function<void(const WiFiEventStationModeConnected &)>>> onConnected;
+  std::vector<std::pair<std::weak_ptr<WiFiEventHandlerOpaque>, std::function<void(const WiFiEventStationModeDisconnected &)>>> onDisconnected;
+  std::vector<std::pair<std::weak_ptr<WiFiEventHandlerOpaque>, std::function<void(const WiFiEventStationModeGotIP &)>>> onGotIP;
+
+  // DNS resolver of the station (lwIP keeps answers and in-flight lookups)
+  std::map<std::string, DnsEntry> dnsCache;
+  std::map<std::string, uint64_t> dnsPending;
+
+  std::mt19937 random{1};  ///< ESP.random()
+
+  // Clock
+  bool ntpRequested = false;
+  EventId pendingNtp = 0;
+  bool timeSet = false;       ///< device clock set, by SNTP or settimeofday()
+  bool ntpSynced = false;     ///< SNTP answered since boot
+  std::function<void(bool)> onTimeSet;
+  int64_t epochAtBoot = 0;  ///< device clock: epoch seconds at millis() == 0
+
+  // Telegram server TLS session cache: session id -> world ms issued
+  std::map<std::string, uint64_t> tlsSessions;
+
+  // Open TCP connections
+  uint32_t nextSocket = 1;
+  std::map<uint32_t, Socket> sockets;
+
+  // MQTT broker
+  std::vector<std::pair<std::string, std::string>> mqttInbox;
+
+  // Telegram API: updates not yet confirmed by a getUpdates offset
+  std::vector<TelegramUpdate> telegramUpdates;
+  uint32_t nextUpdateId = 700000001;
+  TelegramPoll telegramPoll;
+  // Telegram API flood control, GCRA: world ms each bucket is full again
+  std::map<std::string, uint64_t> telegramChatFullAt;
+  std::map<std::string, uint64_t> telegramChatRefusedUntil;
+  uint64_t telegramGlobalFullAt = 0;
+};
+
+World &world();
+
+EventId schedule(uint32_t ms, uint32_t period, bool device, std::function<void()> fn);
+void startAssociation();
+void requestClock();
+void loseIP(int reason);
+int64_t worldEpoch();
+bool topicMatches(const std::string &filter, const std::string &topic);
+Socket *openSocket(uint32_t id);  ///< nullptr when closed or lost with the link
+void telegramRequest(uint32_t socket, const std::string &request);  ///< complete HTTP request to the API
+void fsWipe();  ///< remove every file of the device file system
+
+}  // namespace sim
+
+#endif
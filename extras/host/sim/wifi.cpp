@@ -0,0 +1,549 @@
+// Stand-in implementations of the ESP8266 WiFi station, resolver and TCP client
+
+#include <ESP8266WiFi.h>
+#include <include/ClientContext.h>
+#include <lwip/tcp.h>
+
+#include "sim_internal.h"
+
+ESP8266WiFiClass WiFi;
+
+struct WiFiEventHandlerOpaque {};
+
+static const uint8_t kMac[6] = {0x5C, 0xCF, 0x7F, 0x12, 0x34, 0x56};
+
+static const IPAddress kLocalIP(192, 168, 1, 77);
+static const IPAddress kMask(255, 255, 255, 0);
+static const IPAddress kGateway(192, 168, 1, 1);
+
+bool wifi_get_macaddr(uint8 if_index, uint8 *macaddr) {
+  memcpy(macaddr, kMac, sizeof(kMac));
+  macaddr[5] += if_index;
+  return true;
+}
+
+namespace sim {
+
+template <typename List, typename Event>
+static void fire(List &handlers, const Event &e) {
+  auto copy = handlers;
+  for (auto &h : copy)
+    if (!h.first.expired()) h.second(e);
+}
+
+static void gotIP() {
+  World &w = world();
+  w.pendingConnect = 0;
+  w.hasIP = true;
+  WiFiEventStationModeGotIP e{kLocalIP, kMask, kGateway};
+  if ((uint32_t)w.staticIP) e = {w.staticIP, w.staticMask, w.staticGateway};
+  fire(w.onGotIP, e);
+  requestClock();
+}
+
+// Access point i: 0 the one of the script, i + 1 Script::accessPoints[i]
+static AccessPoint accessPoint(int i) {
+  const Script &script = world().script;
+  if (i > 0) return script.accessPoints[i - 1];
+  AccessPoint ap{script.wifiSsid, {}, script.wifiChannel, script.wifiRssi, script.wifiAvailable};
+  memcpy(ap.bssid, script.wifiBssid, sizeof(ap.bssid));
+  return ap;
+}
+
+static int accessPointCount() { return 1 + (int)world().script.accessPoints.size(); }
+
+// Access point the station associates with: the one given by channel and
+// BSSID, else the strongest of the SSID; -1 when none is in range
+static int targetAccessPoint() {
+  World &w = world();
+  int best = -1;
+  int32_t bestRssi = 0;
+  for (int i = 0; i < accessPointCount(); i++) {
+    AccessPoint ap = accessPoint(i);
+    if (!ap.available || ap.ssid != w.hintSsid) continue;
+    if (w.hintChannel && w.hintChannel != ap.channel) continue;
+    if (w.hintBssidSet && memcmp(w.hintBssid, ap.bssid, sizeof(w.hintBssid))) continue;
+    if (best < 0 || ap.rssi > bestRssi) {
+      best = i;
+      bestRssi = ap.rssi;
+    }
+  }
+  return best;
+}
+
+static void associated() {
+  World &w = world();
+  int target = targetAccessPoint();
+  if (target < 0 || w.script.wifiRejectReason) {
+    WiFiEventStationModeDisconnected e;
+    e.ssid = "";
+    memset(e.bssid, 0, sizeof(e.bssid));
+    e.reason = target >= 0 ? (WiFiDisconnectReason)w.script.wifiRejectReason : WIFI_DISCONNECT_REASON_NO_AP_FOUND;
+    w.pendingConnect = 0;
+    fire(w.onDisconnected, e);
+    if (w.autoReconnect) startAssociation();  // the SDK keeps scanning
+    return;
+  }
+  AccessPoint ap = accessPoint(target);
+  w.associated = true;
+  w.accessPoint = target;
+  WiFiEventStationModeConnected e;
+  e.ssid = ap.ssid.c_str();
+  memcpy(e.bssid, ap.bssid, sizeof(e.bssid));
+  e.channel = ap.channel;
+  fire(w.onConnected, e);
+  if ((uint32_t)w.staticIP) {
+    w.pendingConnect = schedule(w.script.wifiStaticIpMs, 0, true, gotIP);
+  } else {
+    w.counters.dhcpLeases++;
+    w.pendingConnect = schedule(w.script.wifiDhcpMs, 0, true, gotIP);
+  }
+}
+
+void startAssociation() {
+  World &w = world();
+  if (w.pendingConnect) cancel(w.pendingConnect);
+  // a station given channel and BSSID probes that AP only
+  bool fast = w.hintChannel && w.hintBssidSet;
+  if (!fast) w.counters.wifiScans++;
+  w.pendingConnect = schedule(fast ? w.script.wifiFastAssociateMs : w.script.wifiAssociateMs, 0, true, associated);
+}
+
+void loseIP(int reason) {
+  World &w = world();
+  bool was = w.associated;
+  AccessPoint ap = accessPoint(w.accessPoint > 0 ? w.accessPoint : 0);
+  if (w.pendingConnect) cancel(w.pendingConnect);
+  w.pendingConnect = 0;
+  w.associated = false;
+  w.accessPoint = -1;
+  w.hasIP = false;
+  w.link++;
+  w.dnsPending.clear();
+  if (w.pendingNtp) cancel(w.pendingNtp);
+  w.pendingNtp = 0;
+  if (was) {
+    WiFiEventStationModeDisconnected e;
+    e.ssid = ap.ssid.c_str();
+    memcpy(e.bssid, ap.bssid, sizeof(e.bssid));
+    e.reason = (WiFiDisconnectReason)reason;
+    fire(w.onDisconnected, e);
+  }
+}
+
+void dropWiFi(int reason) {
+  world().script.wifiAvailable = false;
+  // a station on another access point keeps its link
+  if (world().accessPoint <= 0) loseIP(reason);
+  if ((world().mode & WIFI_STA) && world().autoReconnect) startAssociation();  // auto reconnect of the SDK
+}
+
+void restoreWiFi() { world().script.wifiAvailable = true; }
+
+int32_t wifiRssi() { return world().associated ? accessPoint(world().accessPoint).rssi : 0; }
+
+static void scanDone() {
+  World &w = world();
+  w.pendingScan = 0;
+  w.scanList.clear();
+  for (int i = 0; i < accessPointCount(); i++)
+    if (accessPoint(i).available) w.scanList.push_back(accessPoint(i));
+  w.scanResult = (int)w.scanList.size();
+}
+
+}  // namespace sim
+
+// ********************  ESP8266WiFiClass  ********************
+
+WiFiMode_t ESP8266WiFiClass::getMode() { return sim::world().mode; }
+
+bool ESP8266WiFiClass::mode(WiFiMode_t m) {
+  if (!(m & WIFI_STA)) sim::loseIP(WIFI_DISCONNECT_REASON_ASSOC_LEAVE);
+  sim::world().mode = m;
+  return true;
+}
+
+void ESP8266WiFiClass::persistent(bool) {}
+bool ESP8266WiFiClass::setAutoConnect(bool) { return true; }
+bool ESP8266WiFiClass::setAutoReconnect(bool autoReconnect) {
+  sim::world().autoReconnect = autoReconnect;
+  return true;
+}
+
+bool ESP8266WiFiClass::disconnect(bool wifioff) {
+  sim::loseIP(WIFI_DISCONNECT_REASON_ASSOC_LEAVE);
+  if (wifioff) sim::world().mode = WIFI_OFF;
+  return true;
+}
+
+bool ESP8266WiFiClass::forceSleepBegin(uint32) {
+  sim::loseIP(WIFI_DISCONNECT_REASON_ASSOC_LEAVE);
+  return true;
+}
+
+bool ESP8266WiFiClass::forceSleepWake() { return true; }
+
+wl_status_t ESP8266WiFiClass::begin(const char *ssid, const char *, int32_t channel, const uint8_t *bssid,
+                                    bool connect) {
+  sim::World &w = sim::world();
+  w.hintSsid = ssid;
+  w.hintChannel = channel;
+  w.hintBssidSet = bssid != nullptr;
+  if (bssid) memcpy(w.hintBssid, bssid, sizeof(w.hintBssid));
+  w.mode = (WiFiMode_t)(w.mode | WIFI_STA);
+  if (w.associated || w.pendingConnect) sim::loseIP(WIFI_DISCONNECT_REASON_ASSOC_LEAVE);
+  if (connect) sim::startAssociation();
+  return status();
+}
+
+bool ESP8266WiFiClass::config(IPAddress local_ip, IPAddress gateway, IPAddress subnet, IPAddress, IPAddress) {
+  sim::World &w = sim::world();
+  w.staticIP = local_ip;
+  w.staticMask = subnet;
+  w.staticGateway = gateway;
+  return true;
+}
+
+wl_status_t ESP8266WiFiClass::status() { return sim::world().hasIP ? WL_CONNECTED : WL_DISCONNECTED; }
+
+IPAddress ESP8266WiFiClass::localIP() {
+  if (!sim::world().hasIP) return IPAddress();
+  return (uint32_t)sim::world().staticIP ? sim::world().staticIP : kLocalIP;
+}
+IPAddress ESP8266WiFiClass::subnetMask() { return sim::world().hasIP ? kMask : IPAddress(); }
+IPAddress ESP8266WiFiClass::gatewayIP() { return sim::world().hasIP ? kGateway : IPAddress(); }
+IPAddress ESP8266WiFiClass::dnsIP(uint8_t) { return sim::world().hasIP ? kGateway : IPAddress(); }
+int32_t ESP8266WiFiClass::RSSI() { return sim::world().associated ? sim::wifiRssi() : 31; }
+
+uint8_t *ESP8266WiFiClass::BSSID() {
+  sim::World &w = sim::world();
+  if (!w.associated) return nullptr;
+  return w.accessPoint > 0 ? w.script.accessPoints[w.accessPoint - 1].bssid : w.script.wifiBssid;
+}
+
+int32_t ESP8266WiFiClass::channel() {
+  sim::World &w = sim::world();
+  if (w.accessPoint > 0) return w.script.accessPoints[w.accessPoint - 1].channel;
+  return w.script.wifiChannel;
+}
+
+// A scan lists the access points in range when it ends; the station stays
+// associated while the radio visits the other channels
+int8_t ESP8266WiFiClass::scanNetworks(bool async, bool, uint8, uint8 *) {
+  sim::World &w = sim::world();
+  if (!(w.mode & WIFI_STA)) return WIFI_SCAN_FAILED;
+  if (w.pendingScan) return WIFI_SCAN_RUNNING;
+  w.counters.wifiScans++;
+  w.scanResult = WIFI_SCAN_RUNNING;
+  if (!async) {
+    sim::block(w.script.wifiScanMs);
+    sim::scanDone();
+    return w.scanResult;
+  }
+  w.pendingScan = sim::schedule(w.script.wifiScanMs, 0, true, sim::scanDone);
+  return WIFI_SCAN_RUNNING;
+}
+
+int8_t ESP8266WiFiClass::scanComplete() { return sim::world().scanResult; }
+
+void ESP8266WiFiClass::scanDelete() {
+  sim::World &w = sim::world();
+  if (w.pendingScan) return;
+  w.scanList.clear();
+  w.scanResult = WIFI_SCAN_FAILED;
+}
+
+String ESP8266WiFiClass::SSID(uint8_t i) {
+  sim::World &w = sim::world();
+  return i < w.scanList.size() ? String(w.scanList[i].ssid.c_str()) : String();
+}
+
+int32_t ESP8266WiFiClass::RSSI(uint8_t i) {
+  sim::World &w = sim::world();
+  return i < w.scanList.size() ? w.scanList[i].rssi : 0;
+}
+
+uint8_t *ESP8266WiFiClass::BSSID(uint8_t i) {
+  sim::World &w = sim::world();
+  return i < w.scanList.size() ? w.scanList[i].bssid : nullptr;
+}
+
+int32_t ESP8266WiFiClass::channel(uint8_t i) {
+  sim::World &w = sim::world();
+  return i < w.scanList.size() ? w.scanList[i].channel : 0;
+}
+
+int ESP8266WiFiClass::hostByName(const char *aHostname, IPAddress &aResult) {
+  return hostByName(aHostname, aResult, 10000);
+}
+
+// lwIP semantics: a lookup that times out stays in flight, a later call picks
+// up its answer; answers are cached for the TTL of the record
+int ESP8266WiFiClass::hostByName(const char *aHostname, IPAddress &aResult, uint32_t timeout_ms) {
+  sim::World &w = sim::world();
+  unsigned a, b, c, d;
+  char tail;
+  if (sscanf(aHostname, "%u.%u.%u.%u%c", &a, &b, &c, &d, &tail) == 4) {
+    aResult = IPAddress(a, b, c, d);
+    return 1;
+  }
+  if (!w.hasIP) return 0;
+
+  std::string name(aHostname);
+  auto cached = w.dnsCache.find(name);
+  if (cached != w.dnsCache.end() && cached->second.expires > w.now) {
+    aResult = cached->second.ip;
+    return 1;
+  }
+
+  uint32_t ip = 0;
+  if (name == sim::kMqttHost) ip = sim::kMqttIp;
+  if (name == sim::kTelegramHost) ip = sim::kTelegramIp;
+
+  auto pending = w.dnsPending.find(name);
+  if (pending == w.dnsPending.end()) {
+    w.counters.dnsQueries++;
+    pending = w.dnsPending.emplace(name, w.now).first;
+  }
+  uint64_t answerAt = pending->second + w.script.dnsMs;
+  if (!w.script.dnsAvailable || !ip || answerAt > w.now + timeout_ms) {
+    sim::block(timeout_ms);
+    if (!w.script.dnsAvailable || !ip) w.dnsPending.erase(name);
+    return 0;
+  }
+  if (answerAt > w.now) sim::block((uint32_t)(answerAt - w.now));
+  w.dnsPending.erase(name);
+  w.dnsCache[name] = sim::DnsEntry{ip, w.now + w.script.dnsTtlS * 1000ULL};
+  aResult = ip;
+  return 1;
+}
+
+WiFiEventHandler ESP8266WiFiClass::onStationModeConnected(
+    std::function<void(const WiFiEventStationModeConnected &)> f) {
+  WiFiEventHandler handler = std::make_shared<WiFiEventHandlerOpaque>();
+  sim::world().onConnected.emplace_back(handler, f);
+  return handler;
+}
+
+WiFiEventHandler ESP8266WiFiClass::onStationModeDisconnected(
+    std::function<void(const WiFiEventStationModeDisconnected &)> f) {
+  WiFiEventHandler handler = std::make_shared<WiFiEventHandlerOpaque>();
+  sim::world().onDisconnected.emplace_back(handler, f);
+  return handler;
+}
+
+WiFiEventHandler ESP8266WiFiClass::onStationModeGotIP(std::function<void(const WiFiEventStationModeGotIP &)> f) {
+  WiFiEventHandler handler = std::make_shared<WiFiEventHandlerOpaque>();
+  sim::world().onGotIP.emplace_back(handler, f);
+  return handler;
+}
+
+// ********************  WiFiClient  ********************
+
+static const sim::Endpoint *endpointFor(uint32_t ip) {
+  static sim::Endpoint endpoints[2];
+  sim::Script &s = sim::script();
+  endpoints[0] = sim::Endpoint{sim::kMqttIp, &s.mqttAvailable, &s.mqttTcpMs, nullptr};
+  endpoints[1] = sim::Endpoint{sim::kTelegramIp, &s.telegramAvailable, &s.telegramTcpMs, &s.telegramIdleCloseMs};
+  for (auto &e : endpoints)
+    if (e.ip == ip) return &e;
+  return nullptr;
+}
+
+WiFiClient::WiFiClient() { _timeout = 5000; }
+
+WiFiClient::~WiFiClient() { stop(); }
+
+WiFiClient::WiFiClient(WiFiClient &&other) : WiFiClient() { *this = std::move(other); }
+
+WiFiClient &WiFiClient::operator=(WiFiClient &&other) {
+  if (this == &other) return *this;
+  stop();
+  _remote = other._remote;
+  _socket = other._socket;
+  _timeout = other._timeout;
+  other._socket = 0;
+  return *this;
+}
+
+WiFiClient::WiFiClient(ClientContext *client) : WiFiClient() {
+  _remote = client->remote;
+  _socket = client->socket;
+  delete client;
+}
+
+int WiFiClient::connect(IPAddress ip, uint16_t) {
+  sim::World &w = sim::world();
+  stop();
+  if (!w.hasIP) return 0;
+  w.counters.tcpConnects++;
+  const sim::Endpoint *e = endpointFor(ip);
+  if (!e || !*e->available || *e->tcpMs > _timeout) {
+    sim::block(_timeout);  // SYN retransmissions until the timeout
+    w.counters.tcpFailures++;
+    return 0;
+  }
+  sim::block(*e->tcpMs);
+  if (!w.hasIP) return 0;
+  _remote = ip;
+  _socket = w.nextSocket++;
+  w.sockets[_socket] = sim::Socket{e, sim::linkGeneration(), std::string(), std::string(), w.now};
+  return 1;
+}
+
+int WiFiClient::connect(const char *host, uint16_t port) {
+  IPAddress ip;
+  if (!WiFi.hostByName(host, ip, _timeout)) return 0;
+  return connect(ip, port);
+}
+
+// ********************  lwIP raw TCP  ********************
+
+struct tcp_pcb {
+  void *arg = nullptr;
+  tcp_err_fn err = nullptr;
+  uint32_t ip = 0;
+  sim::EventId handshake = 0;  ///< SYN answered at this event
+  uint32_t socket = 0;         ///< once established
+};
+
+tcp_pcb *tcp_new() { return new tcp_pcb(); }
+
+void tcp_arg(tcp_pcb *pcb, void *arg) { pcb->arg = arg; }
+
+void tcp_err(tcp_pcb *pcb, tcp_err_fn err) { pcb->err = err; }
+
+// The SYN to a server that is down stays unanswered until the caller gives up
+err_t tcp_connect(tcp_pcb *pcb, const ip_addr_t *ipaddr, uint16_t, tcp_connected_fn connected) {
+  sim::World &w = sim::world();
+  if (!w.hasIP) return ERR_RTE;
+  w.counters.tcpConnects++;
+  pcb->ip = ipaddr->addr;
+  const sim::Endpoint *e = endpointFor(pcb->ip);
+  if (!e) return ERR_OK;
+  uint32_t link = sim::linkGeneration();
+  pcb->handshake = sim::after(*e->tcpMs, [pcb, e, link, connected]() {
+    sim::World &w = sim::world();
+    pcb->handshake = 0;
+    if (link != sim::linkGeneration()) {
+      // lwIP frees the pcb before the error callback
+      tcp_err_fn err = pcb->err;
+      void *arg = pcb->arg;
+      delete pcb;
+      w.counters.tcpFailures++;
+      if (err) err(arg, ERR_ABRT);
+      return;
+    }
+    if (!*e->available) return;
+    pcb->socket = w.nextSocket++;
+    w.sockets[pcb->socket] = sim::Socket{e, link, std::string(), std::string(), w.now};
+    connected(pcb->arg, pcb, ERR_OK);
+  });
+  return ERR_OK;
+}
+
+void tcp_abort(tcp_pcb *pcb) {
+  sim::World &w = sim::world();
+  if (pcb->handshake) sim::cancel(pcb->handshake);
+  if (pcb->socket) {
+    w.sockets.erase(pcb->socket);
+  } else {
+    w.counters.tcpFailures++;
+  }
+  tcp_err_fn err = pcb->err;
+  void *arg = pcb->arg;
+  delete pcb;
+  if (err) err(arg, ERR_ABRT);
+}
+
+ClientContext::ClientContext(tcp_pcb *pcb, discard_cb_t, void *) : remote(pcb->ip), socket(pcb->socket) {
+  // the pcb stays with the context on the device
+  delete pcb;
+}
+
+sim::Socket *sim::openSocket(uint32_t id) {
+  auto it = sim::world().sockets.find(id);
+  if (it == sim::world().sockets.end()) return nullptr;
+  sim::Socket &s = it->second;
+  // the server closes a connection idle too long, one with a long poll held is not idle
+  const uint32_t *idle = s.endpoint->idleCloseMs;
+  bool closed = idle && *idle && sim::world().now - s.activeAt >= *idle && sim::world().telegramPoll.socket != id;
+  closed = closed || (s.closed && s.rx.empty());
+  if (s.link != sim::linkGeneration() || !*s.endpoint->available || closed) {
+    sim::world().sockets.erase(it);
+    return nullptr;
+  }
+  return &s;
+}
+
+uint8_t WiFiClient::connected() {
+  if (!_socket) return 0;
+  if (!sim::openSocket(_socket)) {
+    _socket = 0;
+    return 0;
+  }
+  return 1;
+}
+
+void WiFiClient::stop() {
+  if (_socket) sim::world().sockets.erase(_socket);
+  _socket = 0;
+}
+
+// The broker answers an MQTT CONNECT with CONNACK after the scripted delay,
+// the Telegram API answers a complete HTTP request
+size_t WiFiClient::write(const uint8_t *buf, size_t size) {
+  sim::Socket *s = sim::openSocket(_socket);
+  if (!s) return 0;
+  if (s->endpoint->ip == sim::kMqttIp && size && (buf[0] & 0xF0) == 0x10) {
+    uint32_t id = _socket;
+    sim::after(sim::script().mqttConnackMs, [id]() {
+      sim::Socket *s = sim::openSocket(id);
+      if (s) s->rx.append("\x20\x02\x00\x00", 4);
+    });
+  }
+  if (s->endpoint->ip == sim::kTelegramIp) {
+    s->activeAt = sim::world().now;
+    s->tx.append((const char *)buf, size);
+    size_t end;
+    while ((end = s->tx.find("\r\n\r\n")) != std::string::npos) {
+      // the body of a POST follows the header, Content-Length long
+      size_t length = end + 4;
+      size_t at = s->tx.find("Content-Length: ");
+      if (at != std::string::npos && at < end) length += strtoul(s->tx.c_str() + at + 16, nullptr, 10);
+      if (s->tx.size() < length) break;
+      std::string request = s->tx.substr(0, length);
+      s->tx.erase(0, length);
+      // after the response with Connection: close, pipelined requests go unanswered
+      if (s->closing) continue;
+      uint32_t limit = sim::script().telegramKeepAliveRequests;
+      if (limit && ++s->requests >= limit) s->closing = true;
+      sim::telegramRequest(_socket, request);
+    }
+  }
+  return size;
+}
+
+int WiFiClient::available() {
+  sim::Socket *s = sim::openSocket(_socket);
+  return s ? (int)s->rx.size() : 0;
+}
+
+int WiFiClient::read() {
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+int WiFiClient::read(uint8_t *buf, size_t size) {
+  sim::Socket *s = sim::openSocket(_socket);
+  if (!s || s->rx.empty()) return -1;
+  size_t n = std::min(size, s->rx.size());
+  memcpy(buf, s->rx.data(), n);
+  s->rx.erase(0, n);
+  return (int)n;
+}
+
+int WiFiClient::peek() {
+  sim::Socket *s = sim::openSocket(_socket);
+  return s && !s->rx.empty() ? (uint8_t)s->rx[0] : -1;
+}
@@ -0,0 +1,113 @@
+// Heap fragmentation soak test of the messaging path
+//
+// A device runs for many simulated hours with the library's steady workload:
+// a formatted Telegram message every minute, an MQTT publish (qos 1, through
+// the outbox) every 10 s and a WiFi drop every 3 hours. loop() is called every 10 virtual ms. Free heap
+// and the largest free block are sampled every hour from the simulated heap
+// (sim/heap.cpp) and must not drift once the first hour has warmed it up.
+//
+// Usage: heap_soak [--hours n]
+// Exits non-zero on drift, on a failed allocation or on undelivered messages;
+// the MQTT messages queued during the drops must all reach the broker.
+
+#include <sim.h>
+#include <wifimessaging.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+const uint32_t kStepMs = 10;
+const uint32_t kHourMs = 3600000;
+const uint32_t kMessageEveryMs = 60000;
+const uint32_t kPublishEveryMs = 10000;
+const uint32_t kDropEveryMs = 3 * kHourMs;
+const uint32_t kDropForMs = 20000;
+/// tolerated change of the free heap against the warm sample, in bytes
+const uint32_t kFreeSlack = 64;
+
+void mqttCallback(char *, uint8_t *, unsigned int) {}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  uint32_t hours = 24;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--hours") && i + 1 < argc) {
+      hours = atol(argv[++i]);
+    } else {
+      fprintf(stderr, "usage: %s [--hours n]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  sim::reset();
+  WifiMessaging wm("sim-ssid", "sim-password");
+  wm.SetMQTT(sim::kMqttHost, 1883, mqttCallback);
+  wm.SetTelegram("123456:SIMULATED", "42");
+  wm.connectToWiFi();
+
+  uint32_t queued = 0, published = 0;
+  uint32_t nextMessage = kMessageEveryMs, nextPublish = kPublishEveryMs, nextDrop = kDropEveryMs;
+  sim::HeapStats warm{};
+  int failures = 0;
+
+  printf("%5s %8s %9s %5s %8s %8s\n", "hour", "free", "max blk", "frag", "allocs", "telegram");
+  for (uint32_t hour = 1; hour <= hours; hour++) {
+    uint64_t end = (uint64_t)hour * kHourMs;
+    while (sim::worldMs() < end) {
+      uint32_t now = sim::worldMs();
+      if (now >= nextMessage) {
+        nextMessage += kMessageEveryMs;
+        if (wm.queueMessagef("soak %u: free %u, rssi %d", queued, ESP.getFreeHeap(), (int)WiFi.RSSI())) queued++;
+      }
+      if (now >= nextPublish) {
+        nextPublish += kPublishEveryMs;
+        char payload[24];
+        snprintf(payload, sizeof(payload), "%u", published);
+        if (wm.publish("soak/counter", payload, false, 1)) published++;
+      }
+      if (now >= nextDrop) {
+        nextDrop += kDropEveryMs;
+        sim::dropWiFi(8);
+        sim::after(kDropForMs, sim::restoreWiFi);
+      }
+      wm.loop();
+      sim::advance(kStepMs);
+    }
+
+    // sample between messages, with the connections up and idle
+    sim::HeapStats h = sim::heap();
+    printf("%5u %8u %9u %4u%% %8u %8zu\n", hour, h.free, h.maxBlock, h.fragmentation, h.allocations,
+           sim::telegramSent().size());
+    if (hour == 1) {
+      warm = h;
+      continue;
+    }
+    if (h.maxBlock < warm.maxBlock) {
+      fprintf(stderr, "hour %u: largest free block shrank from %u to %u\n", hour, warm.maxBlock, h.maxBlock);
+      failures++;
+    }
+    if (h.free + kFreeSlack < warm.free) {
+      fprintf(stderr, "hour %u: free heap dropped from %u to %u\n", hour, warm.free, h.free);
+      failures++;
+    }
+  }
+
+  if (sim::heap().failures) {
+    fprintf(stderr, "%u allocations failed\n", sim::heap().failures);
+    failures++;
+  }
+  if (sim::telegramSent().size() + WIFIMESSAGING_TELEGRAM_OUTBOX_SIZE < queued) {
+    fprintf(stderr, "%zu of %u messages delivered\n", sim::telegramSent().size(), queued);
+    failures++;
+  }
+  if (sim::mqttPublished().size() + wm.pendingPublishes() != published) {
+    fprintf(stderr, "%zu of %u MQTT messages reached the broker\n", sim::mqttPublished().size(), published);
+    failures++;
+  }
+  printf("queued %u, delivered %zu, published %u\n", queued, sim::telegramSent().size(), published);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,7 @@
+#!/bin/sh -eux
+
+mkdir -p $PWD/build-host
+cd $PWD/build-host
+cmake ../extras/host
+cmake --build .
+ctest --output-on-failure
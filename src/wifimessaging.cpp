@@ -1,10 +1,31 @@
 #include "wifimessaging.h"
 
+#include <sys/time.h>
+#ifdef ESP8266
+#include <coredecls.h>  // settimeofday_cb()
+#elif ESP32
+#include <esp_sntp.h>   // sntp_set_time_sync_notification_cb()
+#include <lwip/dns.h>
+#include <lwip/priv/tcpip_priv.h>  // tcpip_api_call()
+#endif
+#if WIFIMESSAGING_ENABLE_MQTT
+#ifdef ESP8266
+#include <lwip/tcp.h>
+#include <include/ClientContext.h>  // WiFiClient of a connection lwIP established
+#elif ESP32
+#include <lwip/sockets.h>
+#endif
+#endif
+
 // TIME
 #define TIME_NTPSERVER_1 "nl.pool.ntp.org"
 #define TIME_NTPSERVER_2 "pool.ntp.org"
 #define TIME_ENV_TZ "CET-1CEST,M3.5.0,M10.5.0/3"
 
+// TELEGRAM
+#define TELEGRAM_HOST "api.telegram.org"
+#define TELEGRAM_SSL_PORT 443
+
 // ****************************************************************************
 // **                          Constructors                                  **
 // ****************************************************************************
@@ -21,18 +42,23 @@ WifiMessaging* WifiMessaging::_wifimessaging = nullptr;
  * @param wifi_ssid 
  * @param wifi_password 
  */
-WifiMessaging::WifiMessaging(const char *wifi_ssid, const char *wifi_password)
-    : wifi_ssid(wifi_ssid), wifi_password(wifi_password) {
+WifiMessaging::WifiMessaging(const char *wifi_ssid, const char *wifi_password) {
 
   _wifimessaging = this;
-#ifdef ESP8266
-  cert = CERTIFICATE_ROOT;  // Initialize cert in the constructor body
-#endif
+  wifiCandidates[0] = {wifi_ssid, wifi_password};
   // Force NTP and WiFi as minimal services
-  AddConnectionService(WifiMessaging::connectionService::ServiceNTP);
+  AddConnectionService<ServiceNTP>();
 
   // Initialise WiFi: WiFi off and events set
+  RestoreDutyCycle();
   InitialiseWiFi();
+
+  // NTP is active on the SNTP sync, not on polling the clock
+#ifdef ESP8266
+  settimeofday_cb(std::bind(&WifiMessaging::onTimeSet, this, std::placeholders::_1));
+#elif ESP32
+  sntp_set_time_sync_notification_cb(time_sync_static);
+#endif
 }
 
 /***
@@ -51,15 +77,16 @@ WifiMessaging &WifiMessaging::instance() {
  * 
  */
 void WifiMessaging::InitialiseWiFi() {
-  DEBUG_WIFIMESSAGING_PRINTF("Initalising WiFi");
+  WIFIMESSAGING_LOGD("Initalising WiFi");
 #ifdef ESP8266
 
-  if (WiFi.getMode() != WIFI_OFF) {
+  // the wake of a duty cycle connects at once or sleeps again, switching the radio off first is wasted
+  if (!dutyData.woke && WiFi.getMode() != WIFI_OFF) {
     // 2021-06-20 shutdown function changed, bodge change applied
     WiFi.mode(WIFI_OFF);
     // Set WiFi Off
     if (WiFi.getMode() != WIFI_OFF) {
-      DEBUG_WIFIMESSAGING_PRINTF("WIFI not OFF after shutdown\n");
+      WIFIMESSAGING_LOGW("WIFI not OFF after shutdown");
       WiFi.persistent(true);
       WiFi.setAutoConnect(false);    // do not automatically connect on power on
                                      // to the last used access point
@@ -90,7 +117,7 @@ void WifiMessaging::InitialiseWiFi() {
 
 #endif
 
-  DEBUG_WIFIMESSAGING_PRINTF("Initialised WiFi ...\n");
+  WIFIMESSAGING_LOGD("Initialised WiFi ...");
 }
 
 // EVENTS
@@ -98,30 +125,45 @@ void WifiMessaging::InitialiseWiFi() {
 #ifdef ESP8266
 
 void WifiMessaging::onSTAConnected(const WiFiEventStationModeConnected &e /*String ssid, uint8 bssid[6], uint8 channel*/) {
-  DEBUG_WIFIMESSAGING_PRINTF(
+  WIFIMESSAGING_LOGI(
       "WiFi Connected: SSID %s @ BSSID %.2X:%.2X:%.2X:%.2X:%.2X:%.2X Channel "
-      "%d\n",
+      "%d",
       e.ssid.c_str(), e.bssid[0], e.bssid[1], e.bssid[2], e.bssid[3],
       e.bssid[4], e.bssid[5], e.channel);
+  memcpy(wifiCache.bssid, e.bssid, sizeof(wifiCache.bssid));
+  wifiCache.channel = e.channel;
+  wifiAssociatedAt = millis();
+  if (StatusWiFi == ConnectionInBetween)
+    metricsData.phases[PhaseWiFiAssociate].record(wifiAssociatedAt - wifiConnectStart);
 }
 
 void WifiMessaging::onSTADisconnected(const WiFiEventStationModeDisconnected &e /*String ssid, uint8 bssid[6], WiFiDisconnectReason reason*/) {
   // Reason:
   // https://github.com/esp8266/Arduino/blob/master/libraries/ESP8266WiFi/src/ESP8266WiFiType.h
-  DEBUG_WIFIMESSAGING_PRINTF(
+  WIFIMESSAGING_LOGI(
       "WiFi Disconnected: SSID %s BSSID %.2X:%.2X:%.2X:%.2X:%.2X:%.2X Reason "
-      "%d\n",
+      "%d",
       e.ssid.c_str(), e.bssid[0], e.bssid[1], e.bssid[2], e.bssid[3],
       e.bssid[4], e.bssid[5], e.reason);
-  StatusWiFi = ConnectionInactive;
+  // leaving the old access point of a roam
+  if (wifiRoaming && e.reason == WIFI_DISCONNECT_REASON_ASSOC_LEAVE) return;
+  if (wifiPath > WiFiPathFull && StatusWiFi == ConnectionInBetween) wifiFastFailed = true;
+  PostServiceEvent(ServiceWifi, false, e.reason);
 }
 
 void WifiMessaging::onSTAGotIP(const WiFiEventStationModeGotIP &e /*IPAddress ip, IPAddress mask, IPAddress gw*/) {
-  DEBUG_WIFIMESSAGING_PRINTF(
-      "WiFi GotIP: localIP %s SubnetMask %s GatewayIP %s\n",
+  WIFIMESSAGING_LOGI(
+      "WiFi GotIP: localIP %s SubnetMask %s GatewayIP %s",
       e.ip.toString().c_str(), e.mask.toString().c_str(),
       e.gw.toString().c_str());
-  StatusWiFi = ConnectionActiveNew;
+  wifiCache.ip = e.ip;
+  wifiCache.mask = e.mask;
+  wifiCache.gw = e.gw;
+  if (StatusWiFi == ConnectionInBetween) metricsData.phases[PhaseWiFiIp].record(millis() - wifiAssociatedAt);
+  wifiRoaming = false;
+  wifiScanEntry = -1;
+  SaveWiFiCache();
+  PostServiceEvent(ServiceWifi, true);
 }
 
 #elif ESP32
@@ -129,28 +171,45 @@ void WifiMessaging::onSTAGotIP(const WiFiEventStationModeGotIP &e /*IPAddress ip
 // https://github.com/espressif/arduino-esp32/blob/master/tools/sdk/esp32s2/include/esp_event/include/esp_event_legacy.h
 void WifiMessaging::wifi_event_handler_static(WiFiEvent_t event, WiFiEventInfo_t info)
 {
-  DEBUG_WIFIMESSAGING_PRINTF("[WiFi-event] event: %d\n", event);
+  WIFIMESSAGING_LOG_COMPACT(WIFIMESSAGING_LOG_DEBUG, "[WiFi-event] event: %d", event);
 
     switch (event) {
         case ARDUINO_EVENT_WIFI_READY: // 0
-            Serial.println("WiFi interface ready");
+            WIFIMESSAGING_LOGD("WiFi interface ready");
             break;
         case ARDUINO_EVENT_WIFI_STA_START: // 2
-            Serial.println("WiFi client started");
+            WIFIMESSAGING_LOGD("WiFi client started");
             break;
         case ARDUINO_EVENT_WIFI_STA_CONNECTED: // 4
-            WifiMessaging::instance().onSTAConnected(event, info);
-            break;
         case ARDUINO_EVENT_WIFI_STA_DISCONNECTED: // 5
-            WifiMessaging::instance().onSTADisconnected(event, info);
-            break;
         case ARDUINO_EVENT_WIFI_STA_GOT_IP: // 7
-            WifiMessaging::instance().onSTAGotIP(event,info);
+            // handled in loop(), the event task does not touch the members
+            if (!WifiMessaging::instance().wifiEvents.push({event, info}))
+                WifiMessaging::instance().serviceEventsLost = true;
             break;
         default: break;
     }
 }
 
+void WifiMessaging::DispatchWiFiEvents() {
+  WiFiEventRecord record;
+  while (wifiEvents.pop(record)) {
+    switch (record.event) {
+      case ARDUINO_EVENT_WIFI_STA_CONNECTED:
+        onSTAConnected(record.event, record.info);
+        break;
+      case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+        onSTADisconnected(record.event, record.info);
+        break;
+      case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+        onSTAGotIP(record.event, record.info);
+        break;
+      default:
+        break;
+    }
+  }
+}
+
 void WifiMessaging::onSTAConnected(WiFiEvent_t event, WiFiEventInfo_t info) {
   /* 
     uint8_t ssid[32];           // SSID of connected AP
@@ -161,12 +220,17 @@ void WifiMessaging::onSTAConnected(WiFiEvent_t event, WiFiEventInfo_t info) {
   */
   wifi_event_sta_connected_t e = info.wifi_sta_connected;
 
-  DEBUG_WIFIMESSAGING_PRINTF(
-      "WiFi Connected: SSID %.*s @ BSSID %.2X:%.2X:%.2X:%.2X:%.2X:%.2X Channel %d\n",
+  WIFIMESSAGING_LOGI(
+      "WiFi Connected: SSID %.*s @ BSSID %.2X:%.2X:%.2X:%.2X:%.2X:%.2X Channel %d",
       e.ssid_len, e.ssid, 
       e.bssid[0], e.bssid[1], e.bssid[2], e.bssid[3], e.bssid[4], e.bssid[5], 
       e.channel
   );
+  memcpy(wifiCache.bssid, e.bssid, sizeof(wifiCache.bssid));
+  wifiCache.channel = e.channel;
+  wifiAssociatedAt = millis();
+  if (StatusWiFi == ConnectionInBetween)
+    metricsData.phases[PhaseWiFiAssociate].record(wifiAssociatedAt - wifiConnectStart);
 }
 
 void WifiMessaging::onSTADisconnected(WiFiEvent_t event, WiFiEventInfo_t info) {
@@ -179,14 +243,17 @@ void WifiMessaging::onSTADisconnected(WiFiEvent_t event, WiFiEventInfo_t info) {
   */
   wifi_event_sta_disconnected_t e = info.wifi_sta_disconnected;
 
-  DEBUG_WIFIMESSAGING_PRINTF(
-      "WiFi Disconnected: SSID %.*s BSSID %.2X:%.2X:%.2X:%.2X:%.2X:%.2X Reason %d\n",
+  WIFIMESSAGING_LOGI(
+      "WiFi Disconnected: SSID %.*s BSSID %.2X:%.2X:%.2X:%.2X:%.2X:%.2X Reason %d",
       e.ssid_len, e.ssid,
       e.bssid[0], e.bssid[1], e.bssid[2], e.bssid[3], e.bssid[4], e.bssid[5],
       e.reason
   );
-  
-  StatusWiFi = ConnectionInactive;
+
+  // leaving the old access point of a roam
+  if (wifiRoaming && e.reason == WIFI_REASON_ASSOC_LEAVE) return;
+  if (wifiPath > WiFiPathFull && StatusWiFi == ConnectionInBetween) wifiFastFailed = true;
+  PostServiceEvent(ServiceWifi, false, e.reason);
 
 }
 
@@ -203,26 +270,35 @@ void WifiMessaging::onSTAGotIP(WiFiEvent_t event, WiFiEventInfo_t info) {
   uint32_t nm = e.ip_info.netmask.addr;
   uint32_t gw = e.ip_info.gw.addr;
 
-  DEBUG_WIFIMESSAGING_PRINTF(
-      "WiFi GotIP: localIP %d.%d.%d.%d SubnetMask %d.%d.%d.%d GatewayIP %d.%d.%d.%d\n",
+  WIFIMESSAGING_LOGI(
+      "WiFi GotIP: localIP %d.%d.%d.%d SubnetMask %d.%d.%d.%d GatewayIP %d.%d.%d.%d",
       (ip >> 24) & 0xFF, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF, 
       (nm >> 24) & 0xFF, (nm >> 16) & 0xFF, (nm >> 8) & 0xFF, nm & 0xFF, 
       (gw >> 24) & 0xFF, (gw >> 16) & 0xFF, (gw >> 8) & 0xFF, gw & 0xFF
   );
   
-  StatusWiFi = ConnectionActiveNew;
+  wifiCache.ip = ip;
+  wifiCache.mask = nm;
+  wifiCache.gw = gw;
+  if (StatusWiFi == ConnectionInBetween) metricsData.phases[PhaseWiFiIp].record(millis() - wifiAssociatedAt);
+  wifiRoaming = false;
+  wifiScanEntry = -1;
+  SaveWiFiCache();
+  PostServiceEvent(ServiceWifi, true);
 
 }
 
 #endif
 
+#if WIFIMESSAGING_ENABLE_MQTT
+
 // ****************************************************************************
 // **                          MQTT                                          **
 // ****************************************************************************
 
 void WifiMessaging::SetMQTT(const char *mqtt_host, uint16_t mqqt_port,
                             MQTT_CALLBACK_SIGNATURE) {
-  AddConnectionService(WifiMessaging::connectionService::ServiceMQTT);
+  AddConnectionService<ServiceMQTT>();
   this->mqqt_hostdomain = mqtt_host;
   this->mqtt_hostip = IPAddress(0, 0, 0, 0);
   this->mqqt_port = mqqt_port;
@@ -231,13 +307,22 @@ void WifiMessaging::SetMQTT(const char *mqtt_host, uint16_t mqqt_port,
 
 void WifiMessaging::SetMQTT(IPAddress mqtt_hostip, uint16_t mqqt_port,
                             MQTT_CALLBACK_SIGNATURE) {
-  AddConnectionService(WifiMessaging::connectionService::ServiceMQTT);
+  AddConnectionService<ServiceMQTT>();
   this->mqqt_hostdomain = nullptr;
   this->mqtt_hostip = mqtt_hostip;
   this->mqqt_port = mqqt_port;
   InitialiseMQTT(callback);
 }
 
+void WifiMessaging::SetMqttKeepAlive(uint16_t keepalive_s) {
+  mqttKeepAlive = keepalive_s;
+  mqttClient.setKeepAlive(keepalive_s);
+}
+
+#endif
+
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+
 // ****************************************************************************
 // **                          TELEGRAM                                      **
 // ****************************************************************************
@@ -245,113 +330,646 @@ void WifiMessaging::SetMQTT(IPAddress mqtt_hostip, uint16_t mqqt_port,
 //    bot(TELEGRAM_BOT, secureClient)
 void WifiMessaging::SetTelegram(const char *telegram_bot,
                                 const char *telegram_chat_id) {
-  AddConnectionService(WifiMessaging::connectionService::ServiceTelegram);
+  AddConnectionService<ServiceTelegram>();
   this->telegram_bot = telegram_bot;
-  this->telegram_chat_id = telegram_chat_id;
-  this->bot = new UniversalTelegramBot(telegram_bot, this->secureClient);
+  telegramChats[0].id = telegram_chat_id;
+  if (telegramChatCount == 0) telegramChatCount = 1;
 }
 
+#endif
+
 // ****************************************************************************
 // **                          LOOP                                          **
 // ****************************************************************************
 
 void WifiMessaging::loop() {
-  // New WiFi
-  if (StatusWiFi == ConnectionActiveNew) {
-    StatusWiFi = ConnectionActive;
-    if ((connectionServices & ServiceMQTT) && (StatusMQTT < ConnectionActive))
-      ConnectToMqtt();
-    if ((connectionServices & ServiceNTP) && (StatusNTP < ConnectionActive))
-      InitialiseNTP();
+#if WIFIMESSAGING_NETWORK_TASK
+  if (networkDetached) {
+    DeliverIncoming();
+    return;
+  }
+#endif
+  NetworkLoop();
+}
+
+void WifiMessaging::NetworkLoop() {
+  if (dutyAsleep) return;
+  uint32_t loopStart = micros();
+
+  // log records of the previous loop() and of callbacks, as far as the output takes them
+  WifiMessagingLog::drain();
+
+#if WIFIMESSAGING_NETWORK_TASK
+  // messages the sketch queued since
+  if (networkDetached) TakeCrossings();
+#endif
+
+#ifdef ESP32
+  // WiFi and SNTP events of other tasks
+  DispatchWiFiEvents();
+  if (ntpSynced.exchange(false)) onTimeSet(true);
+#endif
+
+#if WIFIMESSAGING_ENABLE_MQTT
+  // MQTT connect in progress
+  if (mqttStep != MqttIdle) StepConnectToMqtt();
+
+  // MQTT keep-alive and incoming messages. After detachNetwork() an incoming
+  // message waits in the connection while loop() of the sketch has not taken
+  // the previous ones.
+#if WIFIMESSAGING_NETWORK_TASK
+  bool incomingRoom = !networkDetached || mqttIncoming.size() < WIFIMESSAGING_CROSSING_SIZE;
+#else
+  const bool incomingRoom = true;
+#endif
+  if (StatusMQTT == ConnectionActive && incomingRoom) mqttClient.loop();
+
+  // MQTT connection lost
+  if (StatusMQTT == ConnectionActive && !mqttClient.connected()) PostServiceEvent(ServiceMQTT, false);
+
+  // MQTT outbox, a batch per call, filled up from the spool behind what it holds
+#if WIFIMESSAGING_SPOOL
+  if (StatusMQTT == ConnectionActive && mqttSpool.unread() && !mqttOutbox.full()) ReplayMqttSpool();
+#endif
+  if (StatusMQTT == ConnectionActive && !mqttOutbox.empty()) FlushMqttOutbox();
+#endif
+
+  // Services that came up or went down
+  bool dispatched = !serviceEvents.empty() || serviceEventsLost;
+  if (dispatched) DispatchServiceEvents();
+
+  // Reconnect delay passed
+  if (reconnectWaiting && (int32_t)(millis() - reconnectAt) >= 0) ReconcileServices();
+
+  // Duty cycle delivered or out of time
+  if (dutySleepS) {
+    StepDutyCycle();
+    if (dutyAsleep) return;
+  }
+
+  // WiFi connect to a known access point failed or timed out
+  if (wifiPath > WiFiPathFull &&
+      (wifiFastFailed || (StatusWiFi == ConnectionInBetween &&
+                          millis() - wifiConnectStart > WIFIMESSAGING_WIFI_FAST_TIMEOUT_MS))) {
+    WIFIMESSAGING_LOG_COMPACT(WIFIMESSAGING_LOG_INFO, "WiFi connect via path %u failed, scanning", wifiPath);
+    if (wifiPath == WiFiPathFast) {
+      WifiMessagingRtc::erase(WIFIMESSAGING_RTC_WIFI);
+      // nor is the cached access point taken from the scan cache
+      for (uint8_t i = 0; i < wifiScanCount; i++)
+        if (!memcmp(wifiScan[i].bssid, wifiCache.bssid, sizeof(wifiCache.bssid))) wifiScan[i].failed = true;
+    }
+    ConnectToWiFiFull();
+  }
+
+  // Weak WiFi link, look for a stronger access point
+  if (wifiRoamRssi && StatusWiFi == ConnectionActive && wifiScanning == ScanIdle &&
+      (int32_t)(millis() - wifiRoamCheckAt) >= 0)
+    CheckWiFiRoaming();
+
+  // WiFi scan in the background
+  if (wifiScanning != ScanIdle) StepWiFiScan();
+
+  // DNS lookups and TLS setup ahead of the connects, the TLS setup not in the call that brought services up
+  if (prefetchPending && StatusWiFi == ConnectionActive) StepPrefetch(!dispatched);
+
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+#if WIFIMESSAGING_SPOOL
+  if (StatusTelegram == ConnectionActive && telegramSpool.unread() && !telegramOutbox.full())
+    ReplayTelegramSpool();
+#endif
+
+  // Telegram outbox, one message per call as the rate limits allow, pipelined behind those in flight, and
+  // command polls and probes on their own. A new connection blocks, not in the call that brought services up.
+  if (StatusTelegram == ConnectionActive && (secureClient.connected() || (!dispatched && !HoldsTelegramConnect()))) {
+    if (telegramRequesting != TelegramIdle) StepTelegramRequest();
+    if (telegramRequesting == TelegramIdle || telegramRequesting == TelegramSending) {
+      bool sent = !telegramOutbox.empty() && SendFromOutbox();
+      if (!sent && telegramRequesting == TelegramIdle) {
+        if (telegramCommandCount && (int32_t)(millis() - telegramPollAt) >= 0)
+          StartTelegramPoll();
+        else
+          KeepTelegramAlive();
+      }
+    }
+  }
+#endif
+
+#if WIFIMESSAGING_SPOOL
+  // messages out of the outboxes in this call off the spools
+  AckSpools();
+#endif
+
+  // Metrics
+  if ((int32_t)(millis() - metricsHeapAt) >= 0) SampleHeap();
+#if WIFIMESSAGING_ENABLE_MQTT
+  if (metricsTopic && StatusMQTT == ConnectionActive && (int32_t)(millis() - metricsPublishAt) >= 0)
+    PublishMetrics();
+#endif
+#if WIFIMESSAGING_NETWORK_TASK
+  if (networkDetached) ShareCounts();
+#endif
+  metricsData.phases[PhaseLoop].record(micros() - loopStart);
+}
+
+#if WIFIMESSAGING_NETWORK_TASK
+
+// ********************  NETWORK TASK  ********************
+
+void WifiMessaging::detachNetwork() {
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  for (std::atomic<uint32_t> &status : telegramStatusShared) status = 0;
+  for (size_t i = 0; i < telegramOutbox.size(); i++) ShareMessageStatus(telegramOutbox.at(i));
+#endif
+  ShareCounts();
+  networkDetached = true;
+}
+
+void WifiMessaging::runNetwork() { NetworkLoop(); }
+
+#ifdef ESP32
+bool WifiMessaging::beginNetworkTask(uint8_t core) {
+  detachNetwork();
+  if (xTaskCreatePinnedToCore(NetworkTask, "wifimessaging", WIFIMESSAGING_NETWORK_TASK_STACK, this,
+                              WIFIMESSAGING_NETWORK_TASK_PRIORITY, &networkTask, core) == pdPASS)
+    return true;
+  WIFIMESSAGING_LOGE("Network task not created");
+  networkDetached = false;
+  return false;
+}
+
+void WifiMessaging::NetworkTask(void *self) {
+  for (;;) {
+    static_cast<WifiMessaging *>(self)->runNetwork();
+    vTaskDelay(1);
+  }
+}
+#endif
+
+void WifiMessaging::TakeCrossings() {
+  // The shared count includes a message before it leaves its queue, so the
+  // sketch never sees it in neither place
+#if WIFIMESSAGING_ENABLE_MQTT
+  MqttOutboxEntry *message;
+  while ((message = mqttOutgoing.front()) != nullptr) {
+#if WIFIMESSAGING_SPOOL
+    if (MqttToSpool()) {
+      if (!SpoolMqttMessage(message->topic, message->payload, message->length, message->retained, message->qos)) {
+        WIFIMESSAGING_LOGW("MQTT spool full, %s dropped", message->topic);
+        mqttDropped++;
+      }
+      mqttOutboxShared = QueuedPublishes();
+      mqttOutgoing.pop();
+      continue;
+    }
+#endif
+    if (mqttOutbox.full()) {
+      // the queue holds the message until the outbox has room, then publish() refuses
+      if (mqttOverflowPolicy == MqttDropNewest) break;
+      WIFIMESSAGING_LOGW("MQTT outbox full, %s dropped", mqttOutbox.front().topic);
+      mqttDropped++;
+      PopMqttOutbox();
+    }
+    *mqttOutbox.push() = *message;
+    mqttOutboxShared = QueuedPublishes();
+    mqttOutgoing.pop();
+  }
+#endif
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  TelegramOutboxEntry *entry;
+  while ((entry = telegramOutgoing.front()) != nullptr) {
+#if WIFIMESSAGING_SPOOL
+    if (TelegramToSpool()) {
+      // no status while in the spool
+      if (!SpoolTelegramMessage(*entry)) WIFIMESSAGING_LOGW("Telegram spool full");
+      uint32_t queued = (uint32_t)entry->ticket << 8 | DeliveryQueued;
+      telegramStatusShared[entry->ticket % (sizeof(telegramStatusShared) / sizeof(telegramStatusShared[0]))]
+          .compare_exchange_strong(queued, 0);
+      telegramPendingShared = PendingInOutbox();
+      telegramOutgoing.pop();
+      continue;
+    }
+#endif
+    if (telegramOutbox.full()) break;
+    *telegramOutbox.push() = *entry;
+    telegramPendingShared = PendingInOutbox();
+    telegramOutgoing.pop();
+  }
+#endif
+}
+
+void WifiMessaging::ShareCounts() {
+#if WIFIMESSAGING_ENABLE_MQTT
+  mqttOutboxShared = QueuedPublishes();
+#endif
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  telegramPendingShared = PendingInOutbox();
+#endif
+}
+
+void WifiMessaging::DeliverIncoming() {
+#if WIFIMESSAGING_ENABLE_MQTT
+  MqttOutboxEntry message;
+  while (mqttIncoming.pop(message)) DispatchMqttMessage(message.topic, message.payload, message.length);
+#endif
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  TelegramCommandText command;
+  while (telegramIncoming.pop(command)) DispatchTelegramCommand(command.text);
+#endif
+}
+
+#endif
+
+// ********************  SERVICES  ********************
+
+/**
+ * @brief Dependency graph of the compiled services, needs from ServiceNeeds()
+ *
+ * A service is listed after the services it needs.
+ */
+const WifiMessaging::ServiceNode WifiMessaging::services[] = {
+    {ServiceWifi, ServiceNeeds(ServiceWifi), &WifiMessaging::StatusWiFi, &WifiMessaging::ReconnectToWiFi, nullptr,
+     &WifiMessaging::wifiReconnect, WIFIMESSAGING_WIFI_BACKOFF_MIN_MS, WIFIMESSAGING_WIFI_BACKOFF_MAX_MS},
+    {ServiceNTP, ServiceNeeds(ServiceNTP), &WifiMessaging::StatusNTP, &WifiMessaging::InitialiseNTP,
+     &WifiMessaging::StopNTP, nullptr, 0, 0},
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+    {ServiceSecure, ServiceNeeds(ServiceSecure), &WifiMessaging::StatusSecure, &WifiMessaging::InitialiseSecure,
+     &WifiMessaging::StopSecure, nullptr, 0, 0},
+#endif
+#if WIFIMESSAGING_ENABLE_MQTT
+    {ServiceMQTT, ServiceNeeds(ServiceMQTT), &WifiMessaging::StatusMQTT, &WifiMessaging::ConnectToMqtt,
+     &WifiMessaging::StopMQTT, &WifiMessaging::mqttReconnect, WIFIMESSAGING_MQTT_BACKOFF_MIN_MS,
+     WIFIMESSAGING_MQTT_BACKOFF_MAX_MS},
+#endif
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+    {ServiceTelegram, ServiceNeeds(ServiceTelegram), &WifiMessaging::StatusTelegram,
+     &WifiMessaging::InitialiseTelegram, &WifiMessaging::StopTelegram, nullptr, 0, 0},
+#endif
+};
+
+#define SERVICE_COUNT (sizeof(WifiMessaging::services) / sizeof(WifiMessaging::services[0]))
+
+void WifiMessaging::PostServiceEvent(connectionService service, bool up, uint8_t reason) {
+  if (!serviceEvents.push({service, up, reason})) serviceEventsLost = true;
+}
+
+void WifiMessaging::DispatchServiceEvents() {
+  if (serviceEventsLost) {
+    // WiFi events were dropped, take the state from the station
+    serviceEventsLost = false;
+    WIFIMESSAGING_LOGE("Service events lost");
+    if (WiFi.status() == WL_CONNECTED)
+      StatusWiFi = ConnectionActive;
+    else if (StatusWiFi == ConnectionActive)
+      StatusWiFi = ConnectionInactive;
   }
 
-  // New NTP
-  if (StatusNTP == ConnectionActiveNew) {
-    StatusNTP = ConnectionActive;
-    if ((connectionServices & ServiceSecure) &&
-        (StatusSecure < ConnectionActive)) {
-      InitialiseSecure();
+  ServiceEvent event;
+  while (serviceEvents.pop(event)) {
+    for (const ServiceNode &node : services) {
+      if (node.service != event.service) continue;
+      WIFIMESSAGING_LOGD("Service %u %s", node.service, event.up ? "up" : "down");
+      if (node.reconnect) {
+        ReconnectState &state = this->*node.reconnect;
+        if (event.up) {
+          state.waiting = false;
+          if (this->*node.status != ConnectionActive) {
+            state.stats.successes++;
+            state.backoffMs = 0;
+            if (state.offline) state.stats.offlineMs += millis() - state.offlineSince;
+            state.offline = false;
+          }
+        } else if (!event.up && this->*node.status != ConnectionInactive &&
+                   (node.service != ServiceWifi || wifiWanted)) {
+          ReconnectLater(node, this->*node.status == ConnectionInBetween, event.reason);
+        }
+      }
+      this->*node.status = event.up ? ConnectionActive : ConnectionInactive;
     }
+    if (event.service == ServiceWifi && event.up) StartPrefetch();
+    ReconcileServices();
+  }
+}
+
+void WifiMessaging::ReconcileServices() {
+  // Services that lost something they need
+  uint16_t active = 0;
+  uint16_t lost = 0;
+  for (const ServiceNode &node : services) {
+    if (this->*node.status == ConnectionInactive) continue;
+    if ((node.needs & active) != node.needs)
+      lost |= node.service;
+    else if (this->*node.status == ConnectionActive)
+      active |= node.service;
+  }
+
+  // Stop them, dependents first
+  for (size_t i = SERVICE_COUNT; i-- > 0;) {
+    const ServiceNode &node = services[i];
+    if (!(lost & node.service)) continue;
+    if (node.reconnect && this->*node.status == ConnectionActive) {
+      // back as soon as its needs are
+      ReconnectState &state = this->*node.reconnect;
+      state.stats.drops++;
+      state.offline = true;
+      state.offlineSince = millis();
+    }
+    if (node.stop) (this->*node.stop)();
+    this->*node.status = ConnectionInactive;
   }
 
-  // New Secure
-  if (StatusSecure == ConnectionActiveNew) {
-    StatusSecure = ConnectionActive;
-    if ((connectionServices & ServiceTelegram) &&
-        (StatusTelegram < ConnectionActive)) {
-      InitialiseTelegram();
+  // Start intended services whose needs are active, once their reconnect delay passed
+  reconnectWaiting = false;
+  for (const ServiceNode &node : services) {
+    if (!(connectionServices & node.service) || this->*node.status != ConnectionInactive) continue;
+    if (!node.start || (node.needs & active) != node.needs) continue;
+    if (node.reconnect && (this->*node.reconnect).waiting) {
+      ReconnectState &state = this->*node.reconnect;
+      if ((int32_t)(millis() - state.retryAt) < 0) {
+        if (!reconnectWaiting || (int32_t)(state.retryAt - reconnectAt) < 0) reconnectAt = state.retryAt;
+        reconnectWaiting = true;
+        continue;
+      }
+      state.waiting = false;
     }
+    (this->*node.start)();
   }
+}
+
+// ********************  RECONNECT  ********************
 
-  // New Telegram
-  if (StatusTelegram == ConnectionActiveNew) {
-    StatusTelegram = ConnectionActive;
+/**
+ * @brief WiFi disconnect reasons that point at credentials, not at the radio
+ *
+ * Same codes on ESP8266 (WiFiDisconnectReason) and ESP32 (wifi_err_reason_t).
+ */
+static bool credentialFailure(uint8_t reason) {
+  switch (reason) {
+    case 15:   // 4WAY_HANDSHAKE_TIMEOUT
+    case 23:   // 802_1X_AUTH_FAILED
+    case 202:  // AUTH_FAIL
+    case 204:  // HANDSHAKE_TIMEOUT
+      return true;
+    default:
+      return false;
   }
 }
 
-uint16_t WifiMessaging::AddConnectionService(uint16_t connectionService) {
-  this->connectionServices |= connectionService;
+void WifiMessaging::ReconnectLater(const ServiceNode &node, bool failed, uint8_t reason) {
+  ReconnectState &state = this->*node.reconnect;
+  state.stats.lastReason = reason;
+  if (failed)
+    state.stats.failures++;
+  else
+    state.stats.drops++;
+  if (!state.offline) {
+    state.offline = true;
+    state.offlineSince = millis();
+  }
+
+  // Exponential backoff; wrong credentials do not fix themselves, back off faster
+  if (state.backoffMs == 0) state.backoffMs = node.backoffMinMs;
+  uint32_t delayMs = state.backoffMs;
+  state.backoffMs *= credentialFailure(reason) ? 4 : 2;
+  if (state.backoffMs > node.backoffMaxMs || state.backoffMs < delayMs) state.backoffMs = node.backoffMaxMs;
 
-  // include Secure to use Telegram
-  if (this->connectionServices & ServiceTelegram)
-    this->connectionServices |= ServiceSecure;
+  // Jitter from the hardware random generator, a common seed would not spread devices
+  uint32_t jitter = delayMs / 100 * WIFIMESSAGING_RECONNECT_JITTER_PCT;
+#ifdef ESP8266
+  uint32_t random = ESP.random();
+#elif ESP32
+  uint32_t random = esp_random();
+#endif
+  if (jitter) delayMs = delayMs - jitter + random % (2 * jitter + 1);
 
-  // include WiFi and NTP to use Secure
-  if (this->connectionServices & ServiceSecure)
-    this->connectionServices |= (ServiceWifi | ServiceNTP);
+  state.waiting = true;
+  state.retryAt = millis() + delayMs;
+  WIFIMESSAGING_LOGI("Service %u %s (reason %u), reconnect in %lu ms", node.service,
+                     failed ? "failed" : "lost", reason, (unsigned long)delayMs);
+}
 
-  // include WiFi to use NTP
-  if (this->connectionServices & ServiceNTP)
-    this->connectionServices |= ServiceWifi;
+void WifiMessaging::ReconnectAttempt(ReconnectState &state) {
+  state.stats.attempts++;
+  if (state.stats.attempts == 1) {
+    state.offline = true;
+    state.offlineSince = millis();
+  }
+}
 
-  // include Wifi to use MQTT
-  if (connectionServices & ServiceMQTT) this->connectionServices |= ServiceWifi;
+WifiMessaging::connectionStats WifiMessaging::statistics(connectionService service) const {
+  const ReconnectState *state = nullptr;
+  if (service == ServiceWifi) state = &wifiReconnect;
+#if WIFIMESSAGING_ENABLE_MQTT
+  if (service == ServiceMQTT) state = &mqttReconnect;
+#endif
+  if (state == nullptr) return connectionStats();
 
-  return this->connectionServices;
+  connectionStats stats = state->stats;
+  if (state->offline) stats.offlineMs += millis() - state->offlineSince;
+  return stats;
 }
 
+#if WIFIMESSAGING_ENABLE_MQTT
 void WifiMessaging::InitialiseMQTT(MQTT_CALLBACK_SIGNATURE) {
-  mqttClient.setClient(this->wifiClient);
+  mqttClient.setClient(this->mqttTransport);
   mqttClient.setServer(this->mqqt_hostdomain, this->mqqt_port);
-  mqttClient.setCallback(callback);
-  DEBUG_WIFIMESSAGING_PRINTF("Initialised MQTT ...\n");
+  mqttCallback = callback;
+  mqttClient.setCallback(
+      [this](char *topic, uint8_t *payload, unsigned int length) { RouteMqttMessage(topic, payload, length); });
+  WIFIMESSAGING_LOGD("Initialised MQTT ...");
 }
+#endif
 
 void WifiMessaging::InitialiseNTP() {
   StatusNTP = ConnectionInBetween;
+  if (!clockSet) RestoreClock();
+  // (re)start SNTP, a restored clock is corrected in the background
   configTime(0, 0, TIME_NTPSERVER_1, TIME_NTPSERVER_2);
+  ntpStart = millis();
+  ntpTiming = true;
   setenv("TZ", TIME_ENV_TZ, /*overwrite*/ 1);
   tzset();
-#ifdef ESP8266
-  timechecker.attach_ms(500, std::bind(&WifiMessaging::checkNTP, this));
-#elif ESP32
-  timechecker.attach_ms(500, +[](WifiMessaging *instance) { instance->checkNTP(); }, this);
-#endif
-  DEBUG_WIFIMESSAGING_PRINTF("Initialised NTP...\n");
+  WIFIMESSAGING_LOGD("Initialised NTP...");
+  // the clock may be restored, or still set from before a WiFi loss
+  if (clockSet) PostServiceEvent(ServiceNTP, true);
+}
+
+void WifiMessaging::StopNTP() {
+  StatusNTP = ConnectionInactive;
 }
 
+#if WIFIMESSAGING_ENABLE_TELEGRAM
 void WifiMessaging::InitialiseSecure() {
 #ifdef ESP8266
+  RestoreTlsSession();
   secureClient.setSession(&session);  // certificate session to have more
                                       // performance with subsequent calls
   secureClient.setTrustAnchors(&cert);
 #elif ESP32
   secureClient.setCACert(CERTIFICATE_ROOT);
 #endif
-  DEBUG_WIFIMESSAGING_PRINTF("Initialised Secure ...\n");
-  StatusSecure = ConnectionActiveNew;
+  WIFIMESSAGING_LOGD("Initialised Secure ...");
+  StatusSecure = ConnectionInBetween;
+  PostServiceEvent(ServiceSecure, true);
+}
+
+void WifiMessaging::StopSecure() {
+  secureClient.stop();
+  StatusSecure = ConnectionInactive;
+}
+
+#ifdef ESP8266
+#define TLS_TX_BUFFER 512U        ///< transmit record payload, requests are split into records
+#define TLS_RECORD_OVERHEAD 325U  ///< record header, MAC and padding on top of the receive payload
+#define TLS_MAX_FRAGMENT 16384U   ///< receive payload without MFLN
+#endif
+
+bool WifiMessaging::ConnectSecure() {
+  IPAddress ip;
+#ifdef ESP8266
+  // By name, for SNI and the name check; lwIP has the answer of the lookup. BearSSL checks no
+  // name on a connect by address, and the requests carry the bot token: no stale address here,
+  // the reconnect backoff tries again.
+  if (ResolveHost(TELEGRAM_HOST, ip, millis(), WIFIMESSAGING_DNS_STALE_AFTER_MS) == DnsStale) {
+    WIFIMESSAGING_LOGW("Telegram: DNS fails, not connecting by the stale address");
+    return false;
+  }
+  if (tlsRootsLoaded < tlsRootCount) LoadTrustAnchors();
+  uint16_t fragment = TlsFragment();
+  if (fragment + TLS_TX_BUFFER > tlsBudget || ESP.getMaxFreeBlockSize() < fragment + TLS_RECORD_OVERHEAD) {
+    WIFIMESSAGING_LOGW("TLS buffer of %u does not fit, budget %lu, largest block %lu", fragment,
+                       (unsigned long)tlsBudget, (unsigned long)ESP.getMaxFreeBlockSize());
+    return false;
+  }
+  secureClient.setBufferSizes(fragment, TLS_TX_BUFFER);
+  uint32_t before = WifiMessagingRtc::crc32((const void *)&session, sizeof(session));
+  uint32_t start = millis();
+  if (!secureClient.connect(TELEGRAM_HOST, TELEGRAM_SSL_PORT)) return false;
+#elif ESP32
+  // by address, the host name still goes into SNI and the name check
+  bool known = CachedHost(TELEGRAM_HOST, ip) || ResolveHost(TELEGRAM_HOST, ip, millis(), 0) != DnsPending;
+  uint32_t start = millis();
+  if (!(known ? secureClient.connect(ip, TELEGRAM_SSL_PORT, TELEGRAM_HOST, CERTIFICATE_ROOT, nullptr, nullptr)
+              : secureClient.connect(TELEGRAM_HOST, TELEGRAM_SSL_PORT)))
+    return false;
+#endif
+  uint32_t elapsed = millis() - start;
+#ifdef ESP8266
+  // A resumed handshake leaves the session as it was
+  bool resumed = WifiMessagingRtc::crc32((const void *)&session, sizeof(session)) == before;
+  SaveTlsSession();
+  // only an accepted MFLN, a failed probe may have been the network
+  if (tlsFragment != fragment && fragment < TLS_MAX_FRAGMENT) SaveTlsFragment(fragment);
+#elif ESP32
+  bool resumed = false;
+#endif
+  metricsData.phases[resumed ? PhaseTlsResumed : PhaseTlsFull].record(elapsed);
+  telegramAnswered = false;
+  telegramUsedAt = telegramActiveAt = millis();
+  return true;
 }
 
 void WifiMessaging::InitialiseTelegram() {
-  DEBUG_WIFIMESSAGING_PRINTF("Initialised Telegram ...\n");
-  StatusTelegram = ConnectionActiveNew;
+  WIFIMESSAGING_LOGD("Initialised Telegram ...");
+  StatusTelegram = ConnectionInBetween;
+  PostServiceEvent(ServiceTelegram, true);
+}
+
+void WifiMessaging::StopTelegram() {
+  telegramRetrying = false;
+  // messages in flight stay in the outbox and are sent again
+  telegramRequesting = TelegramIdle;
+  telegramInFlightCount = 0;
+  ResetTelegramResponse();
+  StatusTelegram = ConnectionInactive;
+#if WIFIMESSAGING_SPOOL
+  // the outbox outlives a reset while Telegram is down
+  SpoolTelegramOutbox();
+#endif
+}
+#endif
+
+// ********************  PREFETCH  ********************
+
+void WifiMessaging::StartPrefetch() {
+  prefetchPending = 0;
+  prefetchStart = millis();
+#if WIFIMESSAGING_ENABLE_MQTT
+  if ((connectionServices & ServiceMQTT) && this->mqqt_hostdomain != nullptr) prefetchPending |= PrefetchMqttHost;
+#endif
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  if (connectionServices & ServiceTelegram) prefetchPending |= PrefetchTelegramHost;
+#ifdef ESP8266
+  if (connectionServices & ServiceTelegram) prefetchPending |= PrefetchTls;
+  // the probe is repeated on a new link, a failed one may have been the old link
+  tlsProbedFragment = 0;
+#endif
+#endif
+}
+
+void WifiMessaging::StepPrefetch(bool tls) {
+  if (prefetchPending & (PrefetchTelegramHost | PrefetchMqttHost)) {
+    if (millis() - prefetchStart > WIFIMESSAGING_PREFETCH_TIMEOUT_MS) {
+      WIFIMESSAGING_LOGW("DNS prefetch timed out");
+      prefetchPending &= ~(PrefetchTelegramHost | PrefetchMqttHost);
+    }
+    IPAddress ip;
+#if WIFIMESSAGING_ENABLE_MQTT
+    if ((prefetchPending & PrefetchMqttHost) &&
+        (CachedHost(this->mqqt_hostdomain, ip) || ResolveHost(this->mqqt_hostdomain, ip, prefetchStart, 1) != DnsPending))
+      prefetchPending &= ~PrefetchMqttHost;
+#endif
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+    // The ESP8266 connects to Telegram by name, the lookup also fills the cache of lwIP
+#ifdef ESP8266
+    const bool telegramCached = false;
+#elif ESP32
+    bool telegramCached = (prefetchPending & PrefetchTelegramHost) && CachedHost(TELEGRAM_HOST, ip);
+#endif
+    if ((prefetchPending & PrefetchTelegramHost) &&
+        (telegramCached || ResolveHost(TELEGRAM_HOST, ip, prefetchStart, 1) != DnsPending))
+      prefetchPending &= ~PrefetchTelegramHost;
+#endif
+  }
+
+#if WIFIMESSAGING_ENABLE_TELEGRAM && defined(ESP8266)
+  // The probe resolves the host again, from the cache once the lookup is answered. It is a TCP connect and
+  // a hello exchange inside loop(), up to the client timeout when the host does not answer: only in a call
+  // without an MQTT connect step or a WiFi scan, and none at all when RTC memory has the fragment.
+  bool quiet = wifiScanning == ScanIdle;
+#if WIFIMESSAGING_ENABLE_MQTT
+  quiet = quiet && mqttStep == MqttIdle;
+#endif
+  if (tls && quiet && (prefetchPending & PrefetchTls) && !HoldsTelegramConnect()) {
+    prefetchPending &= ~PrefetchTls;
+    if (tlsRootsLoaded < tlsRootCount) LoadTrustAnchors();
+    // by name, it would wait out the lookup while DNS fails
+    DnsCacheEntry *telegram = FindDnsEntry(TELEGRAM_HOST);
+    if (!(telegram && telegram->failing)) TlsFragment();
+    WIFIMESSAGING_LOGD("TLS prefetched %lu ms after the IP", (unsigned long)(millis() - prefetchStart));
+  }
+#endif
+}
+
+bool WifiMessaging::HoldsTelegramConnect() const {
+  // instead of blocking loop() on a lookup the prefetch has in flight
+  if (prefetchPending & PrefetchTelegramHost) return true;
+#if WIFIMESSAGING_ENABLE_MQTT
+  // the TLS connect blocks loop(); the few round trips of MQTT go first, healthy ones take a step each
+  return mqttStep != MqttIdle && millis() - mqttStepStart < 3 * WIFIMESSAGING_MQTT_STEP_MS;
+#else
+  return false;
+#endif
 }
 
 // ********************  WIFI  ********************
 
+#define RTC_TAG_WIFI 0x5746
+
 void WifiMessaging::connectToWiFi() {
-  DEBUG_WIFIMESSAGING_PRINTF("Connect to WiFi %s ...\n", this->wifi_ssid);
+  WIFIMESSAGING_LOGI("Connect to WiFi %s ...", wifiCandidates[0].ssid);
   StatusWiFi = ConnectionInBetween;
+  wifiWanted = true;
+  wifiRoaming = false;
 
 #ifdef ESP8266
   // switch on the WiFi radio
@@ -363,12 +981,221 @@ void WifiMessaging::connectToWiFi() {
   // connect
   WiFi.mode(WIFI_STA);
 #endif
-  WiFi.begin(this->wifi_ssid, this->wifi_password);
+  // reconnects follow the backoff of loop(), not the SDK
+  WiFi.setAutoReconnect(false);
+
+  // Fast connect: no scan with channel and BSSID, no DHCP with the last lease
+  WiFiFastConnect cache;
+  if (WifiMessagingRtc::read(WIFIMESSAGING_RTC_WIFI, RTC_TAG_WIFI, &cache, sizeof(cache))) {
+    for (uint8_t i = 0; i < wifiCandidateCount; i++) {
+      const WiFiCandidate &candidate = wifiCandidates[i];
+      if (cache.ssid != WifiMessagingRtc::crc32(candidate.ssid, strlen(candidate.ssid))) continue;
+      WIFIMESSAGING_LOGI("Fast connect: %s channel %d, IP %s", candidate.ssid, cache.channel,
+                         IPAddress(cache.ip).toString().c_str());
+      wifiPath = WiFiPathFast;
+      wifiCandidate = i;
+      wifiScanEntry = -1;
+      wifiFastFailed = false;
+      wifiConnectStart = millis();
+      ReconnectAttempt(wifiReconnect);
+      WiFi.config(IPAddress(cache.ip), IPAddress(cache.gw), IPAddress(cache.mask), IPAddress(cache.dns));
+      WiFi.begin(candidate.ssid, candidate.password, cache.channel, cache.bssid);
+      return;
+    }
+  }
+
+  ConnectToWiFiFull();
+}
+
+void WifiMessaging::ConnectToWiFiFull() {
+  // the access point of the last attempt gave no IP, the next one of the scan is tried
+  if (wifiScanEntry >= 0) wifiScan[wifiScanEntry].failed = true;
+  wifiScanEntry = -1;
+  wifiRoaming = false;
+  wifiPath = WiFiPathFull;
+  wifiFastFailed = false;
+  wifiConnectStart = millis();
+  ReconnectAttempt(wifiReconnect);
+  StatusWiFi = ConnectionInBetween;
+  // back to DHCP
+  WiFi.config(IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0));
+
+  int8_t entry = BestScanEntry(nullptr);
+  if (entry >= 0) {
+    ConnectToScanEntry(entry);
+    return;
+  }
+  // the SDK connects to the first access point of one SSID, pick among several ourselves
+  if (wifiCandidateCount > 1 && StartWiFiScan(ScanForConnect)) return;
+  wifiCandidate = 0;
+  WiFi.begin(wifiCandidates[0].ssid, wifiCandidates[0].password);
+}
+
+void WifiMessaging::ConnectToScanEntry(int8_t entry) {
+  const WiFiScanEntry &ap = wifiScan[entry];
+  const WiFiCandidate &candidate = wifiCandidates[ap.candidate];
+  WIFIMESSAGING_LOGI("Connect to %s channel %u, %d dBm", candidate.ssid, ap.channel, ap.rssi);
+  wifiPath = WiFiPathScan;
+  wifiCandidate = ap.candidate;
+  wifiScanEntry = entry;
+  WiFi.begin(candidate.ssid, candidate.password, ap.channel, ap.bssid);
+}
+
+bool WifiMessaging::AddWiFi(const char *ssid, const char *password) {
+  if (wifiCandidateCount >= WIFIMESSAGING_WIFI_CANDIDATES) return false;
+  wifiCandidates[wifiCandidateCount++] = {ssid, password};
+  return true;
+}
+
+bool WifiMessaging::StartWiFiScan(wifiScanPurpose purpose) {
+  if (WiFi.scanNetworks(/* async */ true) != WIFI_SCAN_RUNNING) {
+    WIFIMESSAGING_LOGW("WiFi scan not started");
+    return false;
+  }
+  wifiScanning = purpose;
+  return true;
+}
+
+void WifiMessaging::StepWiFiScan() {
+  int16_t found = WiFi.scanComplete();
+  if (found == WIFI_SCAN_RUNNING) return;
+  wifiScanPurpose purpose = wifiScanning;
+  wifiScanning = ScanIdle;
+
+  // Rank the access points of the candidates by RSSI, the weakest fall off a full cache
+  if (found >= 0) {
+    wifiScanCount = 0;
+    wifiScannedAt = millis();
+    for (int16_t i = 0; i < found; i++) {
+      String ssid = WiFi.SSID(i);
+      uint8_t candidate = 0;
+      while (candidate < wifiCandidateCount && strcmp(ssid.c_str(), wifiCandidates[candidate].ssid)) candidate++;
+      if (candidate == wifiCandidateCount) continue;
+
+      int8_t rssi = WiFi.RSSI(i);
+      uint8_t pos = wifiScanCount;
+      while (pos > 0 && wifiScan[pos - 1].rssi < rssi) pos--;
+      if (pos >= WIFIMESSAGING_WIFI_SCAN_SIZE) continue;
+      if (wifiScanCount < WIFIMESSAGING_WIFI_SCAN_SIZE) wifiScanCount++;
+      memmove(&wifiScan[pos + 1], &wifiScan[pos], (wifiScanCount - 1 - pos) * sizeof(wifiScan[0]));
+
+      WiFiScanEntry &ap = wifiScan[pos];
+      memcpy(ap.bssid, WiFi.BSSID(i), sizeof(ap.bssid));
+      ap.channel = WiFi.channel(i);
+      ap.candidate = candidate;
+      ap.rssi = rssi;
+      ap.failed = false;
+    }
+    WiFi.scanDelete();
+    WIFIMESSAGING_LOG_COMPACT(WIFIMESSAGING_LOG_DEBUG, "WiFi scan: %d networks, %u of the candidates", found,
+                              wifiScanCount);
+  }
+
+  if (purpose == ScanForConnect) {
+    // disconnectFromWiFi() or another connect in the meantime
+    if (!wifiWanted || StatusWiFi != ConnectionInBetween || wifiPath != WiFiPathFull) return;
+    int8_t entry = BestScanEntry(nullptr);
+    if (entry >= 0) {
+      ConnectToScanEntry(entry);
+    } else {
+      // none in range, the SDK fails or finds one late
+      wifiCandidate = 0;
+      WiFi.begin(wifiCandidates[0].ssid, wifiCandidates[0].password);
+    }
+  } else if (purpose == ScanForRoam && StatusWiFi == ConnectionActive) {
+    int32_t rssi = WiFi.RSSI();
+    int8_t entry = BestScanEntry(WiFi.BSSID());
+    if (entry >= 0 && wifiScan[entry].rssi >= rssi + wifiRoamHysteresis) {
+      wifiRoamScanMs = WIFIMESSAGING_WIFI_ROAM_SCAN_MS;
+      RoamWiFi(entry);
+    } else if (wifiRoamScanMs < WIFIMESSAGING_WIFI_ROAM_SCAN_MAX_MS / 2) {
+      wifiRoamScanMs *= 2;
+    } else {
+      wifiRoamScanMs = WIFIMESSAGING_WIFI_ROAM_SCAN_MAX_MS;
+    }
+  }
+}
+
+int8_t WifiMessaging::BestScanEntry(const uint8_t *exclude) const {
+  if (wifiScanCount == 0 || millis() - wifiScannedAt > WIFIMESSAGING_WIFI_SCAN_MAX_AGE_MS) return -1;
+  for (uint8_t i = 0; i < wifiScanCount; i++) {
+    if (wifiScan[i].failed) continue;
+    if (exclude && !memcmp(wifiScan[i].bssid, exclude, sizeof(wifiScan[i].bssid))) continue;
+    return i;
+  }
+  return -1;
+}
+
+void WifiMessaging::CheckWiFiRoaming() {
+  wifiRoamCheckAt = millis() + WIFIMESSAGING_WIFI_ROAM_CHECK_MS;
+  int32_t rssi = WiFi.RSSI();
+  if (rssi > wifiRoamRssi) {
+    wifiRoamScanMs = WIFIMESSAGING_WIFI_ROAM_SCAN_MS;
+    wifiRoamScanAt = millis();
+    return;
+  }
+  // each scan takes the radio off channel, a weak link without stronger access points scans seldom
+  if ((int32_t)(millis() - wifiRoamScanAt) < 0) return;
+  wifiRoamScanAt = millis() + wifiRoamScanMs;
+  WIFIMESSAGING_LOG_COMPACT(WIFIMESSAGING_LOG_INFO, "WiFi RSSI %d dBm, scanning for a stronger access point", rssi);
+  StartWiFiScan(ScanForRoam);
+}
+
+void WifiMessaging::RoamWiFi(int8_t entry) {
+  const WiFiScanEntry &ap = wifiScan[entry];
+  const WiFiCandidate &candidate = wifiCandidates[ap.candidate];
+  WIFIMESSAGING_LOGI("WiFi roam to %s channel %u, %d dBm", candidate.ssid, ap.channel, ap.rssi);
+
+  // the services on the old link stop, like after a drop, and come back with the new one
+  wifiReconnect.stats.roams++;
+  ReconnectAttempt(wifiReconnect);
+  wifiReconnect.offline = true;
+  wifiReconnect.offlineSince = millis();
+  StatusWiFi = ConnectionInBetween;
+  ReconcileServices();
+
+  // same network, same lease: no DHCP
+  if (ap.candidate == wifiCandidate)
+    WiFi.config(WiFi.localIP(), WiFi.gatewayIP(), WiFi.subnetMask(), WiFi.dnsIP());
+  else
+    WiFi.config(IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0));
+
+  wifiRoaming = true;
+  wifiPath = WiFiPathRoam;
+  wifiCandidate = ap.candidate;
+  wifiScanEntry = entry;
+  wifiFastFailed = false;
+  wifiConnectStart = millis();
+  WiFi.begin(candidate.ssid, candidate.password, ap.channel, ap.bssid);
+}
+
+void WifiMessaging::ReconnectToWiFi() {
+  if (wifiWanted) connectToWiFi();
+}
+
+void WifiMessaging::SaveWiFiCache() {
+  const char *ssid = wifiCandidates[wifiCandidate].ssid;
+  wifiCache.ssid = WifiMessagingRtc::crc32(ssid, strlen(ssid));
+  wifiCache.reserved = 0;
+  wifiCache.dns = WiFi.dnsIP();
+  WifiMessagingRtc::write(WIFIMESSAGING_RTC_WIFI, RTC_TAG_WIFI, &wifiCache, sizeof(wifiCache));
+  WIFIMESSAGING_LOGI("WiFi connected to %s via %s", ssid,
+                     wifiPath == WiFiPathFast   ? "fast connect"
+                     : wifiPath == WiFiPathScan ? "scan cache and DHCP"
+                     : wifiPath == WiFiPathRoam ? "roam"
+                                                : "scan and DHCP");
 }
 
 void WifiMessaging::disconnectFromWiFi() {
-  DEBUG_WIFIMESSAGING_PRINTF("Disconnect from WiFi ...\n");
+  WIFIMESSAGING_LOGI("Disconnect from WiFi ...");
   StatusWiFi = ConnectionInBetween;
+  wifiWanted = false;
+  wifiReconnect.waiting = false;
+  wifiRoaming = false;
+  if (wifiScanning != ScanIdle) {
+    wifiScanning = ScanIdle;
+    WiFi.scanDelete();
+  }
   // Disconnect to wifi
   WiFi.disconnect(true);
   delay(1);
@@ -380,56 +1207,2031 @@ void WifiMessaging::disconnectFromWiFi() {
 #endif
 }
 
-// ********************  MQTT  ********************
+// ********************  MAC  ********************
 
 String WifiMessaging::macId() {
+  char macStr[13];
+  return String(macId(macStr, sizeof(macStr)));
+}
+
+char *WifiMessaging::macId(char *buffer, size_t size) {
   uint8_t mac[6];
-  char macStr[13] = {0};
 #ifdef ESP8266
   wifi_get_macaddr(STATION_IF, mac);
 #elif ESP32
   esp_read_mac(mac, ESP_MAC_WIFI_STA);
 #endif
-  sprintf(macStr, "%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2], mac[3],
-          mac[4], mac[5]);
-  return String(macStr);
+  snprintf(buffer, size, "%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2], mac[3],
+           mac[4], mac[5]);
+  return buffer;
 }
 
+#if WIFIMESSAGING_ENABLE_MQTT
+
+// ********************  MQTT  ********************
+
 void WifiMessaging::ConnectToMqtt() {
-  StatusMQTT = ConnectionInBetween;
-  String clientId = "ESP-" + macId();
+  if (mqttStep != MqttIdle || mqttClient.connected()) return;
 
-  if (!mqttClient.connected()) {
-    if (mqttClient.connect(clientId.c_str())) {
-      StatusMQTT = ConnectionActive;
-      DEBUG_WIFIMESSAGING_PRINTF("Connected to MQTT as %s\n", clientId.c_str());
-    } else {
-      DEBUG_WIFIMESSAGING_PRINTF("MQTT connection failed\n");
-    }
+  if (!mqttClientId[0]) {
+    strcpy(mqttClientId, "ESP-");
+    macId(mqttClientId + 4, sizeof(mqttClientId) - 4);
   }
+
+  StatusMQTT = ConnectionInBetween;
+  ReconnectAttempt(mqttReconnect);
+  mqttConnectStart = millis();
+  mqttStepStart = mqttConnectStart;
+  mqtt_connectip = this->mqtt_hostip;
+  mqttStep = (this->mqqt_hostdomain != nullptr) ? MqttResolve : MqttTcp;
+  WIFIMESSAGING_LOGD("Connecting to MQTT ...");
 }
 
-// ********************  NTP  ********************
+void WifiMessaging::StepConnectToMqtt() {
+  if (StatusWiFi < ConnectionActive) {
+    AbortConnectToMqtt("no WiFi");
+    return;
+  }
+  if (millis() - mqttConnectStart > WIFIMESSAGING_MQTT_CONNECT_TIMEOUT_MS) {
+    AbortConnectToMqtt("timeout");
+    return;
+  }
 
-void WifiMessaging::checkNTP() {
-  time_t now = time(nullptr);
+  switch (mqttStep) {
+    case MqttResolve:
+      // lwIP keeps the lookup running after the step, the next step picks up the answer
+      if (CachedHost(this->mqqt_hostdomain, mqtt_connectip) ||
+          ResolveHost(this->mqqt_hostdomain, mqtt_connectip, mqttConnectStart, WIFIMESSAGING_MQTT_STEP_MS) !=
+              DnsPending) {
+        mqttStep = MqttTcp;
+        mqttStepStart = millis();
+      }
+      break;
+
+    case MqttTcp:
+      // the handshake stays in flight after the step, however far away the broker is
+      if (!mqttTcp.started() && !mqttTcp.start(mqtt_connectip, this->mqqt_port)) {
+        AbortConnectToMqtt("TCP connect not started");
+        break;
+      }
+      switch (mqttTcp.poll(wifiClient)) {
+        case 1:
+          if (mqttTransport.sendConnect(mqttClientId, mqttKeepAlive)) {
+            mqttStep = MqttConnack;
+          } else {
+            AbortConnectToMqtt("CONNECT not sent");
+          }
+          break;
+        case -1:
+          AbortConnectToMqtt("TCP connect failed");
+          break;
+        default:
+          break;
+      }
+      break;
+
+    case MqttConnack:
+      if (!wifiClient.connected()) {
+        AbortConnectToMqtt("connection closed");
+      } else if (mqttTransport.receiveConnack()) {
+        // PubSubClient finds the connection open and gets the CONNACK replayed
+        if (mqttClient.connect(mqttClientId)) {
+          mqttStep = MqttIdle;
+          metricsData.phases[PhaseMqttConnect].record(millis() - mqttConnectStart);
+          // clean session: the broker forgot the subscriptions
+          ResubscribeMqtt();
+          PostServiceEvent(ServiceMQTT, true);
+          WIFIMESSAGING_LOGI("Connected to MQTT as %s", mqttClientId);
+        } else {
+          AbortConnectToMqtt("CONNACK refused");
+        }
+      }
+      break;
+
+    default:
+      break;
+  }
+}
 
-  if (StatusNTP < ConnectionActive && now > 24 * 3600) {
-    StatusNTP = ConnectionActiveNew;
-    timechecker.detach();
+void WifiMessaging::StopMQTT() {
+  WIFIMESSAGING_LOGD("MQTT stopped");
+  mqttTcp.abort();
+  mqttTransport.stop();
+  mqttStep = MqttIdle;
+  StatusMQTT = ConnectionInactive;
+#if WIFIMESSAGING_SPOOL
+  // the outbox outlives a reset while MQTT is down
+  SpoolMqttOutbox();
+#endif
+}
 
-    struct tm timeinfo;
-    localtime_r(&now, &timeinfo);
-    DEBUG_WIFIMESSAGING_PRINTF("Localtime: %s", asctime(&timeinfo));
-  }
+void WifiMessaging::AbortConnectToMqtt(const char *reason) {
+  WIFIMESSAGING_LOGW("MQTT connection failed: %s", reason);
+  mqttTcp.abort();
+  mqttTransport.stop();
+  mqttStep = MqttIdle;
+  // loop() accounts the failure and sets the reconnect delay
+  PostServiceEvent(ServiceMQTT, false);
 }
 
-// ********************  TELEGRAM  ********************
+bool WifiMessaging::publish(const char *topic, const char *payload, bool retained, uint8_t qos) {
+  return publish(topic, (const uint8_t *)payload, strlen(payload), retained, qos);
+}
 
-bool WifiMessaging::sendMessage(const String &text, const String &parse_mode) {
-  if (StatusTelegram == ConnectionActive) {
-    return this->bot->sendMessage(this->telegram_chat_id, text, parse_mode);
-  } else {
+bool WifiMessaging::publish(const char *topic, const uint8_t *payload, size_t length, bool retained,
+                            uint8_t qos) {
+  if (!(connectionServices & ServiceMQTT)) return false;
+  if (strlen(topic) >= WIFIMESSAGING_MQTT_TOPIC_SIZE || length > WIFIMESSAGING_MQTT_PAYLOAD_SIZE) return false;
+
+#if WIFIMESSAGING_NETWORK_TASK
+  if (networkDetached) {
+    MqttOutboxEntry message;
+    message.set(topic, payload, length, retained, qos);
+    if (mqttOutgoing.push(message)) return true;
+    WIFIMESSAGING_LOGW("MQTT outbox full, %s dropped", topic);
     return false;
   }
-}
\ No newline at end of file
+#endif
+
+#if WIFIMESSAGING_SPOOL
+  if (MqttToSpool()) {
+    if (SpoolMqttMessage(topic, payload, length, retained, qos)) return true;
+    WIFIMESSAGING_LOGW("MQTT spool full, %s dropped", topic);
+    mqttDropped++;
+    return false;
+  }
+#endif
+
+  if (mqttOutbox.full()) {
+    mqttDropped++;
+    if (mqttOverflowPolicy == MqttDropNewest) {
+      WIFIMESSAGING_LOGW("MQTT outbox full, %s dropped", topic);
+      return false;
+    }
+    WIFIMESSAGING_LOGW("MQTT outbox full, %s dropped", mqttOutbox.front().topic);
+    PopMqttOutbox();
+  }
+
+  mqttOutbox.push()->set(topic, payload, length, retained, qos);
+  return true;
+}
+
+size_t WifiMessaging::pendingPublishes() const {
+#if WIFIMESSAGING_NETWORK_TASK
+  // the queue first: a message leaving it is already in the shared count
+  if (networkDetached) return mqttOutgoing.size() + mqttOutboxShared;
+#endif
+  return QueuedPublishes();
+}
+
+size_t WifiMessaging::QueuedPublishes() const {
+#if WIFIMESSAGING_SPOOL
+  return mqttOutbox.size() + mqttSpool.unread();
+#else
+  return mqttOutbox.size();
+#endif
+}
+
+bool WifiMessaging::subscribe(const char *topicFilter, WifiMessagingTopicHandler handler, uint8_t qos) {
+  if (!mqttTopics.insert(topicFilter, handler, qos)) {
+    WIFIMESSAGING_LOGW("MQTT subscribe to %s refused", topicFilter ? topicFilter : "");
+    return false;
+  }
+  if (StatusMQTT == ConnectionActive) mqttClient.subscribe(topicFilter, qos);
+  return true;
+}
+
+void WifiMessaging::ResubscribeMqtt() {
+  mqttTopics.forEach([this](const char *filter, uint8_t qos) { mqttClient.subscribe(filter, qos); });
+}
+
+void WifiMessaging::RouteMqttMessage(char *topic, uint8_t *payload, unsigned int length) {
+#if WIFIMESSAGING_NETWORK_TASK
+  if (networkDetached) {
+    MqttOutboxEntry message;
+    if (strlen(topic) >= sizeof(message.topic) || length > sizeof(message.payload)) {
+      WIFIMESSAGING_LOGW("MQTT message to %s too long for loop(), dropped", topic);
+      crossingDropped++;
+      return;
+    }
+    message.set(topic, payload, length, false, 0);
+    if (!mqttIncoming.push(message)) {
+      WIFIMESSAGING_LOGW("MQTT message to %s not taken by loop(), dropped", topic);
+      crossingDropped++;
+    }
+    return;
+  }
+#endif
+  DispatchMqttMessage(topic, payload, length);
+}
+
+void WifiMessaging::DispatchMqttMessage(char *topic, uint8_t *payload, unsigned int length) {
+  if (mqttTopics.dispatch(topic, payload, length) == 0 && mqttCallback) mqttCallback(topic, payload, length);
+}
+
+void WifiMessaging::FlushMqttOutbox() {
+  for (uint8_t i = 0; i < WIFIMESSAGING_MQTT_BATCH && !mqttOutbox.empty(); i++) {
+    MqttOutboxEntry &entry = mqttOutbox.front();
+    if (mqttClient.publish(entry.topic, entry.payload, entry.length, entry.retained)) {
+      PopMqttOutbox();
+      continue;
+    }
+    if (mqttClient.connected()) {
+      // Refused while connected, larger than MQTT_MAX_PACKET_SIZE: never goes out
+      WIFIMESSAGING_LOGW("MQTT publish to %s refused", entry.topic);
+      mqttDropped++;
+      PopMqttOutbox();
+      continue;
+    }
+    // Connection lost, loop() reconnects; qos 1 waits for the new connection
+    if (entry.qos == 0) {
+      mqttDropped++;
+      PopMqttOutbox();
+    }
+    return;
+  }
+}
+
+void WifiMessaging::PopMqttOutbox() {
+#if WIFIMESSAGING_SPOOL
+  if (mqttOutbox.front().spooled) mqttSpoolDone = mqttOutbox.front().spooled;
+#endif
+  mqttOutbox.pop();
+}
+
+// MQTT transport
+
+bool WifiMessaging::MqttTransport::sendConnect(const char *clientId, uint16_t keepAlive) {
+  // The packet PubSubClient::connect(id) writes after setKeepAlive(keepAlive): clean session, no will,
+  // no credentials
+#if MQTT_VERSION == MQTT_VERSION_3_1
+  const uint8_t header[] = {0x00, 0x06, 'M', 'Q', 'I', 's', 'd', 'p', MQTT_VERSION, 0x02,
+                            (uint8_t)(keepAlive >> 8), (uint8_t)(keepAlive & 0xFF)};
+#else
+  const uint8_t header[] = {0x00, 0x04, 'M', 'Q', 'T', 'T', MQTT_VERSION, 0x02,
+                            (uint8_t)(keepAlive >> 8), (uint8_t)(keepAlive & 0xFF)};
+#endif
+  uint8_t packet[2 + sizeof(header) + 2 + 64];
+  size_t idLength = strlen(clientId);
+  if (idLength > 64) return false;
+
+  size_t length = 0;
+  packet[length++] = 0x10;  // CONNECT
+  packet[length++] = sizeof(header) + 2 + idLength;
+  memcpy(packet + length, header, sizeof(header));
+  length += sizeof(header);
+  packet[length++] = idLength >> 8;
+  packet[length++] = idLength & 0xFF;
+  memcpy(packet + length, clientId, idLength);
+  length += idLength;
+
+  connackLength = 0;
+  connackReplay = 0;
+  swallow = 0;
+  return client.write(packet, length) == length;
+}
+
+bool WifiMessaging::MqttTransport::receiveConnack() {
+  while (connackLength < sizeof(connack) && client.available() > 0) {
+    connack[connackLength++] = client.read();
+  }
+  if (connackLength < sizeof(connack)) return false;
+  swallow = -1;  // drop the CONNECT that PubSubClient::connect() writes next
+  return true;
+}
+
+int WifiMessaging::MqttTransport::connect(IPAddress ip, uint16_t port) {
+  connackLength = connackReplay = 0;
+  swallow = 0;
+  return client.connect(ip, port);
+}
+
+int WifiMessaging::MqttTransport::connect(const char *host, uint16_t port) {
+  connackLength = connackReplay = 0;
+  swallow = 0;
+  return client.connect(host, port);
+}
+
+size_t WifiMessaging::MqttTransport::write(uint8_t b) { return write(&b, 1); }
+
+size_t WifiMessaging::MqttTransport::write(const uint8_t *buf, size_t size) {
+  if (swallow == 0) return client.write(buf, size);
+
+  if (swallow < 0) {
+    // Fixed header of the CONNECT: type byte and variable length remaining length
+    int32_t remaining = 0;
+    size_t pos = 1;
+    for (uint8_t shift = 0; pos < size && shift < 28; shift += 7) {
+      remaining |= (int32_t)(buf[pos] & 0x7F) << shift;
+      if (!(buf[pos++] & 0x80)) break;
+    }
+    swallow = pos + remaining;
+  }
+  size_t dropped = (size < (size_t)swallow) ? size : swallow;
+  swallow -= dropped;
+  if (dropped < size) return dropped + client.write(buf + dropped, size - dropped);
+  return size;
+}
+
+int WifiMessaging::MqttTransport::available() {
+  if (connackReplay < connackLength) return connackLength - connackReplay;
+  return client.available();
+}
+
+int WifiMessaging::MqttTransport::read() {
+  if (connackReplay < connackLength) return connack[connackReplay++];
+  return client.read();
+}
+
+int WifiMessaging::MqttTransport::read(uint8_t *buf, size_t size) {
+  if (connackReplay < connackLength) {
+    size_t n = 0;
+    while (n < size && connackReplay < connackLength) buf[n++] = connack[connackReplay++];
+    return n;
+  }
+  return client.read(buf, size);
+}
+
+int WifiMessaging::MqttTransport::peek() {
+  if (connackReplay < connackLength) return connack[connackReplay];
+  return client.peek();
+}
+
+void WifiMessaging::MqttTransport::flush() { client.flush(); }
+
+void WifiMessaging::MqttTransport::stop() {
+  connackLength = connackReplay = 0;
+  swallow = 0;
+  client.stop();
+}
+
+uint8_t WifiMessaging::MqttTransport::connected() { return client.connected(); }
+
+WifiMessaging::MqttTransport::operator bool() { return client.connected(); }
+
+// MQTT TCP connect
+
+#ifdef ESP8266
+/**
+ * @brief WiFiClient of a ClientContext, as WiFiServer hands out accepted connections
+ */
+class AdoptedWiFiClient : public WiFiClient {
+ public:
+  AdoptedWiFiClient(ClientContext *context) : WiFiClient(context) {}
+};
+
+bool WifiMessaging::MqttTcpConnect::start(IPAddress ip, uint16_t port) {
+  abort();
+  pcb = tcp_new();
+  if (!pcb) return false;
+  tcp_arg(pcb, this);
+  tcp_err(pcb, Error);
+  ip_addr_t address;
+  IP_ADDR4(&address, ip[0], ip[1], ip[2], ip[3]);
+  if (tcp_connect(pcb, &address, port, Connected) != ERR_OK) {
+    abort();
+    return false;
+  }
+  return true;
+}
+
+bool WifiMessaging::MqttTcpConnect::started() const { return pcb || context || failed; }
+
+int8_t WifiMessaging::MqttTcpConnect::poll(WiFiClient &client) {
+  if (context) {
+    client = AdoptedWiFiClient(context);
+    context = nullptr;
+    return 1;
+  }
+  return failed ? -1 : 0;
+}
+
+void WifiMessaging::MqttTcpConnect::abort() {
+  if (pcb) {
+    tcp_arg(pcb, nullptr);
+    tcp_err(pcb, nullptr);
+    tcp_abort(pcb);
+    pcb = nullptr;
+  }
+  if (context) {
+    AdoptedWiFiClient(context).stop();
+    context = nullptr;
+  }
+  failed = false;
+}
+
+int8_t WifiMessaging::MqttTcpConnect::Connected(void *arg, tcp_pcb *pcb, int8_t) {
+  MqttTcpConnect *connect = (MqttTcpConnect *)arg;
+  // the ClientContext takes the pcb and its callbacks over
+  connect->context = new ClientContext(pcb, nullptr, nullptr);
+  connect->pcb = nullptr;
+  return ERR_OK;
+}
+
+void WifiMessaging::MqttTcpConnect::Error(void *arg, int8_t err) {
+  MqttTcpConnect *connect = (MqttTcpConnect *)arg;
+  WIFIMESSAGING_LOG_COMPACT(WIFIMESSAGING_LOG_DEBUG, "MQTT TCP error %d", err);
+  // lwIP has freed the pcb
+  connect->pcb = nullptr;
+  connect->failed = true;
+}
+
+#elif ESP32
+bool WifiMessaging::MqttTcpConnect::start(IPAddress ip, uint16_t port) {
+  abort();
+  fd = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (fd < 0) return false;
+  lwip_fcntl(fd, F_SETFL, lwip_fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = (uint32_t)ip;
+  address.sin_port = htons(port);
+  if (lwip_connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0 && errno != EINPROGRESS) {
+    abort();
+    return false;
+  }
+  return true;
+}
+
+bool WifiMessaging::MqttTcpConnect::started() const { return fd >= 0; }
+
+int8_t WifiMessaging::MqttTcpConnect::poll(WiFiClient &client) {
+  if (fd < 0) return -1;
+  fd_set writable;
+  FD_ZERO(&writable);
+  FD_SET(fd, &writable);
+  struct timeval now = {0, 0};
+  int ready = lwip_select(fd + 1, nullptr, &writable, nullptr, &now);
+  if (ready == 0) return 0;
+  int error = 0;
+  socklen_t length = sizeof(error);
+  if (ready < 0 || lwip_getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error) {
+    abort();
+    return -1;
+  }
+  // WiFiClient reads and writes blocking, as after its own connect()
+  lwip_fcntl(fd, F_SETFL, lwip_fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+  client = WiFiClient(fd);
+  fd = -1;
+  return 1;
+}
+
+void WifiMessaging::MqttTcpConnect::abort() {
+  if (fd >= 0) lwip_close(fd);
+  fd = -1;
+}
+#endif
+
+#endif
+
+// ********************  NTP  ********************
+
+#define RTC_TAG_CLOCK 0x434B
+
+/**
+ * @brief Clock of the last SNTP sync as kept in RTC memory
+ */
+struct ClockRecord {
+  uint32_t syncedAt;  ///< epoch seconds of the sync
+  uint32_t rtcTicks;  ///< ESP8266 RTC timer at the sync
+  uint32_t rtcCali;   ///< ESP8266 RTC tick in us, 12 fractional bits
+};
+
+void WifiMessaging::RestoreClock() {
+  ClockRecord record;
+  if (!WifiMessagingRtc::read(WIFIMESSAGING_RTC_CLOCK, RTC_TAG_CLOCK, &record, sizeof(record))) return;
+
+#ifdef ESP8266
+  // The RTC timer runs through deep sleep, a reset restarts it and makes the age huge
+  uint64_t elapsedUs = ((uint64_t)(system_get_rtc_time() - record.rtcTicks) * record.rtcCali) >> 12;
+  if (elapsedUs / 1000000 > WIFIMESSAGING_CLOCK_MAX_AGE_S) {
+    WIFIMESSAGING_LOGD("Saved clock too old");
+    return;
+  }
+  struct timeval tv;
+  tv.tv_sec = record.syncedAt + elapsedUs / 1000000;
+  tv.tv_usec = elapsedUs % 1000000;
+  settimeofday(&tv, nullptr);
+#elif ESP32
+  // The system time runs through deep sleep, trust it when it follows the sync
+  uint32_t now = time(nullptr);
+  if (now < record.syncedAt || now - record.syncedAt > WIFIMESSAGING_CLOCK_MAX_AGE_S) {
+    WIFIMESSAGING_LOGD("Saved clock too old");
+    return;
+  }
+#endif
+
+  clockSet = true;
+  WIFIMESSAGING_LOGI("Restored clock, synced %lu s ago", (unsigned long)(time(nullptr) - record.syncedAt));
+}
+
+void WifiMessaging::SaveClock() {
+  ClockRecord record;
+  record.syncedAt = time(nullptr);
+#ifdef ESP8266
+  record.rtcTicks = system_get_rtc_time();
+  record.rtcCali = system_rtc_clock_cali_proc();
+#elif ESP32
+  record.rtcTicks = 0;
+  record.rtcCali = 0;
+#endif
+  WifiMessagingRtc::write(WIFIMESSAGING_RTC_CLOCK, RTC_TAG_CLOCK, &record, sizeof(record));
+}
+
+void WifiMessaging::onTimeSet(bool from_sntp) {
+  if (!from_sntp) return;  // set by RestoreClock()
+
+  clockSet = true;
+  if (ntpTiming) metricsData.phases[PhaseNtpSync].record(millis() - ntpStart);
+  ntpTiming = false;
+  SaveClock();
+  SaveDnsCache();
+  if (StatusNTP == ConnectionInBetween) PostServiceEvent(ServiceNTP, true);
+
+  time_t now = time(nullptr);
+  struct tm timeinfo;
+  localtime_r(&now, &timeinfo);
+  WIFIMESSAGING_LOGD("Localtime: %s", asctime(&timeinfo));
+}
+
+#ifdef ESP32
+
+void WifiMessaging::time_sync_static(struct timeval *tv) {
+  // runs in the lwIP task, loop() takes it
+  WifiMessaging::instance().ntpSynced = true;
+}
+
+#endif
+
+// ********************  DNS  ********************
+
+#define RTC_TAG_DNS 0x444E
+#define DNS_STALE_RECHECK_MS 30000  ///< while DNS fails, lookups this far apart and the stale address in between
+
+/**
+ * @brief Entry of the DNS cache as kept in RTC memory
+ */
+struct DnsCacheRecord {
+  uint32_t host;        ///< CRC of the host name, 0 for a free entry
+  uint32_t ip;
+  uint32_t resolvedAt;  ///< epoch seconds
+};
+
+static_assert(sizeof(DnsCacheRecord) * WIFIMESSAGING_DNS_CACHE_SIZE + 8 <= 8 * 4,
+              "DNS cache exceeds its RTC memory blocks");
+
+WifiMessaging::DnsCacheEntry *WifiMessaging::FindDnsEntry(const char *host) {
+  if (!dnsRestored) RestoreDnsCache();
+  uint32_t crc = WifiMessagingRtc::crc32(host, strlen(host));
+  for (DnsCacheEntry &entry : dnsCache)
+    if (entry.host == crc) return &entry;
+  return nullptr;
+}
+
+bool WifiMessaging::CachedHost(const char *host, IPAddress &ip) {
+  DnsCacheEntry *entry = FindDnsEntry(host);
+  if (entry == nullptr || entry->failing || millis() - entry->resolvedAt >= WIFIMESSAGING_DNS_TTL_S * 1000UL)
+    return false;
+  ip = entry->ip;
+  return true;
+}
+
+WifiMessaging::dnsAnswer WifiMessaging::ResolveHost(const char *host, IPAddress &ip, uint32_t since,
+                                                    uint32_t wait_ms) {
+  DnsCacheEntry *entry = FindDnsEntry(host);
+  if (entry && entry->failing && millis() - entry->failedAt < DNS_STALE_RECHECK_MS) {
+    ip = entry->ip;
+    return DnsStale;
+  }
+
+#ifdef ESP8266
+  int found = WiFi.hostByName(host, ip, wait_ms);
+#elif ESP32
+  // WiFi.hostByName() waits out the DNS timeout of the core
+  int found = LookUpHost(host, ip);
+#endif
+  uint32_t now = millis();
+  if (found == 1) {
+    if (entry == nullptr) {
+      // a free entry, or the one resolved longest ago
+      entry = &dnsCache[0];
+      for (DnsCacheEntry &candidate : dnsCache) {
+        if (!candidate.host) {
+          entry = &candidate;
+          break;
+        }
+        if (now - candidate.resolvedAt > now - entry->resolvedAt) entry = &candidate;
+      }
+      entry->host = WifiMessagingRtc::crc32(host, strlen(host));
+    }
+    if (entry->failing) WIFIMESSAGING_LOGI("DNS answers for %s again", host);
+    entry->ip = ip;
+    entry->resolvedAt = now;
+    entry->failing = false;
+    SaveDnsCache();
+    return DnsResolved;
+  }
+
+  if (now - since < WIFIMESSAGING_DNS_STALE_AFTER_MS) return DnsPending;
+  if (entry == nullptr || now - entry->resolvedAt >= WIFIMESSAGING_DNS_STALE_MAX_S * 1000UL) return DnsPending;
+  entry->failing = true;
+  entry->failedAt = now;
+  ip = entry->ip;
+  WIFIMESSAGING_LOGW("DNS failed for %s, using its address of %lu s ago", host,
+                     (unsigned long)((now - entry->resolvedAt) / 1000));
+  return DnsStale;
+}
+
+#ifdef ESP32
+/**
+ * @brief dns_gethostbyname() as the TCP/IP task runs it, under the core lock where lwIP has one
+ */
+struct DnsLookupCall {
+  struct tcpip_api_call_data call;  ///< first, tcpip_api_call() hands it back
+  const char *host;
+  ip_addr_t address;
+  dns_found_callback found;
+  void *lookup;
+};
+
+static err_t StartDnsLookup(struct tcpip_api_call_data *data) {
+  DnsLookupCall *call = reinterpret_cast<DnsLookupCall *>(data);
+  return dns_gethostbyname(call->host, &call->address, call->found, call->lookup);
+}
+
+int8_t WifiMessaging::LookUpHost(const char *host, IPAddress &ip) {
+  uint32_t crc = WifiMessagingRtc::crc32(host, strlen(host));
+  DnsLookup *lookup = nullptr;
+  for (DnsLookup &candidate : dnsLookups) {
+    if (candidate.host == crc) lookup = &candidate;
+  }
+  if (lookup) {
+    int8_t state = lookup->state;
+    if (state == 0) return 0;
+    if (state == 1) ip = IPAddress(lookup->ip.load());
+    lookup->host = 0;
+    return state;
+  }
+
+  for (DnsLookup &candidate : dnsLookups) {
+    if (!candidate.host) lookup = &candidate;
+  }
+  // one lookup per host of the cache at a time
+  if (lookup == nullptr) return 0;
+  lookup->state = 0;
+  DnsLookupCall call;
+  call.host = host;
+  call.found = DnsFound;
+  call.lookup = lookup;
+  err_t err = tcpip_api_call(StartDnsLookup, &call.call);
+  if (err == ERR_OK && IP_IS_V4(&call.address)) {
+    ip = IPAddress(ip4_addr_get_u32(ip_2_ip4(&call.address)));
+    return 1;
+  }
+  if (err != ERR_INPROGRESS) return -1;
+  lookup->host = crc;
+  return 0;
+}
+
+void WifiMessaging::DnsFound(const char *, const ip_addr_t *ipaddr, void *arg) {
+  // in the TCP/IP task; the slot lives as long as the WifiMessaging object
+  DnsLookup *lookup = static_cast<DnsLookup *>(arg);
+  if (ipaddr && IP_IS_V4(ipaddr)) {
+    lookup->ip = ip4_addr_get_u32(ip_2_ip4(ipaddr));
+    lookup->state = 1;
+  } else {
+    lookup->state = -1;
+  }
+}
+#endif
+
+void WifiMessaging::RestoreDnsCache() {
+  dnsRestored = true;
+#if WIFIMESSAGING_DNS_RTC
+  DnsCacheRecord records[WIFIMESSAGING_DNS_CACHE_SIZE];
+  if (!WifiMessagingRtc::read(WIFIMESSAGING_RTC_DNS, RTC_TAG_DNS, records, sizeof(records))) return;
+
+  uint32_t now = time(nullptr);
+  for (size_t i = 0; i < WIFIMESSAGING_DNS_CACHE_SIZE; i++) {
+    const DnsCacheRecord &record = records[i];
+    if (!record.host) continue;
+    // without the clock the age is unknown: expired, for when DNS fails
+    uint32_t age = clockSet && now >= record.resolvedAt ? now - record.resolvedAt : WIFIMESSAGING_DNS_TTL_S;
+    if (age >= WIFIMESSAGING_DNS_STALE_MAX_S) continue;
+    dnsCache[i].host = record.host;
+    dnsCache[i].ip = record.ip;
+    dnsCache[i].resolvedAt = millis() - age * 1000;
+  }
+  WIFIMESSAGING_LOGD("Restored DNS cache");
+#endif
+}
+
+void WifiMessaging::SaveDnsCache() {
+#if WIFIMESSAGING_DNS_RTC
+  // onTimeSet() saves it once the clock is set; not before the kept one was read
+  if (!clockSet || !dnsRestored) return;
+  DnsCacheRecord records[WIFIMESSAGING_DNS_CACHE_SIZE];
+  uint32_t now = time(nullptr);
+  for (size_t i = 0; i < WIFIMESSAGING_DNS_CACHE_SIZE; i++) {
+    const DnsCacheEntry &entry = dnsCache[i];
+    records[i].host = entry.host;
+    records[i].ip = entry.ip;
+    records[i].resolvedAt = now - (millis() - entry.resolvedAt) / 1000;
+  }
+  WifiMessagingRtc::write(WIFIMESSAGING_RTC_DNS, RTC_TAG_DNS, records, sizeof(records));
+#endif
+}
+
+// ********************  SECURE  ********************
+
+#if WIFIMESSAGING_ENABLE_TELEGRAM && defined(ESP8266)
+
+#define RTC_TAG_TLS_SESSION 0x5453
+#define RTC_TAG_TLS_FRAGMENT 0x4D46
+
+/**
+ * @brief TLS session as kept in RTC memory
+ */
+struct TlsSessionRecord {
+  uint32_t savedAt;  ///< epoch seconds of the full handshake
+  uint32_t host;     ///< CRC of the host the session belongs to
+  uint8_t session[sizeof(BearSSL::Session)];
+};
+
+static_assert(sizeof(TlsSessionRecord) + 8 <= 28 * 4, "TLS session record exceeds its RTC memory blocks");
+
+void WifiMessaging::RestoreTlsSession() {
+  TlsSessionRecord record;
+  if (!WifiMessagingRtc::read(WIFIMESSAGING_RTC_TLS_SESSION, RTC_TAG_TLS_SESSION, &record, sizeof(record))) {
+    WIFIMESSAGING_LOGD("No saved TLS session");
+    return;
+  }
+
+  uint32_t now = time(nullptr);
+  if (record.host != WifiMessagingRtc::crc32(TELEGRAM_HOST, strlen(TELEGRAM_HOST)) || now < record.savedAt ||
+      now - record.savedAt > WIFIMESSAGING_TLS_SESSION_LIFETIME_S) {
+    WIFIMESSAGING_LOGD("Saved TLS session expired");
+    WifiMessagingRtc::erase(WIFIMESSAGING_RTC_TLS_SESSION);
+    return;
+  }
+
+  memcpy((void *)&session, record.session, sizeof(session));
+  tlsSessionCrc = WifiMessagingRtc::crc32(record.session, sizeof(record.session));
+  WIFIMESSAGING_LOGD("Restored TLS session of %lu s ago", (unsigned long)(now - record.savedAt));
+}
+
+void WifiMessaging::SaveTlsSession() {
+  uint32_t crc = WifiMessagingRtc::crc32((const void *)&session, sizeof(session));
+  if (crc == tlsSessionCrc) return;  // resumed, or saved before
+
+  TlsSessionRecord record;
+  record.savedAt = time(nullptr);
+  record.host = WifiMessagingRtc::crc32(TELEGRAM_HOST, strlen(TELEGRAM_HOST));
+  memcpy(record.session, (const void *)&session, sizeof(session));
+  if (WifiMessagingRtc::write(WIFIMESSAGING_RTC_TLS_SESSION, RTC_TAG_TLS_SESSION, &record, sizeof(record))) {
+    tlsSessionCrc = crc;
+    WIFIMESSAGING_LOGD("Saved TLS session");
+  }
+}
+
+/**
+ * @brief Receive buffer that connected to a host, as kept in RTC memory
+ */
+struct TlsFragmentRecord {
+  uint32_t host;  ///< CRC of the host
+  uint16_t fragment;
+  uint16_t reserved;
+};
+
+uint16_t WifiMessaging::TlsFragment() {
+  if (tlsFragment) return tlsFragment;
+  if (tlsProbedFragment) return tlsProbedFragment;
+
+  TlsFragmentRecord record;
+  if (WifiMessagingRtc::read(WIFIMESSAGING_RTC_TLS_FRAGMENT, RTC_TAG_TLS_FRAGMENT, &record, sizeof(record)) &&
+      record.host == WifiMessagingRtc::crc32(TELEGRAM_HOST, strlen(TELEGRAM_HOST)) &&
+      record.fragment < TLS_MAX_FRAGMENT) {
+    tlsFragment = record.fragment;
+    return tlsFragment;
+  }
+
+  // A server with MFLN accepts each of 512 to 4096 (RFC 6066), so one probe of the
+  // smallest does. Kept in RTC memory once a connect with it completes. A failed probe may
+  // be the network: without MFLN only for this link, the next link probes again.
+  if (BearSSL::WiFiClientSecure::probeMaxFragmentLength(TELEGRAM_HOST, TELEGRAM_SSL_PORT, 512)) {
+    WIFIMESSAGING_LOGI("TLS maximum fragment length 512");
+    tlsProbedFragment = 512;
+  } else {
+    WIFIMESSAGING_LOGI("TLS maximum fragment length not supported");
+    tlsProbedFragment = TLS_MAX_FRAGMENT;
+  }
+  return tlsProbedFragment;
+}
+
+void WifiMessaging::SaveTlsFragment(uint16_t fragment) {
+  tlsFragment = fragment;
+  TlsFragmentRecord record = {WifiMessagingRtc::crc32(TELEGRAM_HOST, strlen(TELEGRAM_HOST)), fragment, 0};
+  WifiMessagingRtc::write(WIFIMESSAGING_RTC_TLS_FRAGMENT, RTC_TAG_TLS_FRAGMENT, &record, sizeof(record));
+}
+
+bool WifiMessaging::AddTrustAnchor(const uint8_t *der, size_t length) {
+  if (der == nullptr || length == 0 || length > UINT16_MAX || tlsRootCount >= WIFIMESSAGING_TLS_ROOTS) return false;
+  tlsRoots[tlsRootCount++] = {der, (uint16_t)length};
+  return true;
+}
+
+void WifiMessaging::LoadTrustAnchors() {
+  for (; tlsRootsLoaded < tlsRootCount; tlsRootsLoaded++) {
+    const TrustAnchor &root = tlsRoots[tlsRootsLoaded];
+    // BearSSL reads the DER bytewise, which PROGMEM does not allow: decode from a copy
+    uint8_t *der = (uint8_t *)malloc(root.length);
+    if (der == nullptr) return;  // next connection
+    memcpy_P(der, root.der, root.length);
+    if (!cert.append(der, root.length)) WIFIMESSAGING_LOGE("Root %u is no certificate", tlsRootsLoaded);
+    free(der);
+  }
+  WIFIMESSAGING_LOGD("Loaded %u trust anchors", (unsigned)cert.getCount());
+}
+
+#endif
+
+// ********************  DUTY CYCLE  ********************
+
+#define RTC_TAG_DUTY 0x4443
+
+/**
+ * @brief Duty cycles as kept in RTC memory
+ */
+struct DutyCycleRecord {
+  uint32_t cycles;
+  uint32_t lastAwakeMs;
+  uint32_t totalAwakeMs;
+  uint16_t lastUndelivered;
+  uint16_t sleeping;  ///< 1 from the deep sleep until the wake reads it
+};
+
+void WifiMessaging::RestoreDutyCycle() {
+  DutyCycleRecord record;
+  if (!WifiMessagingRtc::read(WIFIMESSAGING_RTC_DUTY_CYCLE, RTC_TAG_DUTY, &record, sizeof(record))) return;
+  dutyData.cycles = record.cycles;
+  dutyData.lastAwakeMs = record.lastAwakeMs;
+  dutyData.totalAwakeMs = record.totalAwakeMs;
+  dutyData.lastUndelivered = record.lastUndelivered;
+  dutyData.woke = record.sleeping;
+  if (record.sleeping) {
+    // a reset later on is no wake
+    record.sleeping = 0;
+    WifiMessagingRtc::write(WIFIMESSAGING_RTC_DUTY_CYCLE, RTC_TAG_DUTY, &record, sizeof(record));
+  }
+}
+
+void WifiMessaging::deliverAndSleep(uint32_t sleep_s, uint32_t awake_ms) {
+  dutySleepS = sleep_s ? sleep_s : 1;
+  dutyAwakeMs = awake_ms;
+
+  // Only what the queued messages need
+  uint16_t needed = 0;
+#if WIFIMESSAGING_ENABLE_MQTT
+  if (QueuedPublishes()) needed |= ServiceClosure(ServiceMQTT);
+#endif
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  if (!telegramOutbox.empty() || PendingInOutbox()) needed |= ServiceClosure(ServiceTelegram);
+#endif
+  if (!needed) {
+    WIFIMESSAGING_LOGD("Duty cycle: nothing to deliver");
+    return;
+  }
+  // NTP also when the clock kept in RTC memory is too old to restore
+  if (!clockSet) RestoreClock();
+  if (!clockSet) needed |= ServiceNTP;
+  connectionServices &= needed;
+  WIFIMESSAGING_LOGD("Duty cycle: services 0x%x, then sleep %lu s", connectionServices,
+                     (unsigned long)dutySleepS);
+  connectToWiFi();
+}
+
+void WifiMessaging::StepDutyCycle() {
+  size_t left = 0;
+#if WIFIMESSAGING_ENABLE_MQTT
+  left += QueuedPublishes();
+#endif
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  // not the sent entries behind a pending one, the outbox only drops them from the front
+  left += PendingInOutbox();
+#endif
+  if (left && (int32_t)(millis() - dutyAwakeMs) < 0) return;
+  if (left) WIFIMESSAGING_LOGW("Duty cycle deadline, %u messages undelivered", (unsigned)left);
+  dutyData.lastUndelivered = left;
+  SleepNow();
+}
+
+void WifiMessaging::SleepNow() {
+  // close cleanly, the broker ends the session at once instead of after the keep-alive
+#if WIFIMESSAGING_ENABLE_MQTT
+  if (mqttClient.connected()) mqttClient.disconnect();
+#endif
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  secureClient.stop();
+#endif
+  if (wifiWanted) disconnectFromWiFi();
+#if WIFIMESSAGING_SPOOL
+  // what was delivered does not come again after the wake, what was not waits in flash
+  AckSpools();
+#if WIFIMESSAGING_ENABLE_MQTT
+  SpoolMqttOutbox();
+#endif
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  SpoolTelegramOutbox();
+#endif
+#endif
+
+  dutyData.cycles++;
+  dutyData.lastAwakeMs = millis();
+  dutyData.totalAwakeMs += dutyData.lastAwakeMs;
+  if (dutyData.totalAwakeMs < dutyData.lastAwakeMs) dutyData.totalAwakeMs = UINT32_MAX;
+  DutyCycleRecord record = {dutyData.cycles, dutyData.lastAwakeMs, dutyData.totalAwakeMs, dutyData.lastUndelivered,
+                            1};
+  WifiMessagingRtc::write(WIFIMESSAGING_RTC_DUTY_CYCLE, RTC_TAG_DUTY, &record, sizeof(record));
+  WIFIMESSAGING_LOGI("Duty cycle %lu: %lu ms awake, sleep %lu s", (unsigned long)dutyData.cycles,
+                     (unsigned long)dutyData.lastAwakeMs, (unsigned long)dutySleepS);
+  WifiMessagingLog::flush();
+
+  dutyAsleep = true;
+#ifdef ESP8266
+  // wakes through GPIO16 wired to RST
+  uint64_t us = (uint64_t)dutySleepS * 1000000;
+  if (us > ESP.deepSleepMax()) us = ESP.deepSleepMax();
+  ESP.deepSleep(us, WAKE_RF_DEFAULT);
+#elif ESP32
+  esp_sleep_enable_timer_wakeup((uint64_t)dutySleepS * 1000000);
+  esp_deep_sleep_start();
+#endif
+}
+
+#if WIFIMESSAGING_SPOOL
+
+// ********************  SPOOL  ********************
+
+bool WifiMessaging::beginSpool(fs::FS &fs, const char *dir) {
+  char path[24];
+  if (strlen(dir) > sizeof(path) - sizeof("/telegram")) return false;
+  // LittleFS creates one level of directories at a time
+  if (!fs.exists(dir) && !fs.mkdir(dir)) return false;
+  bool ready = true;
+#if WIFIMESSAGING_ENABLE_MQTT
+  snprintf(path, sizeof(path), "%s/mqtt", dir);
+  ready = mqttSpool.begin(fs, path) && ready;
+#endif
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  snprintf(path, sizeof(path), "%s/telegram", dir);
+  ready = telegramSpool.begin(fs, path) && ready;
+#endif
+  return ready;
+}
+
+/**
+ * @brief Ack the spool up to done, and up to skipped once no record read before it is in the outbox
+ */
+template <typename Outbox>
+static void AckSpool(WifiMessagingSpool &spool, const Outbox &outbox, uint32_t &done, uint32_t &skipped) {
+  if (skipped) {
+    bool earlier = false;
+    for (size_t i = 0; i < outbox.size() && !earlier; i++) {
+      uint32_t spooled = outbox.at(i).spooled;
+      earlier = spooled && spooled < skipped;
+    }
+    if (!earlier) {
+      if (skipped > done) done = skipped;
+      skipped = 0;
+    }
+  }
+  if (done) {
+    spool.ack(done);
+    done = 0;
+  }
+}
+
+void WifiMessaging::AckSpools() {
+#if WIFIMESSAGING_ENABLE_MQTT
+  AckSpool(mqttSpool, mqttOutbox, mqttSpoolDone, mqttSpoolSkipped);
+#endif
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  AckSpool(telegramSpool, telegramOutbox, telegramSpoolDone, telegramSpoolSkipped);
+#endif
+}
+
+#if WIFIMESSAGING_ENABLE_MQTT
+// MQTT spool record: topic length, qos << 1 | retained, topic, payload
+
+bool WifiMessaging::MqttToSpool() const {
+  return mqttSpool.ready() && (mqttSpool.pending() || StatusMQTT != ConnectionActive || mqttOutbox.full());
+}
+
+bool WifiMessaging::SpoolMqttMessage(const char *topic, const uint8_t *payload, size_t length, bool retained,
+                                     uint8_t qos) {
+  uint8_t record[2 + WIFIMESSAGING_MQTT_TOPIC_SIZE + WIFIMESSAGING_MQTT_PAYLOAD_SIZE];
+  size_t topicLength = strlen(topic);
+  record[0] = topicLength;
+  record[1] = qos << 1 | retained;
+  memcpy(record + 2, topic, topicLength);
+  memcpy(record + 2 + topicLength, payload, length);
+  return mqttSpool.append(record, 2 + topicLength + length);
+}
+
+void WifiMessaging::SpoolMqttOutbox() {
+  // unless messages of the spool are in the outbox or come before
+  if (!mqttSpool.ready() || mqttSpool.pending()) return;
+  while (!mqttOutbox.empty()) {
+    MqttOutboxEntry &entry = mqttOutbox.front();
+    if (!SpoolMqttMessage(entry.topic, entry.payload, entry.length, entry.retained, entry.qos)) return;
+    mqttOutbox.pop();
+  }
+}
+
+void WifiMessaging::ReplayMqttSpool() {
+  uint8_t record[2 + WIFIMESSAGING_MQTT_TOPIC_SIZE + WIFIMESSAGING_MQTT_PAYLOAD_SIZE];
+  for (uint8_t i = 0; i < WIFIMESSAGING_MQTT_BATCH && !mqttOutbox.full(); i++) {
+    uint32_t sequence;
+    uint16_t length = mqttSpool.read(record, sizeof(record), sequence);
+    if (length == 0) return;
+    size_t topicLength = record[0];
+    if (length < 2 + topicLength || topicLength >= WIFIMESSAGING_MQTT_TOPIC_SIZE) {
+      WIFIMESSAGING_LOGW("MQTT spool record %lu unreadable, skipped", (unsigned long)sequence);
+      mqttSpoolSkipped = sequence;  // see AckSpool()
+      continue;
+    }
+    MqttOutboxEntry *entry = mqttOutbox.push();
+    memcpy(entry->topic, record + 2, topicLength);
+    entry->topic[topicLength] = '\0';
+    entry->length = length - 2 - topicLength;
+    memcpy(entry->payload, record + 2 + topicLength, entry->length);
+    entry->qos = record[1] >> 1;
+    entry->retained = record[1] & 1;
+    entry->spooled = sequence;
+  }
+}
+#endif
+
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+// Telegram spool record: priority, chats, parse_mode with its terminator, text
+
+bool WifiMessaging::TelegramToSpool() const {
+  return telegramSpool.ready() &&
+         (telegramSpool.pending() || StatusTelegram != ConnectionActive || telegramOutbox.full());
+}
+
+bool WifiMessaging::SpoolTelegramMessage(const TelegramOutboxEntry &entry) {
+  uint8_t record[2 + sizeof(entry.parse_mode) + sizeof(entry.text)];
+  size_t modeLength = strlen(entry.parse_mode) + 1;
+  size_t textLength = strlen(entry.text);
+  record[0] = entry.priority;
+  record[1] = entry.chats;
+  memcpy(record + 2, entry.parse_mode, modeLength);
+  memcpy(record + 2 + modeLength, entry.text, textLength);
+  return telegramSpool.append(record, 2 + modeLength + textLength);
+}
+
+void WifiMessaging::SpoolTelegramOutbox() {
+  // unless messages of the spool are in the outbox or come before
+  if (!telegramSpool.ready() || telegramSpool.pending()) return;
+  while (!telegramOutbox.empty()) {
+    TelegramOutboxEntry &entry = telegramOutbox.front();
+    if (entry.chats) {
+      if (!SpoolTelegramMessage(entry)) return;
+      // no status while in the spool
+      entry.status = DeliveryUnknown;
+#if WIFIMESSAGING_NETWORK_TASK
+      if (networkDetached) ShareMessageStatus(entry);
+#endif
+    }
+    telegramOutbox.pop();
+  }
+}
+
+void WifiMessaging::ReplayTelegramSpool() {
+  uint8_t record[2 + sizeof(TelegramOutboxEntry::parse_mode) + sizeof(TelegramOutboxEntry::text)];
+  uint8_t known = 0;
+  for (uint8_t i = 0; i < telegramChatCount; i++) {
+    if (telegramChats[i].id) known |= 1 << i;
+  }
+  while (!telegramOutbox.full()) {
+    uint32_t sequence;
+    uint16_t length = telegramSpool.read(record, sizeof(record), sequence);
+    if (length == 0) return;
+    const char *parse_mode = (const char *)record + 2;
+    size_t modeLength = length > 2 ? strnlen(parse_mode, length - 2) : length;
+    uint8_t chats = record[1] & known;
+    if (length < 3 + modeLength || modeLength >= sizeof(TelegramOutboxEntry::parse_mode) || chats == 0) {
+      WIFIMESSAGING_LOGW("Telegram spool record %lu unreadable, skipped", (unsigned long)sequence);
+      telegramSpoolSkipped = sequence;  // see AckSpool()
+      continue;
+    }
+    TelegramOutboxEntry *entry = telegramOutbox.push();
+    entry->ticket = NextTicket();
+    entry->status = DeliveryQueued;
+    entry->priority = (messagePriority)record[0];
+    entry->chats = chats;
+    entry->failed = 0;
+    entry->attempts = 0;
+    entry->spooled = sequence;
+    strcpy(entry->parse_mode, parse_mode);
+    size_t textLength = length - 3 - modeLength;
+    if (textLength > sizeof(entry->text) - 1) textLength = sizeof(entry->text) - 1;
+    memcpy(entry->text, parse_mode + modeLength + 1, textLength);
+    entry->text[textLength] = '\0';
+  }
+}
+#endif
+
+#endif
+
+// ********************  METRICS  ********************
+
+void WifiMessaging::resetMetrics() {
+  metricsData = metricsReport();
+  metricsData.since = millis();
+  metricsHeapAt = millis();
+}
+
+#if WIFIMESSAGING_ENABLE_MQTT
+void WifiMessaging::SetMetricsTopic(const char *topic, uint32_t interval_ms, const char *firmware) {
+  metricsTopic = topic;
+  metricsInterval = interval_ms;
+  metricsFirmware = firmware;
+  metricsPublishAt = millis() + interval_ms;
+}
+#endif
+
+void WifiMessaging::SampleHeap() {
+  metricsHeapAt = millis() + WIFIMESSAGING_METRICS_HEAP_MS;
+  uint32_t free = ESP.getFreeHeap();
+#ifdef ESP8266
+  uint32_t block = ESP.getMaxFreeBlockSize();
+#elif ESP32
+  uint32_t block = ESP.getMaxAllocHeap();
+#endif
+  bool first = metricsData.heapFreeHigh == 0;
+  if (first || free < metricsData.heapFreeLow) metricsData.heapFreeLow = free;
+  if (free > metricsData.heapFreeHigh) metricsData.heapFreeHigh = free;
+  if (first || block < metricsData.maxBlockLow) metricsData.maxBlockLow = block;
+  if (block > metricsData.maxBlockHigh) metricsData.maxBlockHigh = block;
+}
+
+#if WIFIMESSAGING_ENABLE_MQTT
+
+/**
+ * @brief snprintf() at buffer + length, left out when it does not fit whole
+ */
+static size_t AppendPrintf(char *buffer, size_t size, size_t length, const char *format, ...) {
+  if (length + 1 >= size) return length;
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buffer + length, size - length, format, args);
+  va_end(args);
+  if (n < 0 || length + n >= size) {
+    buffer[length] = '\0';
+    return length;
+  }
+  return length + n;
+}
+
+void WifiMessaging::PublishMetrics() {
+  static const char *const keys[PhaseCount] = {"wa", "ip", "ntp", "tlf", "tlr", "mq", "tg", "lp"};
+
+  metricsPublishAt = millis() + metricsInterval;
+  // publish() takes the fixed header, the topic and the payload in the buffer of mqttClient
+  size_t header = MQTT_MAX_HEADER_SIZE + 2 + strlen(metricsTopic);
+  if (mqttClient.getBufferSize() <= header) {
+    WIFIMESSAGING_LOGW("Metrics topic leaves no room in the MQTT buffer");
+    return;
+  }
+  char payload[WIFIMESSAGING_METRICS_SIZE];
+  size_t size = mqttClient.getBufferSize() - header + 1;
+  if (size > sizeof(payload)) size = sizeof(payload);
+  // a field that does not fit is left out whole
+  size_t length = 0;
+  if (metricsFirmware) length = AppendPrintf(payload, size, length, "fw=%s ", metricsFirmware);
+  length = AppendPrintf(payload, size, length, "up=%lu", (unsigned long)((millis() - metricsData.since) / 1000));
+  for (uint8_t i = 0; i < PhaseCount; i++) {
+    const WifiMessagingHistogram &h = metricsData.phases[i];
+    if (h.count == 0) continue;
+    length = AppendPrintf(payload, size, length, " %s=%lu/%lu/%lu", keys[i], (unsigned long)h.count,
+                          (unsigned long)h.quantile(50), (unsigned long)h.max);
+  }
+  length = AppendPrintf(payload, size, length, " hf=%lu/%lu mb=%lu/%lu",
+                        (unsigned long)metricsData.heapFreeLow, (unsigned long)metricsData.heapFreeHigh,
+                        (unsigned long)metricsData.maxBlockLow, (unsigned long)metricsData.maxBlockHigh);
+
+  if (!mqttClient.publish(metricsTopic, (const uint8_t *)payload, length))
+    WIFIMESSAGING_LOGW("Metrics not published");
+}
+
+#endif
+
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+
+// ********************  TELEGRAM  ********************
+
+bool WifiMessaging::sendMessage(const String &text, const String &parse_mode) {
+  return queueMessage(text.c_str(), parse_mode.c_str()) != 0;
+}
+
+bool WifiMessaging::sendMessage(const char *text, const char *parse_mode) {
+  return queueMessage(text, parse_mode) != 0;
+}
+
+uint16_t WifiMessaging::queueMessage(const char *text, const char *parse_mode) {
+  return queueMessage(text, strlen(text), parse_mode);
+}
+
+uint16_t WifiMessaging::queueMessage(const char *text, size_t length, const char *parse_mode) {
+  TelegramOutboxEntry *entry = QueueOutboxEntry(parse_mode, 1, PriorityRoutine);
+  if (entry == nullptr) return 0;
+  if (length > sizeof(entry->text) - 1) length = sizeof(entry->text) - 1;
+  memcpy(entry->text, text, length);
+  entry->text[length] = '\0';
+  return CommitOutboxEntry(entry);
+}
+
+uint16_t WifiMessaging::queueMessageTo(uint8_t chats, messagePriority priority, const char *text,
+                                       const char *parse_mode) {
+  TelegramOutboxEntry *entry = QueueOutboxEntry(parse_mode, chats, priority);
+  if (entry == nullptr) return 0;
+  strncpy(entry->text, text, sizeof(entry->text) - 1);
+  entry->text[sizeof(entry->text) - 1] = '\0';
+  return CommitOutboxEntry(entry);
+}
+
+uint16_t WifiMessaging::queueMessagef(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  uint16_t ticket = VQueueMessagef(1, PriorityRoutine, "", format, args);
+  va_end(args);
+  return ticket;
+}
+
+uint16_t WifiMessaging::queueMessagefTo(uint8_t chats, messagePriority priority, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  uint16_t ticket = VQueueMessagef(chats, priority, "", format, args);
+  va_end(args);
+  return ticket;
+}
+
+uint16_t WifiMessaging::vqueueMessagef(const char *parse_mode, const char *format, va_list args) {
+  return VQueueMessagef(1, PriorityRoutine, parse_mode, format, args);
+}
+
+uint16_t WifiMessaging::VQueueMessagef(uint8_t chats, messagePriority priority, const char *parse_mode,
+                                       const char *format, va_list args) {
+  TelegramOutboxEntry *entry = QueueOutboxEntry(parse_mode, chats, priority);
+  if (entry == nullptr) return 0;
+  vsnprintf(entry->text, sizeof(entry->text), format, args);
+  return CommitOutboxEntry(entry);
+}
+
+WifiMessaging::TelegramOutboxEntry *WifiMessaging::QueueOutboxEntry(const char *parse_mode, uint8_t chats,
+                                                                    messagePriority priority) {
+  if (!(connectionServices & ServiceTelegram)) return nullptr;
+
+  uint8_t known = 0;
+  for (uint8_t i = 0; i < telegramChatCount; i++) {
+    if (telegramChats[i].id) known |= 1 << i;
+  }
+  chats &= known;
+  if (chats == 0) {
+    WIFIMESSAGING_LOGW("Telegram message to no chat");
+    return nullptr;
+  }
+
+  TelegramOutboxEntry *entry;
+#if WIFIMESSAGING_NETWORK_TASK
+  // filled in place, then copied across by CommitOutboxEntry()
+  if (networkDetached)
+    entry = &telegramStaging;
+  else
+#endif
+#if WIFIMESSAGING_SPOOL
+  // filled in place, then appended to the spool by CommitOutboxEntry()
+  if (TelegramToSpool())
+    entry = &telegramStaging;
+  else
+#endif
+    entry = telegramOutbox.push();
+  if (entry == nullptr) {
+    WIFIMESSAGING_LOGW("Telegram outbox full");
+    return nullptr;
+  }
+  entry->ticket = NextTicket();
+  entry->status = DeliveryQueued;
+  entry->priority = priority;
+  entry->chats = chats;
+  entry->failed = 0;
+  entry->attempts = 0;
+#if WIFIMESSAGING_SPOOL
+  entry->spooled = 0;
+#endif
+  strncpy(entry->parse_mode, parse_mode ? parse_mode : "", sizeof(entry->parse_mode) - 1);
+  entry->parse_mode[sizeof(entry->parse_mode) - 1] = '\0';
+  return entry;
+}
+
+uint16_t WifiMessaging::CommitOutboxEntry(TelegramOutboxEntry *entry) {
+#if WIFIMESSAGING_NETWORK_TASK
+  if (networkDetached) {
+    // queued before it crosses, the network task may finish it at once
+    ShareMessageStatus(*entry);
+    if (telegramOutgoing.push(*entry)) return entry->ticket;
+    telegramStatusShared[entry->ticket % (sizeof(telegramStatusShared) / sizeof(telegramStatusShared[0]))] = 0;
+    WIFIMESSAGING_LOGW("Telegram outbox full");
+    return 0;
+  }
+#endif
+#if WIFIMESSAGING_SPOOL
+  if (entry == &telegramStaging) {
+    if (SpoolTelegramMessage(*entry)) return entry->ticket;
+    WIFIMESSAGING_LOGW("Telegram spool full");
+    return 0;
+  }
+#endif
+  return entry->ticket;
+}
+
+uint16_t WifiMessaging::NextTicket() {
+  uint16_t ticket;
+  while ((ticket = ++telegramTicket) == 0) {
+  }
+  return ticket;
+}
+
+uint8_t WifiMessaging::AddTelegramChat(const char *chat_id) {
+  // index 0 stays the chat of SetTelegram(), before or after this call
+  uint8_t index = telegramChatCount ? telegramChatCount : 1;
+  if (index >= WIFIMESSAGING_TELEGRAM_CHATS || chat_id == nullptr) return 0;
+  telegramChats[index].id = chat_id;
+  telegramChatCount = index + 1;
+  return 1 << index;
+}
+
+void WifiMessaging::SetTelegramLimits(uint32_t chat_interval_ms, uint32_t global_interval_ms) {
+  telegramChatInterval = chat_interval_ms;
+  telegramGlobalInterval = global_interval_ms;
+}
+
+void WifiMessaging::SetTelegramKeepAlive(uint32_t idle_ms, uint32_t probe_ms, uint8_t pipeline) {
+  telegramIdleMs = idle_ms;
+  telegramProbeMs = probe_ms;
+  telegramPipeline = pipeline < 1 ? 1 : pipeline > WIFIMESSAGING_TELEGRAM_PIPELINE ? WIFIMESSAGING_TELEGRAM_PIPELINE
+                                                                                    : pipeline;
+}
+
+WifiMessaging::deliveryStatus WifiMessaging::messageStatus(uint16_t ticket) {
+  if (ticket == 0) return DeliveryUnknown;
+#if WIFIMESSAGING_NETWORK_TASK
+  if (networkDetached) {
+    uint32_t shared = telegramStatusShared[ticket % (sizeof(telegramStatusShared) / sizeof(telegramStatusShared[0]))];
+    return (shared >> 8) == ticket ? (deliveryStatus)(shared & 0xFF) : DeliveryUnknown;
+  }
+#endif
+  for (size_t i = 0; i < telegramOutbox.capacity(); i++) {
+    if (telegramOutbox.slot(i).ticket == ticket) return telegramOutbox.slot(i).status;
+  }
+  return DeliveryUnknown;
+}
+
+#if WIFIMESSAGING_NETWORK_TASK
+void WifiMessaging::ShareMessageStatus(const TelegramOutboxEntry &entry) {
+  std::atomic<uint32_t> &shared =
+      telegramStatusShared[entry.ticket % (sizeof(telegramStatusShared) / sizeof(telegramStatusShared[0]))];
+  if (entry.status == DeliveryQueued) {
+    shared = (uint32_t)entry.ticket << 8 | entry.status;
+    return;
+  }
+  // unless the sketch has given the slot to a later ticket meanwhile
+  uint32_t queued = (uint32_t)entry.ticket << 8 | DeliveryQueued;
+  shared.compare_exchange_strong(queued, (uint32_t)entry.ticket << 8 | entry.status);
+}
+#endif
+
+size_t WifiMessaging::pendingMessages() const {
+#if WIFIMESSAGING_NETWORK_TASK
+  // the queue first: a message leaving it is already in the shared count
+  if (networkDetached) return telegramOutgoing.size() + telegramPendingShared;
+#endif
+  return PendingInOutbox();
+}
+
+size_t WifiMessaging::PendingInOutbox() const {
+  size_t pending = 0;
+  for (size_t i = 0; i < telegramOutbox.size(); i++) {
+    if (telegramOutbox.at(i).chats) pending++;
+  }
+#if WIFIMESSAGING_SPOOL
+  pending += telegramSpool.unread();
+#endif
+  return pending;
+}
+
+bool WifiMessaging::SendFromOutbox() {
+  uint32_t now = millis();
+  if (telegramInFlightCount >= telegramPipeline) return false;
+  if (telegramRetrying && (int32_t)(now - telegramRetryAt) < 0) return false;
+  if (telegramGlobal.waitMs(now, telegramGlobalInterval, WIFIMESSAGING_TELEGRAM_GLOBAL_BURST)) return false;
+
+  // Urgent first, then oldest first. A chat out of tokens keeps its messages
+  // in order and does not hold up the other chats. So does a chat with a
+  // message in flight, whose response may still be a 429.
+  uint8_t busy = 0;
+  for (uint8_t i = 0; i < telegramInFlightCount; i++) busy |= 1 << telegramInFlight[i].chat;
+  TelegramOutboxEntry *entry = nullptr;
+  uint8_t chat = 0;
+  for (int priority = PriorityUrgent; priority >= PriorityRoutine && !entry; priority--) {
+    for (size_t i = 0; i < telegramOutbox.size() && !entry; i++) {
+      TelegramOutboxEntry &candidate = telegramOutbox.at(i);
+      if (candidate.priority != priority) continue;
+      for (uint8_t c = 0; c < telegramChatCount; c++) {
+        if ((candidate.chats & ~busy & (1 << c)) &&
+            !telegramChats[c].bucket.waitMs(now, telegramChatInterval, WIFIMESSAGING_TELEGRAM_CHAT_BURST)) {
+          entry = &candidate;
+          chat = c;
+          break;
+        }
+      }
+    }
+  }
+  if (entry == nullptr) return false;
+
+  TelegramSend send;
+  send.ticket = entry->ticket;
+  send.chat = chat;
+  bool open = secureClient.connected();
+  bool written = (open || ConnectSecure()) && WriteSendMessage(*entry, telegramChats[chat].id);
+  if (!written && open && telegramAnswered) {
+    // the server closed the connection it had kept, once more on a new one
+    WIFIMESSAGING_LOGD("Telegram connection closed, reconnecting");
+    LoseTelegramConnection();
+    written = ConnectSecure() && WriteSendMessage(*entry, telegramChats[chat].id);
+  }
+  if (!written) {
+    LoseTelegramConnection();
+    FinishTelegramSend(send, 0, nullptr);
+    return true;
+  }
+  now = millis();
+  telegramChats[chat].bucket.take(now, telegramChatInterval);
+  telegramGlobal.take(now, telegramGlobalInterval);
+  if (telegramRequesting == TelegramIdle) {
+    telegramRequesting = TelegramSending;
+    ResetTelegramResponse();
+  }
+  send.sentAt = now;
+  telegramInFlight[telegramInFlightCount++] = send;
+  telegramUsedAt = telegramActiveAt = now;
+  return true;
+}
+
+/**
+ * @brief Character c of a JSON string, escaped
+ *
+ * @param out at least 7 characters
+ * @return size_t characters written
+ */
+static size_t JsonEscape(char c, char *out) {
+  switch (c) {
+    case '"':
+    case '\\':
+      out[0] = '\\';
+      out[1] = c;
+      return 2;
+    case '\n':
+      out[0] = '\\';
+      out[1] = 'n';
+      return 2;
+    default:
+      if ((uint8_t)c < 0x20) return snprintf(out, 7, "\\u%04x", (unsigned)c);
+      out[0] = c;
+      return 1;
+  }
+}
+
+bool WifiMessaging::WriteSendMessage(const TelegramOutboxEntry &entry, const char *chat_id) {
+  char buffer[192];
+  size_t textLength = 0;
+  for (const char *p = entry.text; *p; p++) textLength += JsonEscape(*p, buffer);
+  size_t bodyLength = strlen("{\"chat_id\":\"\",\"text\":\"\"}") + strlen(chat_id) + textLength;
+  if (entry.parse_mode[0]) bodyLength += strlen(",\"parse_mode\":\"\"") + strlen(entry.parse_mode);
+
+  int n = snprintf(buffer, sizeof(buffer),
+                   "POST /bot%s/sendMessage HTTP/1.1\r\nHost: " TELEGRAM_HOST "\r\n"
+                   "Content-Type: application/json\r\nContent-Length: %u\r\nConnection: keep-alive\r\n\r\n"
+                   "{\"chat_id\":\"%s\",\"text\":\"",
+                   this->telegram_bot, (unsigned)bodyLength, chat_id);
+  if (n <= 0 || n >= (int)sizeof(buffer)) return false;
+  size_t length = n;
+
+  // the text in buffer sized pieces, as few TLS records as the stack allows
+  for (const char *p = entry.text; *p; p++) {
+    if (length + 7 > sizeof(buffer)) {
+      if (secureClient.write((const uint8_t *)buffer, length) != length) return false;
+      length = 0;
+    }
+    length += JsonEscape(*p, buffer + length);
+  }
+  if (length + 32 > sizeof(buffer)) {
+    if (secureClient.write((const uint8_t *)buffer, length) != length) return false;
+    length = 0;
+  }
+  if (entry.parse_mode[0]) {
+    n = snprintf(buffer + length, sizeof(buffer) - length, "\",\"parse_mode\":\"%s\"}", entry.parse_mode);
+  } else {
+    n = snprintf(buffer + length, sizeof(buffer) - length, "\"}");
+  }
+  if (n <= 0) return false;
+  length += n;
+  return secureClient.write((const uint8_t *)buffer, length) == length;
+}
+
+void WifiMessaging::TrimOutbox() {
+  while (!telegramOutbox.empty() && telegramOutbox.front().chats == 0) {
+#if WIFIMESSAGING_SPOOL
+    if (telegramOutbox.front().spooled) telegramSpoolDone = telegramOutbox.front().spooled;
+#endif
+    telegramOutbox.pop();
+  }
+}
+
+// Telegram commands
+
+void WifiMessaging::SetTelegramCommands(const telegramCommand *commands, size_t count, uint32_t poll_ms) {
+  telegramCommands = commands;
+  telegramCommandCount = commands ? count : 0;
+  telegramPollMs = poll_ms;
+  telegramPollAt = millis();
+}
+
+void WifiMessaging::StartTelegramPoll() {
+  if (!secureClient.connected() && !ConnectSecure()) {
+    WIFIMESSAGING_LOGD("Telegram poll: no connection");
+    telegramPollAt = millis() + telegramPollMs;
+    return;
+  }
+
+  char request[160];
+  int length = snprintf(request, sizeof(request),
+                        "GET /bot%s/getUpdates?offset=%lu&limit=1&timeout=%u HTTP/1.1\r\n"
+                        "Host: " TELEGRAM_HOST "\r\nConnection: keep-alive\r\n\r\n",
+                        this->telegram_bot, (unsigned long)telegramUpdateOffset,
+                        (unsigned)WIFIMESSAGING_TELEGRAM_LONG_POLL_S);
+  if (length <= 0 || length >= (int)sizeof(request) ||
+      secureClient.write((const uint8_t *)request, length) != (size_t)length) {
+    WIFIMESSAGING_LOGW("Telegram poll: request not sent");
+    secureClient.stop();
+    telegramPollAt = millis() + telegramPollMs;
+    return;
+  }
+  telegramRequesting = TelegramPolling;
+  ResetTelegramResponse();
+  telegramRequestStart = telegramUsedAt = telegramActiveAt = millis();
+}
+
+void WifiMessaging::KeepTelegramAlive() {
+  if (!secureClient.connected()) {
+    // closed by the server, its TLS buffers are held until stop()
+    if (telegramAnswered) secureClient.stop();
+    telegramAnswered = false;
+    return;
+  }
+  uint32_t now = millis();
+  if (telegramIdleMs && now - telegramUsedAt >= telegramIdleMs) {
+    WIFIMESSAGING_LOGD("Telegram connection idle, closed");
+    secureClient.stop();
+    telegramAnswered = false;
+  } else if (telegramProbeMs && now - telegramActiveAt >= telegramProbeMs) {
+    StartTelegramProbe();
+  }
+}
+
+void WifiMessaging::StartTelegramProbe() {
+  char request[128];
+  int length = snprintf(request, sizeof(request),
+                        "GET /bot%s/getMe HTTP/1.1\r\nHost: " TELEGRAM_HOST "\r\nConnection: keep-alive\r\n\r\n",
+                        this->telegram_bot);
+  if (length <= 0 || length >= (int)sizeof(request) ||
+      secureClient.write((const uint8_t *)request, length) != (size_t)length) {
+    LoseTelegramConnection();
+    return;
+  }
+  telegramRequesting = TelegramProbing;
+  ResetTelegramResponse();
+  telegramRequestStart = telegramActiveAt = millis();
+}
+
+// Room kept free in the response buffer for the chunk framing of a body that does not fit
+#define HTTP_FRAMING_ROOM 32
+
+/**
+ * @brief Value of the field name in the HTTP response header at response, nullptr when absent
+ *
+ * @param headerLength up to the end of the empty line
+ */
+static const char *HttpField(const char *response, size_t headerLength, const char *name) {
+  size_t nameLength = strlen(name);
+  const char *end = response + headerLength;
+  for (const char *line = strstr(response, "\r\n"); line && line + 2 < end; line = strstr(line + 2, "\r\n")) {
+    const char *field = line + 2;
+    if (strncasecmp(field, name, nameLength) == 0 && field[nameLength] == ':') {
+      const char *value = field + nameLength + 1;
+      while (*value == ' ' || *value == '\t') value++;
+      return value;
+    }
+  }
+  return nullptr;
+}
+
+void WifiMessaging::ResetTelegramResponse() {
+  telegramResponseLength = 0;
+  telegramResponseDropped = 0;
+  telegramFraming = HttpHeader;
+  telegramBodyAt = telegramBodyEnd = 0;
+  telegramBodyLeft = 0;
+}
+
+int8_t WifiMessaging::FrameTelegramResponse() {
+  char *response = telegramResponse;
+  // the body beyond this is dropped, the framing after it still fits
+  const uint16_t limit = sizeof(telegramResponse) - 1 - HTTP_FRAMING_ROOM;
+  response[telegramResponseLength] = '\0';
+
+  if (telegramFraming == HttpHeader) {
+    char *end = strstr(response, "\r\n\r\n");
+    if (end == nullptr) return telegramResponseLength < limit ? 0 : -1;
+    telegramBodyAt = telegramBodyEnd = end + 4 - response;
+    if (telegramBodyAt > limit) return -1;
+    int status = strncmp(response, "HTTP/1.", 7) == 0 ? atoi(response + 9) : 0;
+    const char *encoding = HttpField(response, telegramBodyAt, "Transfer-Encoding");
+    const char *length = HttpField(response, telegramBodyAt, "Content-Length");
+    if (encoding && strncasecmp(encoding, "chunked", 7) == 0) {
+      telegramFraming = HttpChunkSize;
+    } else if (length) {
+      telegramFraming = HttpLength;
+      telegramBodyLeft = strtoul(length, nullptr, 10);
+    } else if (status == 204 || status == 304) {
+      telegramFraming = HttpLength;
+      telegramBodyLeft = 0;
+    } else {
+      telegramFraming = HttpClose;
+    }
+  }
+
+  while (telegramFraming != HttpDone) {
+    char *raw = response + telegramBodyEnd;
+    size_t rawLength = telegramResponseLength - telegramBodyEnd;
+    size_t take;  // bytes of raw that are body
+    size_t skip;  // bytes of raw that are framing
+    if (telegramFraming == HttpLength || telegramFraming == HttpChunkData || telegramFraming == HttpClose) {
+      take = rawLength;
+      if (telegramFraming != HttpClose && telegramBodyLeft < take) take = telegramBodyLeft;
+      if (telegramFraming != HttpClose) telegramBodyLeft -= take;
+      skip = 0;
+    } else {
+      // a line: chunk size, the end of a chunk or a trailer field
+      char *line = strstr(raw, "\r\n");
+      if (line == nullptr) return rawLength < HTTP_FRAMING_ROOM ? 0 : -1;
+      take = 0;
+      skip = line + 2 - raw;
+    }
+
+    // Keep what fits of the body, the rest of the body and the framing go
+    size_t keep = telegramBodyEnd + take <= limit ? take : (telegramBodyEnd < limit ? limit - telegramBodyEnd : 0);
+    telegramResponseDropped += take - keep;
+    if (telegramFraming == HttpChunkSize) {
+      char *end;
+      telegramBodyLeft = strtoul(raw, &end, 16);
+      if (end == raw) return -1;
+    } else if (telegramFraming == HttpChunkEnd && skip != 2) {
+      return -1;
+    }
+    telegramBodyEnd += keep;
+    size_t removed = take - keep + skip;
+    memmove(response + telegramBodyEnd, response + telegramBodyEnd + removed, rawLength - keep - removed + 1);
+    telegramResponseLength -= removed;
+
+    switch (telegramFraming) {
+      case HttpLength:
+        if (telegramBodyLeft == 0) telegramFraming = HttpDone;
+        break;
+      case HttpChunkSize:
+        telegramFraming = telegramBodyLeft ? HttpChunkData : HttpTrailer;
+        break;
+      case HttpChunkData:
+        if (telegramBodyLeft == 0) telegramFraming = HttpChunkEnd;
+        break;
+      case HttpChunkEnd:
+        telegramFraming = HttpChunkSize;
+        break;
+      case HttpTrailer:
+        if (skip == 2) telegramFraming = HttpDone;
+        break;
+      default:
+        break;
+    }
+    if (telegramFraming != HttpDone && telegramResponseLength == telegramBodyEnd) return 0;
+  }
+  return 1;
+}
+
+void WifiMessaging::StepTelegramRequest() {
+  // Responses come in the order of the requests, the next one may follow in the same read
+  for (;;) {
+    // Only what has arrived, BearSSL decrypts it without waiting
+    int8_t framed;
+    int available;
+    while ((framed = FrameTelegramResponse()) == 0 && (available = secureClient.available()) > 0) {
+      size_t room = sizeof(telegramResponse) - 1 - telegramResponseLength;
+      if (room == 0) break;
+      int n = secureClient.read((uint8_t *)telegramResponse + telegramResponseLength,
+                                (size_t)available < room ? available : room);
+      if (n <= 0) break;
+      telegramResponseLength += n;
+    }
+    if (framed < 0) {
+      WIFIMESSAGING_LOGW("Telegram: response not understood");
+      LoseTelegramConnection();
+      return;
+    }
+    // A body up to the close of the connection is complete once the server closed it
+    bool closed = framed == 0 && telegramFraming == HttpClose && !secureClient.connected();
+    if (framed == 0 && !closed) break;
+
+    // The response alone in the buffer, terminated
+    char *body = telegramResponse + telegramBodyAt;
+    int status = strncmp(telegramResponse, "HTTP/1.", 7) == 0 ? atoi(telegramResponse + 9) : 0;
+    const char *connection = HttpField(telegramResponse, telegramBodyAt, "Connection");
+    bool closing = closed || (connection && strncasecmp(connection, "close", 5) == 0);
+    size_t kept = telegramBodyEnd;
+    char next = telegramResponse[kept];
+    telegramResponse[kept] = '\0';
+    telegramAnswered = true;
+
+    if (telegramRequesting == TelegramSending) {
+      TelegramSend send = telegramInFlight[0];
+      for (uint8_t i = 1; i < telegramInFlightCount; i++) telegramInFlight[i - 1] = telegramInFlight[i];
+      if (--telegramInFlightCount == 0) telegramRequesting = TelegramIdle;
+      FinishTelegramSend(send, status, body);
+    } else if (telegramRequesting == TelegramPolling) {
+      telegramRequesting = TelegramIdle;
+      if (status != 200) {
+        WIFIMESSAGING_LOGW("Telegram poll: %.12s", telegramResponse + 9);
+        telegramPollAt = millis() + telegramPollMs;
+      } else {
+        uint32_t offset = telegramUpdateOffset;
+        HandleTelegramUpdate(body);
+        // an update came in, there may be more
+        telegramPollAt = (telegramUpdateOffset != offset) ? millis() : millis() + telegramPollMs;
+      }
+    } else {
+      telegramRequesting = TelegramIdle;
+      if (status != 200) WIFIMESSAGING_LOGW("Telegram probe: %.12s", telegramResponse + 9);
+    }
+
+    telegramResponse[kept] = next;
+    uint16_t rest = telegramResponseLength - kept;
+    memmove(telegramResponse, telegramResponse + kept, rest);
+    ResetTelegramResponse();
+    telegramResponseLength = rest;
+    if (closing) {
+      WIFIMESSAGING_LOGD("Telegram connection closed by the server");
+      LoseTelegramConnection();
+      return;
+    }
+    if (telegramRequesting == TelegramIdle) return;
+  }
+
+  uint32_t start = telegramRequesting == TelegramSending ? telegramInFlight[0].sentAt : telegramRequestStart;
+  uint32_t timeout = WIFIMESSAGING_TELEGRAM_POLL_TIMEOUT_MS;
+  if (telegramRequesting == TelegramPolling) timeout += WIFIMESSAGING_TELEGRAM_LONG_POLL_S * 1000UL;
+  if (!secureClient.connected() || millis() - start > timeout) {
+    WIFIMESSAGING_LOGW("Telegram: no response");
+    if (telegramRequesting == TelegramPolling) telegramPollAt = millis() + telegramPollMs;
+    LoseTelegramConnection();
+  }
+}
+
+void WifiMessaging::LoseTelegramConnection() {
+  secureClient.stop();
+  bool answered = telegramAnswered;
+  bool partial = telegramResponseLength || telegramResponseDropped;
+  uint8_t count = telegramInFlightCount;
+  telegramRequesting = TelegramIdle;
+  telegramInFlightCount = 0;
+  ResetTelegramResponse();
+  telegramAnswered = false;
+  uint8_t resent = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    // the server was alive on the connection; a request it began to answer may have been delivered
+    if (answered && !(i == 0 && partial)) {
+      telegramChats[telegramInFlight[i].chat].bucket.giveBack(telegramChatInterval);
+      telegramGlobal.giveBack(telegramGlobalInterval);
+      resent++;
+      continue;
+    }
+    FinishTelegramSend(telegramInFlight[i], 0, nullptr);
+  }
+  if (resent)
+    WIFIMESSAGING_LOG_COMPACT(WIFIMESSAGING_LOG_DEBUG, "Telegram connection lost, %u messages sent again", resent);
+}
+
+/**
+ * @brief Value of a member of the JSON object at object, nullptr when absent
+ *
+ * Only the members of the object itself are looked at, not those of nested
+ * objects. The JSON must be terminated, it may be truncated.
+ */
+static char *JsonMember(char *object, const char *key) {
+  if (object == nullptr || *object != '{') return nullptr;
+  size_t keyLength = strlen(key);
+  int depth = 0;
+  for (char *p = object + 1; *p; p++) {
+    if (*p == '"') {
+      char *start = ++p;
+      while (*p && *p != '"') {
+        if (*p == '\\' && p[1]) p++;
+        p++;
+      }
+      if (!*p) return nullptr;
+      if (depth == 0 && (size_t)(p - start) == keyLength && strncmp(start, key, keyLength) == 0) {
+        char *value = p + 1;
+        while (*value == ' ' || *value == ':') value++;
+        return value;
+      }
+    } else if (*p == '{' || *p == '[') {
+      depth++;
+    } else if (*p == '}' || *p == ']') {
+      if (depth-- == 0) return nullptr;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * @brief Decode the JSON string at value in place
+ *
+ * @return the terminated string, nullptr when value is not a complete string
+ */
+static char *JsonString(char *value) {
+  if (value == nullptr || *value != '"') return nullptr;
+  char *in = value + 1, *out = value;
+  while (*in && *in != '"') {
+    if (*in != '\\') {
+      *out++ = *in++;
+      continue;
+    }
+    in++;
+    switch (*in) {
+      case 'n': *out++ = '\n'; break;
+      case 't': *out++ = '\t'; break;
+      case 'r': *out++ = '\r'; break;
+      case 'b': *out++ = '\b'; break;
+      case 'f': *out++ = '\f'; break;
+      case 'u': {
+        char hex[5] = {0};
+        for (int i = 0; i < 4 && in[1]; i++) hex[i] = *++in;
+        uint32_t c = strtoul(hex, nullptr, 16);
+        // UTF-8 of the code point; the halves of a surrogate pair (emoji) are encoded one by one
+        if (c < 0x80) {
+          *out++ = c;
+        } else if (c < 0x800) {
+          *out++ = 0xC0 | (c >> 6);
+          *out++ = 0x80 | (c & 0x3F);
+        } else {
+          *out++ = 0xE0 | (c >> 12);
+          *out++ = 0x80 | ((c >> 6) & 0x3F);
+          *out++ = 0x80 | (c & 0x3F);
+        }
+        break;
+      }
+      case '\0': return nullptr;
+      default: *out++ = *in; break;  // " \\ /
+    }
+    in++;
+  }
+  if (*in != '"') return nullptr;
+  *out = '\0';
+  return value;
+}
+
+void WifiMessaging::FinishTelegramSend(const TelegramSend &send, int status, char *body) {
+  TelegramOutboxEntry *entry = nullptr;
+  for (size_t i = 0; i < telegramOutbox.size() && !entry; i++) {
+    if (telegramOutbox.at(i).ticket == send.ticket) entry = &telegramOutbox.at(i);
+  }
+  if (entry == nullptr) return;
+  uint8_t chat = 1 << send.chat;
+  uint32_t now = millis();
+
+  if (status == 200) {
+    metricsData.phases[PhaseTelegramSend].record(now - send.sentAt);
+    entry->chats &= ~chat;
+    entry->attempts = 0;
+    telegramRetrying = false;
+  } else if (status == 429) {
+    // Flood control: the chat waits as long as Telegram asks, not an attempt
+    const char *retryAfter = JsonMember(JsonMember(body, "parameters"), "retry_after");
+    uint32_t seconds = retryAfter ? strtoul(retryAfter, nullptr, 10) : 1;
+    telegramLimitedCount++;
+    telegramChats[send.chat].bucket.hold(now, seconds * 1000UL, telegramChatInterval,
+                                                WIFIMESSAGING_TELEGRAM_CHAT_BURST);
+    WIFIMESSAGING_LOG_COMPACT(WIFIMESSAGING_LOG_WARN, "Telegram chat %u limited, retry after %u s",
+                              send.chat, seconds);
+  } else if (status >= 400 && status < 500) {
+    // Refused, e.g. an unknown chat or bad markup: another attempt gets the same answer
+    WIFIMESSAGING_LOGW("Telegram message %u refused for chat %u: %d", entry->ticket, send.chat, status);
+    entry->chats &= ~chat;
+    entry->failed |= chat;
+  } else {
+    WIFIMESSAGING_LOGW("Telegram message %u failed, attempt %u", entry->ticket, entry->attempts + 1);
+    if (++entry->attempts >= WIFIMESSAGING_TELEGRAM_ATTEMPTS) {
+      entry->chats &= ~chat;
+      entry->failed |= chat;
+      entry->attempts = 0;
+    }
+    telegramRetrying = true;
+    telegramRetryAt = now + WIFIMESSAGING_TELEGRAM_RETRY_MS;
+  }
+
+  if (entry->chats == 0) {
+    entry->status = entry->failed ? DeliveryFailed : DeliverySent;
+#if WIFIMESSAGING_NETWORK_TASK
+    ShareMessageStatus(*entry);
+#endif
+  }
+  TrimOutbox();
+}
+
+void WifiMessaging::HandleTelegramUpdate(char *body) {
+  char *result = JsonMember(body, "result");
+  if (result == nullptr || *result != '[') return;
+  char *update = result + 1;
+  while (*update == ' ') update++;
+  char *updateId = JsonMember(update, "update_id");
+  if (updateId == nullptr) return;  // no update
+
+  telegramUpdateOffset = strtoul(updateId, nullptr, 10) + 1;
+  if (telegramResponseDropped) {
+    WIFIMESSAGING_LOGW("Telegram update %lu too long, skipped", (unsigned long)telegramUpdateOffset - 1);
+    return;
+  }
+
+  char *message = JsonMember(update, "message");
+  char *chatId = JsonMember(JsonMember(message, "chat"), "id");
+  if (chatId == nullptr) return;
+  bool known = false;
+  for (uint8_t i = 0; i < telegramChatCount && !known; i++) {
+    const char *id = telegramChats[i].id;
+    if (id == nullptr) continue;
+    size_t idLength = strlen(id);
+    known = strncmp(chatId, id, idLength) == 0 && !isdigit((unsigned char)chatId[idLength]);
+  }
+  if (!known) {
+    WIFIMESSAGING_LOGI("Telegram update from another chat ignored");
+    return;
+  }
+  char *text = JsonString(JsonMember(message, "text"));
+  if (text == nullptr || text[0] != '/') return;
+#if WIFIMESSAGING_NETWORK_TASK
+  if (networkDetached) {
+    TelegramCommandText command;
+    strncpy(command.text, text, sizeof(command.text) - 1);
+    command.text[sizeof(command.text) - 1] = '\0';
+    if (!telegramIncoming.push(command)) {
+      WIFIMESSAGING_LOGW("Telegram command not taken by loop(), dropped");
+      crossingDropped++;
+    }
+    return;
+  }
+#endif
+  DispatchTelegramCommand(text);
+}
+
+void WifiMessaging::DispatchTelegramCommand(char *text) {
+  // "/command@botname arguments"
+  char *command = text + 1;
+  char *arguments = command + strcspn(command, " \n");
+  if (*arguments) *arguments++ = '\0';
+  while (*arguments == ' ' || *arguments == '\n') arguments++;
+  char *bot = strchr(command, '@');
+  if (bot) *bot = '\0';
+
+  for (size_t i = 0; i < telegramCommandCount; i++) {
+    const char *name = telegramCommands[i].command;
+    if (name[0] == '/') name++;
+    if (strcmp(name, command) == 0) {
+      WIFIMESSAGING_LOGI("Telegram command /%s", command);
+      telegramCommands[i].handler(command, arguments);
+      return;
+    }
+  }
+  WIFIMESSAGING_LOGI("Telegram command /%s unknown", command);
+}
+
+#endif
@@ -5,246 +5,2075 @@
 
 #ifdef ESP8266
 #include <ESP8266WiFi.h>       // Arduino library - https://github.com/esp8266/Arduino/blob/master/libraries/ESP8266WiFi/src/ESP8266WiFi.h
-#include <Ticker.h>            // Arduino library - https://github.com/esp8266/Arduino/blob/master/libraries/Ticker/src/Ticker.h
-#include <WiFiClientSecure.h>  // Arduino library - https://github.com/esp8266/Arduino/blob/master/libraries/ESP8266WiFi/src/WiFiClientSecure.h
 #include <time.h>              // Arduino library - https://github.com/esp8266/Arduino/blob/master/tools/sdk/libc/xtensa-lx106-elf/include/time.h
 
-#elif ESP32
-#include <Ticker.h>            //                   https://github.com/espressif/arduino-esp32/blob/master/libraries/Ticker/src/Ticker.h
-#include <WiFi.h>
-#include <WiFiClientSecure.h>  // Arduino library - https://github.com/espressif/arduino-esp32/blob/master/libraries/WiFiClientSecure/src/WiFiClientSecure.h
-#include <time.h>              //                   https://github.com/espressif/arduino-esp32/blob/master/tools/sdk/esp32/include/newlib/platform_include/time.h
+#elif ESP32
+#include <WiFi.h>
+#include <esp_sleep.h>
+#include <lwip/ip_addr.h>
+#include <time.h>              //                   https://github.com/espressif/arduino-esp32/blob/master/tools/sdk/esp32/include/newlib/platform_include/time.h
+
+#endif
+
+#include <wifimessaging_log.h>
+#include <wifimessaging_metrics.h>
+#include <wifimessaging_queue.h>
+#include <wifimessaging_rtc.h>
+#include <wifimessaging_spool.h>
+
+// **************************************** SELECTION ************************************
+
+// Services compiled in. A service left out costs no flash or RAM: its library
+// is not included, its members and methods do not exist. WiFi and NTP are
+// always in, Secure (TLS to Telegram) comes with Telegram. Set these for the
+// library as a whole, e.g. as -D build flags.
+#ifndef WIFIMESSAGING_ENABLE_MQTT
+#define WIFIMESSAGING_ENABLE_MQTT 1
+#endif
+
+#ifndef WIFIMESSAGING_ENABLE_TELEGRAM
+#define WIFIMESSAGING_ENABLE_TELEGRAM 1
+#endif
+
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+#ifdef ESP8266
+#include <WiFiClientSecure.h>  // Arduino library - https://github.com/esp8266/Arduino/blob/master/libraries/ESP8266WiFi/src/WiFiClientSecure.h
+#elif ESP32
+#include <WiFiClientSecure.h>  // Arduino library - https://github.com/espressif/arduino-esp32/blob/master/libraries/WiFiClientSecure/src/WiFiClientSecure.h
+#endif
+#include <Certificate_telegram.h>
+#endif
+
+#if WIFIMESSAGING_ENABLE_MQTT
+#include <wifimessaging_topics.h>
+#include <PubSubClient.h>          // 89              - https://github.com/knolleary/pubsubclient.git
+#ifdef ESP8266
+struct tcp_pcb;
+class ClientContext;
+#endif
+#endif
+
+// **************************************** DEBUG ****************************************
+
+// Log records go to a ring written out by loop(), see wifimessaging_log.h for
+// WIFIMESSAGING_LOG_LEVEL and the size of the ring.
+
+// Former name of WIFIMESSAGING_LOGD()
+#define DEBUG_WIFIMESSAGING_PRINTF(...) WIFIMESSAGING_LOGD(__VA_ARGS__)
+
+// **************************************** SERVICES *************************************
+
+// Service events (WiFi up/down, NTP synced, connect completed) waiting for loop()
+#ifndef WIFIMESSAGING_EVENT_QUEUE_SIZE
+#define WIFIMESSAGING_EVENT_QUEUE_SIZE 16
+#endif
+
+// Reconnect delays vary by +/- this percentage, so devices that lost their
+// connection together do not come back together
+#ifndef WIFIMESSAGING_RECONNECT_JITTER_PCT
+#define WIFIMESSAGING_RECONNECT_JITTER_PCT 25
+#endif
+
+// DNS lookups of the MQTT and Telegram hosts, started when WiFi gets an IP,
+// are given up after this; the connects then resolve the host themselves
+#ifndef WIFIMESSAGING_PREFETCH_TIMEOUT_MS
+#define WIFIMESSAGING_PREFETCH_TIMEOUT_MS 5000
+#endif
+
+// **************************************** NETWORK TASK *********************************
+
+// 1 adds detachNetwork() and runNetwork(): the state machine runs in a task of
+// its own, on the ESP32 the one of beginNetworkTask(), and loop() of the sketch
+// only exchanges messages with it through lock-free queues
+#ifndef WIFIMESSAGING_NETWORK_TASK
+#define WIFIMESSAGING_NETWORK_TASK 0
+#endif
+
+// Core, stack bytes and priority of the task of beginNetworkTask()
+#ifndef WIFIMESSAGING_NETWORK_TASK_CORE
+#define WIFIMESSAGING_NETWORK_TASK_CORE 0
+#endif
+
+#ifndef WIFIMESSAGING_NETWORK_TASK_STACK
+#define WIFIMESSAGING_NETWORK_TASK_STACK 8192
+#endif
+
+#ifndef WIFIMESSAGING_NETWORK_TASK_PRIORITY
+#define WIFIMESSAGING_NETWORK_TASK_PRIORITY 1
+#endif
+
+// Messages in transit between the sketch and the network task, per kind and direction
+#ifndef WIFIMESSAGING_CROSSING_SIZE
+#define WIFIMESSAGING_CROSSING_SIZE 8
+#endif
+
+// **************************************** WIFI *****************************************
+
+// A connect with the cached channel, BSSID and IP falls back to a full scan
+// and DHCP when no IP is obtained within this time
+#ifndef WIFIMESSAGING_WIFI_FAST_TIMEOUT_MS
+#define WIFIMESSAGING_WIFI_FAST_TIMEOUT_MS 3000
+#endif
+
+// Delay before the first WiFi reconnect, doubled after every failure up to the maximum
+#ifndef WIFIMESSAGING_WIFI_BACKOFF_MIN_MS
+#define WIFIMESSAGING_WIFI_BACKOFF_MIN_MS 1000
+#endif
+
+#ifndef WIFIMESSAGING_WIFI_BACKOFF_MAX_MS
+#define WIFIMESSAGING_WIFI_BACKOFF_MAX_MS 120000
+#endif
+
+// Networks to connect to, the one of the constructor and those of AddWiFi()
+#ifndef WIFIMESSAGING_WIFI_CANDIDATES
+#define WIFIMESSAGING_WIFI_CANDIDATES 4
+#endif
+
+// Access points of the candidates kept from a scan, strongest first
+#ifndef WIFIMESSAGING_WIFI_SCAN_SIZE
+#define WIFIMESSAGING_WIFI_SCAN_SIZE 6
+#endif
+
+// A connect takes the strongest access point of a scan up to this age instead of scanning again
+#ifndef WIFIMESSAGING_WIFI_SCAN_MAX_AGE_MS
+#define WIFIMESSAGING_WIFI_SCAN_MAX_AGE_MS 300000
+#endif
+
+// Roaming: below this RSSI in dBm a background scan looks for an access point
+// stronger by the hysteresis, 0 to disable, see SetWiFiRoaming()
+#ifndef WIFIMESSAGING_WIFI_ROAM_RSSI
+#define WIFIMESSAGING_WIFI_ROAM_RSSI -75
+#endif
+
+#ifndef WIFIMESSAGING_WIFI_ROAM_HYSTERESIS_DB
+#define WIFIMESSAGING_WIFI_ROAM_HYSTERESIS_DB 8
+#endif
+
+// Interval of the RSSI check
+#ifndef WIFIMESSAGING_WIFI_ROAM_CHECK_MS
+#define WIFIMESSAGING_WIFI_ROAM_CHECK_MS 5000
+#endif
+
+// Least time between two roaming scans, a scan takes the radio off channel for
+// about 2 s; doubled after every scan without a stronger access point up to the maximum
+#ifndef WIFIMESSAGING_WIFI_ROAM_SCAN_MS
+#define WIFIMESSAGING_WIFI_ROAM_SCAN_MS 30000
+#endif
+
+#ifndef WIFIMESSAGING_WIFI_ROAM_SCAN_MAX_MS
+#define WIFIMESSAGING_WIFI_ROAM_SCAN_MAX_MS 480000
+#endif
+
+// **************************************** NTP ******************************************
+
+// The clock of the last SNTP sync, carried through deep sleep in RTC memory, is
+// trusted up to this age. Keep it below the 32 bit wrap of the ESP8266 RTC timer
+// (about 6.5 hours).
+#ifndef WIFIMESSAGING_CLOCK_MAX_AGE_S
+#define WIFIMESSAGING_CLOCK_MAX_AGE_S 21600
+#endif
+
+// **************************************** DNS ******************************************
+
+// Hosts whose address WifiMessaging keeps: the MQTT broker and the Telegram host
+#ifndef WIFIMESSAGING_DNS_CACHE_SIZE
+#define WIFIMESSAGING_DNS_CACHE_SIZE 2
+#endif
+
+// A cached address is used without a lookup for this long. The Arduino
+// resolvers do not pass the TTL of the record on, set it to the TTL of your hosts.
+#ifndef WIFIMESSAGING_DNS_TTL_S
+#define WIFIMESSAGING_DNS_TTL_S 300
+#endif
+
+// When a lookup fails or is not answered within this time, the expired address
+// is used, while it is younger than WIFIMESSAGING_DNS_STALE_MAX_S
+#ifndef WIFIMESSAGING_DNS_STALE_AFTER_MS
+#define WIFIMESSAGING_DNS_STALE_AFTER_MS 1000
+#endif
+
+#ifndef WIFIMESSAGING_DNS_STALE_MAX_S
+#define WIFIMESSAGING_DNS_STALE_MAX_S 86400
+#endif
+
+// Keep the cache in RTC memory through deep sleep, 0 to keep it in RAM only
+#ifndef WIFIMESSAGING_DNS_RTC
+#define WIFIMESSAGING_DNS_RTC 1
+#endif
+
+// **************************************** MQTT *****************************************
+
+// Longest time a single loop() call waits on the DNS lookup of the MQTT connect
+#ifndef WIFIMESSAGING_MQTT_STEP_MS
+#define WIFIMESSAGING_MQTT_STEP_MS 100
+#endif
+
+// An MQTT connect attempt is abandoned when CONNACK has not arrived after this time
+#ifndef WIFIMESSAGING_MQTT_CONNECT_TIMEOUT_MS
+#define WIFIMESSAGING_MQTT_CONNECT_TIMEOUT_MS 15000
+#endif
+
+// Delay before the first MQTT reconnect, doubled after every failure up to the maximum
+#ifndef WIFIMESSAGING_MQTT_BACKOFF_MIN_MS
+#define WIFIMESSAGING_MQTT_BACKOFF_MIN_MS 2000
+#endif
+
+#ifndef WIFIMESSAGING_MQTT_BACKOFF_MAX_MS
+#define WIFIMESSAGING_MQTT_BACKOFF_MAX_MS 300000
+#endif
+
+// Messages the MQTT outbox holds, then the overflow policy applies
+#ifndef WIFIMESSAGING_MQTT_OUTBOX_SIZE
+#define WIFIMESSAGING_MQTT_OUTBOX_SIZE 16
+#endif
+
+// Longest topic kept in the MQTT outbox, publish() refuses longer topics
+#ifndef WIFIMESSAGING_MQTT_TOPIC_SIZE
+#define WIFIMESSAGING_MQTT_TOPIC_SIZE 64
+#endif
+
+// Longest payload kept in the MQTT outbox, publish() refuses longer payloads
+#ifndef WIFIMESSAGING_MQTT_PAYLOAD_SIZE
+#define WIFIMESSAGING_MQTT_PAYLOAD_SIZE 128
+#endif
+
+// Messages published from the outbox per loop() call
+#ifndef WIFIMESSAGING_MQTT_BATCH
+#define WIFIMESSAGING_MQTT_BATCH 4
+#endif
+
+// Topic levels held by the subscription router, one per filter level not shared with an earlier filter
+#ifndef WIFIMESSAGING_MQTT_TOPIC_NODES
+#define WIFIMESSAGING_MQTT_TOPIC_NODES 32
+#endif
+
+// **************************************** SECURE ***************************************
+
+// A TLS session kept in RTC memory is not offered for resumption after this age
+#ifndef WIFIMESSAGING_TLS_SESSION_LIFETIME_S
+#define WIFIMESSAGING_TLS_SESSION_LIFETIME_S 86400
+#endif
+
+// Root certificates the ESP8266 trusts for Telegram, the built-in root included, see AddTrustAnchor()
+#ifndef WIFIMESSAGING_TLS_ROOTS
+#define WIFIMESSAGING_TLS_ROOTS 4
+#endif
+
+// Bytes the ESP8266 TLS client may take for its receive and transmit record buffers, see SetTlsBudget()
+#ifndef WIFIMESSAGING_TLS_BUDGET
+#define WIFIMESSAGING_TLS_BUDGET (16384 + 512)
+#endif
+
+// **************************************** TELEGRAM *************************************
+
+// Messages the Telegram outbox holds before queueMessage() refuses new ones
+#ifndef WIFIMESSAGING_TELEGRAM_OUTBOX_SIZE
+#define WIFIMESSAGING_TELEGRAM_OUTBOX_SIZE 8
+#endif
+
+// Longest Telegram message text kept in the outbox, longer texts are truncated
+#ifndef WIFIMESSAGING_TELEGRAM_MESSAGE_SIZE
+#define WIFIMESSAGING_TELEGRAM_MESSAGE_SIZE 256
+#endif
+
+// Attempts before a queued Telegram message is given up
+#ifndef WIFIMESSAGING_TELEGRAM_ATTEMPTS
+#define WIFIMESSAGING_TELEGRAM_ATTEMPTS 5
+#endif
+
+// Wait between attempts to send a Telegram message
+#ifndef WIFIMESSAGING_TELEGRAM_RETRY_MS
+#define WIFIMESSAGING_TELEGRAM_RETRY_MS 5000
+#endif
+
+// Chats a message can be sent to, the one of SetTelegram() and those of AddTelegramChat(), at most 8
+#ifndef WIFIMESSAGING_TELEGRAM_CHATS
+#define WIFIMESSAGING_TELEGRAM_CHATS 4
+#endif
+
+// Telegram answers 429 Too Many Requests above about one message a second to
+// a chat and 30 a second in all. The outbox paces its sends with a token
+// bucket per chat and one for the bot, each refilled every interval up to its
+// burst, see SetTelegramLimits().
+#ifndef WIFIMESSAGING_TELEGRAM_CHAT_INTERVAL_MS
+#define WIFIMESSAGING_TELEGRAM_CHAT_INTERVAL_MS 1000
+#endif
+
+#ifndef WIFIMESSAGING_TELEGRAM_CHAT_BURST
+#define WIFIMESSAGING_TELEGRAM_CHAT_BURST 1
+#endif
+
+#ifndef WIFIMESSAGING_TELEGRAM_GLOBAL_INTERVAL_MS
+#define WIFIMESSAGING_TELEGRAM_GLOBAL_INTERVAL_MS 34
+#endif
+
+#ifndef WIFIMESSAGING_TELEGRAM_GLOBAL_BURST
+#define WIFIMESSAGING_TELEGRAM_GLOBAL_BURST 30
+#endif
+
+// Default wait between two getUpdates polls for commands, see SetTelegramCommands()
+#ifndef WIFIMESSAGING_TELEGRAM_POLL_MS
+#define WIFIMESSAGING_TELEGRAM_POLL_MS 3000
+#endif
+
+// Seconds the server may hold a getUpdates poll until an update arrives, 0 to answer at once.
+// The outbox waits for the poll, so a long poll delays queued messages by up to this time.
+#ifndef WIFIMESSAGING_TELEGRAM_LONG_POLL_S
+#define WIFIMESSAGING_TELEGRAM_LONG_POLL_S 0
+#endif
+
+// A getUpdates poll is abandoned when its response has not arrived after this time, on top of the long poll
+#ifndef WIFIMESSAGING_TELEGRAM_POLL_TIMEOUT_MS
+#define WIFIMESSAGING_TELEGRAM_POLL_TIMEOUT_MS 10000
+#endif
+
+// Bytes kept of a getUpdates or sendMessage response; the command of a longer getUpdates response is skipped
+#ifndef WIFIMESSAGING_TELEGRAM_POLL_BUFFER
+#define WIFIMESSAGING_TELEGRAM_POLL_BUFFER 768
+#endif
+
+// sendMessage requests written on the Telegram connection before the responses of the earlier
+// ones arrive, one per chat; the most SetTelegramKeepAlive() allows
+#ifndef WIFIMESSAGING_TELEGRAM_PIPELINE
+#define WIFIMESSAGING_TELEGRAM_PIPELINE 4
+#endif
+
+// The Telegram connection is closed after this long without a message or poll, which frees its
+// TLS buffers; 0 keeps it open
+#ifndef WIFIMESSAGING_TELEGRAM_IDLE_MS
+#define WIFIMESSAGING_TELEGRAM_IDLE_MS 60000
+#endif
+
+// An idle Telegram connection gets a getMe request this often, so the server and NATs on the way
+// keep it until WIFIMESSAGING_TELEGRAM_IDLE_MS; 0 sends none
+#ifndef WIFIMESSAGING_TELEGRAM_PROBE_MS
+#define WIFIMESSAGING_TELEGRAM_PROBE_MS 0
+#endif
+
+// **************************************** DUTY CYCLE ***********************************
+
+// Longest awake time of a deliverAndSleep() cycle, counted from boot
+#ifndef WIFIMESSAGING_DUTY_AWAKE_MS
+#define WIFIMESSAGING_DUTY_AWAKE_MS 15000
+#endif
+
+// **************************************** SPOOL ****************************************
+
+// Messages kept in flash while their service is down, see wifimessaging_spool.h
+// for WIFIMESSAGING_SPOOL and the size of the spools.
+
+// **************************************** METRICS **************************************
+
+// Interval of the metrics payload of SetMetricsTopic()
+#ifndef WIFIMESSAGING_METRICS_INTERVAL_MS
+#define WIFIMESSAGING_METRICS_INTERVAL_MS 300000
+#endif
+
+// Interval of the heap watermark samples; a max block sample walks the heap
+#ifndef WIFIMESSAGING_METRICS_HEAP_MS
+#define WIFIMESSAGING_METRICS_HEAP_MS 1000
+#endif
+
+// Longest metrics payload, on the stack of loop(); the MQTT buffer less the topic may allow less
+#ifndef WIFIMESSAGING_METRICS_SIZE
+#define WIFIMESSAGING_METRICS_SIZE 256
+#endif
+
+// **************************************** CLASS **************************************** 
+// WifiMessaging(ServiceWifi | ServiceNTP | ServiceSecure | ServiceMQTT | ServiceTelegram);
+// WifiMessaging.InitialiseMQTT(callback);
+// WifiMessaging.connectToWiFi();
+
+/**
+ * WiFi and messaging class (h).
+ */
+class WifiMessaging {
+ public:
+  enum connectionStatus {
+    ConnectionInactive = 0,
+    ConnectionInBetween = 1,
+    ConnectionActive = 2,
+    ConnectionActiveNew = 3
+  };
+
+  enum connectionService : uint16_t {
+    ServiceWifi = 1,
+    ServiceNTP = 2,
+    ServiceSecure = 4,
+    ServiceMQTT = 8,
+    ServiceTelegram = 16
+  };
+
+  enum deliveryStatus : uint8_t {
+    DeliveryUnknown = 0,  ///< no such ticket, or its slot has been reused
+    DeliveryQueued = 1,
+    DeliverySent = 2,
+    DeliveryFailed = 3    ///< refused, or given up after WIFIMESSAGING_TELEGRAM_ATTEMPTS, for one of its chats
+  };
+
+  /**
+   * @brief Order of the Telegram outbox: urgent messages are sent before routine ones
+   */
+  enum messagePriority : uint8_t {
+    PriorityRoutine = 0,
+    PriorityUrgent = 1
+  };
+
+  /// Chats of queueMessageTo(): every chat of SetTelegram() and AddTelegramChat()
+  static const uint8_t TelegramAllChats = 0xFF;
+
+  enum mqttOverflow : uint8_t {
+    MqttDropNewest = 0,  ///< publish() refuses the new message
+    MqttDropOldest = 1   ///< the oldest queued message makes room
+  };
+
+  /**
+   * @brief How WiFi connects; the paths after WiFiPathFull go to a known
+   * access point and fall back to WiFiPathFull when that fails
+   */
+  enum wifiConnectPath : uint8_t {
+    WiFiPathNone = 0,
+    WiFiPathFull = 1,  ///< scan and DHCP
+    WiFiPathFast = 2,  ///< cached channel, BSSID and IP configuration
+    WiFiPathScan = 3,  ///< strongest access point of the scan cache and DHCP
+    WiFiPathRoam = 4   ///< switch to a stronger access point, see SetWiFiRoaming()
+  };
+
+  /**
+   * @brief Handler of a Telegram command, see SetTelegramCommands()
+   *
+   * @param command the command without / and bot name
+   * @param arguments the text after the command, "" when none
+   */
+  typedef void (*telegramCommandHandler)(const char *command, const char *arguments);
+
+  /**
+   * @brief Entry of the command table of SetTelegramCommands()
+   */
+  struct telegramCommand {
+    const char *command;  ///< "led" or "/led"
+    telegramCommandHandler handler;
+  };
+
+  /**
+   * @brief Phases timed by metrics()
+   */
+  enum metricPhase : uint8_t {
+    PhaseWiFiAssociate = 0,  ///< WiFi.begin() until associated, scan included
+    PhaseWiFiIp = 1,         ///< associated until the IP is set, by DHCP or static
+    PhaseNtpSync = 2,        ///< SNTP started until the first sync
+    PhaseTlsFull = 3,        ///< TLS connect with a full handshake
+    PhaseTlsResumed = 4,     ///< TLS connect resuming the saved session
+    PhaseMqttConnect = 5,    ///< MQTT connect started until CONNACK
+    PhaseTelegramSend = 6,   ///< Telegram sendMessage round-trip on an open connection
+    PhaseLoop = 7,           ///< one loop() call, in microseconds
+    PhaseCount = 8
+  };
+
+  /**
+   * @brief Durations and heap watermarks since the start or resetMetrics()
+   */
+  struct metricsReport {
+    WifiMessagingHistogram phases[PhaseCount];  ///< in ms, PhaseLoop in us
+    uint32_t heapFreeLow = 0;   ///< lowest ESP.getFreeHeap() sampled
+    uint32_t heapFreeHigh = 0;
+    uint32_t maxBlockLow = 0;   ///< lowest largest free block sampled
+    uint32_t maxBlockHigh = 0;
+    uint32_t since = 0;         ///< millis() of the reset
+  };
+
+  /**
+   * @brief Connect accounting of a service that reconnects, see statistics()
+   */
+  struct connectionStats {
+    uint32_t attempts = 0;   ///< connects started
+    uint32_t successes = 0;  ///< connects completed
+    uint32_t failures = 0;   ///< connects that did not complete
+    uint32_t drops = 0;      ///< established connections lost
+    uint32_t offlineMs = 0;  ///< time not connected since the first connect
+    uint8_t lastReason = 0;  ///< last WiFi disconnect reason, 0 for MQTT
+    uint32_t roams = 0;      ///< switches to a stronger access point, 0 for MQTT
+  };
+
+  /**
+   * @brief Awake time of the duty cycles, see deliverAndSleep()
+   */
+  struct dutyCycleReport {
+    uint32_t cycles = 0;          ///< cycles since power on
+    uint32_t lastAwakeMs = 0;     ///< millis() when the last cycle went to sleep
+    uint32_t totalAwakeMs = 0;    ///< of all cycles, saturates
+    uint16_t lastUndelivered = 0; ///< messages the last cycle left at its deadline
+    bool woke = false;            ///< this boot is the wake from a cycle
+  };
+
+#if WIFIMESSAGING_NETWORK_TASK
+  // Written by the network task and read from any task
+  typedef std::atomic<connectionStatus> connectionStatusField;
+#else
+  typedef connectionStatus connectionStatusField;
+#endif
+  connectionStatusField StatusWiFi{ConnectionInactive};
+  connectionStatusField StatusNTP{ConnectionInactive};
+  connectionStatusField StatusMQTT{ConnectionInactive};
+  connectionStatusField StatusSecure{ConnectionInactive};
+  connectionStatusField StatusTelegram{ConnectionInactive};
+
+  /**
+   * @brief Services compiled in, see WIFIMESSAGING_ENABLE_MQTT and friends
+   */
+  static constexpr uint16_t CompiledServices = ServiceWifi | ServiceNTP |
+                                               (WIFIMESSAGING_ENABLE_MQTT ? ServiceMQTT : 0) |
+                                               (WIFIMESSAGING_ENABLE_TELEGRAM ? ServiceSecure | ServiceTelegram : 0);
+
+  /**
+   * @brief Services the given services need directly
+   *
+   *  WiFi
+   *   |-- MQTT (Insecure)
+   *   |-- NTP (Time)
+   *       |-- WiFiSecure
+   *           |-- Telegram
+   */
+  static constexpr uint16_t ServiceNeeds(uint16_t services) {
+    return ((services & ServiceNTP) ? ServiceWifi : 0) | ((services & ServiceSecure) ? ServiceNTP : 0) |
+           ((services & ServiceMQTT) ? ServiceWifi : 0) |
+           ((services & ServiceTelegram) ? (ServiceSecure | ServiceWifi) : 0);
+  }
+
+  /**
+   * @brief The given services and everything they need
+   */
+  static constexpr uint16_t ServiceClosure(uint16_t services) {
+    return (services | ServiceNeeds(services)) == services ? services
+                                                           : ServiceClosure(services | ServiceNeeds(services));
+  }
+
+#if WIFIMESSAGING_ENABLE_MQTT
+  // MQTT
+  PubSubClient mqttClient;  ///< PubSubClient object
+#endif
+
+  /**
+   * @brief Construct a new Wifi Messaging object
+   *
+   * @param wifi_ssid Service Set Identifier
+   * @param wifi_password Password of the SSID Network
+   */
+  WifiMessaging(const char *wifi_ssid, const char *wifi_password);
+
+#if WIFIMESSAGING_ENABLE_MQTT
+  /**
+   * @brief Set MQTT parameters
+   *
+   * @param mqtt_host mqtt host
+   * @param mqtt_port mqtt port
+   * @param callback function for received messages
+   */
+  void SetMQTT(const char *mqtt_host, uint16_t mqtt_port, MQTT_CALLBACK_SIGNATURE);
+
+  /**
+   * @brief Set MQTT parameters
+   *
+   * @param mqtt_hostip
+   * @param mqqt_port
+   * @param callback function for received messages
+   */
+  void SetMQTT(IPAddress mqtt_hostip, uint16_t mqqt_port, MQTT_CALLBACK_SIGNATURE);
+
+  /**
+   * @brief What publish() does when the MQTT outbox is full
+   */
+  void SetMqttOverflow(mqttOverflow policy) { mqttOverflowPolicy = policy; }
+
+  /**
+   * @brief Keep-alive the broker is told in CONNECT and mqttClient pings by
+   *
+   * Set it here, not with mqttClient.setKeepAlive(): the CONNECT of
+   * mqttClient never reaches the broker, see MqttTransport.
+   *
+   * @param keepalive_s 0 turns the keep-alive off, default MQTT_KEEPALIVE
+   */
+  void SetMqttKeepAlive(uint16_t keepalive_s);
+
+  /**
+   * @brief Publish an MQTT message through the outbox
+   *
+   * Returns at once. The message is copied into the outbox and published by
+   * loop() in order once MQTT is active, also after a disconnect.
+   *
+   * qos 0 is at most once: a message whose publish fails on a broken
+   * connection is dropped. qos 1 is at least once: the message stays queued
+   * and is published again after the reconnect. PubSubClient sends both as
+   * MQTT QoS 0, so this is delivery to the broker's TCP connection.
+   *
+   * @param topic at most WIFIMESSAGING_MQTT_TOPIC_SIZE - 1 chars
+   * @param payload at most WIFIMESSAGING_MQTT_PAYLOAD_SIZE bytes
+   * @return true when queued
+   */
+  bool publish(const char *topic, const uint8_t *payload, size_t length, bool retained = false, uint8_t qos = 0);
+
+  /**
+   * @brief Publish a text payload through the outbox
+   */
+  bool publish(const char *topic, const char *payload, bool retained = false, uint8_t qos = 0);
+
+  /**
+   * @brief Subscribe to a topic filter and route its messages to handler
+   *
+   * The filter may hold + and # wildcards and must stay valid, like a string
+   * literal. It is subscribed at the broker now when MQTT is active and again
+   * after every reconnect. A message goes to the handler of every matching
+   * filter; messages matching none go to the callback of SetMQTT().
+   *
+   * @param qos 0 or 1, as requested from the broker
+   * @return false when the filter is invalid or WIFIMESSAGING_MQTT_TOPIC_NODES is used up
+   */
+  bool subscribe(const char *topicFilter, WifiMessagingTopicHandler handler, uint8_t qos = 0);
+
+  /**
+   * @brief MQTT messages waiting in the outbox, and in the spool
+   */
+  size_t pendingPublishes() const;
+
+  /**
+   * @brief MQTT messages dropped by the overflow policy or a failed qos 0 publish
+   */
+  uint32_t droppedPublishes() const { return mqttDropped; }
+#endif
+
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  /**
+   * @brief Set the Telegram object
+   *
+   * @param telegram_bot The telegram bot code
+   */
+  void SetTelegram(const char *telegram_bot, const char *telegram_chat_id);
+
+  /**
+   * @brief Add a chat messages can be sent to, up to WIFIMESSAGING_TELEGRAM_CHATS
+   *
+   * The chat of SetTelegram() is 1. Commands are taken from every chat.
+   *
+   * @param chat_id must stay valid, like a string literal
+   * @return uint8_t the chat for queueMessageTo(), 0 when all are taken
+   */
+  uint8_t AddTelegramChat(const char *chat_id);
+
+  /**
+   * @brief Pace the Telegram outbox, see WIFIMESSAGING_TELEGRAM_CHAT_INTERVAL_MS
+   *
+   * A 429 answer holds the chat for its retry_after either way.
+   *
+   * @param chat_interval_ms least time between messages to a chat, e.g. 3000 for a group; 0 not paced
+   * @param global_interval_ms least time between messages of the bot; 0 not paced
+   */
+  void SetTelegramLimits(uint32_t chat_interval_ms,
+                         uint32_t global_interval_ms = WIFIMESSAGING_TELEGRAM_GLOBAL_INTERVAL_MS);
+
+  /**
+   * @brief Keep-alive of the Telegram connection, see WIFIMESSAGING_TELEGRAM_IDLE_MS
+   *
+   * The outbox sends over one TLS connection, up to pipeline requests ahead
+   * of their responses. Requests lost with a connection the server has
+   * answered on are sent again on a new one without counting an attempt.
+   *
+   * @param idle_ms close the connection after this long without a message or poll; 0 keeps it open
+   * @param probe_ms getMe on an idle connection this often; 0 none
+   * @param pipeline requests in flight, 1 to WIFIMESSAGING_TELEGRAM_PIPELINE
+   */
+  void SetTelegramKeepAlive(uint32_t idle_ms, uint32_t probe_ms = WIFIMESSAGING_TELEGRAM_PROBE_MS,
+                            uint8_t pipeline = WIFIMESSAGING_TELEGRAM_PIPELINE);
+
+#ifdef ESP8266
+  /**
+   * @brief Trust a further root certificate for Telegram
+   *
+   * Lets a device follow a CA rotation without a reflash, e.g. with a root
+   * read from a file. Like the built-in root, the certificate is decoded when
+   * the next TLS connection is set up, not now.
+   *
+   * @param der DER certificate in RAM or PROGMEM, must stay valid like a static const array
+   * @return false when WIFIMESSAGING_TLS_ROOTS roots are in use
+   */
+  bool AddTrustAnchor(const uint8_t *der, size_t length);
+
+  /**
+   * @brief Limit the record buffers of the TLS client
+   *
+   * The receive buffer is the smallest maximum fragment length (MFLN) the
+   * Telegram host accepts, probed on the first connect and kept in RTC memory,
+   * or 16 KB when it accepts none; the transmit buffer is 512 bytes. A
+   * connect is not started when they exceed the budget or the largest free
+   * heap block, so Telegram stays offline instead of starving MQTT and the
+   * sketch of heap.
+   *
+   * @param bytes receive plus transmit buffer, WIFIMESSAGING_TLS_BUDGET by default
+   */
+  void SetTlsBudget(uint32_t bytes) { tlsBudget = bytes; }
+#endif
+#endif
+
+#if WIFIMESSAGING_SPOOL
+  /**
+   * @brief Keep messages in flash while their service is down, across reboots
+   *
+   * A message publish() or queueMessage() takes while MQTT or Telegram is not
+   * active, or while its outbox is full, is appended to the spool of the
+   * service in dir instead, and so is every later one until the spool is
+   * empty again. When the service goes down, what its outbox holds moves to
+   * the spool as well. Once the service is active, loop() moves the messages
+   * back into the outbox in order as it has room, and a message is taken off
+   * the spool when it leaves the outbox. Messages in the spool after a
+   * reboot go out once the service is active again. A message moved into
+   * the outbox but not yet off the spool when the device resets goes out
+   * twice; a qos 0 message whose publish failed stays dropped.
+   *
+   * A message in the spool has no delivery status: messageStatus() of its
+   * ticket returns DeliveryUnknown, and it gets a new ticket when it comes
+   * back into the outbox. A full spool refuses the message, whatever the
+   * overflow policy.
+   *
+   * Call it in setup(), after the file system is mounted and before
+   * detachNetwork().
+   *
+   * @param fs e.g. LittleFS
+   * @param dir at most 14 chars
+   * @return false when a spool directory cannot be used, messages then stay in RAM
+   */
+  bool beginSpool(fs::FS &fs, const char *dir = WIFIMESSAGING_SPOOL_DIR);
+#endif
+
+  /**
+   * @brief Act on situation
+   *
+   * Dispatches the queued service events, starting services whose
+   * dependencies came up and stopping those whose dependencies went down,
+   * and advances connects in progress. Without events or work in progress
+   * it returns at once.
+   *
+   * After detachNetwork() it only delivers the incoming MQTT messages and
+   * Telegram commands, to their handlers in the calling task.
+   */
+  void loop();
+
+#if WIFIMESSAGING_NETWORK_TASK
+  /**
+   * @brief Leave the network state machine to runNetwork(), called by another task
+   *
+   * From here on publish(), queueMessage() and the other queue calls hand
+   * their message to the network task through a lock-free queue, and loop()
+   * hands the incoming messages to their handlers; neither waits for the
+   * network. The Status fields, pendingPublishes(), pendingMessages() and
+   * messageStatus() may be read from any task.
+   *
+   * Set up everything else, services, subscriptions, commands and the
+   * connect, before; after this call only the network task may use it.
+   */
+  void detachNetwork();
+
+  /**
+   * @brief One round of the network state machine, what loop() does without detachNetwork()
+   *
+   * The network task calls it over and over, from one task only.
+   */
+  void runNetwork();
+
+  /**
+   * @brief Incoming messages dropped since detachNetwork(): loop() did not take them in time, or too long
+   */
+  uint32_t droppedIncoming() const { return crossingDropped; }
+
+#ifdef ESP32
+  /**
+   * @brief Run the network state machine in a FreeRTOS task pinned to a core
+   *
+   * Calls detachNetwork() and starts a task calling runNetwork() every tick.
+   *
+   * @param core 0 leaves core 1, where the Arduino loop() runs, to the sketch
+   * @return false when the task could not be created, loop() then runs everything as before
+   */
+  bool beginNetworkTask(uint8_t core = WIFIMESSAGING_NETWORK_TASK_CORE);
+#endif
+#endif
+
+  /**
+   * @brief Connect to WiFi
+   */
+  void connectToWiFi();
+
+  /**
+   * @brief Disconnect from WiFi
+   */
+  void disconnectFromWiFi();
+
+  /**
+   * @brief Add a further network to connect to
+   *
+   * The network of the constructor is the first candidate. A connect without
+   * a usable fast connect cache takes the strongest access point of all
+   * candidates from a scan of at most WIFIMESSAGING_WIFI_SCAN_MAX_AGE_MS.
+   *
+   * @param ssid kept as pointer, must stay valid
+   * @param password kept as pointer, must stay valid
+   * @return false when WIFIMESSAGING_WIFI_CANDIDATES are set
+   */
+  bool AddWiFi(const char *ssid, const char *password);
+
+  /**
+   * @brief Switch to a stronger access point when the link gets weak
+   *
+   * Every WIFIMESSAGING_WIFI_ROAM_CHECK_MS loop() reads the RSSI. Below the
+   * threshold a background scan looks for an access point of the candidates
+   * that is at least hysteresis_db stronger and connects to it; the services
+   * reconnect as after a drop.
+   *
+   * @param rssi threshold in dBm, 0 disables roaming
+   * @param hysteresis_db margin the new access point must be stronger by
+   */
+  void SetWiFiRoaming(int8_t rssi, uint8_t hysteresis_db = WIFIMESSAGING_WIFI_ROAM_HYSTERESIS_DB) {
+    wifiRoamRssi = rssi;
+    wifiRoamHysteresis = hysteresis_db;
+  }
+
+  /**
+   * @brief Connect accounting of ServiceWifi or ServiceMQTT, zero for other services
+   */
+  connectionStats statistics(connectionService service) const;
+
+  /**
+   * @brief Phase durations and heap watermarks
+   */
+  const metricsReport &metrics() const { return metricsData; }
+
+  /**
+   * @brief Start the metrics afresh
+   */
+  void resetMetrics();
+
+  /**
+   * @brief Deliver the queued messages, then deep-sleep
+   *
+   * Queue the messages of this wake first, then call this instead of
+   * connectToWiFi(). loop() brings up WiFi and only the services the queued
+   * MQTT and Telegram messages need, delivers them and sleeps as soon as the
+   * outboxes are empty or awake_ms after boot have passed. Messages still
+   * queued then are lost without a spool. After beginSpool() they are written
+   * to it and sent again after the next wake, unless the spool is full. With
+   * nothing queued the device sleeps on the next loop() without switching the
+   * radio on.
+   *
+   * @param sleep_s deep sleep, at most ESP.deepSleepMax() on ESP8266
+   * @param awake_ms deadline of the cycle, counted from boot
+   */
+  void deliverAndSleep(uint32_t sleep_s, uint32_t awake_ms = WIFIMESSAGING_DUTY_AWAKE_MS);
+
+  /**
+   * @brief Awake time of the cycles so far, kept in RTC memory through deep sleep
+   */
+  const dutyCycleReport &dutyCycle() const { return dutyData; }
+
+#if WIFIMESSAGING_ENABLE_MQTT
+  /**
+   * @brief Publish the metrics every interval_ms while MQTT is active
+   *
+   * The payload is one line of key=count/p50/max per timed phase (p50 is the
+   * upper bound of its bucket) and the heap watermarks as low/high, e.g.
+   * "fw=1.2 up=600 wa=1/1500/1500 ip=1/600/600 ... hf=18956/21000". It is
+   * published directly, not through the outbox, and is limited by the
+   * PubSubClient buffer; phases without samples are left out.
+   *
+   * @param topic must stay valid, nullptr to stop
+   * @param firmware version put in the payload as fw=, nullptr for none
+   */
+  void SetMetricsTopic(const char *topic, uint32_t interval_ms = WIFIMESSAGING_METRICS_INTERVAL_MS,
+                       const char *firmware = nullptr);
+#endif
+
+  /**
+   * @brief How the last WiFi connect was made
+   */
+  wifiConnectPath connectPath() const { return wifiPath; }
+
+  /**
+   * @brief macId as 12 hexnumber
+   */
+  String macId();
+
+  /**
+   * @brief macId as 12 hexnumber, without allocation
+   *
+   * @param buffer at least 13 chars
+   * @return buffer
+   */
+  char *macId(char *buffer, size_t size);
+
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  /**
+   * @brief Receive Telegram commands
+   *
+   * While Telegram is active, loop() polls getUpdates every poll_ms over the
+   * TLS connection of the outbox, without waiting for the response, and calls
+   * the handler of a /command from the table. Only messages of the chats of
+   * SetTelegram() and AddTelegramChat() are dispatched, others are confirmed
+   * and ignored.
+   *
+   * @param commands table that must stay valid, like a static const array
+   * @param count entries of the table, 0 to stop polling
+   */
+  void SetTelegramCommands(const telegramCommand *commands, size_t count,
+                           uint32_t poll_ms = WIFIMESSAGING_TELEGRAM_POLL_MS);
+
+  /**
+   * @brief send Telegram message, queued in the outbox
+   *
+   * @return true when queued
+   */
+  bool sendMessage(const String &text, const String &parse_mode);
+
+  /**
+   * @brief send Telegram message, queued in the outbox without allocation
+   *
+   * @return true when queued
+   */
+  bool sendMessage(const char *text, const char *parse_mode = "");
+
+  /**
+   * @brief Queue a Telegram message, loop() sends it once Telegram is active
+   *
+   * Returns at once. The text is copied into the outbox, which does not
+   * allocate; texts longer than WIFIMESSAGING_TELEGRAM_MESSAGE_SIZE - 1 are truncated.
+   *
+   * @param text message text
+   * @param parse_mode "", "Markdown", "MarkdownV2" or "HTML"
+   * @return uint16_t ticket for messageStatus(), 0 when the outbox is full
+   */
+  uint16_t queueMessage(const char *text, const char *parse_mode = "");
+
+  /**
+   * @brief Queue the first length chars of text, which need not be terminated
+   */
+  uint16_t queueMessage(const char *text, size_t length, const char *parse_mode = "");
+
+  /**
+   * @brief Queue a Telegram message for one or more chats
+   *
+   * The text is kept once for all chats. Urgent messages go before routine
+   * ones; within a priority, each chat gets its messages in order.
+   *
+   * @param chats chats of SetTelegram() (1) and AddTelegramChat() or'ed, or TelegramAllChats
+   * @return uint16_t ticket for messageStatus(), 0 when the outbox is full or no chat is given
+   */
+  uint16_t queueMessageTo(uint8_t chats, messagePriority priority, const char *text, const char *parse_mode = "");
+
+  /**
+   * @brief Queue a printf formatted Telegram message, formatted straight into the outbox
+   *
+   * @return uint16_t ticket for messageStatus(), 0 when the outbox is full
+   */
+  uint16_t queueMessagef(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+  /**
+   * @brief queueMessagef() for one or more chats, see queueMessageTo()
+   */
+  uint16_t queueMessagefTo(uint8_t chats, messagePriority priority, const char *format, ...)
+      __attribute__((format(printf, 4, 5)));
+
+  /**
+   * @brief queueMessagef() with a parse mode and a va_list
+   */
+  uint16_t vqueueMessagef(const char *parse_mode, const char *format, va_list args);
+
+  /**
+   * @brief Delivery status of a queued Telegram message
+   *
+   * @param ticket as returned by queueMessage()
+   */
+  deliveryStatus messageStatus(uint16_t ticket);
+
+  /**
+   * @brief Telegram messages waiting in the outbox, for at least one of their chats
+   */
+  size_t pendingMessages() const;
+
+  /**
+   * @brief 429 Too Many Requests answers of Telegram, since the start
+   */
+  uint32_t telegramLimited() const { return telegramLimitedCount; }
+#endif
+
+  /**
+   * @brief return static object of this class
+   *
+   * @return WifiMessaging&
+   */
+  static WifiMessaging &instance();
+
+#ifdef ESP32
+
+  static void wifi_event_handler_static(WiFiEvent_t event, WiFiEventInfo_t info);
+
+#endif
+
+ private:
+  /**
+   * @brief Intended connection services, set if constants connection service
+   * are set ServiceWifi | ServiceNTP | ServiceSecure | ServiceMQTT |
+   * ServiceTelegram
+   *
+   */
+  uint16_t connectionServices = ServiceWifi;
+
+  /**
+   * @brief Reconnect state of a service, see services[]
+   */
+  struct ReconnectState {
+    connectionStats stats;
+    uint32_t backoffMs = 0;     ///< delay after the next failure, 0 after a success
+    uint32_t retryAt = 0;       ///< millis() of the next attempt when waiting
+    uint32_t offlineSince = 0;  ///< millis() of the loss when offline
+    bool waiting = false;
+    bool offline = false;
+  };
+
+  ReconnectState wifiReconnect;
+#if WIFIMESSAGING_ENABLE_MQTT
+  ReconnectState mqttReconnect;
+#endif
+  uint32_t reconnectAt = 0;       ///< earliest retryAt of the waiting services
+  bool reconnectWaiting = false;  ///< a service waits for its reconnect delay
+
+  /**
+   * @brief Service in the dependency graph, see services[]
+   */
+  struct ServiceNode {
+    connectionService service;
+    uint16_t needs;                           ///< services that must be active to start and to stay up
+    connectionStatusField WifiMessaging::*status;
+    void (WifiMessaging::*start)();           ///< nullptr when started by the sketch
+    void (WifiMessaging::*stop)();            ///< nullptr when there is nothing to release
+    ReconnectState WifiMessaging::*reconnect; ///< nullptr when the service does not reconnect
+    uint32_t backoffMinMs;
+    uint32_t backoffMaxMs;
+  };
+
+  static const ServiceNode services[];  ///< in dependency order
+
+  /**
+   * @brief A service came up or went down
+   */
+  struct ServiceEvent {
+    connectionService service;
+    bool up;
+    uint8_t reason;  ///< WiFi disconnect reason
+  };
+
+  WifiMessagingEventQueue<ServiceEvent, WIFIMESSAGING_EVENT_QUEUE_SIZE> serviceEvents;
+  volatile bool serviceEventsLost = false;  ///< an event was dropped on a full queue
+
+  /**
+   * @brief Bring-up work that needs an IP but no clock, see StepPrefetch()
+   */
+  enum prefetchItem : uint8_t {
+    PrefetchTelegramHost = 1,  ///< DNS lookup of TELEGRAM_HOST
+    PrefetchMqttHost = 2,      ///< DNS lookup of mqqt_hostdomain
+    PrefetchTls = 4,           ///< trust anchors and the fragment probe
+  };
+
+  uint8_t prefetchPending = 0;  ///< prefetchItem bits still to do
+  uint32_t prefetchStart = 0;   ///< millis() WiFi got the IP
+
+  /**
+   * @brief Address of a host as last resolved
+   */
+  struct DnsCacheEntry {
+    uint32_t host = 0;        ///< CRC of the host name, 0 for a free entry
+    uint32_t ip = 0;
+    uint32_t resolvedAt = 0;  ///< millis()
+    uint32_t failedAt = 0;    ///< millis() of the failed lookup that made the entry stale
+    bool failing = false;     ///< the address is served stale
+  };
+
+  /**
+   * @brief Result of ResolveHost()
+   */
+  enum dnsAnswer : uint8_t {
+    DnsPending,   ///< no address yet
+    DnsResolved,  ///< answered by DNS
+    DnsStale,     ///< DNS failed, the expired address of the cache
+  };
+
+  DnsCacheEntry dnsCache[WIFIMESSAGING_DNS_CACHE_SIZE];
+  bool dnsRestored = false;  ///< the cache kept in RTC memory was read
+
+#ifdef ESP32
+  /**
+   * @brief DNS lookup lwIP has in flight, answered in the TCP/IP task
+   */
+  struct DnsLookup {
+    uint32_t host = 0;                 ///< CRC of the host name, 0 for a free slot
+    std::atomic<int8_t> state{0};      ///< as LookUpHost() returns it
+    std::atomic<uint32_t> ip{0};
+  };
+
+  DnsLookup dnsLookups[WIFIMESSAGING_DNS_CACHE_SIZE];
+
+  /**
+   * @brief Start a lookup of host, or take the answer of the one in flight
+   *
+   * @return int8_t 1 answered in ip, 0 in flight, -1 failed
+   */
+  int8_t LookUpHost(const char *host, IPAddress &ip);
+
+  static void DnsFound(const char *name, const ip_addr_t *ipaddr, void *arg);
+#endif
+
+  // WiFi
+  bool wifiWanted = false;    ///< between connectToWiFi() and disconnectFromWiFi()
+
+  /**
+   * @brief Network to connect to, see AddWiFi()
+   */
+  struct WiFiCandidate {
+    const char *ssid;
+    const char *password;
+  };
+
+  WiFiCandidate wifiCandidates[WIFIMESSAGING_WIFI_CANDIDATES];
+  uint8_t wifiCandidateCount = 1;
+  uint8_t wifiCandidate = 0;  ///< candidate of the connect
+
+  /**
+   * @brief Access point of a candidate seen by a scan
+   */
+  struct WiFiScanEntry {
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t candidate;  ///< index in wifiCandidates
+    int8_t rssi;
+    bool failed;        ///< a connect to it did not give an IP
+  };
+
+  enum wifiScanPurpose : uint8_t {
+    ScanIdle = 0,
+    ScanForConnect = 1,  ///< ConnectToWiFiFull() waits for the strongest access point
+    ScanForRoam = 2      ///< connected, looking for a stronger access point
+  };
+
+  WiFiScanEntry wifiScan[WIFIMESSAGING_WIFI_SCAN_SIZE];  ///< strongest first
+  uint8_t wifiScanCount = 0;
+  uint32_t wifiScannedAt = 0;       ///< millis() of the scan
+  int8_t wifiScanEntry = -1;        ///< entry of the connect in progress, -1 for none
+  wifiScanPurpose wifiScanning = ScanIdle;
+  int8_t wifiRoamRssi = WIFIMESSAGING_WIFI_ROAM_RSSI;
+  uint8_t wifiRoamHysteresis = WIFIMESSAGING_WIFI_ROAM_HYSTERESIS_DB;
+  uint32_t wifiRoamCheckAt = 0;     ///< millis() of the next RSSI check
+  uint32_t wifiRoamScanAt = 0;      ///< millis() of the earliest roaming scan
+  uint32_t wifiRoamScanMs = WIFIMESSAGING_WIFI_ROAM_SCAN_MS;
+  bool wifiRoaming = false;         ///< the disconnect from the old access point is ours
+
+  /**
+   * @brief Access point and IP configuration of the last connect, kept in RTC memory
+   */
+  struct WiFiFastConnect {
+    uint32_t ssid;  ///< CRC of the SSID of the candidate
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t reserved;
+    uint32_t ip;
+    uint32_t mask;
+    uint32_t gw;
+    uint32_t dns;
+  };
+
+  WiFiFastConnect wifiCache;      ///< collected from the connect events
+  wifiConnectPath wifiPath = WiFiPathNone;
+  uint32_t wifiConnectStart = 0;  ///< millis() of the connect
+  uint32_t wifiAssociatedAt = 0;  ///< millis() of the association
+  bool wifiFastFailed = false;    ///< disconnected during a fast connect
+
+  static WifiMessaging *_wifimessaging;
+  
+#ifdef ESP8266
+  WiFiEventHandler e1;  ///< event onStationModeConnected
+  WiFiEventHandler e2;  ///< event onStationModeDisconnected
+  WiFiEventHandler e4;  ///< event onStationModeGotIP
+#elif ESP32
+  /**
+   * @brief WiFi event as the event task hands it to loop()
+   */
+  struct WiFiEventRecord {
+    WiFiEvent_t event;
+    WiFiEventInfo_t info;
+  };
+
+  WifiMessagingEventQueue<WiFiEventRecord, WIFIMESSAGING_EVENT_QUEUE_SIZE> wifiEvents;
+  std::atomic<bool> ntpSynced{false};  ///< set by the SNTP callback, taken by loop()
+#endif
+
+#if WIFIMESSAGING_ENABLE_MQTT
+  // MQTT
+  WiFiClient wifiClient;      ///< WifiClient object
+
+  /**
+   * @brief Client between mqttClient and wifiClient
+   *
+   * The MQTT connect state machine sends CONNECT and collects CONNACK itself.
+   * PubSubClient::connect() then finds the TCP connection open: its CONNECT is
+   * swallowed and the collected CONNACK is replayed, so it returns at once.
+   * The broker therefore only learns the keep-alive of SetMqttKeepAlive().
+   *
+   * This leans on how PubSubClient 2.8 connects, hence the pinned version in
+   * library.json and library.properties: connect() skips the TCP connect when
+   * connected() is true, writes its CONNECT in one write() and reads a CONNACK
+   * of exactly 4 bytes. Check these three before moving to another version.
+   */
+  class MqttTransport : public Client {
+   public:
+    MqttTransport(WiFiClient &client) : client(client) {}
+
+    bool sendConnect(const char *clientId, uint16_t keepAlive);
+    bool receiveConnack();
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(const char *host, uint16_t port) override;
+#ifdef ESP32
+    // Pure virtual in arduino-esp32 3.x, plain members in 2.x
+    int connect(IPAddress ip, uint16_t port, int32_t timeout) { return client.connect(ip, port, timeout); }
+    int connect(const char *host, uint16_t port, int32_t timeout) { return client.connect(host, port, timeout); }
+#endif
+    size_t write(uint8_t b) override;
+    size_t write(const uint8_t *buf, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t *buf, size_t size) override;
+    int peek() override;
+    void flush() override;
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override;
+
+   private:
+    WiFiClient &client;
+    uint8_t connack[4];        ///< CONNACK as received from the broker
+    uint8_t connackLength = 0; ///< bytes of CONNACK received
+    uint8_t connackReplay = 0; ///< bytes of CONNACK replayed to PubSubClient
+    int32_t swallow = 0;       ///< bytes of PubSubClient's CONNECT still to drop, -1 unknown
+  };
+
+  MqttTransport mqttTransport{wifiClient};
+
+  /**
+   * @brief TCP connect to the broker, kept in flight over loop() calls
+   *
+   * WiFiClient::connect() waits for the handshake and drops it at its timeout.
+   * On the ESP8266 the lwIP raw API takes the connect instead, its callback
+   * wraps the connection in a ClientContext; on the ESP32 a non-blocking
+   * socket is polled with select().
+   */
+  class MqttTcpConnect {
+   public:
+    bool start(IPAddress ip, uint16_t port);
+    bool started() const;
+
+    /**
+     * @brief Hand an established connection to client
+     *
+     * @return int8_t 1 handed over, 0 in flight, -1 failed
+     */
+    int8_t poll(WiFiClient &client);
+
+    void abort();
+
+   private:
+#ifdef ESP8266
+    tcp_pcb *pcb = nullptr;            ///< in the handshake
+    ClientContext *context = nullptr;  ///< established, not handed to a WiFiClient yet
+    bool failed = false;
+
+    static int8_t Connected(void *arg, tcp_pcb *pcb, int8_t err);
+    static void Error(void *arg, int8_t err);
+#elif ESP32
+    int fd = -1;
+#endif
+  };
+
+  MqttTcpConnect mqttTcp;
+
+  IPAddress mqtt_hostip;
+  const char *mqqt_hostdomain;
+  uint16_t mqqt_port;
+
+  /**
+   * @brief Steps of the non-blocking MQTT connect, advanced by loop()
+   */
+  enum mqttConnectStep : uint8_t {
+    MqttIdle = 0,
+    MqttResolve = 1,  ///< resolving mqqt_hostdomain
+    MqttTcp = 2,      ///< opening the TCP connection
+    MqttConnack = 3   ///< CONNECT sent, waiting for CONNACK
+  };
+
+  /**
+   * @brief MQTT message waiting in the outbox
+   */
+  struct MqttOutboxEntry {
+    char topic[WIFIMESSAGING_MQTT_TOPIC_SIZE];
+    uint8_t payload[WIFIMESSAGING_MQTT_PAYLOAD_SIZE];
+    uint16_t length;
+    uint8_t qos;
+    bool retained;
+#if WIFIMESSAGING_SPOOL
+    uint32_t spooled;  ///< sequence in the spool, 0 when not from the spool
+#endif
+
+    /// topic and payload must fit
+    void set(const char *topic, const uint8_t *payload, size_t length, bool retained, uint8_t qos) {
+      strcpy(this->topic, topic);
+      memcpy(this->payload, payload, length);
+      this->length = length;
+      this->qos = qos;
+      this->retained = retained;
+#if WIFIMESSAGING_SPOOL
+      spooled = 0;
+#endif
+    }
+  };
+
+  WifiMessagingQueue<MqttOutboxEntry, WIFIMESSAGING_MQTT_OUTBOX_SIZE> mqttOutbox;
+  mqttOverflow mqttOverflowPolicy = MqttDropNewest;
+  uint32_t mqttDropped = 0;
+#if WIFIMESSAGING_SPOOL
+  WifiMessagingSpool mqttSpool;
+  uint32_t mqttSpoolDone = 0;  ///< sequence of the last spooled message out of the outbox since the last ack
+  uint32_t mqttSpoolSkipped = 0;  ///< last unreadable record, acked once nothing read before it is in the outbox
+#endif
+
+  WifiMessagingTopics<WIFIMESSAGING_MQTT_TOPIC_NODES> mqttTopics;  ///< filters of subscribe()
+  std::function<void(char *, uint8_t *, unsigned int)> mqttCallback;  ///< of SetMQTT(), for unrouted messages
+
+  char mqttClientId[17] = "";  ///< "ESP-" and the macId, set on the first connect
+  uint16_t mqttKeepAlive = MQTT_KEEPALIVE;  ///< seconds, of SetMqttKeepAlive()
+  mqttConnectStep mqttStep = MqttIdle;
+  uint32_t mqttConnectStart;  ///< millis() at the start of the connect attempt
+  uint32_t mqttStepStart;     ///< millis() at the start of the connect attempt or once the broker was resolved
+  IPAddress mqtt_connectip;   ///< resolved address of the broker
+#endif
+
+  // NTP
+  volatile bool clockSet = false;  ///< synced by SNTP or restored from RTC memory since boot
+  uint32_t ntpStart = 0;           ///< millis() SNTP was started
+  bool ntpTiming = false;          ///< the first sync after ntpStart is still to come
+
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+#ifdef ESP8266
+  // Secure
+  BearSSL::WiFiClientSecure secureClient;
+  BearSSL::X509List cert;    ///< trust anchors decoded from tlsRoots, filled by LoadTrustAnchors()
+  BearSSL::Session session;  
+  // session cache used to remember secret keys established with clients, to support session resumption.
+  uint32_t tlsSessionCrc = 0;  ///< CRC of the session last saved to RTC memory
+
+  /**
+   * @brief Root certificate, not decoded before the first TLS connection
+   */
+  struct TrustAnchor {
+    const uint8_t *der;  ///< in RAM or PROGMEM
+    uint16_t length;
+  };
+
+  TrustAnchor tlsRoots[WIFIMESSAGING_TLS_ROOTS] = {{CERTIFICATE_ROOT_DER, sizeof(CERTIFICATE_ROOT_DER)}};
+  uint8_t tlsRootCount = 1;
+  uint8_t tlsRootsLoaded = 0;  ///< roots of tlsRoots handed to cert
+
+  uint32_t tlsBudget = WIFIMESSAGING_TLS_BUDGET;
+  uint16_t tlsFragment = 0;  ///< MFLN accepted by the host and connected with, 0 unknown
+  uint16_t tlsProbedFragment = 0;  ///< answer of the fragment probe on this link, 0 not probed
+#elif ESP32
+  WiFiClientSecure secureClient;
+#endif
+#endif
+
+  // Duty cycle
+  dutyCycleReport dutyData;
+  uint32_t dutySleepS = 0;       ///< sleep of the armed cycle, 0 when none is armed
+  uint32_t dutyAwakeMs = 0;      ///< deadline, millis()
+  bool dutyAsleep = false;       ///< deep sleep called, returns only on the host
+
+  // Metrics
+  metricsReport metricsData;
+  uint32_t metricsHeapAt = 0;       ///< millis() of the next heap sample
+#if WIFIMESSAGING_ENABLE_MQTT
+  const char *metricsTopic = nullptr;
+  const char *metricsFirmware = nullptr;
+  uint32_t metricsInterval = WIFIMESSAGING_METRICS_INTERVAL_MS;
+  uint32_t metricsPublishAt = 0;    ///< millis() of the next payload
+#endif
+
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  // Telegram
+  const char *telegram_bot;
+
+  /**
+   * @brief Token bucket in its GCRA form: one timestamp instead of a token count
+   */
+  struct TelegramBucket {
+    uint32_t fullAt = 0;  ///< millis() the bucket is full again
+
+    /// ms until a token is left, 0 when one is
+    uint32_t waitMs(uint32_t now, uint32_t interval, uint8_t burst) const {
+      int32_t wait = (int32_t)(fullAt - now) - (int32_t)(interval * (burst - 1));
+      return wait > 0 ? wait : 0;
+    }
+
+    void take(uint32_t now, uint32_t interval) { fullAt = ((int32_t)(fullAt - now) > 0 ? fullAt : now) + interval; }
+
+    /// the token of a request the server never took
+    void giveBack(uint32_t interval) { fullAt -= interval; }
+
+    /// no token before now + ms
+    void hold(uint32_t now, uint32_t ms, uint32_t interval, uint8_t burst) {
+      uint32_t at = now + ms + interval * (burst - 1);
+      if ((int32_t)(at - fullAt) > 0) fullAt = at;
+    }
+  };
+
+  struct TelegramChat {
+    const char *id = nullptr;
+    TelegramBucket bucket;
+  };
+
+  TelegramChat telegramChats[WIFIMESSAGING_TELEGRAM_CHATS];
+  uint8_t telegramChatCount = 0;
+  TelegramBucket telegramGlobal;
+  uint32_t telegramChatInterval = WIFIMESSAGING_TELEGRAM_CHAT_INTERVAL_MS;
+  uint32_t telegramGlobalInterval = WIFIMESSAGING_TELEGRAM_GLOBAL_INTERVAL_MS;
+  uint32_t telegramLimitedCount = 0;
+
+  /**
+   * @brief Telegram message waiting in, or finished by, the outbox
+   */
+  struct TelegramOutboxEntry {
+    uint16_t ticket = 0;
+    deliveryStatus status = DeliveryUnknown;
+    messagePriority priority = PriorityRoutine;
+    uint8_t chats = 0;   ///< chats still to send to, one bit each
+    uint8_t failed = 0;  ///< chats given up
+    uint8_t attempts = 0;
+#if WIFIMESSAGING_SPOOL
+    uint32_t spooled = 0;  ///< sequence in the spool, 0 when not from the spool
+#endif
+    char parse_mode[12];
+    char text[WIFIMESSAGING_TELEGRAM_MESSAGE_SIZE];
+  };
+
+  WifiMessagingQueue<TelegramOutboxEntry, WIFIMESSAGING_TELEGRAM_OUTBOX_SIZE> telegramOutbox;
+#if WIFIMESSAGING_NETWORK_TASK
+  std::atomic<uint16_t> telegramTicket{0};  ///< last ticket handed out, by the sketch and the spool replay
+#else
+  uint16_t telegramTicket = 0;     ///< last ticket handed out
+#endif
+#if WIFIMESSAGING_NETWORK_TASK || WIFIMESSAGING_SPOOL
+  TelegramOutboxEntry telegramStaging;  ///< filled by the sketch before it crosses or goes to the spool
+#endif
+#if WIFIMESSAGING_SPOOL
+  WifiMessagingSpool telegramSpool;
+  uint32_t telegramSpoolDone = 0;  ///< sequence of the last spooled message out of the outbox since the last ack
+  uint32_t telegramSpoolSkipped = 0;  ///< last unreadable record, acked once nothing read before it is in the outbox
+#endif
+  uint32_t telegramRetryAt = 0;    ///< millis() of the next attempt after a failure
+  bool telegramRetrying = false;
+
+  /**
+   * @brief Requests on the Telegram connection: a poll, a probe, or sendMessage requests
+   */
+  enum telegramRequest : uint8_t {
+    TelegramIdle = 0,
+    TelegramPolling = 1,  ///< getUpdates sent
+    TelegramSending = 2,  ///< sendMessage sent, see telegramInFlight
+    TelegramProbing = 3   ///< getMe sent to keep the connection
+  };
+
+  /**
+   * @brief sendMessage waiting for its response
+   */
+  struct TelegramSend {
+    uint16_t ticket = 0;  ///< outbox entry
+    uint8_t chat = 0;     ///< index
+    uint32_t sentAt = 0;  ///< millis()
+  };
+
+  telegramRequest telegramRequesting = TelegramIdle;
+  uint32_t telegramRequestStart = 0;  ///< millis() the poll or probe in progress was sent
+  TelegramSend telegramInFlight[WIFIMESSAGING_TELEGRAM_PIPELINE];  ///< in the order of their responses
+  uint8_t telegramInFlightCount = 0;
+  uint8_t telegramPipeline = WIFIMESSAGING_TELEGRAM_PIPELINE;
+  uint32_t telegramIdleMs = WIFIMESSAGING_TELEGRAM_IDLE_MS;
+  uint32_t telegramProbeMs = WIFIMESSAGING_TELEGRAM_PROBE_MS;
+  uint32_t telegramUsedAt = 0;    ///< millis() of the last message or poll on the connection
+  uint32_t telegramActiveAt = 0;  ///< millis() of the last request of any kind
+  bool telegramAnswered = false;  ///< the connection has answered a request
+
+  const telegramCommand *telegramCommands = nullptr;
+  size_t telegramCommandCount = 0;
+  uint32_t telegramPollMs = WIFIMESSAGING_TELEGRAM_POLL_MS;
+  uint32_t telegramPollAt = 0;       ///< millis() of the next poll
+  uint32_t telegramUpdateOffset = 0; ///< update_id after the last update received
+  /**
+   * @brief How the end of the response body is found
+   */
+  enum httpFraming : uint8_t {
+    HttpHeader = 0,     ///< header not complete yet
+    HttpLength = 1,     ///< Content-Length, telegramBodyLeft bytes to come
+    HttpChunkSize = 2,  ///< chunked, at the size line of a chunk
+    HttpChunkData = 3,  ///< chunked, telegramBodyLeft bytes of the chunk to come
+    HttpChunkEnd = 4,   ///< chunked, at the CRLF after the data of a chunk
+    HttpTrailer = 5,    ///< chunked, after the last chunk until the empty line
+    HttpClose = 6,      ///< until the server closes the connection
+    HttpDone = 7
+  };
+
+  uint16_t telegramResponseLength = 0;   ///< bytes in the buffer: header, body kept, bytes not framed yet
+  uint32_t telegramResponseDropped = 0;  ///< bytes of the body beyond the buffer
+  httpFraming telegramFraming = HttpHeader;
+  uint16_t telegramBodyAt = 0;   ///< offset of the body in the buffer
+  uint16_t telegramBodyEnd = 0;  ///< end of the body kept, and start of the bytes not framed yet
+  uint32_t telegramBodyLeft = 0;
+  char telegramResponse[WIFIMESSAGING_TELEGRAM_POLL_BUFFER];
+#endif
+
+#if WIFIMESSAGING_NETWORK_TASK
+  // Between the sketch and the network task, see detachNetwork(). The sketch
+  // produces the outgoing queues and consumes the incoming ones.
+  std::atomic<bool> networkDetached{false};
+  std::atomic<uint32_t> crossingDropped{0};  ///< incoming messages loop() did not take in time
+#if WIFIMESSAGING_ENABLE_MQTT
+  WifiMessagingEventQueue<MqttOutboxEntry, WIFIMESSAGING_CROSSING_SIZE> mqttOutgoing;
+  WifiMessagingEventQueue<MqttOutboxEntry, WIFIMESSAGING_CROSSING_SIZE> mqttIncoming;
+  std::atomic<uint16_t> mqttOutboxShared{0};  ///< size of the outbox, for pendingPublishes()
+#endif
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  struct TelegramCommandText {
+    char text[WIFIMESSAGING_TELEGRAM_MESSAGE_SIZE];
+  };
+
+  WifiMessagingEventQueue<TelegramOutboxEntry, WIFIMESSAGING_CROSSING_SIZE> telegramOutgoing;
+  WifiMessagingEventQueue<TelegramCommandText, WIFIMESSAGING_CROSSING_SIZE> telegramIncoming;
+  std::atomic<uint16_t> telegramPendingShared{0};  ///< for pendingMessages()
+  /// ticket << 8 | status by ticket, for messageStatus()
+  std::atomic<uint32_t> telegramStatusShared[WIFIMESSAGING_TELEGRAM_OUTBOX_SIZE + WIFIMESSAGING_CROSSING_SIZE];
+#endif
+#ifdef ESP32
+  TaskHandle_t networkTask = nullptr;
+#endif
+#endif
+
+  /**
+   * @brief Intend a service and everything it needs, the closure taken at compile time
+   */
+  template <uint16_t Service>
+  uint16_t AddConnectionService() {
+    static_assert((Service & ~CompiledServices) == 0, "service not compiled in, see WIFIMESSAGING_ENABLE_*");
+    static constexpr uint16_t closure = ServiceClosure(Service);
+    return connectionServices |= closure;
+  }
+
+  /**
+   * @brief Queue a service event for loop(), safe from event callbacks
+   */
+  void PostServiceEvent(connectionService service, bool up, uint8_t reason = 0);
+
+  /**
+   * @brief Apply the queued service events
+   */
+  void DispatchServiceEvents();
+
+  /**
+   * @brief Stop services with a lost dependency, dependents first, then start
+   * the intended services whose dependencies are active
+   */
+  void ReconcileServices();
+
+  /**
+   * @brief Account a lost or failed connect of a service and set its reconnect delay
+   *
+   * @param failed the connect did not complete, otherwise an established connection was lost
+   * @param reason WiFi disconnect reason
+   */
+  void ReconnectLater(const ServiceNode &node, bool failed, uint8_t reason);
+
+  /**
+   * @brief Account a connect attempt
+   */
+  void ReconnectAttempt(ReconnectState &state);
+
+  /**
+   * @brief WiFi got an IP: queue the prefetch of the intended services
+   */
+  void StartPrefetch();
+
+  /**
+   * @brief Advance the prefetch: DNS lookups of all hosts in flight together, then the TLS setup
+   *
+   * Runs while NTP syncs; only the TLS handshake, which validates the
+   * certificate, waits for the clock. The DNS lookups overlap the wait, the
+   * fragment probe does not: it blocks loop() for a TCP connect and a hello
+   * exchange, up to the client timeout when the host does not answer. It
+   * therefore runs only in a call without an MQTT connect step or a WiFi
+   * scan, and not when the fragment is known from RTC memory.
+   *
+   * @param tls the TLS setup may run in this call
+   */
+  void StepPrefetch(bool tls);
+
+  /**
+   * @brief Entry of host in the DNS cache, nullptr when there is none
+   */
+  DnsCacheEntry *FindDnsEntry(const char *host);
+
+  /**
+   * @brief Address of host from the DNS cache while its TTL lasts
+   */
+  bool CachedHost(const char *host, IPAddress &ip);
+
+  /**
+   * @brief Look host up and keep the answer in the DNS cache
+   *
+   * On the ESP8266 a lookup not answered within wait_ms keeps running, a
+   * later call picks up the answer; the ESP32 does not wait at all. While
+   * lookups fail, the expired address is served without a lookup for a while.
+   *
+   * @param since millis() the caller started resolving, the stale address is served WIFIMESSAGING_DNS_STALE_AFTER_MS later
+   * @param wait_ms ESP8266: longest wait for the answer
+   */
+  dnsAnswer ResolveHost(const char *host, IPAddress &ip, uint32_t since, uint32_t wait_ms);
+
+  /**
+   * @brief Read the DNS cache kept in RTC memory, addresses of unknown age become stale
+   */
+  void RestoreDnsCache();
+
+  /**
+   * @brief Keep the DNS cache in RTC memory, once the clock is set
+   */
+  void SaveDnsCache();
+
+  /**
+   * @brief A new Telegram connection waits for its lookup in flight and for an MQTT connect in its first round trips
+   */
+  bool HoldsTelegramConnect() const;
+
+  /**
+   * @brief Initialise WiFi: WiFi off and events set
+   */
+  void InitialiseWiFi();
+
+  /**
+   * @brief Connect with a scan and DHCP
+   *
+   * Takes the strongest access point of the scan cache, else scans first
+   * when there are several candidates, else leaves the scan to the SDK.
+   */
+  void ConnectToWiFiFull();
+
+  /**
+   * @brief Connect to an access point of the scan cache, no scan of the SDK
+   */
+  void ConnectToScanEntry(int8_t entry);
+
+  /**
+   * @brief Start a scan in the background, finished by StepWiFiScan()
+   */
+  bool StartWiFiScan(wifiScanPurpose purpose);
+
+  /**
+   * @brief Rank the results of a finished scan and act on them
+   */
+  void StepWiFiScan();
+
+  /**
+   * @brief Strongest access point of a fresh scan that has not failed
+   *
+   * @param exclude BSSID to skip, the current one, nullptr for none
+   * @return index in wifiScan, -1 when none
+   */
+  int8_t BestScanEntry(const uint8_t *exclude) const;
+
+  /**
+   * @brief Scan when the RSSI is below the roaming threshold
+   */
+  void CheckWiFiRoaming();
+
+  /**
+   * @brief Switch to the access point of the scan cache
+   */
+  void RoamWiFi(int8_t entry);
+
+  /**
+   * @brief Reconnect after the WiFi backoff, unless disconnected by the sketch
+   */
+  void ReconnectToWiFi();
+
+  /**
+   * @brief Save channel, BSSID and IP configuration of the connection to RTC memory
+   */
+  void SaveWiFiCache();
+
+#if WIFIMESSAGING_ENABLE_MQTT
+  /**
+   * @brief Initialise MQTT
+   */
+  void InitialiseMQTT(MQTT_CALLBACK_SIGNATURE);
+
+  /**
+   * @brief Start connecting to the MQTT server, loop() advances the connect
+   */
+  void ConnectToMqtt();
 
-#endif
+  /**
+   * @brief Advance the MQTT connect by one step, waiting at most WIFIMESSAGING_MQTT_STEP_MS
+   */
+  void StepConnectToMqtt();
 
-#include <Certificate_telegram.h>
-#include <PubSubClient.h>          // 89              - https://github.com/knolleary/pubsubclient.git
-#include <UniversalTelegramBot.h>  // 1262            - https://github.com/witnessmenow/Universal-Arduino-Telegram-Bot.git
+  /**
+   * @brief Abandon the MQTT connect attempt
+   */
+  void AbortConnectToMqtt(const char *reason);
 
-// **************************************** DEBUG ****************************************
+  /**
+   * @brief Close the MQTT connection
+   */
+  void StopMQTT();
 
-// Uncomment lines below to receive debug messages via Serial
-#define DEBUG_WIFIMESSAGING_TO_SERIAL 1
-
-#ifdef DEBUG_WIFIMESSAGING_TO_SERIAL
-#define DEBUG_WIFIMESSAGING_BEGIN()  \
-  if (!Serial) Serial.begin(115200); \
-  Serial.println();
-#define DEBUG_WIFIMESSAGING_PRINT(x) Serial.print(x)
-#define DEBUG_WIFIMESSAGING_PRINTLN(x) Serial.println(x)
-#define DEBUG_WIFIMESSAGING_PRINTF(...) \
-  {                                     \
-    Serial.printf("%lu", millis());     \
-    Serial.print("mS L");               \
-    Serial.print(__LINE__);             \
-    Serial.print("/");                  \
-    Serial.print(__FUNCTION__);         \
-    Serial.print(": ");                 \
-    Serial.printf(__VA_ARGS__);         \
-  }
-#define DEBUG_WIFIMESSAGING_FLUSH() Serial.flush()
-#else
-#define DEBUG_WIFIMESSAGING_BEGIN()
-#define DEBUG_WIFIMESSAGING_PRINT(x)
-#define DEBUG_WIFIMESSAGING_PRINTLN(x)
-#define DEBUG_WIFIMESSAGING_PRINTF(...)
-#define DEBUG_WIFIMESSAGING_FLUSH()
-#endif
+  /**
+   * @brief Subscribe every filter of subscribe() at the broker
+   */
+  void ResubscribeMqtt();
 
-// **************************************** CLASS **************************************** 
-// WifiMessaging(ServiceWifi | ServiceNTP | ServiceSecure | ServiceMQTT | ServiceTelegram);
-// WifiMessaging.InitialiseMQTT(callback);
-// WifiMessaging.connectToWiFi();
+  /**
+   * @brief Incoming MQTT message: to DispatchMqttMessage(), or to loop() after detachNetwork()
+   */
+  void RouteMqttMessage(char *topic, uint8_t *payload, unsigned int length);
 
-/**
- * WiFi and messaging class (h).
- */
-class WifiMessaging {
- public:
-  enum connectionStatus {
-    ConnectionInactive = 0,
-    ConnectionInBetween = 1,
-    ConnectionActive = 2,
-    ConnectionActiveNew = 3
-  };
+  /**
+   * @brief Hand an incoming MQTT message to the matching handlers
+   */
+  void DispatchMqttMessage(char *topic, uint8_t *payload, unsigned int length);
 
-  enum connectionService : uint16_t {
-    ServiceWifi = 1,
-    ServiceNTP = 2,
-    ServiceSecure = 4,
-    ServiceMQTT = 8,
-    ServiceTelegram = 16
-  };
+  /**
+   * @brief Publish up to WIFIMESSAGING_MQTT_BATCH messages of the MQTT outbox, in order
+   */
+  void FlushMqttOutbox();
 
-  connectionStatus StatusWiFi = ConnectionInactive;
-  connectionStatus StatusNTP = ConnectionInactive;
-  connectionStatus StatusMQTT = ConnectionInactive;
-  connectionStatus StatusSecure = ConnectionInactive;
-  connectionStatus StatusTelegram = ConnectionInactive;
+  /**
+   * @brief Take the oldest message off the MQTT outbox, and off the spool when it came from there
+   */
+  void PopMqttOutbox();
 
-  // MQTT
-  PubSubClient mqttClient;  ///< PubSubClient object
+  /**
+   * @brief MQTT messages in the outbox, and in the spool not yet moved into it
+   */
+  size_t QueuedPublishes() const;
 
+#if WIFIMESSAGING_SPOOL
   /**
-   * @brief Construct a new Wifi Messaging object
-   *
-   * @param wifi_ssid Service Set Identifier
-   * @param wifi_password Password of the SSID Network
+   * @brief A new MQTT message goes to the spool: behind those there, or MQTT is down or the outbox full
    */
-  WifiMessaging(const char *wifi_ssid, const char *wifi_password);
+  bool MqttToSpool() const;
 
   /**
-   * @brief Set MQTT parameters
+   * @brief Append an MQTT message to the spool
    *
-   * @param mqtt_host mqtt host
-   * @param mqtt_port mqtt port
-   * @param callback function for received messages
+   * @return false when the spool is full
    */
-  void SetMQTT(const char *mqtt_host, uint16_t mqtt_port, MQTT_CALLBACK_SIGNATURE);
+  bool SpoolMqttMessage(const char *topic, const uint8_t *payload, size_t length, bool retained, uint8_t qos);
 
   /**
-   * @brief Set MQTT parameters
+   * @brief Move the messages of the MQTT outbox to an empty spool, MQTT went down
+   */
+  void SpoolMqttOutbox();
+
+  /**
+   * @brief Move up to WIFIMESSAGING_MQTT_BATCH messages of the spool into the outbox
+   */
+  void ReplayMqttSpool();
+#endif
+
+  /**
+   * @brief Publish the metrics payload to metricsTopic
+   */
+  void PublishMetrics();
+#endif
+
+  /**
+   * @brief Initialise NTP
+   */
+  void InitialiseNTP();
+
+  /**
+   * @brief Stop waiting for NTP
+   */
+  void StopNTP();
+
+  /**
+   * @brief Set the clock from the last SNTP sync kept in RTC memory, unless too old
+   */
+  void RestoreClock();
+
+  /**
+   * @brief Save the clock of an SNTP sync to RTC memory
+   */
+  void SaveClock();
+
+  /**
+   * @brief Read the duty cycle record of the last sleep, mark this boot awake
+   */
+  void RestoreDutyCycle();
+
+  /**
+   * @brief Sleep once the armed cycle delivered everything or its deadline passed
+   */
+  void StepDutyCycle();
+
+  /**
+   * @brief Record the cycle in RTC memory, close the connections and deep-sleep
+   */
+  void SleepNow();
+
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  /**
+   * @brief Initialise Secure
+   */
+  void InitialiseSecure();
+
+  /**
+   * @brief Close the TLS connection
+   */
+  void StopSecure();
+
+#ifdef ESP8266
+  /**
+   * @brief Restore the TLS session saved in RTC memory, unless expired
+   */
+  void RestoreTlsSession();
+
+  /**
+   * @brief Save the TLS session to RTC memory when it changed
+   */
+  void SaveTlsSession();
+
+  /**
+   * @brief Decode the roots of tlsRoots not yet in cert
+   */
+  void LoadTrustAnchors();
+
+  /**
+   * @brief Receive buffer for Telegram: known, kept in RTC memory, or probed
+   */
+  uint16_t TlsFragment();
+
+  /**
+   * @brief Keep the accepted MFLN of a completed connect in RTC memory
+   */
+  void SaveTlsFragment(uint16_t fragment);
+#endif
+
+  /**
+   * @brief Open the TLS connection to Telegram, timed as a full or resumed handshake
+   */
+  bool ConnectSecure();
+#endif
+
+  /**
+   * @brief Sample free heap and largest free block into the watermarks
+   */
+  void SampleHeap();
+
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  /**
+   * @brief Initialise Telegram
+   */
+  void InitialiseTelegram();
+
+  /**
+   * @brief Stop sending from the Telegram outbox
+   */
+  void StopTelegram();
+
+  /**
+   * @brief Take a slot of the Telegram outbox and give it a ticket
    *
-   * @param mqtt_hostip
-   * @param mqqt_port
-   * @param callback function for received messages
+   * @param chats one bit per chat, limited to the chats there are
+   * @return nullptr when full, no chat is left, or Telegram is not intended
    */
-  void SetMQTT(IPAddress mqtt_hostip, uint16_t mqqt_port, MQTT_CALLBACK_SIGNATURE);
+  TelegramOutboxEntry *QueueOutboxEntry(const char *parse_mode, uint8_t chats, messagePriority priority);
+
+  uint16_t VQueueMessagef(uint8_t chats, messagePriority priority, const char *parse_mode, const char *format,
+                          va_list args);
 
   /**
-   * @brief Set the Telegram object
+   * @brief Send the next message of the Telegram outbox its chat and the bot have a token for
    *
-   * @param telegram_bot The telegram bot code
+   * Urgent before routine, oldest first. loop() collects the response.
+   *
+   * @return false when no message may be sent now
    */
-  void SetTelegram(const char *telegram_bot, const char *telegram_chat_id);
+  bool SendFromOutbox();
 
   /**
-   * @brief Act on situation
+   * @brief Write a sendMessage request for a chat, the text JSON escaped
    */
-  void loop();
+  bool WriteSendMessage(const TelegramOutboxEntry &entry, const char *chat_id);
 
   /**
-   * @brief Connect to WiFi
+   * @brief Account the response of a sendMessage: sent, held on 429, retried or given up
+   *
+   * @param status HTTP status, 0 when no response came
+   * @param body JSON body, terminated
    */
-  void connectToWiFi();
+  void FinishTelegramSend(const TelegramSend &send, int status, char *body);
 
   /**
-   * @brief Disconnect from WiFi
+   * @brief Close the Telegram connection after a failure and account the requests in flight
+   *
+   * Those the server has not answered are sent again without counting an
+   * attempt when the connection had answered before, e.g. one the server
+   * closed while idle.
    */
-  void disconnectFromWiFi();
+  void LoseTelegramConnection();
 
   /**
-   * @brief macId as 12 hexnumber
+   * @brief Close the Telegram connection when idle too long, or probe it
    */
-  String macId();
+  void KeepTelegramAlive();
 
   /**
-   * @brief send Telegram message
+   * @brief Send a getMe request to keep the connection, loop() collects the response
    */
-  bool sendMessage(const String &text, const String &parse_mode);
+  void StartTelegramProbe();
 
   /**
-   * @brief return static object of this class
-   *
-   * @return WifiMessaging&
+   * @brief Messages of the Telegram outbox with a chat left to send to, and those in the spool not yet moved into it
    */
-  static WifiMessaging &instance();
+  size_t PendingInOutbox() const;
 
-#ifdef ESP32
+  /**
+   * @brief Take finished messages off the front of the Telegram outbox
+   */
+  void TrimOutbox();
 
-  static void wifi_event_handler_static(WiFiEvent_t event, WiFiEventInfo_t info);
+  /**
+   * @brief Send a getUpdates request, loop() collects the response
+   */
+  void StartTelegramPoll();
 
-#endif
+  /**
+   * @brief Read what arrived of the responses on the Telegram connection, without waiting
+   */
+  void StepTelegramRequest();
 
- private:
   /**
-   * @brief Intended connection services, set if constants connection service
-   * are set ServiceWifi | ServiceNTP | ServiceSecure | ServiceMQTT |
-   * ServiceTelegram
+   * @brief Take the bytes in the buffer after the body kept into the response
+   *
+   * The body is kept decoded: the chunk framing is taken out and what does not
+   * fit is dropped. Bytes after a complete response stay for the next one.
    *
+   * @return int8_t 1 complete, 0 more to come, -1 not understood
    */
-  uint16_t connectionServices = ServiceWifi;
+  int8_t FrameTelegramResponse();
 
-  // WiFi
-  const char *wifi_ssid;      ///< Wifi SSID
-  const char *wifi_password;  ///< WiFi password
-  WiFiClient wifiClient;      ///< WifiClient object
-  
-  static WifiMessaging *_wifimessaging;
-  
-#ifdef ESP8266
-  WiFiEventHandler e1;  ///< event onStationModeConnected
-  WiFiEventHandler e2;  ///< event onStationModeDisconnected
-  WiFiEventHandler e4;  ///< event onStationModeGotIP
-#elif ESP32
+  /**
+   * @brief Empty the response buffer for the next request
+   */
+  void ResetTelegramResponse();
 
-#endif
+  /**
+   * @brief Take the update of a complete getUpdates response and dispatch its command
+   *
+   * @param body JSON body, terminated, decoded in place
+   */
+  void HandleTelegramUpdate(char *body);
 
-  // MQTT
-  IPAddress mqtt_hostip;
-  const char *mqqt_hostdomain;
-  uint16_t mqqt_port;
+  /**
+   * @brief Call the handler of the /command in text
+   */
+  void DispatchTelegramCommand(char *text);
 
-  // NTP
-  Ticker timechecker;
+  /**
+   * @brief Queued message in the outbox, or across to the network task, or in the spool
+   *
+   * @return uint16_t ticket, 0 when it did not fit
+   */
+  uint16_t CommitOutboxEntry(TelegramOutboxEntry *entry);
 
-#ifdef ESP8266
-  // Secure
-  BearSSL::WiFiClientSecure secureClient;
-  BearSSL::X509List cert;
-  BearSSL::Session session;  
-  // session cache used to remember secret keys established with clients, to support session resumption.
-#elif ESP32
-  WiFiClientSecure secureClient;
-#endif
+  /**
+   * @brief Next ticket, never 0
+   */
+  uint16_t NextTicket();
 
-  // Telegram
-  const char *telegram_bot;
-  const char *telegram_chat_id;
-  UniversalTelegramBot *bot;
+#if WIFIMESSAGING_SPOOL
+  /**
+   * @brief A new Telegram message goes to the spool: behind those there, or Telegram is down or the outbox full
+   */
+  bool TelegramToSpool() const;
 
   /**
-   * @brief Congruent combination of connection services
+   * @brief Append a Telegram message, its chats still to send to, to the spool
    *
-   *  WiFi
-   *   |-- MQTT (Insecure)
-   *   |-- NTP (Time)
-   *       |-- WiFiSecure
-   *           |-- Telegram
+   * @return false when the spool is full
    */
-  uint16_t CheckConnectionServices(uint16_t connectionServices);
+  bool SpoolTelegramMessage(const TelegramOutboxEntry &entry);
 
-  uint16_t AddConnectionService(uint16_t connectionService);
+  /**
+   * @brief Move the messages of the Telegram outbox to an empty spool, Telegram went down
+   */
+  void SpoolTelegramOutbox();
 
   /**
-   * @brief Initialise WiFi: WiFi off and events set
+   * @brief Move a message of the spool into the outbox
    */
-  void InitialiseWiFi();
+  void ReplayTelegramSpool();
+#endif
+#endif
 
+#if WIFIMESSAGING_SPOOL
   /**
-   * @brief Initialise MQTT
+   * @brief Take the messages out of the outboxes since the last call off the spools, one ack each
    */
-  void InitialiseMQTT(MQTT_CALLBACK_SIGNATURE);
+  void AckSpools();
+#endif
 
   /**
-   * @brief Connect to MQTT server
+   * @brief The state machine, see loop() and runNetwork()
    */
-  void ConnectToMqtt();
+  void NetworkLoop();
 
+#if WIFIMESSAGING_NETWORK_TASK
   /**
-   * @brief Initialise NTP
+   * @brief Move what the sketch queued into the outboxes, network task
    */
-  void InitialiseNTP();
+  void TakeCrossings();
 
   /**
-   * @brief Initialise Secure
+   * @brief Publish the outbox counts for pendingPublishes() and pendingMessages()
    */
-  void InitialiseSecure();
+  void ShareCounts();
 
   /**
-   * @brief Initialise Telegram
+   * @brief Hand the incoming messages to their handlers, loop() of the sketch
    */
-  void InitialiseTelegram();
+  void DeliverIncoming();
+
+#if WIFIMESSAGING_ENABLE_TELEGRAM
+  /**
+   * @brief Publish the delivery status of a message for messageStatus()
+   */
+  void ShareMessageStatus(const TelegramOutboxEntry &entry);
+#endif
+
+#ifdef ESP32
+  static void NetworkTask(void *self);
+#endif
+#endif
 
 #ifdef ESP8266
 
@@ -264,6 +2093,11 @@ class WifiMessaging {
   void onSTAGotIP(const WiFiEventStationModeGotIP &e /*IPAddress ip, IPAddress mask, IPAddress gw*/);
 
 #elif ESP32
+  /**
+   * @brief Handle the WiFi events the event task queued
+   */
+  void DispatchWiFiEvents();
+
   void  onSTAConnected(WiFiEvent_t event, WiFiEventInfo_t info);
   void  onSTADisconnected(WiFiEvent_t event, WiFiEventInfo_t info);
   void  onSTAGotIP(WiFiEvent_t event, WiFiEventInfo_t info);
@@ -271,9 +2105,13 @@ class WifiMessaging {
 #endif
 
   /**
-   * @brief Check time received via NTP
+   * @brief Clock set, NTP is active when the clock comes from SNTP
    */
-  void checkNTP();
+  void onTimeSet(bool from_sntp);
+
+#ifdef ESP32
+  static void time_sync_static(struct timeval *tv);
+#endif
 };
 
 #endif
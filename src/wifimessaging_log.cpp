@@ -0,0 +1,228 @@
+#include "wifimessaging_log.h"
+
+#include <stdarg.h>
+
+#include <atomic>
+
+static_assert((WIFIMESSAGING_LOG_RECORDS & (WIFIMESSAGING_LOG_RECORDS - 1)) == 0,
+              "WIFIMESSAGING_LOG_RECORDS must be a power of two");
+
+#if WIFIMESSAGING_LOG_LEVEL > WIFIMESSAGING_LOG_NONE
+
+static const char LEVEL_LETTERS[] = "-EWID";
+
+/**
+ * @brief Record in the ring
+ *
+ * sequence is the claim ticket of the record minus its index, so the
+ * zero-initialised ring is ready before any constructor runs: a global
+ * WifiMessaging logs from its constructor.
+ */
+struct LogRecord {
+  std::atomic<uint32_t> sequence;
+  uint32_t ms;
+  const char *function;
+  uint16_t line;
+  uint8_t level;
+  bool compact;
+  union {
+    char text[WIFIMESSAGING_LOG_TEXT + 1];
+    struct {
+      const char *format;
+      uint32_t args[3];
+    } values;
+  };
+};
+
+static LogRecord ring[WIFIMESSAGING_LOG_RECORDS];
+static std::atomic<uint32_t> head;       ///< next ticket to claim, producers
+static uint32_t tail;                    ///< next ticket to write out, drain() only
+static std::atomic<uint32_t> lost;       ///< dropped since the last report
+static std::atomic<uint32_t> lostTotal;
+static Print *out = &Serial;
+static bool direct = false;
+
+// Line being written out by drain(), pending from outPos to outLength
+static char outLine[WIFIMESSAGING_LOG_TEXT + 48];
+static size_t outLength = 0;
+static size_t outPos = 0;
+
+static inline uint32_t sequenceOf(uint32_t index) {
+  return ring[index].sequence.load(std::memory_order_acquire) + index;
+}
+
+/**
+ * @brief Claim the next record, nullptr when the ring is full
+ */
+static LogRecord *IRAM_ATTR claim(uint32_t &ticket) {
+  ticket = head.load(std::memory_order_relaxed);
+  for (;;) {
+    uint32_t index = ticket % WIFIMESSAGING_LOG_RECORDS;
+    int32_t diff = (int32_t)(sequenceOf(index) - ticket);
+    if (diff == 0) {
+      if (head.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed)) return &ring[index];
+    } else if (diff < 0) {
+      // the record of one round ago is not written out yet
+      lost.fetch_add(1, std::memory_order_relaxed);
+      lostTotal.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    } else {
+      ticket = head.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ * @brief Hand a claimed record to drain()
+ */
+static void IRAM_ATTR publish(uint32_t ticket) {
+  uint32_t index = ticket % WIFIMESSAGING_LOG_RECORDS;
+  ring[index].sequence.store(ticket + 1 - index, std::memory_order_release);
+}
+
+/**
+ * @brief Format a record as an output line
+ */
+static size_t formatLine(char *buffer, size_t size, const LogRecord &record) {
+  int n = snprintf(buffer, size, "%lumS %c L%u/%s: ", (unsigned long)record.ms, LEVEL_LETTERS[record.level],
+                   record.line, record.function);
+  if (n < 0) return 0;
+  size_t length = (size_t)n < size ? (size_t)n : size - 1;
+  if (record.compact) {
+    n = snprintf(buffer + length, size - length, record.values.format, record.values.args[0], record.values.args[1],
+                 record.values.args[2]);
+  } else {
+    n = snprintf(buffer + length, size - length, "%s", record.text);
+  }
+  if (n > 0) length += (size_t)n < size - length ? (size_t)n : size - length - 1;
+  // the text may end in a newline of its own
+  if (length && buffer[length - 1] == '\n') length--;
+  if (length > size - 3) length = size - 3;
+  buffer[length++] = '\r';
+  buffer[length++] = '\n';
+  buffer[length] = 0;
+  return length;
+}
+
+/**
+ * @brief Take the next record out of the ring into outLine
+ *
+ * @return false when there is none
+ */
+static bool nextLine() {
+  outPos = outLength = 0;
+  uint32_t dropped = lost.exchange(0, std::memory_order_relaxed);
+  if (dropped) {
+    int n = snprintf(outLine, sizeof(outLine), "%lumS W log: %lu records dropped\r\n", (unsigned long)millis(),
+                     (unsigned long)dropped);
+    outLength = n > 0 ? (size_t)n : 0;
+    return true;
+  }
+  uint32_t index = tail % WIFIMESSAGING_LOG_RECORDS;
+  if (sequenceOf(index) != tail + 1) return false;
+  outLength = formatLine(outLine, sizeof(outLine), ring[index]);
+  ring[index].sequence.store(tail + WIFIMESSAGING_LOG_RECORDS - index, std::memory_order_release);
+  tail++;
+  return true;
+}
+
+/**
+ * @brief Write a record at once, see synchronous()
+ */
+static void writeDirect(const LogRecord &record) {
+  if (!out) return;
+  char line[sizeof(outLine)];
+  size_t length = formatLine(line, sizeof(line), record);
+  out->write((const uint8_t *)line, length);
+}
+
+void WifiMessagingLog::text(uint8_t level, uint16_t line, const char *function, const char *format, ...) {
+  LogRecord directRecord;
+  uint32_t ticket = 0;
+  LogRecord *record = direct ? &directRecord : claim(ticket);
+  if (!record) return;
+  record->ms = millis();
+  record->function = function;
+  record->line = line;
+  record->level = level;
+  record->compact = false;
+  va_list args;
+  va_start(args, format);
+  vsnprintf(record->text, sizeof(record->text), format, args);
+  va_end(args);
+  if (direct)
+    writeDirect(*record);
+  else
+    publish(ticket);
+}
+
+void IRAM_ATTR WifiMessagingLog::compact(uint8_t level, uint16_t line, const char *function, const char *format,
+                                         uint32_t a, uint32_t b, uint32_t c) {
+  LogRecord directRecord;
+  uint32_t ticket = 0;
+  LogRecord *record = direct ? &directRecord : claim(ticket);
+  if (!record) return;
+  record->ms = millis();
+  record->function = function;
+  record->line = line;
+  record->level = level;
+  record->compact = true;
+  record->values.format = format;
+  record->values.args[0] = a;
+  record->values.args[1] = b;
+  record->values.args[2] = c;
+  if (direct)
+    writeDirect(*record);
+  else
+    publish(ticket);
+}
+
+void WifiMessagingLog::output(Print *to) { out = to; }
+
+size_t WifiMessagingLog::drain() {
+  size_t written = 0;
+  for (;;) {
+    if (outPos == outLength && !nextLine()) break;
+    if (!out) {
+      outPos = outLength;
+      continue;
+    }
+    int room = out->availableForWrite();
+    if (room <= 0) break;
+    size_t n = outLength - outPos;
+    if (n > (size_t)room) n = room;
+    n = out->write((const uint8_t *)outLine + outPos, n);
+    if (n == 0) break;
+    outPos += n;
+    written += n;
+  }
+  return written;
+}
+
+void WifiMessagingLog::flush() {
+  for (;;) {
+    if (outPos == outLength && !nextLine()) break;
+    if (out) out->write((const uint8_t *)outLine + outPos, outLength - outPos);
+    outPos = outLength;
+  }
+  if (out) out->flush();
+}
+
+void WifiMessagingLog::synchronous(bool on) {
+  if (on) flush();
+  direct = on;
+}
+
+uint32_t WifiMessagingLog::dropped() { return lostTotal.load(std::memory_order_relaxed); }
+
+#else
+
+void WifiMessagingLog::text(uint8_t, uint16_t, const char *, const char *, ...) {}
+void WifiMessagingLog::compact(uint8_t, uint16_t, const char *, const char *, uint32_t, uint32_t, uint32_t) {}
+void WifiMessagingLog::output(Print *) {}
+size_t WifiMessagingLog::drain() { return 0; }
+void WifiMessagingLog::flush() {}
+void WifiMessagingLog::synchronous(bool) {}
+uint32_t WifiMessagingLog::dropped() { return 0; }
+
+#endif
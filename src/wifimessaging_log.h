@@ -0,0 +1,117 @@
+#ifndef WIFIMESSAGING_LOG_H
+#define WIFIMESSAGING_LOG_H
+
+#include <Arduino.h>
+
+// Log levels, a record is kept when its level is at most WIFIMESSAGING_LOG_LEVEL
+#define WIFIMESSAGING_LOG_NONE 0
+#define WIFIMESSAGING_LOG_ERROR 1
+#define WIFIMESSAGING_LOG_WARN 2
+#define WIFIMESSAGING_LOG_INFO 3
+#define WIFIMESSAGING_LOG_DEBUG 4
+
+// Levels compiled in. Calls above this level, their arguments included, are
+// removed by the compiler; WIFIMESSAGING_LOG_NONE also leaves out the ring.
+// Set it for the library as a whole, e.g. as a -D build flag.
+#ifndef WIFIMESSAGING_LOG_LEVEL
+#define WIFIMESSAGING_LOG_LEVEL WIFIMESSAGING_LOG_INFO
+#endif
+
+// Records in the ring, a power of two. A record that finds the ring full is dropped and counted.
+#ifndef WIFIMESSAGING_LOG_RECORDS
+#define WIFIMESSAGING_LOG_RECORDS 16
+#endif
+
+// Characters of a text record, longer text is cut
+#ifndef WIFIMESSAGING_LOG_TEXT
+#define WIFIMESSAGING_LOG_TEXT 80
+#endif
+
+/**
+ * @brief Leveled log in a lock-free ring, written out by loop()
+ *
+ * A log call only copies its record into the ring; drain() writes the ring
+ * to the output as far as it takes without waiting. Any number of producers
+ * (loop(), WiFi and SNTP callbacks, an ESP32 task, an interrupt) may log
+ * while loop() drains: a producer claims a record with one compare-and-swap
+ * and never waits for another one.
+ *
+ * Two record formats:
+ * - text: formatted with vsnprintf() at the call, up to WIFIMESSAGING_LOG_TEXT
+ *   characters
+ * - compact: the format and up to three 32-bit integers, formatted by drain().
+ *   The format must be a string literal taking only %d, %u or %x, and is
+ *   cheap enough for interrupt context.
+ *
+ * An output line reads "<millis>mS <level> L<line>/<function>: <text>".
+ */
+class WifiMessagingLog {
+ public:
+  /**
+   * @brief Keep a text record, see WIFIMESSAGING_LOGI() and the other levels
+   */
+  static void text(uint8_t level, uint16_t line, const char *function, const char *format, ...)
+      __attribute__((format(printf, 4, 5)));
+
+  /**
+   * @brief Keep a compact record, see WIFIMESSAGING_LOG_COMPACT()
+   */
+  static void compact(uint8_t level, uint16_t line, const char *function, const char *format, uint32_t a = 0,
+                      uint32_t b = 0, uint32_t c = 0);
+
+  /**
+   * @brief Where drain() writes, Serial by default
+   *
+   * @param out nullptr to discard the records
+   */
+  static void output(Print *out);
+
+  /**
+   * @brief Write records while the output takes them without waiting
+   *
+   * Called by WifiMessaging::loop(). A line is written in parts when the
+   * output has less room, Print::availableForWrite() tells how much.
+   *
+   * @return size_t bytes written
+   */
+  static size_t drain();
+
+  /**
+   * @brief Write all records, waiting for the output; before a deep sleep or restart
+   */
+  static void flush();
+
+  /**
+   * @brief Write every record at the call instead of at drain(), waiting for the output
+   *
+   * For debugging a crash, where records still in the ring are lost.
+   */
+  static void synchronous(bool on);
+
+  /**
+   * @brief Records dropped on a full ring, since the start
+   */
+  static uint32_t dropped();
+};
+
+#define WIFIMESSAGING_LOG_AT(level, ...)                                      \
+  do {                                                                        \
+    if ((level) <= WIFIMESSAGING_LOG_LEVEL)                                   \
+      WifiMessagingLog::text(level, __LINE__, __FUNCTION__, __VA_ARGS__);     \
+  } while (0)
+
+#define WIFIMESSAGING_LOGE(...) WIFIMESSAGING_LOG_AT(WIFIMESSAGING_LOG_ERROR, __VA_ARGS__)
+#define WIFIMESSAGING_LOGW(...) WIFIMESSAGING_LOG_AT(WIFIMESSAGING_LOG_WARN, __VA_ARGS__)
+#define WIFIMESSAGING_LOGI(...) WIFIMESSAGING_LOG_AT(WIFIMESSAGING_LOG_INFO, __VA_ARGS__)
+#define WIFIMESSAGING_LOGD(...) WIFIMESSAGING_LOG_AT(WIFIMESSAGING_LOG_DEBUG, __VA_ARGS__)
+
+/**
+ * @brief Compact record: level, a string literal format and up to three integers
+ */
+#define WIFIMESSAGING_LOG_COMPACT(level, format, ...)                                 \
+  do {                                                                                \
+    if ((level) <= WIFIMESSAGING_LOG_LEVEL)                                           \
+      WifiMessagingLog::compact(level, __LINE__, __FUNCTION__, format, ##__VA_ARGS__); \
+  } while (0)
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef WIFIMESSAGING_METRICS_H
+#define WIFIMESSAGING_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Histogram of durations in power-of-two buckets
+ *
+ * Bucket 0 counts the value 0, bucket i > 0 the values from 2^(i-1) up to
+ * 2^i - 1; the last bucket also counts everything larger. Recording is a
+ * handful of integer operations, the histogram takes 80 bytes.
+ */
+struct WifiMessagingHistogram {
+  static const uint8_t BUCKETS = 16;
+
+  uint32_t count = 0;
+  uint32_t min = 0;  ///< only meaningful when count > 0
+  uint32_t max = 0;
+  uint32_t sum = 0;  ///< saturates instead of wrapping
+  uint32_t buckets[BUCKETS] = {};
+
+  void record(uint32_t value) {
+    if (count == 0 || value < min) min = value;
+    if (value > max) max = value;
+    sum = (sum + value < sum) ? UINT32_MAX : sum + value;
+    count++;
+    uint8_t i = 0;
+    while (value && i < BUCKETS - 1) {
+      value >>= 1;
+      i++;
+    }
+    buckets[i]++;
+  }
+
+  uint32_t mean() const { return count ? sum / count : 0; }
+
+  /**
+   * @brief Upper bound of the bucket holding the given percentile, at most max
+   *
+   * @param percent 0..100
+   */
+  uint32_t quantile(uint8_t percent) const {
+    if (count == 0) return 0;
+    uint32_t rank = ((uint64_t)count * percent + 99) / 100;
+    if (rank == 0) rank = 1;
+    uint32_t seen = 0;
+    for (uint8_t i = 0; i < BUCKETS; i++) {
+      seen += buckets[i];
+      if (seen >= rank) {
+        uint32_t bound = i ? (uint32_t)((1UL << i) - 1) : 0;
+        return (i == BUCKETS - 1 || bound > max) ? max : bound;
+      }
+    }
+    return max;
+  }
+
+  void reset() { *this = WifiMessagingHistogram(); }
+};
+
+#endif
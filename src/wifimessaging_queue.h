@@ -0,0 +1,142 @@
+#ifndef WIFIMESSAGING_QUEUE_H
+#define WIFIMESSAGING_QUEUE_H
+
+#include <stddef.h>
+
+#include <atomic>
+
+/**
+ * @brief Fixed-capacity ring buffer without heap allocation
+ *
+ * push() hands out the next free slot to be filled in place. A popped slot
+ * keeps its contents until it is handed out again, so finished entries can
+ * still be inspected through slot().
+ *
+ * @tparam T entry type
+ * @tparam N capacity
+ */
+template <typename T, size_t N>
+class WifiMessagingQueue {
+ public:
+  static constexpr size_t capacity() { return N; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  bool full() const { return count == N; }
+
+  /**
+   * @brief Append an entry
+   *
+   * @return T* slot to fill, nullptr when full
+   */
+  T *push() {
+    if (full()) return nullptr;
+    T *entry = &slots[(first + count) % N];
+    count++;
+    return entry;
+  }
+
+  /**
+   * @brief Oldest entry, only valid when not empty
+   */
+  T &front() { return slots[first]; }
+
+  /**
+   * @brief i-th entry counted from the oldest, only valid when i < size()
+   */
+  T &at(size_t i) { return slots[(first + i) % N]; }
+  const T &at(size_t i) const { return slots[(first + i) % N]; }
+
+  /**
+   * @brief Remove the oldest entry
+   */
+  void pop() {
+    if (count == 0) return;
+    first = (first + 1) % N;
+    count--;
+  }
+
+  /**
+   * @brief Raw slot i, queued or not, i < capacity()
+   */
+  T &slot(size_t i) { return slots[i]; }
+
+ private:
+  T slots[N];
+  size_t first = 0;
+  size_t count = 0;
+};
+
+/**
+ * @brief Fixed-capacity single-producer single-consumer ring of events
+ *
+ * push() may run in a WiFi event or SNTP callback, or in another task, while
+ * pop() runs in loop(): the producer only writes head, the consumer only
+ * writes tail.
+ *
+ * @tparam T event type, copied in and out
+ * @tparam N capacity
+ */
+template <typename T, size_t N>
+class WifiMessagingEventQueue {
+ public:
+  bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_relaxed); }
+
+  /**
+   * @brief Append an event, producer side
+   *
+   * @return false when full, the event is dropped
+   */
+  bool push(const T &event) {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t next = (h + 1) % (N + 1);
+    if (next == tail.load(std::memory_order_acquire)) return false;
+    slots[h] = event;
+    head.store(next, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Take the oldest event, consumer side
+   *
+   * @return false when empty
+   */
+  bool pop(T &event) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) return false;
+    event = slots[t];
+    tail.store((t + 1) % (N + 1), std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Oldest event in place, consumer side; nullptr when empty
+   */
+  T *front() {
+    size_t t = tail.load(std::memory_order_relaxed);
+    return t == head.load(std::memory_order_acquire) ? nullptr : &slots[t];
+  }
+
+  /**
+   * @brief Remove the oldest event, consumer side, after front()
+   */
+  void pop() {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t != head.load(std::memory_order_acquire)) tail.store((t + 1) % (N + 1), std::memory_order_release);
+  }
+
+  /**
+   * @brief Events queued, from either side; a snapshot while the other side runs
+   */
+  size_t size() const {
+    size_t t = tail.load(std::memory_order_acquire);
+    size_t h = head.load(std::memory_order_acquire);
+    return (h + N + 1 - t) % (N + 1);
+  }
+
+ private:
+  T slots[N + 1];  ///< one slot stays free to tell full from empty
+  std::atomic<size_t> head{0};
+  std::atomic<size_t> tail{0};
+};
+
+#endif
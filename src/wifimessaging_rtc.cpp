@@ -0,0 +1,81 @@
+#include "wifimessaging_rtc.h"
+
+#define RTC_USER_MEMORY_BLOCKS 128
+
+#ifdef ESP32
+#include <esp_attr.h>
+
+// Not cleared by deep sleep or software resets, the CRC catches power-on garbage
+RTC_NOINIT_ATTR static uint32_t rtcUserMemory[RTC_USER_MEMORY_BLOCKS];
+#endif
+
+/**
+ * @brief Header in front of every record
+ */
+struct RtcRecordHeader {
+  uint16_t tag;
+  uint16_t size;
+  uint32_t crc;  ///< over tag, size and data
+};
+
+static bool readBlocks(uint32_t block, void *data, size_t size) {
+  uint8_t *out = (uint8_t *)data;
+  for (size_t offset = 0; offset < size; offset += 4, block++) {
+    uint32_t word;
+#ifdef ESP8266
+    if (!ESP.rtcUserMemoryRead(block, &word, sizeof(word))) return false;
+#elif ESP32
+    if (block >= RTC_USER_MEMORY_BLOCKS) return false;
+    word = rtcUserMemory[block];
+#endif
+    memcpy(out + offset, &word, (size - offset < 4) ? size - offset : 4);
+  }
+  return true;
+}
+
+static bool writeBlocks(uint32_t block, const void *data, size_t size) {
+  const uint8_t *in = (const uint8_t *)data;
+  for (size_t offset = 0; offset < size; offset += 4, block++) {
+    uint32_t word = 0;
+    memcpy(&word, in + offset, (size - offset < 4) ? size - offset : 4);
+#ifdef ESP8266
+    if (!ESP.rtcUserMemoryWrite(block, &word, sizeof(word))) return false;
+#elif ESP32
+    if (block >= RTC_USER_MEMORY_BLOCKS) return false;
+    rtcUserMemory[block] = word;
+#endif
+  }
+  return true;
+}
+
+bool WifiMessagingRtc::read(uint32_t block, uint16_t tag, void *data, size_t size) {
+  RtcRecordHeader header;
+  if (!readBlocks(block, &header, sizeof(header))) return false;
+  if (header.tag != tag || header.size != size) return false;
+  if (!readBlocks(block + sizeof(header) / 4, data, size)) return false;
+  return header.crc == crc32(data, size, crc32(&header, 4));
+}
+
+bool WifiMessagingRtc::write(uint32_t block, uint16_t tag, const void *data, size_t size) {
+  if (size > 0xFFFF || block + (sizeof(RtcRecordHeader) + size + 3) / 4 > RTC_USER_MEMORY_BLOCKS) return false;
+  RtcRecordHeader header;
+  header.tag = tag;
+  header.size = size;
+  header.crc = crc32(data, size, crc32(&header, 4));
+  return writeBlocks(block + sizeof(header) / 4, data, size) && writeBlocks(block, &header, sizeof(header));
+}
+
+void WifiMessagingRtc::erase(uint32_t block) {
+  RtcRecordHeader header = {0, 0, 0};
+  writeBlocks(block, &header, sizeof(header));
+}
+
+uint32_t WifiMessagingRtc::crc32(const void *data, size_t length, uint32_t crc) {
+  const uint8_t *p = (const uint8_t *)data;
+  crc = ~crc;
+  while (length--) {
+    crc ^= *p++;
+    for (uint8_t bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+  }
+  return ~crc;
+}
@@ -0,0 +1,58 @@
+#ifndef WIFIMESSAGING_RTC_H
+#define WIFIMESSAGING_RTC_H
+
+#include <Arduino.h>
+
+// RTC user memory: 512 bytes in 4-byte blocks, kept through deep sleep and
+// resets, lost on power loss. The first 32 blocks are left to OTA (eboot).
+// Block offsets of the records kept by WifiMessaging:
+#define WIFIMESSAGING_RTC_TLS_SESSION 32  ///< 28 blocks
+#define WIFIMESSAGING_RTC_WIFI 60         ///< 12 blocks
+#define WIFIMESSAGING_RTC_CLOCK 72        ///< 6 blocks
+#define WIFIMESSAGING_RTC_TLS_FRAGMENT 78 ///< 4 blocks
+#define WIFIMESSAGING_RTC_DUTY_CYCLE 82   ///< 6 blocks
+#define WIFIMESSAGING_RTC_DNS 88          ///< 8 blocks
+
+/**
+ * @brief Records in RTC user memory, each with a tag, size and CRC32
+ *
+ * On ESP32 the same layout lives in an RTC_NOINIT_ATTR array.
+ */
+class WifiMessagingRtc {
+ public:
+  /**
+   * @brief Read a record written by write()
+   *
+   * @param block offset in 4-byte blocks
+   * @param tag expected record tag
+   * @param data destination
+   * @param size expected size of the record
+   * @return true when tag, size and CRC match
+   */
+  static bool read(uint32_t block, uint16_t tag, void *data, size_t size);
+
+  /**
+   * @brief Write a record
+   *
+   * @param block offset in 4-byte blocks
+   * @param tag record tag
+   * @param data source
+   * @param size record size, the record occupies 2 + (size + 3) / 4 blocks
+   * @return true when written
+   */
+  static bool write(uint32_t block, uint16_t tag, const void *data, size_t size);
+
+  /**
+   * @brief Invalidate the record at block
+   */
+  static void erase(uint32_t block);
+
+  /**
+   * @brief CRC-32 (IEEE 802.3)
+   *
+   * @param crc previous value, to continue over several buffers
+   */
+  static uint32_t crc32(const void *data, size_t length, uint32_t crc = 0);
+};
+
+#endif
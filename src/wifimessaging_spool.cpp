@@ -0,0 +1,305 @@
+#include "wifimessaging_spool.h"
+
+#if WIFIMESSAGING_SPOOL
+
+#include "wifimessaging_log.h"
+#include "wifimessaging_rtc.h"
+
+#define SPOOL_MAGIC 0xA5
+#define SPOOL_DATA 1
+#define SPOOL_ACK 2
+
+/**
+ * @brief Header in front of every record
+ */
+struct SpoolRecordHeader {
+  uint32_t crc;       ///< over the rest of the header and the data
+  uint32_t sequence;  ///< of a data record, or the last one done of an ack record
+  uint16_t length;    ///< of the data
+  uint8_t type;
+  uint8_t magic;
+};
+
+static_assert(sizeof(SpoolRecordHeader) == 12, "spool record header is written as is");
+
+static uint32_t recordCrc(const SpoolRecordHeader &header, const void *data, uint16_t length) {
+  return WifiMessagingRtc::crc32(data, length, WifiMessagingRtc::crc32(&header.sequence, 8));
+}
+
+bool WifiMessagingSpool::begin(fs::FS &fs, const char *dir) {
+  end();
+  if (strlen(dir) >= sizeof(this->dir)) return false;
+  if (!fs.exists(dir) && !fs.mkdir(dir)) return false;
+  File listing = fs.open(dir, "r");
+  if (!listing || !listing.isDirectory()) return false;
+  strcpy(this->dir, dir);
+  this->fs = &fs;
+
+  // Segment files in the order of their ids; beyond the limit, e.g. after it
+  // was lowered, the oldest go
+  segmentCount = 0;
+  for (File file = listing.openNextFile(); file; file = listing.openNextFile()) {
+    const char *name = file.name();
+    char *end;
+    uint32_t id = strtoul(name, &end, 16);
+    if (strlen(name) != 8 || *end || id == 0) continue;
+    file.close();
+    uint8_t at = segmentCount;
+    while (at > 0 && segments[at - 1].id > id) at--;
+    if (segmentCount == WIFIMESSAGING_SPOOL_SEGMENTS) {
+      char path[40];
+      Path(path, sizeof(path), at == 0 ? id : segments[0].id);
+      WIFIMESSAGING_LOGW("Spool segment %s over the limit, removed", path);
+      fs.remove(path);
+      if (at == 0) continue;
+      memmove(&segments[0], &segments[1], (at - 1) * sizeof(Segment));
+      at--;
+    } else {
+      memmove(&segments[at + 1], &segments[at], (segmentCount - at) * sizeof(Segment));
+      segmentCount++;
+    }
+    segments[at] = {id, 0, 0, 0, false};
+  }
+  listing.close();
+
+  uint32_t acked = 0;
+  for (uint8_t i = 0; i < segmentCount; i++) {
+    ScanSegment(segments[i], acked);
+    if (segments[i].last >= nextSequence) nextSequence = segments[i].last + 1;
+    if (i + 1 < segmentCount) segments[i].sealed = true;
+  }
+  if (segmentCount) nextId = segments[segmentCount - 1].id + 1;
+  if (acked >= nextSequence) nextSequence = acked + 1;
+  headSequence = acked + 1;
+  for (uint8_t i = 0; i < segmentCount; i++) {
+    if (segments[i].first) {
+      if (segments[i].first > headSequence) headSequence = segments[i].first;
+      break;
+    }
+  }
+  if (headSequence > nextSequence) headSequence = nextSequence;
+  readSequence = headSequence;
+  if (pending() == 0)
+    Clear();
+  else
+    Collect();
+  WIFIMESSAGING_LOGI("Spool %s: %u records in %u segments", dir, (unsigned)pending(), segmentCount);
+  return true;
+}
+
+void WifiMessagingSpool::end() {
+  writer.close();
+  reader.close();
+  fs = nullptr;
+  segmentCount = 0;
+  nextId = 1;
+  nextSequence = headSequence = readSequence = 1;
+  readId = 0;
+}
+
+void WifiMessagingSpool::Path(char *path, size_t size, uint32_t id) const {
+  snprintf(path, size, "%s/%08lx", dir, (unsigned long)id);
+}
+
+void WifiMessagingSpool::ScanSegment(Segment &segment, uint32_t &acked) {
+  char path[40];
+  Path(path, sizeof(path), segment.id);
+  File file = fs->open(path, "r");
+  if (!file) {
+    segment.sealed = true;
+    return;
+  }
+  size_t fileSize = file.size();
+  uint32_t offset = 0;
+  SpoolRecordHeader header;
+  while (offset + sizeof(header) <= fileSize) {
+    if (file.read((uint8_t *)&header, sizeof(header)) != sizeof(header) || header.magic != SPOOL_MAGIC ||
+        offset + sizeof(header) + header.length > fileSize)
+      break;
+    // CRC of the data through a small buffer
+    uint8_t chunk[32];
+    uint32_t crc = WifiMessagingRtc::crc32(&header.sequence, 8);
+    uint16_t left = header.length;
+    while (left) {
+      uint16_t n = left < sizeof(chunk) ? left : sizeof(chunk);
+      if (file.read(chunk, n) != n) break;
+      crc = WifiMessagingRtc::crc32(chunk, n, crc);
+      left -= n;
+    }
+    if (left || crc != header.crc) break;
+    if (header.type == SPOOL_DATA) {
+      if (!segment.first) segment.first = header.sequence;
+      segment.last = header.sequence;
+    } else if (header.type == SPOOL_ACK && header.sequence > acked) {
+      acked = header.sequence;
+    }
+    offset += sizeof(header) + header.length;
+  }
+  segment.size = offset;
+  if (offset < fileSize) {
+    WIFIMESSAGING_LOGW("Spool segment %s ends at %u of %u bytes", path, (unsigned)offset, (unsigned)fileSize);
+    segment.sealed = true;
+  }
+}
+
+bool WifiMessagingSpool::append(const void *data, uint16_t length) {
+  if (!ready() || length == 0 || length > WIFIMESSAGING_SPOOL_SEGMENT_SIZE - 2 * sizeof(SpoolRecordHeader))
+    return false;
+  // in the last segment there is always room left for an ack
+  if (!Write(SPOOL_DATA, nextSequence, data, length, sizeof(SpoolRecordHeader))) return false;
+  nextSequence++;
+  return true;
+}
+
+bool WifiMessagingSpool::Write(uint8_t type, uint32_t sequence, const void *data, uint16_t length,
+                               uint32_t reserve) {
+  uint32_t need = sizeof(SpoolRecordHeader) + length;
+  Segment *tail = segmentCount ? &segments[segmentCount - 1] : nullptr;
+  if (!tail || tail->sealed ||
+      tail->size + need + (segmentCount == WIFIMESSAGING_SPOOL_SEGMENTS ? reserve : 0) >
+          WIFIMESSAGING_SPOOL_SEGMENT_SIZE) {
+    if (!OpenSegment()) return false;
+    tail = &segments[segmentCount - 1];
+  }
+  char path[40];
+  if (!writer) {
+    Path(path, sizeof(path), tail->id);
+    writer = fs->open(path, "a");
+    if (!writer) return false;
+  }
+
+  SpoolRecordHeader header = {0, sequence, length, type, SPOOL_MAGIC};
+  header.crc = recordCrc(header, data, length);
+  bool written = writer.write((const uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+                 writer.write((const uint8_t *)data, length) == length;
+  writer.flush();
+  if (!written) {
+    // whatever made it to the file ends the segment at the next begin()
+    WIFIMESSAGING_LOGW("Spool %s: write failed", dir);
+    tail->sealed = true;
+    writer.close();
+    return false;
+  }
+  tail->size += need;
+  if (type == SPOOL_DATA) {
+    if (!tail->first) tail->first = sequence;
+    tail->last = sequence;
+  }
+  return true;
+}
+
+bool WifiMessagingSpool::OpenSegment() {
+  if (segmentCount == WIFIMESSAGING_SPOOL_SEGMENTS) {
+    Collect();
+    if (segmentCount == WIFIMESSAGING_SPOOL_SEGMENTS) return false;
+  }
+  writer.close();
+  if (segmentCount) segments[segmentCount - 1].sealed = true;
+  segments[segmentCount++] = {nextId++, 0, 0, 0, false};
+  return true;
+}
+
+uint16_t WifiMessagingSpool::read(void *data, uint16_t size, uint32_t &sequence) {
+  SpoolRecordHeader header;
+  while (readSequence < nextSequence) {
+    int8_t i = FindSegment(readId);
+    if (i < 0) {
+      // the first segment with records from readSequence on
+      for (i = 0; i < segmentCount && segments[i].last < readSequence; i++) {
+      }
+      if (i == segmentCount) return 0;
+      reader.close();
+      readId = segments[i].id;
+      readOffset = 0;
+    }
+    const Segment &segment = segments[i];
+    if (readOffset + sizeof(header) > segment.size) {
+      reader.close();
+      if (i + 1 == segmentCount) return 0;
+      readId = segments[i + 1].id;
+      readOffset = 0;
+      continue;
+    }
+    if (!reader) {
+      char path[40];
+      Path(path, sizeof(path), segment.id);
+      reader = fs->open(path, "r");
+      if (!reader) return 0;
+    }
+    if (!reader.seek(readOffset) || reader.read((uint8_t *)&header, sizeof(header)) != sizeof(header)) {
+      reader.close();
+      return 0;
+    }
+    readOffset += sizeof(header) + header.length;
+    if (header.type != SPOOL_DATA || header.sequence < readSequence) continue;
+    uint16_t n = header.length < size ? header.length : size;
+    if (reader.read((uint8_t *)data, n) != n) {
+      reader.close();
+      readOffset -= sizeof(header) + header.length;
+      return 0;
+    }
+    sequence = header.sequence;
+    readSequence = sequence + 1;
+    return n;
+  }
+  return 0;
+}
+
+void WifiMessagingSpool::ack(uint32_t sequence) {
+  if (!ready() || sequence < headSequence) return;
+  headSequence = sequence < readSequence ? sequence + 1 : readSequence;
+  if (headSequence == nextSequence) {
+    Clear();
+    return;
+  }
+  // An ack record only when records done stay in a segment that is kept
+  for (uint8_t i = 0; i < segmentCount; i++) {
+    const Segment &segment = segments[i];
+    if (i + 1 < segmentCount && segment.last < headSequence) continue;
+    if (segment.first && segment.first < headSequence &&
+        !Write(SPOOL_ACK, headSequence - 1, nullptr, 0, 0))
+      WIFIMESSAGING_LOGW("Spool %s: ack not written, records up to %u come again after a reboot", dir,
+                         (unsigned)(headSequence - 1));
+    break;
+  }
+  Collect();
+}
+
+void WifiMessagingSpool::Collect() {
+  uint8_t done = 0;
+  while (done + 1 < segmentCount && segments[done].last < headSequence) {
+    char path[40];
+    Path(path, sizeof(path), segments[done].id);
+    if (segments[done].id == readId) {
+      reader.close();
+      readId = 0;
+    }
+    fs->remove(path);
+    done++;
+  }
+  if (!done) return;
+  memmove(&segments[0], &segments[done], (segmentCount - done) * sizeof(Segment));
+  segmentCount -= done;
+}
+
+void WifiMessagingSpool::Clear() {
+  writer.close();
+  reader.close();
+  for (uint8_t i = 0; i < segmentCount; i++) {
+    char path[40];
+    Path(path, sizeof(path), segments[i].id);
+    fs->remove(path);
+  }
+  segmentCount = 0;
+  readId = 0;
+}
+
+int8_t WifiMessagingSpool::FindSegment(uint32_t id) const {
+  if (id == 0) return -1;
+  for (uint8_t i = 0; i < segmentCount; i++) {
+    if (segments[i].id == id) return i;
+  }
+  return -1;
+}
+
+#endif
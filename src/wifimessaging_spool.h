@@ -0,0 +1,154 @@
+#ifndef WIFIMESSAGING_SPOOL_H
+#define WIFIMESSAGING_SPOOL_H
+
+#include <Arduino.h>
+
+// 1 adds WifiMessaging::beginSpool(): messages that find their service down
+// or the outbox full are kept in flash until delivered, also over a reboot.
+// Set it for the library as a whole, e.g. as a -D build flag.
+#ifndef WIFIMESSAGING_SPOOL
+#define WIFIMESSAGING_SPOOL 0
+#endif
+
+// Directory of the spools, one subdirectory per service
+#ifndef WIFIMESSAGING_SPOOL_DIR
+#define WIFIMESSAGING_SPOOL_DIR "/spool"
+#endif
+
+// Bytes of a segment file, one flash block of LittleFS
+#ifndef WIFIMESSAGING_SPOOL_SEGMENT_SIZE
+#define WIFIMESSAGING_SPOOL_SEGMENT_SIZE 4096
+#endif
+
+// Segment files per spool; a spool holding this many full segments refuses new messages
+#ifndef WIFIMESSAGING_SPOOL_SEGMENTS
+#define WIFIMESSAGING_SPOOL_SEGMENTS 4
+#endif
+
+#if WIFIMESSAGING_SPOOL
+
+#include <FS.h>
+
+/**
+ * @brief Append-only log of records in segment files, for messages that must outlive RAM
+ *
+ * A record is a 12-byte header, with a CRC32 over the rest of the header and
+ * the data, followed by the data. Records are only ever appended, to the
+ * newest segment, and every append is flushed. A delivered record is not
+ * rewritten: ack() appends an ack record with the sequence number up to
+ * which records are done, and a segment is removed as a whole once all its
+ * records are done. Flash is thus written once per record, spread over fresh
+ * blocks, and never erased in place.
+ *
+ * begin() scans the segments. A segment ends at its first record that is
+ * short or fails its CRC, what a power loss during a write leaves; such a
+ * segment takes no further records.
+ *
+ * read() hands out the records not done, oldest first, each with its
+ * sequence number. What was read but not acked before a reboot is read again
+ * after it: delivery is at least once.
+ */
+class WifiMessagingSpool {
+ public:
+  /**
+   * @brief Open the spool in dir, created when missing, and scan its segments
+   *
+   * @param dir kept as copy, at most 23 chars
+   * @return false when the directory cannot be used, the spool then stays closed
+   */
+  bool begin(fs::FS &fs, const char *dir);
+
+  /**
+   * @brief Close the files, the records stay
+   */
+  void end();
+
+  bool ready() const { return fs != nullptr; }
+
+  /**
+   * @brief Append a record
+   *
+   * @param length 1 to WIFIMESSAGING_SPOOL_SEGMENT_SIZE - 24 bytes
+   * @return false when closed, full or not written
+   */
+  bool append(const void *data, uint16_t length);
+
+  /**
+   * @brief Next record not read yet, oldest first
+   *
+   * @param size of data, a longer record is cut
+   * @param sequence of the record, for ack()
+   * @return uint16_t bytes copied, 0 when every record was read
+   */
+  uint16_t read(void *data, uint16_t size, uint32_t &sequence);
+
+  /**
+   * @brief The records read up to sequence are done
+   */
+  void ack(uint32_t sequence);
+
+  /**
+   * @brief Records not acked, those read included
+   */
+  uint32_t pending() const { return nextSequence - headSequence; }
+
+  /**
+   * @brief Records not read yet
+   */
+  uint32_t unread() const { return nextSequence - readSequence; }
+
+ private:
+  struct Segment {
+    uint32_t id;     ///< file name, 8 hex digits
+    uint32_t first;  ///< sequence of the first record, 0 when none
+    uint32_t last;   ///< sequence of the last record, 0 when none
+    uint32_t size;   ///< bytes of valid records
+    bool sealed;     ///< takes no further records
+  };
+
+  fs::FS *fs = nullptr;
+  char dir[24] = "";
+  Segment segments[WIFIMESSAGING_SPOOL_SEGMENTS];
+  uint8_t segmentCount = 0;
+  uint32_t nextId = 1;
+  uint32_t nextSequence = 1;
+  uint32_t headSequence = 1;  ///< oldest record not acked
+  uint32_t readSequence = 1;  ///< next record for read()
+  uint32_t readId = 0;        ///< segment of the read position, 0 when to be found
+  uint32_t readOffset = 0;
+  File writer;  ///< the newest segment, kept open for appending
+  File reader;
+
+  void Path(char *path, size_t size, uint32_t id) const;
+
+  /**
+   * @brief Read the records of a segment: its range, valid size and the last ack
+   */
+  void ScanSegment(Segment &segment, uint32_t &acked);
+
+  /**
+   * @brief Write a record to the newest segment, a new one when it has no room
+   */
+  bool Write(uint8_t type, uint32_t sequence, const void *data, uint16_t length, uint32_t reserve);
+
+  /**
+   * @brief Start a new segment
+   */
+  bool OpenSegment();
+
+  /**
+   * @brief Remove the segments before the newest whose records are all acked
+   */
+  void Collect();
+
+  /**
+   * @brief Remove every segment, the spool is empty
+   */
+  void Clear();
+
+  int8_t FindSegment(uint32_t id) const;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef WIFIMESSAGING_TOPICS_H
+#define WIFIMESSAGING_TOPICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * @brief Handler of the MQTT messages matching a topic filter
+ */
+typedef void (*WifiMessagingTopicHandler)(char *topic, uint8_t *payload, unsigned int length);
+
+/**
+ * @brief Fixed-capacity trie of MQTT topic filters with + and # wildcards
+ *
+ * Every filter level is a node. Plain levels are found through an open
+ * addressed hash table keyed by parent and level text, the + and # levels
+ * hang directly off their parent, so a topic is matched in a number of steps
+ * proportional to its depth for every wildcard branch that matches.
+ *
+ * Nodes point into the filter strings instead of copying them: a filter must
+ * stay valid as long as the trie, like a string literal.
+ *
+ * @tparam N number of nodes, the root included; a filter takes one node per
+ * level not shared with an earlier filter
+ */
+template <size_t N>
+class WifiMessagingTopics {
+ public:
+  /**
+   * @brief Add a filter, or replace the handler of a filter added before
+   *
+   * @return false when the filter is invalid or the trie is full
+   */
+  bool insert(const char *filter, WifiMessagingTopicHandler handler, uint8_t qos = 0) {
+    if (filter == nullptr || handler == nullptr) return false;
+    uint16_t node = 0;
+    const char *level = filter;
+    while (true) {
+      const char *end = strchr(level, '/');
+      size_t length = end ? (size_t)(end - level) : strlen(level);
+      if (length > 255) return false;
+      uint16_t child;
+      if (length == 1 && level[0] == '#') {
+        if (end) return false;  // # must be the last level
+        child = nodes[node].multi ? nodes[node].multi : add(node, level, length);
+        if (child) nodes[node].multi = child;
+      } else if (length == 1 && level[0] == '+') {
+        child = nodes[node].plus ? nodes[node].plus : add(node, level, length);
+        if (child) nodes[node].plus = child;
+      } else {
+        if (memchr(level, '+', length) || memchr(level, '#', length)) return false;
+        child = find(node, level, length);
+        if (!child && (child = add(node, level, length)) != 0) link(child);
+      }
+      if (!child) return false;
+      node = child;
+      if (!end) break;
+      level = end + 1;
+    }
+    nodes[node].filter = filter;
+    nodes[node].handler = handler;
+    nodes[node].qos = qos;
+    return true;
+  }
+
+  /**
+   * @brief Call the handler of every filter matching topic
+   *
+   * Topics starting with $ are not matched by a leading + or #.
+   *
+   * @return number of handlers called
+   */
+  size_t dispatch(char *topic, uint8_t *payload, unsigned int length) {
+    Match m{topic, payload, length, 0};
+    descend(m, 0, topic, topic[0] == '$');
+    return m.calls;
+  }
+
+  /**
+   * @brief Call fn(filter, qos) for every filter, in insertion order of their last level
+   */
+  template <typename F>
+  void forEach(F fn) const {
+    for (uint16_t i = 1; i < used; i++) {
+      if (nodes[i].filter) fn(nodes[i].filter, nodes[i].qos);
+    }
+  }
+
+  size_t size() const { return used; }  ///< nodes in use, the root included
+  static constexpr size_t capacity() { return N; }
+
+ private:
+  struct Node {
+    const char *level = nullptr;   ///< level text inside a filter, not terminated
+    const char *filter = nullptr;  ///< filter ending at this node, nullptr when none
+    WifiMessagingTopicHandler handler = nullptr;
+    uint16_t parent = 0;
+    uint16_t plus = 0;   ///< + child, 0 when none
+    uint16_t multi = 0;  ///< # child, 0 when none
+    uint8_t length = 0;
+    uint8_t qos = 0;
+  };
+
+  struct Match {
+    char *topic;
+    uint8_t *payload;
+    unsigned int length;
+    size_t calls;
+  };
+
+  static const size_t BUCKETS = 2 * N;  ///< at most half full
+
+  Node nodes[N];
+  uint16_t buckets[BUCKETS] = {};  ///< node of a plain level, 0 when empty
+  uint16_t used = 1;               ///< node 0 is the root
+
+  static size_t hash(uint16_t parent, const char *level, size_t length) {
+    uint32_t h = 2166136261u ^ parent;  // FNV-1a
+    for (size_t i = 0; i < length; i++) h = (h ^ (uint8_t)level[i]) * 16777619u;
+    return h % BUCKETS;
+  }
+
+  uint16_t find(uint16_t parent, const char *level, size_t length) const {
+    for (size_t b = hash(parent, level, length);; b = (b + 1) % BUCKETS) {
+      uint16_t i = buckets[b];
+      if (i == 0) return 0;
+      const Node &n = nodes[i];
+      if (n.parent == parent && n.length == length && memcmp(n.level, level, length) == 0) return i;
+    }
+  }
+
+  uint16_t add(uint16_t parent, const char *level, size_t length) {
+    if (used >= N) return 0;
+    Node &n = nodes[used];
+    n.level = level;
+    n.length = length;
+    n.parent = parent;
+    return used++;
+  }
+
+  void link(uint16_t node) {
+    const Node &n = nodes[node];
+    size_t b = hash(n.parent, n.level, n.length);
+    while (buckets[b] != 0) b = (b + 1) % BUCKETS;
+    buckets[b] = node;
+  }
+
+  void call(Match &m, const Node &n) {
+    if (n.handler == nullptr) return;
+    n.handler(m.topic, m.payload, m.length);
+    m.calls++;
+  }
+
+  /**
+   * @brief Match the topic levels from level on below node
+   */
+  void descend(Match &m, uint16_t node, const char *level, bool system) {
+    const Node &n = nodes[node];
+    // # matches the remaining levels, and "a/#" matches "a" too (below)
+    if (n.multi && !system) call(m, nodes[n.multi]);
+
+    const char *end = strchr(level, '/');
+    size_t length = end ? (size_t)(end - level) : strlen(level);
+    uint16_t children[2] = {find(node, level, length), system ? (uint16_t)0 : n.plus};
+    for (uint16_t child : children) {
+      if (!child) continue;
+      if (end) {
+        descend(m, child, end + 1, false);
+      } else {
+        call(m, nodes[child]);
+        if (nodes[child].multi) call(m, nodes[nodes[child].multi]);
+      }
+    }
+  }
+};
+
+#endif